@@ -0,0 +1,162 @@
+library ieee;
+use ieee.std_logic_1164.all;
+use ieee.numeric_std.all;
+
+-- Packs records into blocks without per byte framing bits:
+--   x"A5" x"5A"   sync word
+--   count         number of records in the block (1..max_records)
+--   payload       records MSB first without gaps, zero padded to full bytes
+--   checksum      xor of count and all payload bytes
+-- A block is sent when max_records are collected or when no record
+-- arrived for timeout_cycles. New records are not accepted while a
+-- block is sent, they wait in the tdc fifos.
+-- Records are 35 bits (3 bit channel, 24 bit time, 8 bit sample) or
+-- 42 bits for pulses (3 bit type "100", 2 bit channel, 24 bit time,
+-- 3 bit phase, 10 bit time over threshold), the type tells the length.
+entity block_encoder is
+  generic (
+    max_records    : natural := 64;
+    timeout_cycles : natural := 1024
+  );
+  port (
+    clk_i, rst_i : in  std_logic;
+
+    -- record input
+    push_i       : in  std_logic;
+    ready_o      : out std_logic;
+    record_i     : in  std_logic_vector(41 downto 0); -- right aligned
+    long_i       : in  std_logic;                     -- '1' for 42 bit records
+
+    -- byte output (to ft232h fifo)
+    push_o       : out std_logic;
+    full_i       : in  std_logic;
+    data_o       : out std_logic_vector(7 downto 0)
+  );
+end entity;
+
+architecture rtl of block_encoder is
+
+  constant record_bits      : natural := 35;
+  constant long_record_bits : natural := 42;
+  constant max_bytes        : natural := (max_records*long_record_bits+7)/8;
+
+  type byte_array_t is array (0 to max_bytes-1) of std_logic_vector(7 downto 0);
+  signal payload      : byte_array_t;
+
+  type state_t is (s_collect, s_flush, s_send_sync_0, s_send_sync_1, s_send_count, s_send_payload, s_send_checksum);
+  signal state        : state_t := s_collect;
+
+  -- bit accumulator, the valid bits are acc(acc_bits-1 downto 0)
+  signal acc          : unsigned(long_record_bits+7-1 downto 0) := (others => '0');
+  signal acc_bits     : integer range 0 to long_record_bits+7 := 0;
+  signal n_records    : integer range 0 to max_records := 0;
+  signal n_bytes      : integer range 0 to max_bytes := 0;
+  signal rd_idx       : integer range 0 to max_bytes := 0;
+  signal idle_count   : integer range 0 to timeout_cycles := 0;
+  signal checksum     : std_logic_vector(7 downto 0) := (others => '0');
+  signal push         : std_logic := '0';
+  signal ready        : std_logic;
+
+begin
+
+  ready   <= '1' when state = s_collect and acc_bits < 8 and n_records < max_records else '0';
+  ready_o <= ready;
+  push_o  <= push;
+
+  main: process
+    variable byte : std_logic_vector(7 downto 0);
+  begin
+    wait until rising_edge(clk_i);
+    if rst_i = '1' then
+      state      <= s_collect;
+      acc        <= (others => '0');
+      acc_bits   <= 0;
+      n_records  <= 0;
+      n_bytes    <= 0;
+      rd_idx     <= 0;
+      idle_count <= 0;
+      checksum   <= (others => '0');
+      push       <= '0';
+      data_o     <= (others => '0');
+    else
+      push <= '0';
+      case state is
+        when s_collect =>
+          if acc_bits >= 8 then
+            -- move the 8 oldest bits into the payload buffer
+            byte := std_logic_vector(resize(shift_right(acc, acc_bits-8), 8));
+            payload(n_bytes) <= byte;
+            checksum <= checksum xor byte;
+            n_bytes  <= n_bytes + 1;
+            acc_bits <= acc_bits - 8;
+          elsif push_i = '1' and ready = '1' then
+            if long_i = '1' then
+              acc      <= shift_left(acc, long_record_bits) or resize(unsigned(record_i), acc'length);
+              acc_bits <= acc_bits + long_record_bits;
+            else
+              acc      <= shift_left(acc, record_bits) or resize(unsigned(record_i(record_bits-1 downto 0)), acc'length);
+              acc_bits <= acc_bits + record_bits;
+            end if;
+            n_records  <= n_records + 1;
+            idle_count <= 0;
+          elsif n_records /= 0 then
+            if n_records = max_records or idle_count = timeout_cycles then
+              state <= s_flush;
+            else
+              idle_count <= idle_count + 1;
+            end if;
+          end if;
+        when s_flush =>
+          if acc_bits /= 0 then
+            -- zero pad the last byte
+            byte := std_logic_vector(resize(shift_left(acc, 8-acc_bits), 8));
+            payload(n_bytes) <= byte;
+            checksum <= checksum xor byte;
+            n_bytes  <= n_bytes + 1;
+            acc_bits <= 0;
+          end if;
+          rd_idx <= 0;
+          state  <= s_send_sync_0;
+        when s_send_sync_0 =>
+          if push = '0' and full_i = '0' then
+            push   <= '1';
+            data_o <= x"a5";
+            state  <= s_send_sync_1;
+          end if;
+        when s_send_sync_1 =>
+          if push = '0' and full_i = '0' then
+            push   <= '1';
+            data_o <= x"5a";
+            state  <= s_send_count;
+          end if;
+        when s_send_count =>
+          if push = '0' and full_i = '0' then
+            push     <= '1';
+            data_o   <= std_logic_vector(to_unsigned(n_records, 8));
+            checksum <= checksum xor std_logic_vector(to_unsigned(n_records, 8));
+            state    <= s_send_payload;
+          end if;
+        when s_send_payload =>
+          if push = '0' and full_i = '0' then
+            push   <= '1';
+            data_o <= payload(rd_idx);
+            rd_idx <= rd_idx + 1;
+            if rd_idx = n_bytes-1 then
+              state <= s_send_checksum;
+            end if;
+          end if;
+        when s_send_checksum =>
+          if push = '0' and full_i = '0' then
+            push       <= '1';
+            data_o     <= checksum;
+            checksum   <= (others => '0');
+            n_records  <= 0;
+            n_bytes    <= 0;
+            idle_count <= 0;
+            state      <= s_collect;
+          end if;
+      end case;
+    end if;
+  end process;
+
+end architecture;
@@ -13,7 +13,8 @@ entity fifo is
     push_i, pop_i   : in  std_logic;
     full_o, empty_o : out std_logic;
     data_i          : in  std_logic_vector ( bit_width-1 downto 0 );
-    data_o          : out std_logic_vector ( bit_width-1 downto 0 )
+    data_o          : out std_logic_vector ( bit_width-1 downto 0 );
+    level_o         : out std_logic_vector ( depth downto 0 ) -- number of entries
   ); 
 end entity;
 
@@ -72,4 +73,6 @@ begin
   full_o     <=     msb_xor when empty_or_full else '0';
   empty_o    <= not msb_xor when empty_or_full else '0';
 
+  level_o    <= std_logic_vector(w_idx - r_idx);
+
 end architecture;
@@ -49,6 +49,9 @@ architecture rtl of ft232h_async_fifo is
                                                             -- ch1_threshold: [23 downto 12]
                                                             -- ch2_threshold: [35 downto 24]
                                                             -- ch3_threshold: [47 downto 36]
+                                                            -- block_format:  [48]
+                                                            -- pulse_mode:    [49]
+                                                            -- sync_frames:   [50]
                                                             -- ch0_TDCactive: [60]
                                                             -- ch1_TDCactive: [61]
                                                             -- ch2_TDCactive: [62]
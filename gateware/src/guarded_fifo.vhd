@@ -13,7 +13,8 @@ entity guarded_fifo is
     push_i, pop_i   : in  std_logic;
     full_o, empty_o : out std_logic;
     data_i          : in  std_logic_vector ( bit_width-1 downto 0 );
-    data_o          : out std_logic_vector ( bit_width-1 downto 0 )
+    data_o          : out std_logic_vector ( bit_width-1 downto 0 );
+    level_o         : out std_logic_vector ( depth downto 0 )
   );
 end entity;
 
@@ -37,7 +38,8 @@ begin
     full_o  => full,
     empty_o => empty,
     data_i  => data_i,
-    data_o  => data_o
+    data_o  => data_o,
+    level_o => level_o
   );
 
   full_o  <= full;
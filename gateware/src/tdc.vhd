@@ -4,7 +4,8 @@ use ieee.numeric_std.all;
 
 entity tdc is 
     generic (
-      data_buffer_depth : natural := 4
+      data_buffer_depth : natural := 11;
+      time_counter_init : natural := 0  -- value after reset, only changed in simulation
     );
     port (
       rst_i         : in  std_logic;
@@ -15,10 +16,22 @@ entity tdc is
 
       async_i       : in  std_logic;
 
+      -- '1': one word per pulse instead of one word per sample change
+      pulse_mode_i  : in  std_logic := '0';
+      -- '1': a sync word in the middle of every counter period
+      sync_mode_i   : in  std_logic := '0';
+
       -- fifo output interface
+      --   data_o(39 downto 38) = "00": sample word (31 downto 8) time, (7 downto 0) sample
+      --   data_o(39 downto 38) = "01": pulse word  (36 downto 13) time of the falling edge,
+      --                                            (12 downto 10) ns of the falling edge inside the tick, 
+      --                                            ( 9 downto  0) time over threshold in ns
+      --   data_o(39 downto 38) = "10": loss word   (25 downto  0) number of words dropped before it
+      --   data_o(39 downto 38) = "11": sync word   (25 downto  0) number of time counter overflows
       empty_o       : out std_logic;  
       pop_i         :  in std_logic;  
-      data_o        : out std_logic_vector(31 downto 0);
+      data_o        : out std_logic_vector(39 downto 0);
+      level_o       : out std_logic_vector(15 downto 0); -- number of words in the buffer
 
       -- led indicator
       led_o         : out std_logic
@@ -44,17 +57,89 @@ architecture rtl of tdc is
   signal push                : std_logic := '0';
   signal full                : std_logic;
 
-  signal buffer_input_data   : std_logic_vector(31 downto 0) := (others => '0');
+  signal buffer_input_data   : std_logic_vector(39 downto 0) := (others => '0');
   signal buffer_push         : std_logic := '0';
   signal buffer_full         : std_logic := '0';
+  signal buffer_space        : std_logic;
+  signal buffer_level        : std_logic_vector(data_buffer_depth downto 0);
+
+  -- words dropped while the buffer was full, they are reported 
+  -- with a loss word as soon as there is space again
+  signal lost_count          : unsigned(25 downto 0) := (others => '0');
 
   signal time_counter        : unsigned(23 downto 0) := (others => '0');
+  -- upper bits of the time, sent with the sync word. The sync word waits 
+  -- for a cycle without other words, it is never dropped.
+  signal epoch_counter       : unsigned(25 downto 0) := (others => '0');
+  signal sync_pending        : std_logic := '0';
   --signal sequence_counter    : unsigned( 3 downto 0) := (others => '0');
 
   signal led_counter         : unsigned(21 downto 0) := (others => '0');
   signal led_state           : std_logic := '0';
+
+  -- sample with bit 7 being the first ns of the tick and '1' for high input
+  signal corrected           : std_logic_vector(7 downto 0);
+
+  -- pulse pairing: p_low/p_high wait for the edges of a clean pulse, 
+  -- everything else (several edges in one tick, pulses longer than 1023 ns,
+  -- pulses over a counter overflow) falls back to sample words in p_raw 
+  -- until the input is low again
+  type pulse_state_t is (p_low, p_high, p_raw);
+  signal pulse_state         : pulse_state_t := p_raw;
+  signal lead_phase          : integer range 0 to 7 := 0;
+  signal lead_word           : std_logic_vector(39 downto 0) := (others => '0');
+  signal high_ticks          : integer range 0 to 127 := 0;
+  -- sometimes two words have to be written in one clock cycle (the sample word
+  -- of the leading edge and the current one), the second one waits here
+  signal pending_word        : std_logic_vector(39 downto 0) := (others => '0');
+  signal pending_valid       : std_logic := '0';
+
+  constant max_high_ticks    : integer := 127; -- the time over threshold has 10 bits
+
+  -- 0..01..1: returns the number of zeros, -1 for other patterns
+  function rise_position(c : std_logic_vector(7 downto 0)) return integer is
+  begin
+    for a in 0 to 7 loop
+      if c = std_logic_vector(shift_right(to_unsigned(255,8), a)) then
+        return a;
+      end if;
+    end loop;
+    return -1;
+  end function;
+
+  -- 1..10..0: returns the number of ones, -1 for other patterns
+  function fall_position(c : std_logic_vector(7 downto 0)) return integer is
+  begin
+    for a in 0 to 7 loop
+      if c = not std_logic_vector(shift_right(to_unsigned(255,8), a)) then
+        return a;
+      end if;
+    end loop;
+    return -1;
+  end function;
+
+  -- 0..01..10..0 with at least one trailing zero: returns 8*zeros+ones, -1 for other patterns
+  function pulse_position(c : std_logic_vector(7 downto 0)) return integer is
+  begin
+    for a in 0 to 6 loop
+      for b in 1 to 7-a loop
+        if c = std_logic_vector(shift_right(to_unsigned(255,8), a) and not shift_right(to_unsigned(255,8), a+b)) then
+          return 8*a+b;
+        end if;
+      end loop;
+    end loop;
+    return -1;
+  end function;
+
 begin
 
+  -- this has to be negated here because negating the async input
+  --   will destroy the subsampling between clocks which relys on 
+  --   the delay of one inverter. If the input is inverted than
+  --   the optimizer will just cancel the dual inversion and the subsampling
+  --   is reversed. Also the led_o has to be inverted.
+  corrected <= not (sample xor "01010101");
+
   n_async_i <= not async_i after 500 ps;
 
   -- invert the led state
@@ -112,13 +197,27 @@ begin
   end process;
 
   p_sample: process
+    variable sample_word  : std_logic_vector(39 downto 0);
+    variable sample_push  : boolean;
+    variable words        : integer range 0 to 2;
+    variable word_1       : std_logic_vector(39 downto 0);
+    variable word_2       : std_logic_vector(39 downto 0);
+    variable rise, fall   : integer range -1 to 7;
+    variable pulse        : integer range -1 to 63;
+    variable tot          : integer range 0 to 1023;
   begin
     wait until rising_edge(clk_000_i);
 
     if rst_i = '1' then
       buffer_input_data  <= (others => '0');
       buffer_push        <= '0';
-      time_counter       <= (others => '0');
+      time_counter       <= to_unsigned(time_counter_init, time_counter'length);
+      epoch_counter      <= (others => '0');
+      sync_pending       <= '0';
+      pulse_state        <= p_raw;
+      pending_valid      <= '0';
+      high_ticks         <= 0;
+      lost_count         <= (others => '0');
       if async_1_000 = '0' then
         sample_old   <= "10101010";
         sample       <= "10101010";
@@ -128,6 +227,12 @@ begin
       end if;        
     else 
       time_counter <= time_counter + 1;
+      if time_counter = x"ffffff" then
+        epoch_counter <= epoch_counter + 1;
+      end if;
+      if time_counter = x"800000" and sync_mode_i = '1' then
+        sync_pending <= '1';
+      end if;
 
       sample(0) <= sync_270;
       sample(1) <= n_sync_270;
@@ -139,24 +244,131 @@ begin
       sample(7) <= n_sync_000;
       sample_old <= sample;
 
+      sample_word := "00" & "000000" & std_logic_vector(time_counter) & corrected;
+      sample_push :=  (  (sample_old /= sample) and 
+                         ((sample /= x"55" and sample /= x"aa") or (sample(7) = sample_old(0))) 
+                      ) or (time_counter = 0);
+      words  := 0;
+      word_1 := sample_word;
+      word_2 := sample_word;
+      rise   := rise_position(corrected);
+      fall   := fall_position(corrected);
+      pulse  := pulse_position(corrected);
+
+      if pulse_mode_i = '0' then
+        pulse_state <= p_raw;
+        if sample_push then
+          words := 1;
+        end if;
+      else
+        case pulse_state is
+          when p_low =>
+            if time_counter = 0 then
+              words := 1;
+              if corrected(0) = '1' then
+                pulse_state <= p_raw;
+              end if;
+            elsif corrected = x"00" then
+              null;
+            elsif time_counter = x"ffffff" then
+              -- pulses over a counter overflow are sent as samples
+              words := 1;
+              if corrected(0) = '1' then
+                pulse_state <= p_raw;
+              end if;
+            elsif rise /= -1 then
+              lead_phase  <= rise;
+              lead_word   <= sample_word;
+              high_ticks  <= 1;
+              pulse_state <= p_high;
+            elsif pulse /= -1 then
+              -- the whole pulse is inside this tick
+              words  := 1;
+              word_1 := "01" & "0" & std_logic_vector(time_counter) 
+                      & std_logic_vector(to_unsigned(pulse/8 + pulse mod 8, 3))
+                      & std_logic_vector(to_unsigned(pulse mod 8, 10));
+            else
+              words := 1;
+              if corrected(0) = '1' then
+                pulse_state <= p_raw;
+              end if;
+            end if;
+          when p_high =>
+            if fall /= -1 then
+              tot    := 8*high_ticks + fall - lead_phase;
+              words  := 1;
+              word_1 := "01" & "0" & std_logic_vector(time_counter) 
+                      & std_logic_vector(to_unsigned(fall, 3))
+                      & std_logic_vector(to_unsigned(tot, 10));
+              pulse_state <= p_low;
+            elsif corrected = x"ff" then
+              if high_ticks = max_high_ticks or time_counter = x"ffffff" then
+                -- too long for a pulse word, send the leading edge as sample
+                words  := 1;
+                word_1 := lead_word;
+                pulse_state <= p_raw;
+              else
+                high_ticks <= high_ticks + 1;
+              end if;
+            else
+              -- several edges in this tick
+              words  := 2;
+              word_1 := lead_word;
+              word_2 := sample_word;
+              if corrected(0) = '1' then
+                pulse_state <= p_raw;
+              else
+                pulse_state <= p_low;
+              end if;
+            end if;
+          when p_raw =>
+            if sample_push then
+              words := 1;
+            end if;
+            if corrected(0) = '0' then
+              pulse_state <= p_low;
+            end if;
+        end case;
+      end if;
+
+      -- a pending word goes first, there is never more than one
+      if pending_valid = '1' then
+        if words = 0 then
+          pending_valid <= '0';
+        else
+          pending_word  <= word_1;
+        end if;
+        word_2 := word_1;
+        word_1 := pending_word;
+        words  := words + 1;
+      elsif words = 2 then
+        pending_valid <= '1';
+        pending_word  <= word_2;
+      end if;
+
       buffer_push       <= '0';
-      if  (  (sample_old /= sample) and 
-             ((sample /= x"55" and sample /= x"aa") or (sample(7) = sample_old(0))) 
-          ) or (time_counter = 0) then
-            if buffer_full = '0' then
+      if lost_count /= 0 and buffer_space = '1' then
+        -- the loss word goes first, a word of this cycle is reported with the next one
+        buffer_push       <= '1';
+        buffer_input_data <= "10" & "000000000000" & std_logic_vector(lost_count);
+        if words /= 0 then
+          lost_count <= to_unsigned(1, lost_count'length);
+        else
+          lost_count <= (others => '0');
+        end if;
+      elsif words /= 0 then
+            if buffer_space = '1' then
               buffer_push       <= '1';
-              buffer_input_data <= std_logic_vector(time_counter) &
-                                   (not (sample xor "01010101"));
-                                -- ^^ this has to be negated here because negating the async input
-                                --      will destroy the subsampling between clocks which relys on 
-                                --      the delay of one inverter. If the input is inverted than
-                                --      the optimizer will just cancel the dual inversion and the subsampling
-                                --      is reversed. Also the led_o has to be inverted.
-            else 
-              -- buffer is full... but we have something to write... data will be dropped
-              -- do something reasonable here, e.g. increment error count 
+              buffer_input_data <= word_1;
+            elsif lost_count /= 2**lost_count'length-1 then
+              -- buffer is full, the word is dropped and counted
+              lost_count <= lost_count + 1;
             end if;
             --sequence_counter <= sequence_counter + 1;
+      elsif sync_pending = '1' and buffer_space = '1' then
+        buffer_push       <= '1';
+        buffer_input_data <= "11" & "000000000000" & std_logic_vector(epoch_counter);
+        sync_pending      <= '0';
       end if;
     end if;
 
@@ -177,10 +389,16 @@ begin
   end process;
 
 
+  -- the push of the previous cycle is not in the buffer level yet
+  buffer_space <= '0' when buffer_full = '1' 
+                        or (buffer_push = '1' and unsigned(buffer_level) = 2**data_buffer_depth-1) 
+                      else '1';
+  level_o      <= std_logic_vector(resize(unsigned(buffer_level), level_o'length));
+
   buffer_fifo: entity work.guarded_fifo
   generic map (
     depth       => data_buffer_depth,
-    bit_width   => 32,
+    bit_width   => 40,
     default_out => 'U'
   )
   port map(
@@ -191,7 +409,8 @@ begin
     full_o  => buffer_full,
     empty_o => empty_o,
     data_i  => buffer_input_data,
-    data_o  => data_o
+    data_o  => data_o,
+    level_o => buffer_level
     );
 
 
@@ -9,8 +9,10 @@ use ieee.numeric_std.all;
 
 entity tdc_top is
 	generic (
-		data_buffer_depth  : natural := 12;
-		n_channels         : natural := 4
+		data_buffer_depth  : natural := 11; -- 4 x 2**11 words of 40 bit fit into the block ram
+		n_channels         : natural := 4;
+		arbiter_max_wait   : natural := 8;  -- a channel with data is passed over at most this often
+		time_counter_init  : natural := 0   -- simulation only, reaches the sync word and counter overflows quickly
 	);
     port (  
 		clk_i     : in    std_logic; -- 12MHz
@@ -62,9 +64,17 @@ architecture rtl of tdc_top is
 
 	signal tdc_pop            : std_logic_vector(n_channels-1 downto 0) := (others => '0');
 	signal tdc_empty          : std_logic_vector(n_channels-1 downto 0);
-	type tdc_data_array_t is array (n_channels-1 downto 0) of std_logic_vector(31 downto 0);
+	type tdc_data_array_t is array (n_channels-1 downto 0) of std_logic_vector(39 downto 0);
 	signal tdc_data           : tdc_data_array_t;
 	signal tdc_idx            : integer range 0 to n_channels-1 := 0;
+	type tdc_level_array_t is array (n_channels-1 downto 0) of std_logic_vector(15 downto 0);
+	signal tdc_level          : tdc_level_array_t;
+
+	-- readout arbiter, next_idx is the channel to read next if next_valid = '1'
+	type wait_count_array_t is array (n_channels-1 downto 0) of integer range 0 to arbiter_max_wait;
+	signal wait_count         : wait_count_array_t := (others => 0);
+	signal next_idx           : integer range 0 to n_channels-1 := 0;
+	signal next_valid         : std_logic := '0';
 
 
 	signal ftdi_data   : std_logic_vector(7 downto 0) := (others => '0');
@@ -73,8 +83,10 @@ architecture rtl of tdc_top is
 	signal time_2_reg  : std_logic_vector(6 downto 0) := (others => '0');
 	signal time_3_reg  : std_logic_vector(6 downto 0) := (others => '0');
 	signal time_4_reg  : std_logic_vector(6 downto 0) := (others => '0');
+	signal time_5_reg  : std_logic_vector(6 downto 0) := (others => '0');
+	signal six_bytes   : std_logic := '0'; -- pulse frames have 6 bytes
 	signal ftdi_push, ftdi_full : std_logic;
-	type send_data_state_t is (s_wait_for_event, s_pop_from_tdc, s_read_from_tdc, s_send_header, s_send_sample_and_time, s_send_time_2, s_send_time_3, s_send_time_4);
+	type send_data_state_t is (s_wait_for_event, s_pop_from_tdc, s_read_from_tdc, s_send_header, s_send_sample_and_time, s_send_time_2, s_send_time_3, s_send_time_4, s_send_time_5, s_send_record);
 	signal send_data_state : send_data_state_t := s_wait_for_event;
 
 	signal pwm_value : std_logic_vector(0 to 3);
@@ -86,6 +98,18 @@ architecture rtl of tdc_top is
 
 	signal registers  : std_logic_vector(63 downto 0);
 
+	-- block format (registers(48) = '1'): records go through the block encoder
+	signal block_format : std_logic;
+	signal block_rst    : std_logic;
+	signal block_push   : std_logic := '0';
+	signal block_ready  : std_logic;
+	signal block_record : std_logic_vector(41 downto 0) := (others => '0');
+	signal block_long   : std_logic := '0';
+	signal block_data   : std_logic_vector(7 downto 0);
+	signal block_byte_push : std_logic;
+	signal ft_push      : std_logic;
+	signal ft_data      : std_logic_vector(7 downto 0);
+
 	signal tdc_reset : std_logic_vector(n_channels-1 downto 0);
 begin
 
@@ -137,7 +161,8 @@ begin
 		tdc_reset(i) <= rst or not registers(60+i);
 		tdc_instance : entity work.tdc 
 		generic map (
-			data_buffer_depth => data_buffer_depth
+			data_buffer_depth => data_buffer_depth,
+			time_counter_init => time_counter_init
 		)
 		port map (
 			rst_i      => tdc_reset(i),
@@ -146,9 +171,12 @@ begin
 			clk_180_i  => clk_quad_180,
 			clk_270_i  => clk_quad_270,
 			async_i    => async_input(i),
+			pulse_mode_i => registers(49),
+			sync_mode_i  => registers(50),
 			empty_o    => tdc_empty(i),
 			pop_i      => tdc_pop(i),
 			data_o     => tdc_data(i),
+			level_o    => tdc_level(i),
 			led_o      => signal_led_o(i)
 		);
 	end generate;
@@ -184,22 +212,20 @@ begin
 			time_2_reg      <= (others => '0');
 			time_3_reg      <= (others => '0');
 			time_4_reg      <= (others => '0');
+			time_5_reg      <= (others => '0');
+			six_bytes       <= '0';
 			send_data_state <= s_wait_for_event;
 			tdc_idx         <= 0;
+			block_push      <= '0';
 		else
 			case send_data_state is
 				when s_wait_for_event =>
 					ftdi_push <= '0';
-					if ftdi_push = '0' and tdc_empty(tdc_idx) = '0' then
-						-- read data from tdc(tdc_idx)
-						tdc_pop(tdc_idx) <= '1'; 
+					if ftdi_push = '0' and next_valid = '1' then
+						-- read data from the tdc the arbiter selected
+						tdc_idx <= next_idx;
+						tdc_pop(next_idx) <= '1'; 
 						send_data_state <= s_pop_from_tdc;
-					else
-						if tdc_idx < n_channels-1 then
-							tdc_idx <= tdc_idx + 1;
-						else 
-							tdc_idx <= 0;
-						end if;
 					end if;
 				when s_pop_from_tdc =>
 					ftdi_push <= '0';
@@ -207,12 +233,43 @@ begin
 					send_data_state <= s_read_from_tdc;
 				when s_read_from_tdc =>
 					ftdi_push <= '0';
-					header_reg  <= std_logic_vector(to_unsigned(tdc_idx,3)) & tdc_data(tdc_idx)(7 downto 4);
-					s_and_t_reg <= tdc_data(tdc_idx)(3 downto 0) & tdc_data(tdc_idx)(31 downto 29);
-					time_2_reg  <= tdc_data(tdc_idx)(28 downto 22);
-					time_3_reg  <= tdc_data(tdc_idx)(21 downto 15);
-					time_4_reg  <= tdc_data(tdc_idx)(14 downto  8);
-					send_data_state <= s_send_header;
+					if tdc_data(tdc_idx)(39 downto 38) = "01" then 
+						-- pulse frame: type "100", then 39 bits channel, time, phase, time over threshold
+						header_reg  <= "100" & std_logic_vector(to_unsigned(tdc_idx,2)) & tdc_data(tdc_idx)(36 downto 35);
+						s_and_t_reg <= tdc_data(tdc_idx)(34 downto 28);
+						time_2_reg  <= tdc_data(tdc_idx)(27 downto 21);
+						time_3_reg  <= tdc_data(tdc_idx)(20 downto 14);
+						time_4_reg  <= tdc_data(tdc_idx)(13 downto  7);
+						time_5_reg  <= tdc_data(tdc_idx)( 6 downto  0);
+						six_bytes   <= '1';
+						block_record <= "100" & std_logic_vector(to_unsigned(tdc_idx,2)) & tdc_data(tdc_idx)(36 downto 0);
+						block_long   <= '1';
+					elsif tdc_data(tdc_idx)(39) = '1' then
+						-- control frame: type "111", subtype 0 (loss word) or 1 (sync word), 
+						-- then 28 bits channel and number of lost words or counter overflows
+						header_reg  <= "111" & "000" & tdc_data(tdc_idx)(38);
+						s_and_t_reg <= std_logic_vector(to_unsigned(tdc_idx,2)) & tdc_data(tdc_idx)(25 downto 21);
+						time_2_reg  <= tdc_data(tdc_idx)(20 downto 14);
+						time_3_reg  <= tdc_data(tdc_idx)(13 downto  7);
+						time_4_reg  <= tdc_data(tdc_idx)( 6 downto  0);
+						six_bytes   <= '0';
+						block_record <= "0000000" & "111" & "000" & tdc_data(tdc_idx)(38) & std_logic_vector(to_unsigned(tdc_idx,2)) & tdc_data(tdc_idx)(25 downto 0);
+						block_long   <= '0';
+					else
+						header_reg  <= std_logic_vector(to_unsigned(tdc_idx,3)) & tdc_data(tdc_idx)(7 downto 4);
+						s_and_t_reg <= tdc_data(tdc_idx)(3 downto 0) & tdc_data(tdc_idx)(31 downto 29);
+						time_2_reg  <= tdc_data(tdc_idx)(28 downto 22);
+						time_3_reg  <= tdc_data(tdc_idx)(21 downto 15);
+						time_4_reg  <= tdc_data(tdc_idx)(14 downto  8);
+						six_bytes   <= '0';
+						block_record <= "0000000" & std_logic_vector(to_unsigned(tdc_idx,3)) & tdc_data(tdc_idx)(31 downto 0);
+						block_long   <= '0';
+					end if;
+					if block_format = '1' then
+						send_data_state <= s_send_record;
+					else
+						send_data_state <= s_send_header;
+					end if;
 				when s_send_header =>
 					ftdi_push <= '0';
 					if ftdi_push = '0' and ftdi_full = '0' then
@@ -246,22 +303,114 @@ begin
 					if ftdi_push = '0' and ftdi_full = '0' then
 						ftdi_push <= '1';
 						ftdi_data <= '0' & time_4_reg;
+						if six_bytes = '1' then
+							send_data_state <= s_send_time_5;
+						else
+							send_data_state <= s_wait_for_event;
+						end if;
+					end if;
+				when s_send_time_5 =>
+					ftdi_push <= '0';
+					if ftdi_push = '0' and ftdi_full = '0' then
+						ftdi_push <= '1';
+						ftdi_data <= '0' & time_5_reg;
+						send_data_state <= s_wait_for_event;
+					end if;
+				when s_send_record =>
+					-- hold the record until the block encoder takes it
+					ftdi_push <= '0';
+					if block_push = '1' and block_ready = '1' then
+						block_push <= '0';
 						send_data_state <= s_wait_for_event;
+					else
+						block_push <= '1';
 					end if;
 			end case; 
 		end if;
 
 	end process;
 
+	-- readout arbiter: the tdc with the fullest buffer is read first, so that
+	-- a burst on one channel doesn't overflow its buffer while the others 
+	-- are almost empty. A channel with data that was passed over 
+	-- arbiter_max_wait times is read next, whatever the others have.
+	-- The choice is registered, it is ready again long before the next pop.
+	arbiter: process
+		variable best     : integer range 0 to n_channels-1;
+		variable found    : boolean;
+		variable starving : boolean;
+	begin
+		wait until rising_edge(clk_quad_000);
+		if rst = '1' then
+			wait_count <= (others => 0);
+			next_valid <= '0';
+			next_idx   <= 0;
+		else
+			best     := 0;
+			found    := false;
+			starving := false;
+			for i in 0 to n_channels-1 loop
+				if tdc_empty(i) = '0' then
+					if wait_count(i) = arbiter_max_wait then
+						if not starving then
+							best     := i;
+							starving := true;
+						end if;
+					elsif not starving and (not found or unsigned(tdc_level(i)) > unsigned(tdc_level(best))) then
+						best := i;
+					end if;
+					found := true;
+				end if;
+			end loop;
+			if found then
+				next_valid <= '1';
+			else
+				next_valid <= '0';
+			end if;
+			next_idx <= best;
+
+			-- count how often a channel with data was passed over
+			if unsigned(tdc_pop) /= 0 then
+				for i in 0 to n_channels-1 loop
+					if tdc_pop(i) = '1' then
+						wait_count(i) <= 0;
+					elsif tdc_empty(i) = '0' and wait_count(i) /= arbiter_max_wait then
+						wait_count(i) <= wait_count(i) + 1;
+					end if;
+				end loop;
+			end if;
+		end if;
+	end process;
+
+	-- pack records into blocks without per byte framing bits,
+	-- a partly filled block is discarded when the format is switched
+	block_format <= registers(48);
+	block_rst    <= rst or not block_format;
+	block_encoder_inst : entity work.block_encoder
+	port map (
+		clk_i    => clk_quad_000,
+		rst_i    => block_rst,
+		push_i   => block_push,
+		ready_o  => block_ready,
+		record_i => block_record,
+		long_i   => block_long,
+		push_o   => block_byte_push,
+		full_i   => ftdi_full,
+		data_o   => block_data
+	);
+
+	ft_push <= block_byte_push when block_format = '1' else ftdi_push;
+	ft_data <= block_data      when block_format = '1' else ftdi_data;
+
 	-- instanciate FT232H chip (USB to host PC)
 	ft232h : entity work.ft232h_async_fifo
 	port map (
 		clk_i    => clk_quad_000,
 		rst_i    => rst,
 		-- write interface (write to host PC)
-		push_i   => ftdi_push,
+		push_i   => ft_push,
 		full_o   => ftdi_full,
-		data_i   => ftdi_data,
+		data_i   => ft_data,
 
 		registers_o => registers,
 
@@ -0,0 +1,166 @@
+library ieee;
+use ieee.std_logic_1164.all;
+use ieee.numeric_std.all;
+use ieee.math_real.all;
+
+use std.textio.all;
+
+-- Self-checking co-simulation of tdc_top with the host decoder.
+-- Random pulses are driven into all channels and written to edges.txt,
+-- the bytes the design sends to the FT232H are written to capture.raw.
+-- host_software/tdc-cosim decodes the capture and compares (see makefile).
+entity testbench is
+  generic (
+    seed               : positive := 1;
+    mode               : natural  := 0;      -- mode nibble: 1 blocks, 2 pulse mode, 4 sync frames
+    run_time_us        : natural  := 5000;   -- same as --stop-time
+    drain_time_us      : natural  := 500;    -- no new pulses at the end of the run
+    mean_gap_ns        : natural  := 40000;  -- mean time between pulses per channel
+    min_gap_ns         : natural  := 20;
+    min_width_ns       : natural  := 10;     -- rising and falling edge in different samples
+    max_width_ns       : natural  := 500;    -- short enough for pulse mode
+    host_stall_percent : natural  := 10;     -- probability of TXE# high per microsecond
+    buffer_depth       : natural  := 11;     -- log2 of the words in each channel buffer
+    time_counter_init  : natural  := 0       -- time counter of the channels after reset
+  );
+end entity;
+
+architecture simulation of testbench is
+  constant clk_period : time := 83.333333 ns;
+  signal clk          : std_logic := '0';
+
+  type byte_array_t is array (natural range <>) of std_logic_vector(7 downto 0);
+
+  signal input_data   : std_logic_vector(7 downto 0) := (others => '0');
+  signal adbus_io     : std_logic_vector(7 downto 0);
+  signal n_rxf_i      : std_logic := '1';
+  signal n_txe_i      : std_logic := '0';
+  signal n_rd_o       : std_logic := '0';
+  signal n_wr_o       : std_logic := '0';
+  signal n_siwu_o     : std_logic := '0';
+  signal n_oe_o       : std_logic := '0';
+
+  signal async_input  : std_logic_vector(3 downto 0) := (others => '0');
+  signal enabled      : boolean := false;
+
+  file edges_file : text open write_mode is "edges.txt";
+
+  type char_file_t is file of character;
+  file capture_file : char_file_t open write_mode is "capture.raw";
+
+begin
+  -- generate clk and reset signal
+  clk <= not clk after clk_period/2;
+
+  -- instantiate device under test (dut)
+  dut : entity work.tdc_top
+    generic map (
+      data_buffer_depth => buffer_depth,
+      time_counter_init => time_counter_init
+    )
+    port map (
+      clk_i         => clk,
+      adbus_io      => adbus_io,
+      n_rxf_i       => n_rxf_i,
+      n_txe_i       => n_txe_i,
+      n_rd_o        => n_rd_o,
+      n_wr_o        => n_wr_o,
+      n_siwu_o      => n_siwu_o,
+      n_oe_o        => n_oe_o,
+      async_input_i => async_input
+    );
+
+  -- set the mode register, then enable all channels
+  configure : process
+    variable commands : byte_array_t(0 to 1);
+    variable l        : line;
+  begin
+    write(l, string'("mode "));
+    write(l, mode);
+    writeline(edges_file, l);
+
+    commands := (std_logic_vector(to_unsigned(12*16 + mode, 8)), x"ff");
+    for i in 1 to 30 loop
+      wait until rising_edge(clk);
+    end loop;
+    for i in commands'range loop
+      n_rxf_i <= '0';
+      input_data <= commands(i);
+      wait until rising_edge(n_rd_o);
+      n_rxf_i <= '1';
+      wait until rising_edge(clk);
+    end loop;
+    wait for 10 us;
+    enabled <= true;
+    wait;
+  end process;
+
+  adbus_io <= input_data when n_rxf_i = '0' else (others => 'Z');
+
+  -- the host doesn't always take data, like a USB bus with other traffic
+  host_stall : process
+    variable seed1 : positive := seed;
+    variable seed2 : positive := 17;
+    variable x     : real;
+  begin
+    wait for 1 us;
+    uniform(seed1, seed2, x);
+    if x*100.0 < real(host_stall_percent) then
+      n_txe_i <= '1';
+    else
+      n_txe_i <= '0';
+    end if;
+  end process;
+
+  -- random pulses with exponentially distributed gaps on each channel,
+  -- every edge is written as "<channel> <edge> <ns> <ps>"
+  gen_channels : for ch in 0 to 3 generate
+    gen_pulses : process
+      variable seed1   : positive := seed;
+      variable seed2   : positive := ch+1;
+      variable x       : real;
+      variable gap     : integer; -- in [ps]
+      variable width   : integer; -- in [ps]
+      variable t_ns    : integer;
+      variable l       : line;
+
+      procedure log_edge(edge : integer) is
+      begin
+        t_ns := now / 1 ns;
+        write(l, ch);
+        write(l, ' ');
+        write(l, edge);
+        write(l, ' ');
+        write(l, t_ns);
+        write(l, ' ');
+        write(l, (now - t_ns*1 ns) / 1 ps);
+        writeline(edges_file, l);
+      end procedure;
+    begin
+      wait until enabled;
+      loop
+        uniform(seed1, seed2, x);
+        gap   := min_gap_ns*1000 + integer(-real(mean_gap_ns)*1000.0*log(x));
+        uniform(seed1, seed2, x);
+        width := min_width_ns*1000 + integer(x*real(max_width_ns-min_width_ns)*1000.0);
+        exit when now + (gap+width)*1 ps > (run_time_us-drain_time_us)*1 us;
+
+        wait for gap*1 ps;
+        async_input(ch) <= '1';
+        log_edge(1);
+        wait for width*1 ps;
+        async_input(ch) <= '0';
+        log_edge(0);
+      end loop;
+      wait;
+    end process;
+  end generate;
+
+  -- write the bytes on the link (data is stable at the end of the write strobe)
+  capture : process
+  begin
+    wait until rising_edge(n_wr_o);
+    write(capture_file, character'val(to_integer(unsigned(adbus_io))));
+  end process;
+
+end architecture;
@@ -0,0 +1,145 @@
+library ieee;
+use ieee.std_logic_1164.all;
+use ieee.numeric_std.all;
+
+-- Two tdcs on the same input, one sends sample words, the other one pulse
+-- words. The edges are extracted from the words like tdc_next_event() in
+-- host_software/tdc_control.c does it and have to be the same for both.
+entity testbench is
+end entity;
+
+architecture simulation of testbench is
+  constant clk_period : time := 8 ns;
+  signal clk_000      : std_logic := '1';
+  signal clk_090      : std_logic := '1';
+  signal clk_180      : std_logic := '1';
+  signal clk_270      : std_logic := '1';
+  signal rst          : std_logic := '1';
+
+  signal async_input  : std_logic := '0';
+
+  type word_array_t is array (0 to 1) of std_logic_vector(39 downto 0);
+  signal empty        : std_logic_vector(0 to 1);
+  signal pop          : std_logic_vector(0 to 1) := (others => '0');
+  signal data         : word_array_t;
+  signal pulse_mode   : std_logic_vector(0 to 1) := "01";
+
+  -- edges as 2*time_in_ns + rising
+  type edge_array_t is array (0 to 4095) of integer;
+  type edges_t is array (0 to 1) of edge_array_t;
+  signal edges        : edges_t;
+  type count_array_t is array (0 to 1) of integer;
+  signal n_edges      : count_array_t := (0, 0);
+  signal n_words      : count_array_t := (0, 0);
+  signal n_pulses     : count_array_t := (0, 0);
+
+  -- pulse width and the gap after it in ps
+  type pulse_t is record
+    width, gap : integer;
+  end record;
+  type pulse_array_t is array (natural range <>) of pulse_t;
+  constant pulses : pulse_array_t := (
+    (  1300,  50000), (  2100,  50000), (  3700,  50000), (  5000,  50000),
+    (  7900,  50000), (  9100,  50000), ( 12000,  50000), (100000,  50000),
+    (101000,   3000), (  2500,   2500), (  2500,   2500), (  2500,  50000), -- several edges per tick
+    (999000,  50000), (1016000, 50000), (1023000, 50000), (1031000, 50000), -- around the 10 bit limit
+    (2000000, 50000), (  6000,   1500), (  6000,  50000)
+  );
+
+begin
+  -- four clock phases, 2 ns apart
+  clk_000 <= not clk_000 after clk_period/2;
+  clk_090 <= transport clk_000 after clk_period/4;
+  clk_180 <= transport clk_000 after clk_period/2;
+  clk_270 <= transport clk_000 after clk_period*3/4;
+  rst     <= '0' after clk_period*20;
+
+  duts: for i in 0 to 1 generate
+  begin
+    dut : entity work.tdc
+      generic map (
+        data_buffer_depth => 6
+      )
+      port map (
+        rst_i        => rst,
+        clk_000_i    => clk_000,
+        clk_090_i    => clk_090,
+        clk_180_i    => clk_180,
+        clk_270_i    => clk_270,
+        async_i      => async_input,
+        pulse_mode_i => pulse_mode(i),
+        empty_o      => empty(i),
+        pop_i        => pop(i),
+        data_o       => data(i)
+      );
+
+    -- read the words and extract the edges
+    read_words : process
+      variable level   : std_logic := '0';
+      variable word    : std_logic_vector(39 downto 0);
+      variable t, fall : integer;
+      variable n       : integer := 0;
+    begin
+      wait until rising_edge(clk_000);
+      if empty(i) = '0' then
+        pop(i) <= '1';
+        wait until rising_edge(clk_000);
+        pop(i) <= '0';
+        wait until rising_edge(clk_000);
+        word := data(i);
+        n_words(i) <= n_words(i) + 1;
+        t := 8*to_integer(unsigned(word(31 downto 8)));
+        if word(39 downto 38) = "01" then
+          fall := 8*to_integer(unsigned(word(36 downto 13))) + to_integer(unsigned(word(12 downto 10)));
+          edges(i)(n)   <= 2*(fall - to_integer(unsigned(word(9 downto 0)))) + 1;
+          edges(i)(n+1) <= 2*fall;
+          n := n + 2;
+          level := '0';
+          n_pulses(i) <= n_pulses(i) + 1;
+        else
+          for b in 7 downto 0 loop
+            if word(b) /= level then
+              level := word(b);
+              if level = '1' then
+                edges(i)(n) <= 2*(t + 7-b) + 1;
+              else
+                edges(i)(n) <= 2*(t + 7-b);
+              end if;
+              n := n + 1;
+            end if;
+          end loop;
+        end if;
+        n_edges(i) <= n;
+      end if;
+    end process;
+  end generate;
+
+  gen_input : process
+  begin
+    wait for 1 us;
+    for i in pulses'range loop
+      async_input <= '1';
+      wait for pulses(i).width * 1 ps;
+      async_input <= '0';
+      wait for pulses(i).gap * 1 ps;
+    end loop;
+    wait;
+  end process;
+
+  check : process
+  begin
+    wait for 10 us;
+    report "sample words " & integer'image(n_words(0)) & ", pulse mode words " & integer'image(n_words(1))
+         & " (" & integer'image(n_pulses(1)) & " pulses)";
+    assert n_edges(0) = 2*pulses'length report "not all edges seen" severity error;
+    assert n_edges(1) = n_edges(0) report "different number of edges in pulse mode" severity error;
+    for j in 0 to n_edges(0)-1 loop
+      assert edges(0)(j) = edges(1)(j) 
+        report "edge " & integer'image(j) & " differs: " & integer'image(edges(0)(j)) & " /= " & integer'image(edges(1)(j))
+        severity error;
+    end loop;
+    assert n_pulses(1) > 0 and n_words(1) < n_words(0) report "pulse mode doesn't save words" severity error;
+    wait;
+  end process;
+
+end architecture;
@@ -13,6 +13,12 @@ architecture simulation of testbench is
 
   signal led          : std_logic := '0';
 
+  -- two identical devices on the same inputs, one sends 5 byte frames,
+  -- the other one is switched to the block format
+  type byte_array_t is array (natural range <>) of std_logic_vector(7 downto 0);
+  constant frame_commands : byte_array_t := (0 => x"ff");
+  constant block_commands : byte_array_t := (x"ff", x"c1");
+
   signal input_data   : std_logic_vector(7 downto 0) := (others => '0');
   signal adbus_io     : std_logic_vector(7 downto 0);
   signal n_rxf_i      : std_logic := '1';
@@ -22,8 +28,25 @@ architecture simulation of testbench is
   signal n_siwu_o     : std_logic := '0';
   signal n_oe_o       : std_logic := '0';
 
+  signal block_input_data : std_logic_vector(7 downto 0) := (others => '0');
+  signal block_adbus_io   : std_logic_vector(7 downto 0);
+  signal block_n_rxf_i    : std_logic := '1';
+  signal block_n_rd_o     : std_logic := '0';
+  signal block_n_wr_o     : std_logic := '0';
+  signal block_n_siwu_o   : std_logic := '0';
+  signal block_n_oe_o     : std_logic := '0';
+
   signal async_input  : std_logic_vector(3 downto 0) := (others => '0');
 
+  -- records that arrived at the host side of each device
+  type int_array_t is array (0 to 3) of integer;
+  signal frame_records : integer := 0;
+  signal channel_records : int_array_t := (others => 0); -- frames device, without loss frames
+  signal lost_words    : int_array_t := (others => 0);   -- as reported by loss frames
+  signal loss_frames   : integer := 0;
+  signal block_records : integer := 0;
+  signal block_errors  : integer := 0;
+
 begin
   -- generate clk and reset signal
   clk <= not clk after clk_period/2;
@@ -46,16 +69,35 @@ begin
       async_input_i => async_input
     );
 
+  dut_blocks : entity work.tdc_top
+    generic map (
+      data_buffer_depth => 4
+    )
+    port map (
+      clk_i         => clk,
+      adbus_io      => block_adbus_io,
+      n_rxf_i       => block_n_rxf_i,
+      n_txe_i       => n_txe_i,
+      n_rd_o        => block_n_rd_o,
+      n_wr_o        => block_n_wr_o,
+      n_siwu_o      => block_n_siwu_o,
+      n_oe_o        => block_n_oe_o,
+      async_input_i => async_input
+    );
+
   -- activate all channels
   enable_channels : process
   begin
     for i in 1 to 30 loop
       wait until rising_edge(clk);
     end loop;
-    n_rxf_i <= '0';
-    input_data <= x"ff";
-    wait until rising_edge(n_rd_o);
-    n_rxf_i <= '1';
+    for i in frame_commands'range loop
+      n_rxf_i <= '0';
+      input_data <= frame_commands(i);
+      wait until rising_edge(n_rd_o);
+      n_rxf_i <= '1';
+      wait until rising_edge(clk);
+    end loop;
 
     while true loop
       wait until rising_edge(clk);
@@ -64,22 +106,140 @@ begin
 
   end process;
 
+  -- activate all channels and the block format
+  enable_blocks : process
+  begin
+    for i in 1 to 30 loop
+      wait until rising_edge(clk);
+    end loop;
+    for i in block_commands'range loop
+      block_n_rxf_i <= '0';
+      block_input_data <= block_commands(i);
+      wait until rising_edge(block_n_rd_o);
+      block_n_rxf_i <= '1';
+      wait until rising_edge(clk);
+    end loop;
+    wait;
+  end process;
 
 
-  adbus_io <= input_data when n_rxf_i = '0' else (others => 'Z');
+  adbus_io       <= input_data       when n_rxf_i = '0'       else (others => 'Z');
+  block_adbus_io <= block_input_data when block_n_rxf_i = '0' else (others => 'Z');
 
   --async_input(0) <= not input_data(5) after 3.300 ns;
   --async_input(1) <= not input_data(5) after 3.300 ns;
   --async_input(2) <= not input_data(5) after 3.300 ns;
   --async_input(3) <= not input_data(5) after 3.300 ns;
 
+  -- a 12 ns pulse every 50 us, two sample words each
   gen_input : process
   begin
-    wait for 5 us;
+    wait for 50 us;
     async_input(0) <= '1';
     wait for 12 ns;
     async_input(0) <= '0';
   end process;
 
+  -- more edges on all channels than the link can carry
+  gen_dense_input : process
+  begin
+    wait for 20 us;
+    while true loop
+      async_input(3 downto 1) <= (others => '1');
+      wait for 43 ns;
+      async_input(3 downto 1) <= (others => '0');
+      wait for 157 ns;
+    end loop;
+  end process;
+
+  -- count the records on the link (data is stable at the end of the write strobe)
+  count_frames : process
+    variable frame : byte_array_t(0 to 5);
+    variable n     : integer := 0;
+    variable ch    : integer;
+  begin
+    wait until rising_edge(n_wr_o);
+    if adbus_io(7) = '1' then
+      frame_records <= frame_records + 1;
+      n := 0;
+    end if;
+    if n < 6 then
+      frame(n) := adbus_io;
+      n := n + 1;
+    end if;
+    if n = 5 and frame(0)(6 downto 4) = "111" and frame(0)(3 downto 0) /= "0000" then
+      -- sync frames are not switched on here
+      report "unexpected control frame" severity error;
+    elsif n = 5 and frame(0)(6 downto 4) = "111" then
+      -- loss frame: subtype 0, 2 bit channel, 26 bit count
+      ch := to_integer(unsigned(frame(1)(6 downto 5)));
+      lost_words(ch) <= lost_words(ch) + to_integer(unsigned(frame(1)(4 downto 0) & frame(2)(6 downto 0) 
+                                                           & frame(3)(6 downto 0) & frame(4)(6 downto 0)));
+      loss_frames    <= loss_frames + 1;
+    elsif n = 1 and unsigned(frame(0)(6 downto 4)) < 4 then
+      ch := to_integer(unsigned(frame(0)(6 downto 4)));
+      channel_records(ch) <= channel_records(ch) + 1;
+    end if;
+  end process;
+
+  count_blocks : process
+    variable state     : integer := 0;
+    variable count     : integer := 0;
+    variable remaining : integer := 0;
+  begin
+    wait until rising_edge(block_n_wr_o);
+    case state is
+      when 0 => -- sync word
+        if block_adbus_io = x"a5" then
+          state := 1;
+        end if;
+      when 1 =>
+        if block_adbus_io = x"5a" then
+          state := 2;
+        else
+          block_errors <= block_errors + 1;
+          state := 0;
+        end if;
+      when 2 => -- record count
+        count     := to_integer(unsigned(block_adbus_io));
+        remaining := (count*35+7)/8 + 1; -- payload and checksum, no pulse records here
+        state     := 3;
+      when others =>
+        remaining := remaining - 1;
+        if remaining = 0 then
+          block_records <= block_records + count;
+          state := 0;
+        end if;
+    end case;
+  end process;
+
+  -- at fixed link bandwidth the block format has to deliver more records
+  compare_formats : process
+  begin
+    wait for 490 us;
+    report "records delivered: frames " & integer'image(frame_records)
+         & ", blocks " & integer'image(block_records);
+    assert block_errors = 0 report "block format out of sync" severity error;
+    assert block_records > frame_records report "block format is not denser than frames" severity error;
+    wait;
+  end process;
+
+  -- under the burst on channels 1-3 the buffers overflow, which has to 
+  -- be reported in band. The few words of channel 0 are read before its
+  -- buffer runs full, whatever the fill level of the others.
+  check_arbiter : process
+  begin
+    wait for 490 us;
+    for ch in 0 to 3 loop
+      report "channel " & integer'image(ch) & ": " & integer'image(channel_records(ch))
+           & " records, " & integer'image(lost_words(ch)) & " words lost";
+    end loop;
+    assert loss_frames > 0 report "no loss frames under burst load" severity error;
+    assert lost_words(1) > 0 and lost_words(2) > 0 and lost_words(3) > 0 
+      report "loss not reported for the burst channels" severity error;
+    assert lost_words(0) = 0 report "channel 0 starved by the burst channels" severity error;
+    assert channel_records(0) >= 2*(490/50-1) report "channel 0 records missing" severity error;
+    wait;
+  end process;
 
-end architecture;
\ No newline at end of file
+end architecture;
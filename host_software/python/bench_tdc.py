@@ -0,0 +1,74 @@
+# decoding a capture into columns: parsing the text output of tdc-ctl
+# against the Python bindings, run with 'make bench-python'
+import os
+import subprocess
+import sys
+import time
+
+import tdc
+from test_tdc import TDC_CTL, random_capture
+
+FILENAME = 'bench_data_py.raw'
+
+
+def parse_tdc_ctl(filename):
+    output = subprocess.run([TDC_CTL, filename], stdout=subprocess.PIPE, check=True).stdout
+    channel, times, edge, sample, dt = [], [], [], [], []
+    for line in output.decode('utf-8').splitlines():
+        fields = line.split()
+        if len(fields) == 5 and fields[3].startswith('sample='):
+            channel.append(int(fields[0]))
+            edge.append(int(fields[1]))
+            times.append(int(fields[2]))
+            sample.append(int(fields[3][7:11], 16))
+            dt.append(int(fields[4][3:]))
+        elif len(fields) == 6 and fields[1] == 'lost':
+            channel.append(int(fields[0]))
+            edge.append(tdc.LOSS)
+            times.append(int(fields[5]))
+            sample.append(0)
+            dt.append(int(fields[2]))
+    return len(times)
+
+
+def run_tdc_ctl(filename):
+    output = subprocess.run([TDC_CTL, filename], stdout=subprocess.PIPE, check=True).stdout
+    return output.count(b'sample=') + output.count(b' lost ')
+
+
+def decode_batches(filename):
+    # the batches stay alive, like columns that are used later
+    batches = list(tdc.Decoder(filename, chunk_size=1 << 16))
+    return sum(len(batch) for batch in batches)
+
+
+def decode_numpy(filename):
+    import numpy
+    times = [numpy.frombuffer(batch.time, numpy.uint64) for batch in tdc.Decoder(filename)]
+    return len(numpy.concatenate(times))
+
+
+def bench(name, function, repeat=3):
+    best = 1e99
+    for i in range(repeat):
+        start = time.perf_counter()
+        events = function(FILENAME)
+        best = min(best, time.perf_counter() - start)
+    print('%s,%d,%.6f,%.1f' % (name, events, best, events/best))
+    sys.stdout.flush()
+
+
+if __name__ == '__main__':
+    n_frames = int(sys.argv[1]) if len(sys.argv) > 1 else 500000
+    with open(FILENAME, 'wb') as f:
+        f.write(random_capture(n_frames))
+    print('method,events,seconds,events_per_s')
+    bench('tdc_ctl_text_only', run_tdc_ctl)
+    bench('tdc_ctl_parse', parse_tdc_ctl)
+    bench('tdc_batches', decode_batches)
+    try:
+        import numpy
+        bench('tdc_batches_numpy', decode_numpy)
+    except ImportError:
+        pass
+    os.unlink(FILENAME)
@@ -0,0 +1,467 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+
+#include "tdc_control.h"
+
+#include <unistd.h>
+
+//////////////////////////////////////////
+// Python bindings of the host library
+//
+// tdc.Decoder opens a capture file or a device with tdc_open() and
+// decodes events into batches. A batch keeps one array per field
+// (structure of arrays), each field is exported with the buffer
+// protocol, so numpy.frombuffer(batch.time, numpy.uint64) or
+// numpy.asarray(batch.time) uses the memory of the batch without a copy.
+// The GIL is released while decoding. Iterating over a decoder yields
+// batches of chunk_size events, so captures larger than the memory
+// can be processed.
+//
+// For loss events (edge == tdc.LOSS) the dt field holds the number
+// of words the board dropped. The tot field is the time over threshold
+// of falling edges, 0 if the rising edge wasn't seen.
+//////////////////////////////////////////
+
+enum { COL_CHANNEL, COL_TIME, COL_EDGE, COL_SAMPLE, COL_DT, COL_TOT, N_COLUMNS };
+static char *column_formats[N_COLUMNS] = {"b", "Q", "b", "B", "Q", "Q"};
+static const Py_ssize_t column_sizes[N_COLUMNS] = {1, 8, 1, 1, 8, 8};
+
+//////////////////////////////////////////
+// batch of decoded events
+//////////////////////////////////////////
+
+typedef struct
+{
+	PyObject_HEAD
+	Py_ssize_t len;
+	void      *columns[N_COLUMNS];
+} BatchObject;
+
+// one field of a batch, keeps the batch alive while it is exported
+typedef struct
+{
+	PyObject_HEAD
+	BatchObject *batch;
+	int          column;
+	Py_ssize_t   shape;
+	Py_ssize_t   stride;
+} ColumnObject;
+
+static PyTypeObject BatchType;
+static PyTypeObject ColumnType;
+
+static BatchObject *batch_new(Py_ssize_t capacity)
+{
+	BatchObject *batch = PyObject_New(BatchObject, &BatchType);
+	if (!batch) {
+		return NULL;
+	}
+	batch->len = 0;
+	for (int c = 0; c < N_COLUMNS; ++c) {
+		batch->columns[c] = NULL;
+	}
+	for (int c = 0; c < N_COLUMNS; ++c) {
+		// one spare element so that empty batches have valid pointers
+		batch->columns[c] = PyMem_RawMalloc((capacity+1)*column_sizes[c]);
+		if (!batch->columns[c]) {
+			Py_DECREF(batch);
+			return (BatchObject*)PyErr_NoMemory();
+		}
+	}
+	return batch;
+}
+
+static void batch_dealloc(BatchObject *self)
+{
+	for (int c = 0; c < N_COLUMNS; ++c) {
+		PyMem_RawFree(self->columns[c]);
+	}
+	PyObject_Del(self);
+}
+
+static Py_ssize_t batch_length(BatchObject *self)
+{
+	return self->len;
+}
+
+static PyObject *batch_column(BatchObject *self, void *closure)
+{
+	ColumnObject *column = PyObject_New(ColumnObject, &ColumnType);
+	if (!column) {
+		return NULL;
+	}
+	Py_INCREF(self);
+	column->batch  = self;
+	column->column = (int)(Py_ssize_t)closure;
+	column->shape  = self->len;
+	column->stride = column_sizes[column->column];
+	PyObject *view = PyMemoryView_FromObject((PyObject*)column);
+	Py_DECREF(column);
+	return view;
+}
+
+static PySequenceMethods batch_as_sequence = {
+	.sq_length = (lenfunc)batch_length,
+};
+
+static PyGetSetDef batch_getset[] = {
+	{"channel", (getter)batch_column, NULL, "channel number (int8)",                     (void*)COL_CHANNEL},
+	{"time",    (getter)batch_column, NULL, "time in units of [1 ns] (uint64)",          (void*)COL_TIME},
+	{"edge",    (getter)batch_column, NULL, "tdc.FALLING, tdc.RISING or tdc.LOSS (int8)", (void*)COL_EDGE},
+	{"sample",  (getter)batch_column, NULL, "8 bit sample around the edge (uint8)",      (void*)COL_SAMPLE},
+	{"dt",      (getter)batch_column, NULL, "ns since the previous edge of the channel, lost words for losses (uint64)", (void*)COL_DT},
+	{"tot",     (getter)batch_column, NULL, "time over threshold of falling edges in [ns], 0 if unknown (uint64)", (void*)COL_TOT},
+	{NULL}
+};
+
+static PyTypeObject BatchType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name        = "tdc.Batch",
+	.tp_doc         = "decoded events, one buffer per field",
+	.tp_basicsize   = sizeof(BatchObject),
+	.tp_flags       = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc     = (destructor)batch_dealloc,
+	.tp_as_sequence = &batch_as_sequence,
+	.tp_getset      = batch_getset,
+};
+
+static int column_getbuffer(ColumnObject *self, Py_buffer *view, int flags)
+{
+	if (flags & PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "batches are read-only");
+		return -1;
+	}
+	view->buf        = self->batch->columns[self->column];
+	view->obj        = (PyObject*)self;
+	view->len        = self->shape*self->stride;
+	view->readonly   = 1;
+	view->itemsize   = self->stride;
+	view->format     = (flags & PyBUF_FORMAT) ? column_formats[self->column] : NULL;
+	view->ndim       = 1;
+	view->shape      = (flags & PyBUF_ND)      ? &self->shape  : NULL;
+	view->strides    = (flags & PyBUF_STRIDES) ? &self->stride : NULL;
+	view->suboffsets = NULL;
+	view->internal   = NULL;
+	Py_INCREF(self);
+	return 0;
+}
+
+static void column_dealloc(ColumnObject *self)
+{
+	Py_DECREF(self->batch);
+	PyObject_Del(self);
+}
+
+static PyBufferProcs column_as_buffer = {
+	.bf_getbuffer = (getbufferproc)column_getbuffer,
+};
+
+static PyTypeObject ColumnType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name      = "tdc.Column",
+	.tp_doc       = "one field of a batch, use it through the buffer protocol",
+	.tp_basicsize = sizeof(ColumnObject),
+	.tp_flags     = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc   = (destructor)column_dealloc,
+	.tp_as_buffer = &column_as_buffer,
+};
+
+//////////////////////////////////////////
+// decoder
+//////////////////////////////////////////
+
+typedef struct
+{
+	PyObject_HEAD
+	tdc_t             *tdc;
+	Py_ssize_t         chunk_size;
+	int                eof;
+	PyThread_type_lock lock; // one decoding thread at a time, taken without the GIL
+} DecoderObject;
+
+static int decoder_init(DecoderObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *keywords[] = {"filename", "format", "chunk_size", NULL};
+	const char *filename;
+	const char *format = "frames";
+	Py_ssize_t chunk_size = 1<<16;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|sn", keywords, &filename, &format, &chunk_size)) {
+		return -1;
+	}
+	if (chunk_size < 1) {
+		PyErr_SetString(PyExc_ValueError, "chunk_size must be positive");
+		return -1;
+	}
+	if (strcmp(format, "frames") != 0 && strcmp(format, "blocks") != 0) {
+		PyErr_SetString(PyExc_ValueError, "format must be 'frames' or 'blocks'");
+		return -1;
+	}
+	if (self->tdc) {
+		PyErr_SetString(PyExc_RuntimeError, "decoder is already open");
+		return -1;
+	}
+	if (!self->lock && !(self->lock = PyThread_allocate_lock())) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	tdc_t *tdc;
+	Py_BEGIN_ALLOW_THREADS
+	tdc = tdc_open(filename);
+	Py_END_ALLOW_THREADS
+	if (!tdc) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+		return -1;
+	}
+	tdc_format_t tdc_format = strcmp(format, "blocks") == 0 ? TDC_FORMAT_BLOCKS : TDC_FORMAT_FRAMES;
+	if (isatty(tdc->fd)) {
+		tdc_set_format(tdc, tdc_format);
+	} else {
+		tdc->format = tdc_format; // a file can't take the mode register write
+	}
+	self->tdc        = tdc;
+	self->chunk_size = chunk_size;
+	self->eof        = 0;
+	return 0;
+}
+
+static void decoder_close_tdc(DecoderObject *self)
+{
+	if (self->tdc) {
+		tdc_close(self->tdc);
+		self->tdc = NULL;
+	}
+}
+
+static void decoder_dealloc(DecoderObject *self)
+{
+	decoder_close_tdc(self);
+	if (self->lock) {
+		PyThread_free_lock(self->lock);
+	}
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+// runs without the GIL, returns the number of events
+static Py_ssize_t decode(tdc_t *tdc, BatchObject *batch, Py_ssize_t n, int *eof)
+{
+	signed char   *channel = batch->columns[COL_CHANNEL];
+	unsigned long *time    = batch->columns[COL_TIME];
+	signed char   *edge    = batch->columns[COL_EDGE];
+	unsigned char *sample  = batch->columns[COL_SAMPLE];
+	unsigned long *dt      = batch->columns[COL_DT];
+	unsigned long *tot     = batch->columns[COL_TOT];
+	Py_ssize_t i;
+	for (i = 0; i < n; ++i) {
+		tdc_event_t event = tdc_next_event(tdc);
+		if (event.channel == -1) {
+			*eof = 1;
+			break;
+		}
+		channel[i] = event.channel;
+		time[i]    = event.time;
+		edge[i]    = event.edge;
+		sample[i]  = event.sample;
+		dt[i]      = event.edge == TDC_EDGE_LOSS ? event.lost : event.dt;
+		tot[i]     = event.tot;
+	}
+	return i;
+}
+
+static PyObject *decoder_read_batch(DecoderObject *self, Py_ssize_t n)
+{
+	if (!self->tdc) {
+		PyErr_SetString(PyExc_ValueError, "decoder is closed");
+		return NULL;
+	}
+	BatchObject *batch = batch_new(n);
+	if (!batch) {
+		return NULL;
+	}
+	if (self->eof) {
+		return (PyObject*)batch;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(self->lock, WAIT_LOCK);
+	if (self->tdc) { // closed by another thread in the meantime
+		batch->len = decode(self->tdc, batch, n, &self->eof);
+	}
+	PyThread_release_lock(self->lock);
+	Py_END_ALLOW_THREADS
+	return (PyObject*)batch;
+}
+
+static PyObject *decoder_read(DecoderObject *self, PyObject *args)
+{
+	Py_ssize_t n = self->chunk_size;
+	if (!PyArg_ParseTuple(args, "|n", &n)) {
+		return NULL;
+	}
+	if (n < 0) {
+		PyErr_SetString(PyExc_ValueError, "the number of events must not be negative");
+		return NULL;
+	}
+	return decoder_read_batch(self, n);
+}
+
+static PyObject *decoder_iternext(DecoderObject *self)
+{
+	PyObject *batch = decoder_read_batch(self, self->chunk_size);
+	if (batch && PySequence_Length(batch) == 0) {
+		Py_DECREF(batch);
+		return NULL; // StopIteration
+	}
+	return batch;
+}
+
+static PyObject *decoder_seek(DecoderObject *self, PyObject *args)
+{
+	unsigned long offset;
+	if (!PyArg_ParseTuple(args, "k", &offset)) {
+		return NULL;
+	}
+	if (!self->tdc) {
+		PyErr_SetString(PyExc_ValueError, "decoder is closed");
+		return NULL;
+	}
+	int result, closed;
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(self->lock, WAIT_LOCK);
+	closed = !self->tdc; // closed by another thread in the meantime
+	result = closed || tdc_seek(self->tdc, offset);
+	PyThread_release_lock(self->lock);
+	Py_END_ALLOW_THREADS
+	if (closed) {
+		PyErr_SetString(PyExc_ValueError, "decoder is closed");
+		return NULL;
+	}
+	if (!result) {
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+	self->eof = 0;
+	Py_RETURN_NONE;
+}
+
+static PyObject *channel_list(const unsigned long *values)
+{
+	return Py_BuildValue("[kkkk]", values[0], values[1], values[2], values[3]);
+}
+
+static PyObject *decoder_stats(DecoderObject *self, PyObject *unused)
+{
+	if (!self->tdc) {
+		PyErr_SetString(PyExc_ValueError, "decoder is closed");
+		return NULL;
+	}
+	tdc_stats_t stats;
+	unsigned long offset = 0;
+	int closed;
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(self->lock, WAIT_LOCK);
+	closed = !self->tdc; // closed by another thread in the meantime
+	if (!closed) {
+		tdc_get_stats(self->tdc, &stats);
+		offset = self->tdc->raw_offset;
+	}
+	PyThread_release_lock(self->lock);
+	Py_END_ALLOW_THREADS
+	if (closed) {
+		PyErr_SetString(PyExc_ValueError, "decoder is closed");
+		return NULL;
+	}
+	return Py_BuildValue("{s:k,s:N,s:N,s:N,s:k,s:k,s:k,s:k,s:N,s:N,s:k,s:k}",
+		"bytes",            stats.bytes,
+		"frames",           channel_list(stats.frames),
+		"overflows",        channel_list(stats.overflows),
+		"lost_words",       channel_list(stats.lost_words),
+		"resync_bytes",     stats.resync_bytes,
+		"truncated_frames", stats.truncated_frames,
+		"invalid_frames",   stats.invalid_frames,
+		"invalid_blocks",   stats.invalid_blocks,
+		"syncs",            channel_list(stats.syncs),
+		"repaired_wraps",   channel_list(stats.repaired_wraps),
+		"unsynced_words",   stats.unsynced_words,
+		"offset",           offset);
+}
+
+static PyObject *decoder_close(DecoderObject *self, PyObject *unused)
+{
+	if (!self->tdc) {
+		Py_RETURN_NONE;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(self->lock, WAIT_LOCK);
+	decoder_close_tdc(self);
+	PyThread_release_lock(self->lock);
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
+}
+
+static PyObject *decoder_enter(DecoderObject *self, PyObject *unused)
+{
+	Py_INCREF(self);
+	return (PyObject*)self;
+}
+
+static PyObject *decoder_exit(DecoderObject *self, PyObject *args)
+{
+	return decoder_close(self, NULL);
+}
+
+static PyMethodDef decoder_methods[] = {
+	{"read",      (PyCFunction)decoder_read,  METH_VARARGS, "read([n]) -> Batch of up to n events (chunk_size by default), empty at the end"},
+	{"seek",      (PyCFunction)decoder_seek,  METH_VARARGS, "seek(offset): continue at a byte offset of a capture, like tdc_seek()"},
+	{"stats",     (PyCFunction)decoder_stats, METH_NOARGS,  "stats() -> dict with the counters of the decoder"},
+	{"close",     (PyCFunction)decoder_close, METH_NOARGS,  "close the file or device"},
+	{"__enter__", (PyCFunction)decoder_enter, METH_NOARGS,  NULL},
+	{"__exit__",  (PyCFunction)decoder_exit,  METH_VARARGS, NULL},
+	{NULL}
+};
+
+static PyTypeObject DecoderType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name      = "tdc.Decoder",
+	.tp_doc       = "Decoder(filename, format='frames', chunk_size=65536)\n\n"
+	                "Decodes a capture file or a device, iterating yields batches of chunk_size events.",
+	.tp_basicsize = sizeof(DecoderObject),
+	.tp_flags     = Py_TPFLAGS_DEFAULT,
+	.tp_new       = PyType_GenericNew,
+	.tp_init      = (initproc)decoder_init,
+	.tp_dealloc   = (destructor)decoder_dealloc,
+	.tp_iter      = PyObject_SelfIter,
+	.tp_iternext  = (iternextfunc)decoder_iternext,
+	.tp_methods   = decoder_methods,
+};
+
+//////////////////////////////////////////
+// module
+//////////////////////////////////////////
+
+static struct PyModuleDef tdc_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "tdc",
+	.m_doc  = "decoder for the dTOT time to digital converter",
+	.m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_tdc(void)
+{
+	if (PyType_Ready(&BatchType) < 0 || PyType_Ready(&ColumnType) < 0 || PyType_Ready(&DecoderType) < 0) {
+		return NULL;
+	}
+	PyObject *module = PyModule_Create(&tdc_module);
+	if (!module) {
+		return NULL;
+	}
+	Py_INCREF(&DecoderType);
+	Py_INCREF(&BatchType);
+	if (PyModule_AddObject(module, "Decoder", (PyObject*)&DecoderType) < 0 ||
+	    PyModule_AddObject(module, "Batch",   (PyObject*)&BatchType)   < 0 ||
+	    PyModule_AddIntConstant(module, "FALLING", TDC_EDGE_FALLING) < 0 ||
+	    PyModule_AddIntConstant(module, "RISING",  TDC_EDGE_RISING)  < 0 ||
+	    PyModule_AddIntConstant(module, "LOSS",    TDC_EDGE_LOSS)    < 0) {
+		Py_DECREF(module);
+		return NULL;
+	}
+	return module;
+}
@@ -0,0 +1,147 @@
+# tests of the Python bindings, run with 'make test-python'
+import os
+import random
+import subprocess
+import sys
+import threading
+
+import tdc
+
+HERE     = os.path.dirname(os.path.abspath(__file__))
+TDC_CTL  = os.path.join(HERE, '..', 'tdc-ctl')
+FILENAME = 'testdata_py.raw'
+
+
+def sample_frame(channel, time, sample):
+    return bytes([0x80 | (channel << 4) | (sample >> 4),
+                  ((sample & 0xf) << 3) | ((time >> 21) & 0x7),
+                  (time >> 14) & 0x7f, (time >> 7) & 0x7f, time & 0x7f])
+
+
+def loss_frame(channel, lost):
+    payload = (channel << 26) | lost
+    return bytes([0x80 | (7 << 4) | 0,
+                  (payload >> 21) & 0x7f, (payload >> 14) & 0x7f, (payload >> 7) & 0x7f, payload & 0x7f])
+
+
+def random_capture(n):
+    random.seed(7)
+    time  = [0]*4
+    level = [0]*4
+    data  = bytearray()
+    for i in range(n):
+        ch = random.randrange(4)
+        time[ch] = (time[ch] + random.randrange(1, 0x40000)) & 0xffffff
+        if random.random() < 0.01:
+            data += loss_frame(ch, random.randrange(100))
+            continue
+        pos = random.randrange(1, 8)
+        sample = (0xff << pos) & 0xff if level[ch] else ~(0xff << pos) & 0xff
+        level[ch] = sample & 1
+        data += sample_frame(ch, time[ch], sample)
+    return bytes(data)
+
+
+# the same events as printed by tdc-ctl
+def tdc_ctl_events(filename):
+    output = subprocess.run([TDC_CTL, filename], stdout=subprocess.PIPE, check=True).stdout
+    events = []
+    for line in output.decode('utf-8').splitlines():
+        fields = line.split()
+        if len(fields) == 5 and fields[3].startswith('sample='):
+            events.append((int(fields[0]), int(fields[2]), int(fields[1]), int(fields[3][7:11], 16), int(fields[4][3:])))
+        elif len(fields) == 6 and fields[1] == 'lost':
+            events.append((int(fields[0]), int(fields[5]), tdc.LOSS, 0, int(fields[2])))
+    return events
+
+
+def batch_events(batch):
+    return list(zip(batch.channel.tolist(), batch.time.tolist(), batch.edge.tolist(),
+                    batch.sample.tolist(), batch.dt.tolist()))
+
+
+def test_known_events():
+    with open(FILENAME, 'wb') as f:
+        f.write(sample_frame(1, 100, 0x0f) + sample_frame(1, 200, 0x00) + loss_frame(1, 7) + sample_frame(1, 300, 0xf0))
+    with tdc.Decoder(FILENAME) as decoder:
+        batch = decoder.read()
+        assert len(batch) == 4
+        assert batch.time.tolist() == [100*8+4, 200*8, 200*8, 300*8+4]
+        assert batch.edge.tolist() == [tdc.RISING, tdc.FALLING, tdc.LOSS, tdc.FALLING]
+        assert batch.dt.tolist()[1:] == [100*8-4, 7, 100*8+4]
+        assert batch.tot.tolist() == [0, 200*8-(100*8+4), 0, 0]  # the loss hides the last rising edge
+        assert len(decoder.read()) == 0
+        assert decoder.stats()['lost_words'] == [0, 7, 0, 0]
+
+
+def test_buffers():
+    with open(FILENAME, 'wb') as f:
+        f.write(sample_frame(2, 100, 0x0f))
+    batch = tdc.Decoder(FILENAME).read()
+    time = batch.time
+    del batch  # the view keeps the memory alive
+    assert time.format == 'Q' and time.itemsize == 8 and time.readonly
+    assert time.shape == (1,) and time.tolist() == [100*8+4]
+    try:
+        import numpy
+        assert numpy.asarray(time)[0] == 100*8+4
+    except ImportError:
+        pass
+
+
+def test_against_tdc_ctl():
+    with open(FILENAME, 'wb') as f:
+        f.write(random_capture(20000))
+    expected = tdc_ctl_events(FILENAME)
+    assert len(expected) > 19000
+
+    # one batch, and chunks that don't fit the number of events
+    assert batch_events(tdc.Decoder(FILENAME).read(10**6)) == expected
+    events = []
+    for batch in tdc.Decoder(FILENAME, chunk_size=777):
+        assert 0 < len(batch) <= 777
+        events += batch_events(batch)
+    assert events == expected
+
+
+def test_errors():
+    try:
+        tdc.Decoder('/nonexistent/capture.raw')
+        assert False
+    except OSError:
+        pass
+    try:
+        tdc.Decoder(FILENAME, format='bytes')
+        assert False
+    except ValueError:
+        pass
+    decoder = tdc.Decoder(FILENAME)
+    decoder.close()
+    for method in (decoder.read, decoder.stats, lambda: decoder.seek(0)):
+        try:
+            method()
+            assert False
+        except ValueError:
+            pass
+    # stats() from another thread while the decoder is closed
+    decoder = tdc.Decoder(FILENAME)
+    def poll_stats():
+        try:
+            while True:
+                decoder.stats()
+        except ValueError:
+            pass
+    thread = threading.Thread(target=poll_stats)
+    thread.start()
+    decoder.read(1000)
+    decoder.close()
+    thread.join()
+
+
+if __name__ == '__main__':
+    test_known_events()
+    test_buffers()
+    test_against_tdc_ctl()
+    test_errors()
+    os.unlink(FILENAME)
+    print('All Python tests passed!')
@@ -0,0 +1,311 @@
+#include "tdc_control.h"
+#include "tdc_decoder.hpp"
+
+// POSIX header
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+// C++ header
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+//////////////////////////////////////////
+// benchmark of the header-only decoder against the C API
+//
+// All variants fill the same time over threshold histograms:
+//   c_api      tdc_next_event() and a switch on the edge per event
+//   template   tdc::decoder with the histogram sink inlined
+//   callback   tdc::decoder with a sink that calls function pointers
+// The stream is generated from a fixed seed. One CSV line per
+// (variant, mix, input) with the best of n_repeat runs.
+//////////////////////////////////////////
+
+static long n_frames = 1000000;
+static int  n_repeat = 3;
+static const char *tmp_filename = "bench_data_cxx.raw";
+
+struct bench_mix_t
+{
+	const char *name;
+	int inner_edges; // edges inside the sample instead of between samples
+	int pulses;      // percentage of pulse frames
+};
+
+static const bench_mix_t mixes[] = {
+	{"boundary", 0, 0},
+	{"inner",    1, 0},
+	{"pulses",   0, 100},
+	{"mixed",    1, 30},
+};
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+//////////////////////////////////////////
+// synthetic stream
+//////////////////////////////////////////
+
+static std::vector<unsigned char> generate_stream(const bench_mix_t &mix, long frames)
+{
+	std::vector<unsigned char> stream;
+	stream.reserve(6*frames);
+	unsigned long time[TDC_N_CHANNELS] = {0,};
+	int level[TDC_N_CHANNELS] = {0,};
+	srand(1234);
+	for (long n = 0; n < frames; ++n) {
+		int ch = rand()%TDC_N_CHANNELS;
+		time[ch] += 1 + rand()%200;
+		if (time[ch] >= 0x1000000) {
+			time[ch] -= 0x1000000;
+		}
+		unsigned long t = time[ch];
+		if (rand()%100 < mix.pulses && !level[ch]) {
+			unsigned long long payload = ((unsigned long long)ch<<37) | ((unsigned long long)t<<13)
+			                           | ((rand()%8)<<10) | (1 + rand()%1000);
+			stream.push_back(0x80 | (TDC_TYPE_PULSE<<4) | ((payload>>35)&0xf));
+			for (int shift = 28; shift >= 0; shift -= 7) {
+				stream.push_back((payload>>shift)&0x7f);
+			}
+			continue;
+		}
+		unsigned char sample;
+		if (mix.inner_edges) {
+			int pos = 1 + rand()%7; // edge between bit pos and pos-1
+			sample = level[ch] ? (0xff<<pos) : ~(0xff<<pos);
+		} else {
+			sample = level[ch] ? 0x00 : 0xff;
+		}
+		level[ch] = sample&0x01;
+		stream.push_back(0x80 | (ch<<4) | (sample>>4));
+		stream.push_back(((sample&0xf)<<3) | ((t>>21)&0x7));
+		stream.push_back((t>>14)&0x7f);
+		stream.push_back((t>> 7)&0x7f);
+		stream.push_back( t     &0x7f);
+	}
+	return stream;
+}
+
+//////////////////////////////////////////
+// the consumer: time over threshold histograms
+//////////////////////////////////////////
+
+struct tot_histograms
+{
+	unsigned long rise[TDC_N_CHANNELS] = {0,};
+	long          bins[TDC_N_CHANNELS][1024] = {{0,},};
+	long          events = 0;
+
+	inline void fill(int channel, edge_t edge, std::uint64_t time)
+	{
+		++events;
+		if (edge == TDC_EDGE_RISING) {
+			rise[channel] = time;
+		} else if (edge == TDC_EDGE_FALLING) {
+			std::uint64_t tot = time - rise[channel];
+			++bins[channel][tot < 1024 ? tot : 1023];
+		}
+	}
+	long checksum() const
+	{
+		long sum = 0;
+		for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+			for (int i = 0; i < 1024; ++i) {
+				sum += i*bins[ch][i];
+			}
+		}
+		return sum;
+	}
+};
+
+struct tot_sink
+{
+	tot_histograms hist;
+
+	void edge(int channel, edge_t edge, std::uint64_t time, std::uint8_t, std::uint64_t, std::uint64_t)
+	{
+		hist.fill(channel, edge, time);
+	}
+	void loss(int channel, std::uint64_t, std::uint64_t)
+	{
+		++hist.events;
+	}
+};
+
+// a plain C style callback interface
+typedef void (*edge_callback_t)(void *user, int channel, edge_t edge, std::uint64_t time, std::uint8_t sample, std::uint64_t dt, std::uint64_t tot);
+typedef void (*loss_callback_t)(void *user, int channel, std::uint64_t time, std::uint64_t lost);
+
+struct callback_sink
+{
+	edge_callback_t on_edge;
+	loss_callback_t on_loss;
+	void           *user;
+
+	void edge(int channel, edge_t edge, std::uint64_t time, std::uint8_t sample, std::uint64_t dt, std::uint64_t tot)
+	{
+		on_edge(user, channel, edge, time, sample, dt, tot);
+	}
+	void loss(int channel, std::uint64_t time, std::uint64_t lost)
+	{
+		on_loss(user, channel, time, lost);
+	}
+};
+
+__attribute__((noinline)) static void fill_edge(void *user, int channel, edge_t edge, std::uint64_t time, std::uint8_t, std::uint64_t, std::uint64_t)
+{
+	static_cast<tot_histograms*>(user)->fill(channel, edge, time);
+}
+
+__attribute__((noinline)) static void fill_loss(void *user, int, std::uint64_t, std::uint64_t)
+{
+	++static_cast<tot_histograms*>(user)->events;
+}
+
+// the callbacks are only known at run time, like in a library
+static edge_callback_t volatile edge_callbacks[] = {fill_edge};
+static loss_callback_t volatile loss_callbacks[] = {fill_loss};
+
+//////////////////////////////////////////
+// variants
+//////////////////////////////////////////
+
+static void print_result(const char *bench, const char *mix, const char *input, long frames, long events, double seconds, long checksum)
+{
+	printf("%s,%s,%s,%ld,%ld,%.6f,%.1f,%.3f,%ld\n", bench, mix, input, frames, events, seconds,
+		events/seconds, 1e9*seconds/events, checksum);
+	fflush(stdout);
+}
+
+static void bench_c_api(const bench_mix_t &mix)
+{
+	double best = 1e99;
+	tot_histograms hist;
+	for (int rep = 0; rep < n_repeat; ++rep) {
+		hist = tot_histograms();
+		tdc_t *tdc = tdc_open(tmp_filename);
+		double start = now_sec();
+		for (;;) {
+			tdc_event_t event = tdc_next_event(tdc);
+			if (event.channel == -1) {
+				break;
+			}
+			switch (event.edge) {
+				case TDC_EDGE_RISING:
+				case TDC_EDGE_FALLING:
+					hist.fill(event.channel, event.edge, event.time);
+					break;
+				default:
+					++hist.events;
+			}
+		}
+		double elapsed = now_sec() - start;
+		tdc_close(tdc);
+		if (elapsed < best) {
+			best = elapsed;
+		}
+	}
+	print_result("c_api", mix.name, "file", n_frames, hist.events, best, hist.checksum());
+}
+
+// reads the file in chunks like tdc_t does, or takes the stream from memory
+template <class Sink>
+static double run_decoder(Sink &sink, const std::vector<unsigned char> &stream, bool from_file)
+{
+	tdc::decoder<Sink> decoder(sink);
+	double start = now_sec();
+	if (from_file) {
+		int fd = open(tmp_filename, O_RDONLY);
+		unsigned char buffer[TDC_READ_BUFFER_SIZE];
+		long size;
+		while ((size = read(fd, buffer, sizeof(buffer))) > 0) {
+			decoder.feed(buffer, size);
+		}
+		close(fd);
+	} else {
+		decoder.feed(stream.data(), stream.size());
+	}
+	return now_sec() - start;
+}
+
+static void bench_template(const bench_mix_t &mix, const std::vector<unsigned char> &stream, bool from_file)
+{
+	double best = 1e99;
+	tot_sink sink;
+	for (int rep = 0; rep < n_repeat; ++rep) {
+		sink = tot_sink();
+		double elapsed = run_decoder(sink, stream, from_file);
+		if (elapsed < best) {
+			best = elapsed;
+		}
+	}
+	print_result("template", mix.name, from_file ? "file" : "memory", n_frames, sink.hist.events, best, sink.hist.checksum());
+}
+
+static void bench_callback(const bench_mix_t &mix, const std::vector<unsigned char> &stream, bool from_file)
+{
+	double best = 1e99;
+	tot_histograms hist;
+	for (int rep = 0; rep < n_repeat; ++rep) {
+		hist = tot_histograms();
+		callback_sink sink = {edge_callbacks[0], loss_callbacks[0], &hist};
+		double elapsed = run_decoder(sink, stream, from_file);
+		if (elapsed < best) {
+			best = elapsed;
+		}
+	}
+	print_result("callback", mix.name, from_file ? "file" : "memory", n_frames, hist.events, best, hist.checksum());
+}
+
+static void print_help()
+{
+	printf("usage: tdc-bench-cxx [options]\n");
+	printf("\n");
+	printf("Compares tdc_next_event() with the header-only decoder (tdc_decoder.hpp)\n");
+	printf("with an inlined sink and with a function pointer sink.\n");
+	printf("\n");
+	printf("available options:\n");
+	printf("-n <frames>     frames per stream (default %ld)\n", n_frames);
+	printf("-r <repeat>     runs per result, the fastest one is reported (default %d)\n", n_repeat);
+	printf("-h              print this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while((opt = getopt(argc, argv, "hn:r:")) != -1) {
+		switch(opt) {
+			case 'h': print_help();              return 0;
+			case 'n': n_frames = atol(optarg);   break;
+			case 'r': n_repeat = atoi(optarg);   break;
+			default:
+				fprintf(stderr, "use option -h for detailed help\n");
+				return 1;
+		}
+	}
+
+	printf("bench,mix,input,frames,events,seconds,events_per_s,ns_per_event,checksum\n");
+	for (const bench_mix_t &mix : mixes) {
+		std::vector<unsigned char> stream = generate_stream(mix, n_frames);
+		int fd = open(tmp_filename, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+		if (fd == -1 || write(fd, stream.data(), stream.size()) != (long)stream.size()) {
+			perror("cannot write benchmark data file");
+			return 1;
+		}
+		close(fd);
+
+		bench_c_api(mix);
+		bench_template(mix, stream, true);
+		bench_callback(mix, stream, true);
+		bench_template(mix, stream, false);
+		bench_callback(mix, stream, false);
+	}
+	unlink(tmp_filename);
+	return 0;
+}
@@ -0,0 +1,1235 @@
+#define _GNU_SOURCE
+#include "tdc_control.h"
+#include "tdc_trace.h"
+#include "tdc_histogram.h"
+#include "tdc_index.h"
+#include "tdc_batch.h"
+#include "tdc_walk.h"
+
+// POSIX header
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// C header
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//////////////////////////////////////////
+// benchmark suite for the host decoder
+//
+// Every benchmark runs on a synthetic stream that is generated
+// from a fixed seed, so results are comparable between versions.
+// One result line per (benchmark, mix) is written as CSV or JSON.
+//////////////////////////////////////////
+
+typedef struct s_bench_mix_t
+{
+	const char *name;
+	int n_active_channels; // channels that carry data
+	int edges_per_frame;   // 0: edges only between samples, 1..4: edges inside the sample
+	long step;             // mean distance between two frames of a channel in units of [8 ns]
+	int signal_every;      // 0: off, n: noise pulses inside the samples, a clean pulse every n frames
+} bench_mix_t;
+
+static const bench_mix_t mixes[] = {
+	{"1ch_boundary", 1, 0, 100,   0},
+	{"4ch_boundary", 4, 0, 100,   0},
+	{"1ch_inner",    1, 1, 100,   0},
+	{"4ch_inner",    4, 1, 100,   0},
+	{"4ch_burst",    4, 3, 100,   0},
+	{"4ch_overflow", 4, 1, 1<<22, 0},
+	{"4ch_noise",    4, 2, 20,    20}, // narrow noise pulses near threshold, 5% signal
+};
+#define N_MIXES (int)(sizeof(mixes)/sizeof(mixes[0]))
+
+typedef struct s_bench_result_t
+{
+	const char *bench;
+	const char *build;
+	const char *mix;
+	const char *input;
+	long        frames;
+	long        events;
+	long        lost;
+	double      seconds;
+	// latency percentiles in [us], only for the pty input (negative if not measured)
+	double      p50, p90, p99, p999, max;
+} bench_result_t;
+
+static int output_json  = 0;
+static int first_result = 1;
+static long n_frames    = 1000000;
+static int  n_repeat    = 3;
+static long pty_rate    = 1000000; // bytes per second for the latency run
+static const char *tmp_filename = "bench_data.raw";
+static int  trace_flags = 0;
+
+#ifdef TDC_TRACE
+static const char *build_name = "trace";
+#else
+static const char *build_name = "plain";
+#endif
+
+// all benchmarks open the decoder through this function
+static tdc_t *open_tdc(const char *filename)
+{
+	tdc_t *tdc = tdc_open(filename);
+	if (tdc && trace_flags) {
+		tdc_trace_enable(tdc, trace_flags, 1<<16);
+	}
+	return tdc;
+}
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static void print_header()
+{
+	if (output_json) {
+		printf("[\n");
+	} else {
+		printf("bench,build,mix,input,frames,events,lost,seconds,events_per_s,mbytes_per_s,ns_per_frame,p50_us,p90_us,p99_us,p999_us,max_us\n");
+	}
+}
+
+static void print_footer()
+{
+	if (output_json) {
+		printf("\n]\n");
+	}
+}
+
+static void print_result(bench_result_t *r)
+{
+	double events_per_s = r->events/r->seconds;
+	double mbytes_per_s = 5e-6*r->frames/r->seconds;
+	double ns_per_frame = 1e9*r->seconds/r->frames;
+	if (output_json) {
+		printf("%s  {\"bench\":\"%s\",\"build\":\"%s%s\",\"mix\":\"%s\",\"input\":\"%s\",\"frames\":%ld,\"events\":%ld,\"lost\":%ld,"
+		       "\"seconds\":%.6f,\"events_per_s\":%.1f,\"mbytes_per_s\":%.3f,\"ns_per_frame\":%.3f",
+		       first_result?"":",\n",
+		       r->bench, build_name, trace_flags?"_on":"", r->mix, r->input, r->frames, r->events, r->lost,
+		       r->seconds, events_per_s, mbytes_per_s, ns_per_frame);
+		if (r->p50 >= 0) {
+			printf(",\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f",
+			       r->p50, r->p90, r->p99, r->p999, r->max);
+		}
+		printf("}");
+	} else {
+		printf("%s,%s%s,%s,%s,%ld,%ld,%ld,%.6f,%.1f,%.3f,%.3f",
+		       r->bench, build_name, trace_flags?"_on":"", r->mix, r->input, r->frames, r->events, r->lost,
+		       r->seconds, events_per_s, mbytes_per_s, ns_per_frame);
+		if (r->p50 >= 0) {
+			printf(",%.3f,%.3f,%.3f,%.3f,%.3f\n", r->p50, r->p90, r->p99, r->p999, r->max);
+		} else {
+			printf(",,,,,\n");
+		}
+	}
+	first_result = 0;
+	fflush(stdout);
+}
+
+static void init_result(bench_result_t *r, const char *bench, const char *mix, const char *input)
+{
+	memset(r, 0, sizeof(*r));
+	r->bench = bench;
+	r->mix   = mix;
+	r->input = input;
+	r->p50 = r->p90 = r->p99 = r->p999 = r->max = -1;
+}
+
+//////////////////////////////////////////
+// synthetic stream generation
+//////////////////////////////////////////
+
+static void pack_raw_event(unsigned char *data, int channel, long timestamp, unsigned char sample)
+{
+	data[0] = 0x80 | ((channel&0x7)<<4) | (sample>>4);
+	data[1] = 0x00 | (( sample&0xf)<<3) | ((timestamp>>21)&0x7);
+	data[2] = 0x00                      | ((timestamp>>14)&0x7f);
+	data[3] = 0x00                      | ((timestamp>> 7)&0x7f);
+	data[4] = 0x00                      | ((timestamp>> 0)&0x7f);
+}
+
+// build a sample that starts at 'level' and has 'n_edges' edges
+// inside the sample (between bit 7 and bit 0)
+static unsigned char make_sample(int level, int n_edges)
+{
+	int flip[8] = {0,};
+	for (int n = 0; n < n_edges && n < 7; ) {
+		int pos = 1 + rand()%7; // edge between bit pos and bit pos-1
+		if (!flip[pos]) {
+			flip[pos] = 1;
+			++n;
+		}
+	}
+	unsigned char sample = 0;
+	int bit = level;
+	for (int i = 7; i >= 0; --i) {
+		sample |= bit<<i;
+		if (i > 0 && flip[i]) {
+			bit = !bit;
+		}
+	}
+	return sample;
+}
+
+// returns the number of bytes written into the buffer (5 per frame)
+static long generate_stream(const bench_mix_t *mix, long frames, unsigned char *buffer)
+{
+	long time[TDC_N_CHANNELS]  = {0,};
+	int  level[TDC_N_CHANNELS] = {0,};
+	long n = 0;
+	srand(1234);
+	while (n < frames) {
+		int ch = rand()%mix->n_active_channels;
+		time[ch] += 1 + rand()%(2*mix->step);
+		if (time[ch] >= 0x1000000) {
+			// the hardware sends a frame at each counter overflow
+			time[ch] -= 0x1000000;
+			pack_raw_event(&buffer[5*n++], ch, 0, level[ch]?0xff:0x00);
+			if (n == frames) {
+				break;
+			}
+			if (time[ch] == 0) {
+				time[ch] = 1;
+			}
+		}
+		unsigned char sample;
+		if (mix->signal_every && !level[ch] && n%mix->signal_every != 0) {
+			sample = make_sample(0, mix->edges_per_frame); // a pulse shorter than 8 ns
+		} else if (mix->edges_per_frame == 0 || mix->signal_every) {
+			level[ch] = !level[ch];
+			sample = level[ch]?0xff:0x00;
+		} else {
+			sample = make_sample(level[ch], mix->edges_per_frame);
+			level[ch] = sample&0x01;
+		}
+		pack_raw_event(&buffer[5*n++], ch, time[ch], sample);
+	}
+	return 5*n;
+}
+
+static int write_file(const char *filename, unsigned char *buffer, long size)
+{
+	int fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		perror("cannot create benchmark data file");
+		return 0;
+	}
+	for (long done = 0; done < size; ) {
+		long result = write(fd, buffer+done, size-done);
+		if (result <= 0) {
+			perror("cannot write benchmark data file");
+			close(fd);
+			return 0;
+		}
+		done += result;
+	}
+	close(fd);
+	return 1;
+}
+
+//////////////////////////////////////////
+// in-memory benchmarks
+//////////////////////////////////////////
+
+static void bench_unpack(const bench_mix_t *mix, unsigned char *buffer, long size)
+{
+	bench_result_t r;
+	init_result(&r, "unpack_raw_event", mix->name, "memory");
+	r.frames  = size/5;
+	r.seconds = 1e99;
+	for (int rep = 0; rep < n_repeat; ++rep) {
+		long checksum = 0;
+		raw_event_t revent;
+		double start = now_sec();
+		for (long i = 0; i < r.frames; ++i) {
+			if (unpack_raw_event(&buffer[5*i], &revent)) {
+				checksum += revent.time + revent.sample;
+			}
+		}
+		double elapsed = now_sec() - start;
+		if (elapsed < r.seconds) {
+			r.seconds = elapsed;
+		}
+		if (checksum == 42) { // keep the loop from being optimized away
+			printf("#\n");
+		}
+	}
+	r.events = r.frames;
+	print_result(&r);
+}
+
+static void bench_smooth_time(const bench_mix_t *mix, tdc_event_t *events, long n_events, tdc_t *tdc)
+{
+	bench_result_t r;
+	init_result(&r, "tdc_smooth_time", mix->name, "memory");
+	r.frames  = n_events;
+	r.events  = n_events;
+	r.seconds = 1e99;
+	for (int rep = 0; rep < n_repeat; ++rep) {
+		double sum = 0;
+		double start = now_sec();
+		for (long i = 0; i < n_events; ++i) {
+			sum += tdc_smooth_time(tdc, &events[i]);
+		}
+		double elapsed = now_sec() - start;
+		if (elapsed < r.seconds) {
+			r.seconds = elapsed;
+		}
+		if (sum == 42) {
+			printf("#\n");
+		}
+	}
+	print_result(&r);
+}
+
+//////////////////////////////////////////
+// file input benchmarks
+//////////////////////////////////////////
+
+static void bench_file_read(const bench_mix_t *mix, long frames)
+{
+	bench_result_t r;
+	init_result(&r, "read_5_bytes", mix->name, "file");
+	r.frames  = frames;
+	r.seconds = 1e99;
+	for (int rep = 0; rep < n_repeat; ++rep) {
+		int fd = open(tmp_filename, O_RDONLY);
+		unsigned char data[5];
+		double start = now_sec();
+		while (read(fd, data, 5) == 5) {
+		}
+		double elapsed = now_sec() - start;
+		close(fd);
+		if (elapsed < r.seconds) {
+			r.seconds = elapsed;
+		}
+	}
+	r.events = frames;
+	print_result(&r);
+}
+
+static void bench_file_raw_events(const bench_mix_t *mix, long frames)
+{
+	bench_result_t r;
+	init_result(&r, "next_raw_event", mix->name, "file");
+	r.frames  = frames;
+	r.seconds = 1e99;
+	for (int rep = 0; rep < n_repeat; ++rep) {
+		tdc_t *tdc = open_tdc(tmp_filename);
+		long n = 0;
+		double start = now_sec();
+		while (next_raw_event(tdc).channel != -1) {
+			++n;
+		}
+		double elapsed = now_sec() - start;
+		tdc_close(tdc);
+		if (elapsed < r.seconds) {
+			r.seconds = elapsed;
+		}
+		r.events = n;
+	}
+	r.lost = frames - r.events;
+	print_result(&r);
+}
+
+// decodes the file once and returns all events and the file offset
+// after each event (used as reference for the pty benchmarks)
+static long bench_file_events(const bench_mix_t *mix, long frames, tdc_event_t **events_out, long **offsets_out)
+{
+	bench_result_t r;
+	init_result(&r, "tdc_next_event", mix->name, "file");
+	r.frames  = frames;
+	r.seconds = 1e99;
+	for (int rep = 0; rep < n_repeat; ++rep) {
+		tdc_t *tdc = open_tdc(tmp_filename);
+		long n = 0;
+		double start = now_sec();
+		while (tdc_next_event(tdc).channel != -1) {
+			++n;
+		}
+		double elapsed = now_sec() - start;
+		if (rep == 0 && tdc->trace) {
+			fprintf(stderr, "trace of tdc_next_event, mix %s:\n", mix->name);
+			tdc_trace_print(stderr, tdc->trace);
+		}
+		tdc_close(tdc);
+		if (elapsed < r.seconds) {
+			r.seconds = elapsed;
+		}
+		r.events = n;
+	}
+	print_result(&r);
+
+	// reference pass (not timed)
+	tdc_event_t *events  = malloc(sizeof(tdc_event_t)*(r.events+1));
+	long        *offsets = malloc(sizeof(long)*(r.events+1));
+	tdc_t *tdc = open_tdc(tmp_filename);
+	long n = 0;
+	for (;;) {
+		tdc_event_t event = tdc_next_event(tdc);
+		if (event.channel == -1 || n == r.events) {
+			break;
+		}
+		events[n]  = event;
+		offsets[n] = tdc->raw_offset;
+		++n;
+	}
+	tdc_close(tdc);
+	*events_out  = events;
+	*offsets_out = offsets;
+	return n;
+}
+
+// decoding with histogram filling and a snapshot thread writing every 100 ms
+static void bench_file_histograms(const bench_mix_t *mix, long frames)
+{
+	bench_result_t r;
+	init_result(&r, "tdc_next_event_histograms", mix->name, "file");
+	r.frames  = frames;
+	r.seconds = 1e99;
+	for (int rep = 0; rep < n_repeat; ++rep) {
+		tdc_monitor_t *monitor = tdc_monitor_new();
+		tdc_monitor_shard_t shard;
+		if (!tdc_monitor_add_shard(monitor, &shard) ||
+		    !tdc_monitor_start(monitor, "bench_histograms.txt", 0.1)) {
+			exit(1);
+		}
+		tdc_t *tdc = open_tdc(tmp_filename);
+		long n = 0;
+		double start = now_sec();
+		for (;;) {
+			tdc_event_t event = tdc_next_event(tdc);
+			if (event.channel == -1) {
+				break;
+			}
+			tdc_monitor_fill(&shard, &event);
+			++n;
+		}
+		double elapsed = now_sec() - start;
+		tdc_close(tdc);
+		tdc_monitor_free(monitor);
+		if (elapsed < r.seconds) {
+			r.seconds = elapsed;
+		}
+		r.events = n;
+	}
+	unlink("bench_histograms.txt");
+	print_result(&r);
+}
+
+// noise pulses removed after the event was built and formatted (like a
+// script behind tdc-ctl) against removed by the filter stage of the decoder
+static tdc_filter_t bench_filter = {
+	.min_tot = 10,
+};
+
+static void bench_file_filter(const bench_mix_t *mix, long frames, int in_decoder)
+{
+	bench_result_t r;
+	init_result(&r, in_decoder ? "filter_in_decoder" : "filter_after_event", mix->name, "file");
+	r.frames  = frames;
+	r.seconds = 1e99;
+	for (int rep = 0; rep < n_repeat; ++rep) {
+		tdc_t *tdc = open_tdc(tmp_filename);
+		for (int ch = 0; in_decoder && ch < TDC_N_CHANNELS; ++ch) {
+			tdc_set_filter(tdc, ch, &bench_filter);
+		}
+		long n = 0;
+		double sum = 0;
+		char line[128];
+		double start = now_sec();
+		for (;;) {
+			tdc_event_t event = tdc_next_event(tdc);
+			if (event.channel == -1) {
+				break;
+			}
+			sum += tdc_smooth_time(tdc, &event);
+			n += snprintf(line, sizeof(line), "%d %d %20ld     sample=0x%02x   dt=%ld\n",
+				event.channel, event.edge, event.time, event.sample, event.dt) > 0;
+		}
+		double elapsed = now_sec() - start;
+		tdc_close(tdc);
+		if (elapsed < r.seconds) {
+			r.seconds = elapsed;
+		}
+		r.events = n;
+		if (sum == 42) {
+			printf("#\n");
+		}
+	}
+	print_result(&r);
+}
+
+//////////////////////////////////////////
+// time index over a large capture
+//////////////////////////////////////////
+
+#define INDEX_CHUNK_FRAMES (1L<<24) // 80 MB, repeated up to the size of the capture
+
+static int compare_double(const void *a, const void *b);
+static double percentile(double *sorted, long n, double p);
+
+static int count_event(const tdc_event_t *event, void *arg)
+{
+	++*(long*)arg;
+	return 1;
+}
+
+// Builds the index of a capture of 'gbytes' and runs 10 ms window queries
+// at random times, compared with decoding from byte 0 to a window in the
+// middle. The capture is in the page cache after writing it, so this is
+// the decoding cost without the disk.
+static int bench_index(double gbytes, int n_queries)
+{
+	const bench_mix_t *mix = &mixes[3]; // 4ch_inner
+	unsigned char *buffer = malloc(5*INDEX_CHUNK_FRAMES);
+	long chunk = generate_stream(mix, INDEX_CHUNK_FRAMES, buffer);
+	int fd = open(tmp_filename, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		perror("cannot create benchmark data file");
+		free(buffer);
+		return 0;
+	}
+	long size = 0;
+	while (size < gbytes*1e9) {
+		if (write(fd, buffer, chunk) != chunk) {
+			perror("cannot write benchmark data file");
+			close(fd);
+			free(buffer);
+			return 0;
+		}
+		size += chunk;
+	}
+	close(fd);
+	free(buffer);
+	char input[32];
+	snprintf(input, sizeof(input), "file_%.1fGB", size/1e9);
+
+	bench_result_t r;
+	init_result(&r, "tdc_index_build", mix->name, input);
+	r.frames = size/5;
+	double start = now_sec();
+	tdc_index_t *index = tdc_index_build(tmp_filename, TDC_FORMAT_FRAMES, TDC_INDEX_DEFAULT_INTERVAL);
+	r.seconds = now_sec() - start;
+	r.events  = index->header.n_entries;
+	print_result(&r);
+	unsigned long end = index->entries[index->header.n_entries-1].time;
+	fprintf(stderr, "index: %lu entries, %lu kB for %.1f GB, %.1f s of data\n",
+		(unsigned long)index->header.n_entries, index->header.n_entries*sizeof(tdc_index_entry_t)/1024,
+		size/1e9, end*1e-9);
+
+	// the latency columns are the time per query
+	init_result(&r, "tdc_index_query_10ms", mix->name, input);
+	double *latency = malloc(sizeof(double)*n_queries);
+	srand(4321);
+	for (int q = 0; q < n_queries; ++q) {
+		unsigned long t0 = (unsigned long)((double)rand()/RAND_MAX*(end - 10000000));
+		long n = 0;
+		tdc_t *tdc = open_tdc(tmp_filename);
+		long offset = index->entries[tdc_index_find(index, t0)].offset;
+		start = now_sec();
+		tdc_index_query(index, tdc, t0, t0+10000000, count_event, &n);
+		latency[q] = 1e6*(now_sec() - start);
+		r.frames  += (tdc->raw_offset - offset)/5;
+		r.events  += n;
+		r.seconds += 1e-6*latency[q];
+		tdc_close(tdc);
+	}
+	qsort(latency, n_queries, sizeof(double), compare_double);
+	r.p50  = percentile(latency, n_queries, 0.5);
+	r.p90  = percentile(latency, n_queries, 0.9);
+	r.p99  = percentile(latency, n_queries, 0.99);
+	r.p999 = percentile(latency, n_queries, 0.999);
+	r.max  = latency[n_queries-1];
+	print_result(&r);
+	free(latency);
+
+	// without the index: everything in front of the window is decoded.
+	// The window is next to an entry in the middle, away from the gaps
+	// between the chunks of the capture.
+	init_result(&r, "tdc_next_event_to_10ms", mix->name, input);
+	unsigned long t0 = index->entries[index->header.n_entries/2 + 1].time;
+	tdc_t *tdc = open_tdc(tmp_filename);
+	start = now_sec();
+	for (;;) {
+		tdc_event_t event = tdc_next_event(tdc);
+		if (event.channel == -1 || event.time >= t0+10000000) {
+			break;
+		}
+		r.events += event.time >= t0;
+	}
+	r.seconds = now_sec() - start;
+	r.frames  = tdc->raw_offset/5;
+	r.p50 = r.p90 = r.p99 = r.p999 = r.max = 1e6*r.seconds;
+	tdc_close(tdc);
+	print_result(&r);
+	tdc_index_free(index);
+	unlink(tmp_filename);
+	return 1;
+}
+
+//////////////////////////////////////////
+// event layouts in the loops behind the decoder
+//
+// The same histogram, coincidence and selection loops over tdc_event_t
+// (array of structures), tdc_packed_event_t and tdc_batch_t (structure
+// of arrays). The event array is larger than the caches, so the loops
+// stream it from memory. 'bytes' counts what a loop touches: all of an
+// array of structures, only the arrays it uses of a batch.
+//////////////////////////////////////////
+
+#define COINCIDENCE_WINDOW 20 // ns
+
+// last level cache misses of this thread, -1 if there is no counter (e.g. in a VM)
+static int open_cache_misses()
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size           = sizeof(attr);
+	attr.type           = PERF_TYPE_HARDWARE;
+	attr.config         = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled       = 1;
+	attr.exclude_kernel = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long read_cache_misses(int fd)
+{
+	long count = -1;
+	if (fd >= 0 && read(fd, &count, sizeof(count)) != sizeof(count)) {
+		count = -1;
+	}
+	return count;
+}
+
+typedef struct s_layout_data_t
+{
+	long                n;
+	tdc_event_t        *events;
+	tdc_packed_event_t *packed;
+	tdc_batch_t        *batch;
+} layout_data_t;
+
+// ToT histogram with 1 ns bins per channel, over the falling edges
+static long histogram_aos(layout_data_t *d, unsigned long counts[][1024])
+{
+	for (long i = 0; i < d->n; ++i) {
+		const tdc_event_t *e = &d->events[i];
+		unsigned long tot = e->dt < 1023 ? e->dt : 1023;
+		counts[e->channel&3][tot] += e->edge == TDC_EDGE_FALLING;
+	}
+	return sizeof(tdc_event_t)*d->n;
+}
+
+static long histogram_packed(layout_data_t *d, unsigned long counts[][1024])
+{
+	for (long i = 0; i < d->n; ++i) {
+		const tdc_packed_event_t *e = &d->packed[i];
+		unsigned int tot = e->tot < 1023 ? e->tot : 1023;
+		counts[e->channel&3][tot] += e->edge == TDC_EDGE_FALLING;
+	}
+	return sizeof(tdc_packed_event_t)*d->n;
+}
+
+static long histogram_batch(layout_data_t *d, unsigned long counts[][1024])
+{
+	const tdc_batch_t *b = d->batch;
+	for (long i = 0; i < b->n; ++i) {
+		unsigned int tot = b->tot[i] < 1023 ? b->tot[i] : 1023;
+		counts[b->channel[i]&3][tot] += b->edge[i] == TDC_EDGE_FALLING;
+	}
+	return (sizeof(uint32_t) + 2)*b->n;
+}
+
+// rising edges of two channels closer than COINCIDENCE_WINDOW
+static long coincidence_aos(layout_data_t *d, unsigned long *coincidences)
+{
+	unsigned long last[TDC_N_CHANNELS] = {0,};
+	for (long i = 0; i < d->n; ++i) {
+		const tdc_event_t *e = &d->events[i];
+		if (e->edge != TDC_EDGE_RISING) {
+			continue;
+		}
+		for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+			*coincidences += ch != e->channel && e->time - last[ch] < COINCIDENCE_WINDOW;
+		}
+		last[e->channel&3] = e->time;
+	}
+	return sizeof(tdc_event_t)*d->n;
+}
+
+static long coincidence_packed(layout_data_t *d, unsigned long *coincidences)
+{
+	unsigned long last[TDC_N_CHANNELS] = {0,};
+	for (long i = 0; i < d->n; ++i) {
+		const tdc_packed_event_t *e = &d->packed[i];
+		if (e->edge != TDC_EDGE_RISING) {
+			continue;
+		}
+		for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+			*coincidences += ch != e->channel && e->time - last[ch] < COINCIDENCE_WINDOW;
+		}
+		last[e->channel&3] = e->time;
+	}
+	return sizeof(tdc_packed_event_t)*d->n;
+}
+
+static long coincidence_batch(layout_data_t *d, unsigned long *coincidences)
+{
+	const tdc_batch_t *b = d->batch;
+	unsigned long last[TDC_N_CHANNELS] = {0,};
+	for (long i = 0; i < b->n; ++i) {
+		if (b->edge[i] != TDC_EDGE_RISING) {
+			continue;
+		}
+		for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+			*coincidences += ch != b->channel[i] && b->time[i] - last[ch] < COINCIDENCE_WINDOW;
+		}
+		last[b->channel[i]&3] = b->time[i];
+	}
+	return (sizeof(uint64_t) + 2)*b->n;
+}
+
+// falling edges in a ToT window, no dependency between events: the batch
+// loop runs over whole blocks of TDC_BATCH_ALIGN events and vectorizes
+static long select_aos(layout_data_t *d, unsigned long *selected)
+{
+	unsigned long n = 0;
+	for (long i = 0; i < d->n; ++i) {
+		const tdc_event_t *e = &d->events[i];
+		n += e->edge == TDC_EDGE_FALLING && e->dt >= 10 && e->dt < 200;
+	}
+	*selected += n;
+	return sizeof(tdc_event_t)*d->n;
+}
+
+static long select_packed(layout_data_t *d, unsigned long *selected)
+{
+	unsigned long n = 0;
+	for (long i = 0; i < d->n; ++i) {
+		const tdc_packed_event_t *e = &d->packed[i];
+		n += e->edge == TDC_EDGE_FALLING && e->tot >= 10 && e->tot < 200;
+	}
+	*selected += n;
+	return sizeof(tdc_packed_event_t)*d->n;
+}
+
+static long select_batch(layout_data_t *d, unsigned long *selected)
+{
+	const tdc_batch_t *b = d->batch;
+	unsigned long n = 0;
+	for (long block = 0; block < b->n; block += TDC_BATCH_ALIGN) {
+		const uint32_t *tot  = b->tot + block;
+		const uint8_t  *edge = b->edge + block;
+		unsigned int in_block = 0;
+		for (int i = 0; i < TDC_BATCH_ALIGN; ++i) {
+			in_block += (edge[i] == TDC_EDGE_FALLING) & (tot[i] - 10 < 190);
+		}
+		n += in_block;
+	}
+	*selected += n;
+	return (sizeof(uint32_t) + 1)*b->n;
+}
+
+typedef long (*layout_loop_t)(layout_data_t *d, void *result);
+
+static void bench_layout_loop(const char *name, layout_loop_t loop, layout_data_t *d, void *result, size_t result_size)
+{
+	bench_result_t r;
+	init_result(&r, name, "4ch_inner", "memory");
+	r.frames  = d->n;
+	r.events  = d->n;
+	r.seconds = 1e99;
+	int misses_fd = open_cache_misses();
+	long bytes = 0, misses = -1;
+	for (int rep = 0; rep < n_repeat; ++rep) {
+		memset(result, 0, result_size);
+		if (misses_fd >= 0) {
+			ioctl(misses_fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+		double start = now_sec();
+		bytes = loop(d, result);
+		double elapsed = now_sec() - start;
+		if (misses_fd >= 0) {
+			ioctl(misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+		}
+		if (elapsed < r.seconds) {
+			r.seconds = elapsed;
+			misses = read_cache_misses(misses_fd);
+		}
+	}
+	if (misses_fd >= 0) {
+		close(misses_fd);
+	}
+	print_result(&r);
+	if (misses >= 0) {
+		fprintf(stderr, "%-20s %5.1f bytes/event %6.2f GB/s %6.3f cache misses/event\n",
+			name, (double)bytes/d->n, 1e-9*bytes/r.seconds, (double)misses/d->n);
+	} else {
+		fprintf(stderr, "%-20s %5.1f bytes/event %6.2f GB/s (no cache miss counter)\n",
+			name, (double)bytes/d->n, 1e-9*bytes/r.seconds);
+	}
+}
+
+// the events of the 4ch_inner mix, repeated with a time offset up to n_events
+static int generate_events(long n_events, tdc_event_t *events)
+{
+	const bench_mix_t *mix = &mixes[3];
+	long frames = n_frames < n_events ? n_frames : n_events;
+	unsigned char *buffer = malloc(5*frames);
+	long size = generate_stream(mix, frames, buffer);
+	if (!write_file(tmp_filename, buffer, size)) {
+		free(buffer);
+		return 0;
+	}
+	free(buffer);
+	tdc_t *tdc = open_tdc(tmp_filename);
+	long n = 0;
+	for (;;) {
+		tdc_event_t event = tdc_next_event(tdc);
+		if (event.channel == -1 || n == n_events) {
+			break;
+		}
+		events[n++] = event;
+	}
+	tdc_close(tdc);
+	unlink(tmp_filename);
+	for (long i = n, span = events[n-1].time + 1000; i < n_events; ++i) {
+		events[i] = events[i%n];
+		events[i].time += i/n*span;
+	}
+	return 1;
+}
+
+static int bench_layout(long n_events)
+{
+	layout_data_t d = {.n = n_events};
+	d.events = malloc(sizeof(tdc_event_t)*n_events);
+	d.packed = malloc(sizeof(tdc_packed_event_t)*n_events);
+	d.batch  = tdc_batch_new(n_events);
+	if (!d.events || !d.packed || !d.batch) {
+		fprintf(stderr, "not enough memory for %ld events\n", n_events);
+		return 0;
+	}
+	if (!generate_events(n_events, d.events)) {
+		return 0;
+	}
+
+	memset(d.packed, 0, sizeof(tdc_packed_event_t)*n_events); // no page faults in the timing
+	double start = now_sec();
+	tdc_pack_events(d.events, n_events, d.packed);
+	double pack_seconds = now_sec() - start;
+	start = now_sec();
+	tdc_batch_from_events(d.batch, d.events, n_events);
+	double batch_seconds = now_sec() - start;
+	fprintf(stderr, "%ld events: %.0f MB as tdc_event_t, %.0f MB packed, %.0f MB as batch\n",
+		n_events, 1e-6*sizeof(tdc_event_t)*n_events, 1e-6*sizeof(tdc_packed_event_t)*n_events,
+		1e-6*(sizeof(uint64_t) + sizeof(uint32_t) + 3)*d.batch->capacity);
+	fprintf(stderr, "conversion: %.2f ns/event to packed, %.2f ns/event to a batch\n",
+		1e9*pack_seconds/n_events, 1e9*batch_seconds/n_events);
+
+	static unsigned long counts[3][TDC_N_CHANNELS][1024];
+	unsigned long coincidences[3], selected[3];
+	bench_layout_loop("histogram_aos",      (layout_loop_t)histogram_aos,      &d, counts[0],        sizeof(counts[0]));
+	bench_layout_loop("histogram_packed",   (layout_loop_t)histogram_packed,   &d, counts[1],        sizeof(counts[1]));
+	bench_layout_loop("histogram_batch",    (layout_loop_t)histogram_batch,    &d, counts[2],        sizeof(counts[2]));
+	bench_layout_loop("coincidence_aos",    (layout_loop_t)coincidence_aos,    &d, &coincidences[0], sizeof(unsigned long));
+	bench_layout_loop("coincidence_packed", (layout_loop_t)coincidence_packed, &d, &coincidences[1], sizeof(unsigned long));
+	bench_layout_loop("coincidence_batch",  (layout_loop_t)coincidence_batch,  &d, &coincidences[2], sizeof(unsigned long));
+	bench_layout_loop("select_aos",         (layout_loop_t)select_aos,         &d, &selected[0],     sizeof(unsigned long));
+	bench_layout_loop("select_packed",      (layout_loop_t)select_packed,      &d, &selected[1],     sizeof(unsigned long));
+	bench_layout_loop("select_batch",       (layout_loop_t)select_batch,       &d, &selected[2],     sizeof(unsigned long));
+	// all layouts must give the same results
+	int ok = memcmp(counts[0], counts[1], sizeof(counts[0])) == 0 && memcmp(counts[0], counts[2], sizeof(counts[0])) == 0
+		&& coincidences[0] == coincidences[1] && coincidences[0] == coincidences[2]
+		&& selected[0] == selected[1] && selected[0] == selected[2];
+	if (!ok) {
+		fprintf(stderr, "the layouts give different results\n");
+	}
+	free(d.events);
+	free(d.packed);
+	tdc_batch_free(d.batch);
+	return ok;
+}
+
+//////////////////////////////////////////
+// time-walk correction
+//
+// The table generation (all CPUs, one CPU and from the cache) and the
+// correction of the events of the 4ch_inner mix, with the ToT spread over
+// the whole table: per event from tdc_event_t and per batch.
+//////////////////////////////////////////
+
+static int bench_walk(long n_events)
+{
+	const tdc_walk_model_t model = {.tau = 40, .RC = 10, .threshold_tau = 50, .trigger_delay = 10};
+	bench_result_t r;
+	init_result(&r, "tdc_walk_table_build", "model", "all_cpus");
+	r.frames = r.events = TDC_WALK_N_SETTINGS*TDC_WALK_N_TOT;
+	double start = now_sec();
+	tdc_walk_table_t *table = tdc_walk_table_build(&model, 0);
+	r.seconds = now_sec() - start;
+	print_result(&r);
+	tdc_walk_table_free(table);
+	init_result(&r, "tdc_walk_table_build", "model", "one_cpu");
+	r.frames = r.events = TDC_WALK_N_SETTINGS*TDC_WALK_N_TOT;
+	start = now_sec();
+	table = tdc_walk_table_build(&model, 1);
+	r.seconds = now_sec() - start;
+	print_result(&r);
+	tdc_walk_table_free(table);
+	char cache_dir[] = "/tmp/tdc-bench-walk-XXXXXX";
+	if (!mkdtemp(cache_dir)) {
+		perror("cannot create the cache directory");
+		return 0;
+	}
+	tdc_walk_table_free(tdc_walk_table_open(&model, cache_dir)); // builds and writes the table
+	init_result(&r, "tdc_walk_table_open", "model", "cache");
+	r.frames = r.events = TDC_WALK_N_SETTINGS*TDC_WALK_N_TOT;
+	start = now_sec();
+	table = tdc_walk_table_open(&model, cache_dir);
+	r.seconds = now_sec() - start;
+	print_result(&r);
+	char filename[4096];
+	snprintf(filename, sizeof(filename), "%s/tdc-walk-%016lx.tab", cache_dir, (unsigned long)table->key);
+	unlink(filename);
+	rmdir(cache_dir);
+
+	static tdc_walk_t walk;
+	tdc_walk_init(&walk, table);
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		tdc_walk_set_threshold(&walk, ch, 500 + 1000*ch);
+	}
+	tdc_event_t *events = malloc(sizeof(tdc_event_t)*n_events);
+	tdc_batch_t *batch  = tdc_batch_new(n_events);
+	float *walk_event   = malloc(sizeof(float)*batch->capacity);
+	float *walk_batch   = malloc(sizeof(float)*batch->capacity);
+	if (!events || !batch || !walk_event || !walk_batch) {
+		fprintf(stderr, "not enough memory for %ld events\n", n_events);
+		return 0;
+	}
+	if (!generate_events(n_events, events)) {
+		return 0;
+	}
+	for (long i = 0; i < n_events; ++i) {
+		events[i].tot = events[i].edge == TDC_EDGE_FALLING ? 1 + (i*7919)%1100 : 0;
+	}
+	tdc_batch_from_events(batch, events, n_events);
+	memset(walk_event, 0, sizeof(float)*batch->capacity); // no page faults in the timing
+	memset(walk_batch, 0, sizeof(float)*batch->capacity);
+
+	init_result(&r, "tdc_walk_of", "4ch_inner", "memory");
+	r.frames  = r.events = n_events;
+	r.seconds = 1e99;
+	for (int rep = 0; rep < n_repeat; ++rep) {
+		start = now_sec();
+		for (long i = 0; i < n_events; ++i) {
+			const tdc_event_t *e = &events[i];
+			walk_event[i] = e->edge == TDC_EDGE_FALLING && e->tot ? tdc_walk_of(&walk, e->channel, e->tot) : 0;
+		}
+		double elapsed = now_sec() - start;
+		r.seconds = elapsed < r.seconds ? elapsed : r.seconds;
+	}
+	print_result(&r);
+	init_result(&r, "tdc_walk_batch", "4ch_inner", "memory");
+	r.frames  = r.events = n_events;
+	r.seconds = 1e99;
+	for (int rep = 0; rep < n_repeat; ++rep) {
+		start = now_sec();
+		tdc_walk_batch(&walk, batch, walk_batch);
+		double elapsed = now_sec() - start;
+		r.seconds = elapsed < r.seconds ? elapsed : r.seconds;
+	}
+	print_result(&r);
+
+	// the batch may contract to fused multiply-adds
+	int ok = 1;
+	for (long i = 0; i < n_events; ++i) {
+		if (walk_batch[i] - walk_event[i] > 1e-3 || walk_event[i] - walk_batch[i] > 1e-3) {
+			fprintf(stderr, "event %ld: walk %f per event, %f in the batch\n", i, walk_event[i], walk_batch[i]);
+			ok = 0;
+			break;
+		}
+	}
+	free(events);
+	free(walk_event);
+	free(walk_batch);
+	tdc_batch_free(batch);
+	tdc_walk_table_free(table);
+	return ok;
+}
+
+//////////////////////////////////////////
+// pseudo terminal input benchmarks
+//////////////////////////////////////////
+
+#define PTY_CHUNK 512 // FT232H USB packet size
+
+typedef struct s_pty_writer_t
+{
+	int            master;
+	unsigned char *buffer;
+	long           size;
+	long           rate;       // bytes per second, 0 is unpaced
+	double        *send_time;  // one entry per chunk
+	volatile long  progress;   // events seen by the reader
+	volatile int   reader_done;
+} pty_writer_t;
+
+static void *pty_writer_thread(void *arg)
+{
+	pty_writer_t *w = arg;
+	double start = now_sec();
+	for (long offset = 0, chunk = 0; offset < w->size; offset += PTY_CHUNK, ++chunk) {
+		if (w->rate) {
+			double target = start + (double)offset/w->rate;
+			while (now_sec() < target) {
+			}
+		}
+		long len = w->size-offset < PTY_CHUNK ? w->size-offset : PTY_CHUNK;
+		w->send_time[chunk] = now_sec();
+		for (long done = 0; done < len; ) {
+			long result = write(w->master, w->buffer+offset+done, len-done);
+			if (result <= 0) {
+				return NULL;
+			}
+			done += result;
+		}
+	}
+	// wait for the reader to finish or to get stuck (lost data)
+	long   last_progress = -1;
+	double last_change   = now_sec();
+	while (!w->reader_done && now_sec()-last_change < 2.0) {
+		if (w->progress != last_progress) {
+			last_progress = w->progress;
+			last_change   = now_sec();
+		}
+		usleep(1000);
+	}
+	// closing the master side makes the reader see EOF
+	close(w->master);
+	return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double da = *(const double*)a, db = *(const double*)b;
+	return (da > db) - (da < db);
+}
+
+static double percentile(double *sorted, long n, double p)
+{
+	if (n == 0) {
+		return 0;
+	}
+	long idx = (long)(p*(n-1));
+	return sorted[idx];
+}
+
+static void bench_pty(const bench_mix_t *mix, unsigned char *buffer, long size, long rate,
+                      tdc_event_t *ref_events, long *ref_offsets, long n_ref)
+{
+	bench_result_t r;
+	init_result(&r, rate?"tdc_next_event_paced":"tdc_next_event", mix->name, "pty");
+	r.frames = size/5;
+
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+		perror("cannot create pseudo terminal");
+		return;
+	}
+	tdc_t *tdc = open_tdc(ptsname(master));
+	if (!tdc) {
+		close(master);
+		return;
+	}
+
+	pty_writer_t writer = {
+		.master    = master,
+		.buffer    = buffer,
+		.size      = size,
+		.rate      = rate,
+		.send_time = calloc(size/PTY_CHUNK+1, sizeof(double)),
+	};
+	double *latency = malloc(sizeof(double)*(n_ref+1));
+	long    n_latency = 0;
+
+	pthread_t thread;
+	double start = now_sec();
+	pthread_create(&thread, NULL, pty_writer_thread, &writer);
+	long ref = 0;
+	while (ref < n_ref) {
+		tdc_event_t event = tdc_next_event(tdc);
+		double t_recv = now_sec();
+		if (event.channel == -1) {
+			break;
+		}
+		++r.events;
+		writer.progress = r.events;
+		// align with the reference decoding, tolerating lost frames
+		for (long k = ref; k < n_ref && k < ref+64; ++k) {
+			if (ref_events[k].channel == event.channel && ref_events[k].time == event.time) {
+				latency[n_latency++] = 1e6*(t_recv - writer.send_time[(ref_offsets[k]-1)/PTY_CHUNK]);
+				ref = k+1;
+				break;
+			}
+		}
+	}
+	r.seconds = now_sec() - start;
+	writer.reader_done = 1;
+	pthread_join(thread, NULL);
+	tdc_close(tdc);
+
+	r.lost = n_ref - n_latency;
+	if (rate) {
+		qsort(latency, n_latency, sizeof(double), compare_double);
+		r.p50  = percentile(latency, n_latency, 0.5);
+		r.p90  = percentile(latency, n_latency, 0.9);
+		r.p99  = percentile(latency, n_latency, 0.99);
+		r.p999 = percentile(latency, n_latency, 0.999);
+		r.max  = n_latency ? latency[n_latency-1] : 0;
+	}
+	print_result(&r);
+	free(latency);
+	free(writer.send_time);
+}
+
+void print_help() {
+	printf("usage: tdc-bench [options]\n");
+	printf("\n");
+	printf("Runs the decoder benchmark suite and prints one result line per benchmark.\n");
+	printf("\n");
+	printf("available options:\n");
+	printf("-n <frames>   number of frames per mix (default %ld)\n", n_frames);
+	printf("-r <repeat>   repetitions per benchmark, the fastest is reported (default %d)\n", n_repeat);
+	printf("-p <rate>     byte rate of the paced pty benchmark in bytes/s (default %ld)\n", pty_rate);
+	printf("-j            write JSON instead of CSV\n");
+	printf("-P            skip the pty benchmarks\n");
+	printf("-t            enable tracing (needs a build with TRACE=1)\n");
+	printf("-L <events>   only the event layout benchmark: histogram, coincidence and\n");
+	printf("              selection loops over tdc_event_t, tdc_packed_event_t and\n");
+	printf("              tdc_batch_t arrays of <events> (see tdc_batch.h)\n");
+	printf("-X <gbytes>   only the time index benchmark, on a capture of <gbytes> GB:\n");
+	printf("              index build and 10 ms window queries against decoding from\n");
+	printf("              the start (see tdc_index.h)\n");
+	printf("-J <events>   only the time-walk correction benchmark: table generation and\n");
+	printf("              the correction of <events> per event and per batch (see\n");
+	printf("              tdc_walk.h)\n");
+	printf("-h            print this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	int with_pty = 1;
+	double index_gbytes = 0;
+	long layout_events = 0;
+	long walk_events = 0;
+	while((opt = getopt(argc, argv, "hn:r:p:jPtL:X:J:")) != -1) {
+		switch(opt) {
+			case 'h': print_help(); return 0;
+			case 'n': n_frames = atol(optarg); break;
+			case 'r': n_repeat = atoi(optarg); break;
+			case 'p': pty_rate = atol(optarg); break;
+			case 'j': output_json = 1; break;
+			case 'P': with_pty = 0; break;
+			case 't': trace_flags = TDC_TRACE_ALL; break;
+			case 'L': layout_events = atol(optarg); break;
+			case 'X': index_gbytes = atof(optarg); break;
+			case 'J': walk_events = atol(optarg); break;
+			default:
+				fprintf(stderr, "use option -h for detailed help\n");
+				return 1;
+		}
+	}
+	if (trace_flags && !tdc_trace_available()) {
+		fprintf(stderr, "tracing is not compiled in, use tdc-bench-trace\n");
+		return 1;
+	}
+	if (n_frames < 1 || n_repeat < 1) {
+		fprintf(stderr, "invalid number of frames or repetitions\n");
+		return 1;
+	}
+
+	if (layout_events > 0) {
+		print_header();
+		int ok = bench_layout(layout_events);
+		print_footer();
+		return !ok;
+	}
+	if (index_gbytes > 0) {
+		print_header();
+		int ok = bench_index(index_gbytes, 100);
+		print_footer();
+		return !ok;
+	}
+	if (walk_events > 0) {
+		print_header();
+		int ok = bench_walk(walk_events);
+		print_footer();
+		return !ok;
+	}
+
+	unsigned char *buffer = malloc(5*n_frames);
+	print_header();
+	for (int m = 0; m < N_MIXES; ++m) {
+		const bench_mix_t *mix = &mixes[m];
+		long size = generate_stream(mix, n_frames, buffer);
+		if (!write_file(tmp_filename, buffer, size)) {
+			return 1;
+		}
+
+		bench_unpack(mix, buffer, size);
+		bench_file_read(mix, size/5);
+		bench_file_raw_events(mix, size/5);
+
+		tdc_event_t *events;
+		long        *offsets;
+		long n_events = bench_file_events(mix, size/5, &events, &offsets);
+		bench_file_histograms(mix, size/5);
+		bench_file_filter(mix, size/5, 0);
+		bench_file_filter(mix, size/5, 1);
+
+		tdc_t *tdc = open_tdc(tmp_filename);
+		while (tdc_next_event(tdc).channel != -1) { // fill the sample statistics
+		}
+		bench_smooth_time(mix, events, n_events, tdc);
+		tdc_close(tdc);
+
+		if (with_pty) {
+			// the pty benchmarks are slow, use a fraction of the stream
+			long pty_size = size < 5*100000 ? size : 5*100000;
+			long n_ref = 0;
+			while (n_ref < n_events && offsets[n_ref] <= pty_size) {
+				++n_ref;
+			}
+			bench_pty(mix, buffer, pty_size, 0, events, offsets, n_ref);
+			long lat_size = size < 5*20000 ? size : 5*20000;
+			n_ref = 0;
+			while (n_ref < n_events && offsets[n_ref] <= lat_size) {
+				++n_ref;
+			}
+			bench_pty(mix, buffer, lat_size, pty_rate, events, offsets, n_ref);
+		}
+		free(events);
+		free(offsets);
+	}
+	print_footer();
+	unlink(tmp_filename);
+	free(buffer);
+	return 0;
+}
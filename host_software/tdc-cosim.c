@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tdc_control.h"
+
+//////////////////////////////////////////
+// checker for the co-simulation in gateware/tests/cosim
+//
+// The testbench writes the edges it drives into tdc_top to a text file
+// ("mode <n>" in the first line, then "<channel> <edge> <ns> <ps>") and
+// the bytes the design sends to the FT232H to a raw capture. The capture
+// is decoded with this library and every event has to match an injected
+// edge of the same channel and type. The time origin of the board is
+// unknown, it is estimated from the first edges of all channels.
+//////////////////////////////////////////
+
+#define MAX_REPORTS 10
+// edges per channel used for the time origin, even the smallest channel 
+// buffer of the testbench holds them, so they are never lost
+#define ORIGIN_EDGES 4
+
+typedef struct s_edge_t
+{
+	long long time; // in [ps]
+	int       edge;
+} cosim_edge_t;
+
+typedef struct s_edge_list_t
+{
+	cosim_edge_t *edges;
+	long          len;
+	long          size;
+} edge_list_t;
+
+static void append(edge_list_t *list, long long time, int edge)
+{
+	if (list->len == list->size) {
+		list->size  = list->size ? 2*list->size : 1024;
+		list->edges = realloc(list->edges, list->size*sizeof(cosim_edge_t));
+	}
+	list->edges[list->len].time = time;
+	list->edges[list->len].edge = edge;
+	++list->len;
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+	long long x = *(const long long*)a, y = *(const long long*)b;
+	return (x > y) - (x < y);
+}
+
+void print_help() {
+	printf("usage: tdc-cosim [options] <edges> <capture>\n");
+	printf("\n");
+	printf("Decodes <capture> and compares the events to the edges in <edges>.\n");
+	printf("Both files are written by the testbench in gateware/tests/cosim.\n");
+	printf("The exit code is 0 if all edges were found.\n");
+	printf("\n");
+	printf("available options:\n");
+	printf("-t <ns>     allowed deviation from the injected time (default 2)\n");
+	printf("-l          fail if no channel reported lost words\n");
+	printf("-s          fail if a channel with events got no sync frame\n");
+	printf("-h          print this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	double tolerance_ns = 2;
+	int expect_loss = 0;
+	int expect_sync = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "ht:ls")) != -1) {
+		switch(opt) {
+			case 'h': print_help();                  return 0;
+			case 't': tolerance_ns = atof(optarg);   break;
+			case 'l': expect_loss = 1;               break;
+			case 's': expect_sync = 1;               break;
+			default:
+				fprintf(stderr, "use option -h for detailed help\n");
+				return 1;
+		}
+	}
+	if (argc - optind != 2) {
+		print_help();
+		return 1;
+	}
+	const char *edges_name   = argv[optind];
+	const char *capture_name = argv[optind+1];
+
+	// injected edges
+	edge_list_t injected[TDC_N_CHANNELS] = {{0,},};
+	FILE *edges_file = fopen(edges_name, "r");
+	if (!edges_file) {
+		fprintf(stderr, "Cannot open %s\n", edges_name);
+		return 1;
+	}
+	int mode = 0;
+	if (fscanf(edges_file, "mode %d", &mode) != 1) {
+		fprintf(stderr, "%s: no mode line\n", edges_name);
+		return 1;
+	}
+	int ch, edge;
+	long long ns, ps;
+	while (fscanf(edges_file, "%d %d %lld %lld", &ch, &edge, &ns, &ps) == 4) {
+		if (ch < 0 || ch >= TDC_N_CHANNELS) {
+			fprintf(stderr, "%s: invalid channel %d\n", edges_name, ch);
+			return 1;
+		}
+		append(&injected[ch], ns*1000 + ps, edge ? TDC_EDGE_RISING : TDC_EDGE_FALLING);
+	}
+	fclose(edges_file);
+
+	// decoded events
+	edge_list_t decoded[TDC_N_CHANNELS] = {{0,},};
+	unsigned long lost[TDC_N_CHANNELS] = {0,};
+	tdc_t *tdc = tdc_open(capture_name);
+	if (!tdc) {
+		return 1;
+	}
+	if (mode & TDC_MODE_BLOCKS) {
+		tdc->format = TDC_FORMAT_BLOCKS; // a file can't take the mode register write
+	}
+	for (;;) {
+		tdc_event_t event = tdc_next_event(tdc);
+		if (event.channel == -1) {
+			break;
+		}
+		if (event.edge == TDC_EDGE_LOSS) {
+			lost[event.channel] += event.lost;
+			continue;
+		}
+		append(&decoded[event.channel], (long long)event.time*1000, event.edge);
+	}
+
+	// time origin of the board: median of the differences between the
+	// first edges of each channel, before any of them can be lost
+	long long differences[TDC_N_CHANNELS*ORIGIN_EDGES];
+	int n_differences = 0;
+	for (ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		for (long i = 0; i < ORIGIN_EDGES && i < injected[ch].len && i < decoded[ch].len; ++i) {
+			differences[n_differences++] = decoded[ch].edges[i].time - injected[ch].edges[i].time;
+		}
+	}
+	if (n_differences == 0) {
+		fprintf(stderr, "no events decoded from %s\n", capture_name);
+		return 1;
+	}
+	qsort(differences, n_differences, sizeof(long long), compare_ll);
+	long long offset    = differences[n_differences/2];
+	long long tolerance = tolerance_ns*1000;
+
+	// match both sorted lists channel by channel
+	int failed = 0;
+	int reports = 0;
+	unsigned long total_lost = 0;
+	long long min_deviation = 0, max_deviation = 0;
+	for (ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		long i = 0, j = 0, matched = 0, missing = 0, extra = 0;
+		while (i < injected[ch].len || j < decoded[ch].len) {
+			long long deviation = 0;
+			if (i < injected[ch].len && j < decoded[ch].len) {
+				deviation = decoded[ch].edges[j].time - injected[ch].edges[i].time - offset;
+			}
+			if (i < injected[ch].len && j < decoded[ch].len && llabs(deviation) <= tolerance
+				&& decoded[ch].edges[j].edge == injected[ch].edges[i].edge) {
+				if (deviation < min_deviation) min_deviation = deviation;
+				if (deviation > max_deviation) max_deviation = deviation;
+				++matched; ++i; ++j;
+			} else if (j == decoded[ch].len || (i < injected[ch].len && deviation > 0)) {
+				if (reports++ < MAX_REPORTS) {
+					printf("channel %d: edge %d at %lld ps not decoded\n",
+						ch, injected[ch].edges[i].edge, injected[ch].edges[i].time);
+				}
+				++missing; ++i;
+			} else {
+				if (reports++ < MAX_REPORTS) {
+					printf("channel %d: decoded edge %d at %lld ps was not injected\n",
+						ch, decoded[ch].edges[j].edge, decoded[ch].edges[j].time - offset);
+				}
+				++extra; ++j;
+			}
+		}
+		// edges can only go missing with a loss report
+		if (extra || (missing && !lost[ch])) {
+			failed = 1;
+		}
+		if (expect_sync && decoded[ch].len && !tdc->stats.syncs[ch]) {
+			failed = 1;
+		}
+		printf("channel %d: %ld edges injected, %ld matched, %ld missing, %ld not injected, %lu words lost, %lu syncs\n",
+			ch, injected[ch].len, matched, missing, extra, lost[ch], tdc->stats.syncs[ch]);
+		total_lost += lost[ch];
+	}
+	// an overflow case that didn't overflow tests nothing
+	if (expect_loss && !total_lost) {
+		printf("no words lost, but -l was given\n");
+		failed = 1;
+	}
+	printf("board time origin %lld ps, deviation [%lld,%lld] ps, %lu invalid frames, %lu resync bytes\n",
+		offset, min_deviation, max_deviation, tdc->stats.invalid_frames, tdc->stats.resync_bytes);
+	if (tdc->stats.invalid_frames || tdc->stats.invalid_blocks) {
+		failed = 1;
+	}
+	printf("%s\n", failed ? "FAILED" : "passed");
+
+	tdc_close(tdc);
+	for (ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		free(injected[ch].edges);
+		free(decoded[ch].edges);
+	}
+	return failed;
+}
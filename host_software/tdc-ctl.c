@@ -1,8 +1,21 @@
 #include <stdio.h> 
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h> 
 #include <time.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <limits.h>
 
 #include "tdc_control.h"
+#include "tdc_trace.h"
+#include "tdc_histogram.h"
+#include "tdc_shm.h"
+#include "tdc_server.h"
+#include "tdc_realtime.h"
+#include "tdc_index.h"
+#include "tdc_walk.h"
 
 char* sample_to_text(unsigned char ch, unsigned long time, int edge)
 {
@@ -34,6 +47,137 @@ char* sample_to_text(unsigned char ch, unsigned long time, int edge)
 	return str_out;
 }
 
+tdc_t         *stats_tdc      = 0;
+double         stats_interval = 0;
+tdc_latency_t *stats_latency  = 0;
+
+// print the statistics from a separate thread, so that a line 
+// is printed even when the decoder is blocked in read()
+void *print_stats(void *arg)
+{
+	tdc_stats_t previous, current;
+	tdc_get_stats(stats_tdc, &previous);
+	for (;;) {
+		usleep(stats_interval*1e6);
+		tdc_get_stats(stats_tdc, &current);
+		tdc_print_stats(stderr, &previous, &current);
+		if (stats_latency) {
+			tdc_latency_print(stderr, stats_latency);
+		}
+		previous = current;
+	}
+	return NULL;
+}
+
+// <channel>:<setting>,... with the settings dead=<ns>, tot=<min>-<max>,
+// prescale=<n>/<m> and edges=rising|falling|both into filters[channel],
+// returns 0 if the text is invalid
+int parse_filter(const char *text, tdc_filter_t *filters)
+{
+	int channel = -1, pos = 0;
+	if (sscanf(text, "%d:%n", &channel, &pos) != 1 || channel < 0 || channel >= TDC_N_CHANNELS) {
+		return 0;
+	}
+	tdc_filter_t *filter = &filters[channel];
+	memset(filter, 0, sizeof(tdc_filter_t));
+	char settings[256];
+	snprintf(settings, sizeof(settings), "%s", text+pos);
+	for (char *setting = strtok(settings, ","); setting; setting = strtok(NULL, ",")) {
+		char edges[16];
+		if (sscanf(setting, "dead=%lu", &filter->deadtime) == 1) {
+			continue;
+		}
+		if (sscanf(setting, "tot=%lu-%lu", &filter->min_tot, &filter->max_tot) == 2) {
+			continue;
+		}
+		if (sscanf(setting, "prescale=%u/%u", &filter->prescale_n, &filter->prescale_m) == 2) {
+			continue;
+		}
+		if (sscanf(setting, "edges=%15s", edges) == 1) {
+			if (strcmp(edges, "rising") == 0) {
+				filter->polarity = TDC_POLARITY_RISING;
+				continue;
+			} else if (strcmp(edges, "falling") == 0) {
+				filter->polarity = TDC_POLARITY_FALLING;
+				continue;
+			} else if (strcmp(edges, "both") == 0) {
+				filter->polarity = TDC_POLARITY_BOTH;
+				continue;
+			}
+		}
+		fprintf(stderr, "invalid filter setting %s\n", setting);
+		return 0;
+	}
+	return 1;
+}
+
+// the model of -w, 'threshold' is set by th=
+int parse_walk(const char *text, tdc_walk_model_t *model, int *threshold)
+{
+	memset(model, 0, sizeof(tdc_walk_model_t));
+	char settings[256];
+	snprintf(settings, sizeof(settings), "%s", text);
+	for (char *setting = strtok(settings, ","); setting; setting = strtok(NULL, ",")) {
+		if (sscanf(setting, "tau=%lf", &model->tau) == 1
+				|| sscanf(setting, "rc=%lf", &model->RC) == 1
+				|| sscanf(setting, "thtau=%lf", &model->threshold_tau) == 1
+				|| sscanf(setting, "delay=%lf", &model->trigger_delay) == 1) {
+			continue;
+		}
+		if (sscanf(setting, "th=%d", threshold) == 1 && *threshold >= 0 && *threshold < TDC_THRESHOLD_RANGE) {
+			continue;
+		}
+		fprintf(stderr, "invalid walk setting %s\n", setting);
+		return 0;
+	}
+	return model->tau > 0 && model->RC > 0 && model->threshold_tau > 0;
+}
+
+// $XDG_CACHE_HOME/dtot or ~/.cache/dtot, NULL if there is no home
+static const char *walk_cache_dir()
+{
+	static char dir[4096];
+	const char *base = getenv("XDG_CACHE_HOME");
+	if (base && base[0]) {
+		snprintf(dir, sizeof(dir), "%s", base);
+	} else if ((base = getenv("HOME")) && base[0]) {
+		snprintf(dir, sizeof(dir), "%s/.cache", base);
+	} else {
+		return NULL;
+	}
+	mkdir(dir, 0755);
+	strncat(dir, "/dtot", sizeof(dir)-strlen(dir)-1);
+	mkdir(dir, 0755);
+	return dir;
+}
+
+// busy, poll, lock, cpu=<n> and prio=<n> separated by commas,
+// returns 0 if the text is invalid
+int parse_realtime(const char *text, tdc_realtime_config_t *config)
+{
+	tdc_realtime_default_config(config);
+	char settings[256];
+	snprintf(settings, sizeof(settings), "%s", text);
+	for (char *setting = strtok(settings, ","); setting; setting = strtok(NULL, ",")) {
+		int value;
+		if (strcmp(setting, "busy") == 0) {
+			config->busy_poll = 1;
+		} else if (strcmp(setting, "poll") == 0) {
+			config->busy_poll = 0;
+		} else if (strcmp(setting, "lock") == 0) {
+			config->lock_memory = 1;
+		} else if (sscanf(setting, "cpu=%d", &value) == 1 && value >= 0) {
+			config->cpu = value;
+		} else if (sscanf(setting, "prio=%d", &value) == 1 && value >= 1 && value <= 99) {
+			config->priority = value;
+		} else {
+			fprintf(stderr, "invalid real-time setting %s\n", setting);
+			return 0;
+		}
+	}
+	return 1;
+}
+
 void print_help() {
 	printf("usage: tdc-ctl <device> [options]\n");
 	printf("\n");
@@ -55,6 +199,82 @@ void print_help() {
 	printf("                        '-t0:0'    set threshold of channel 0 to 0\n ");
 	printf("                        '-t1:4095' set threshold of channel 1 to 4095 (max)\n ");
 	printf("                        '-t2:2000' set threshold of channel 2 to 2000\n ");
+	printf("-f <format>             Switch the board and the decoder to another stream\n");
+	printf("                        format: 'frames' (5 byte frames, power up default) or\n");
+	printf("                        'blocks' (packed records, ~12%% less bandwidth). The\n");
+	printf("                        board keeps the format, so give the same -f option\n");
+	printf("                        when reading events later.\n");
+	printf("-p <on|off>             Pulse mode: the board pairs the edges of pulses shorter\n");
+	printf("                        than 1024 ns and sends one frame per pulse instead of\n");
+	printf("                        one per edge. The events are the same in both modes.\n");
+	printf("-y <on|off>             Sync frames: the board sends the absolute epoch of\n");
+	printf("                        every channel once per counter period (134 ms), so that\n");
+	printf("                        lost overflow frames are repaired and a capture can be\n");
+	printf("                        decoded from the middle.\n");
+	printf("-F <channel:settings>   Filter the pulses of a channel in the decoder, before\n");
+	printf("                        events are built. Settings separated by commas:\n");
+	printf("                        dead=<ns>         deadtime after a rising edge\n");
+	printf("                        tot=<min>-<max>   ToT window in ns (max 0: no limit)\n");
+	printf("                        prescale=<n>/<m>  keep n of every m pulses\n");
+	printf("                        edges=<rising|falling|both>\n");
+	printf("                        '-F0:dead=200,tot=10-0' drops narrow noise pulses\n");
+	printf("                        and pulses in the 200 ns after a pulse on channel 0.\n");
+	printf("                        -s shows the filter counters.\n");
+	printf("-s <seconds>            Print rates per channel and edge type and the error \n");
+	printf("                        counters of the decoder to stderr every <seconds>.\n");
+	printf("-T <file>               Trace the decoder (needs a build with TRACE=1). At the\n");
+	printf("                        end a summary is printed to stderr and the trace records\n");
+	printf("                        are written to <file>.\n");
+	printf("-H <target>             Fill ToT, dt and phase histograms per channel and\n");
+	printf("                        publish snapshots to <target>, which is a file name or\n");
+	printf("                        unix:<path> to serve them on a unix domain socket.\n");
+	printf("-I <seconds>            Histogram snapshot interval (default 1 second)\n");
+	printf("-P <name>               Publish all events in the shared memory ring <name>\n");
+	printf("                        (e.g. /tdc) for any number of tdc-shm consumers.\n");
+	printf("-S, --serve <target>    Stream events in binary batches to clients on\n");
+	printf("                        unix:<path> or tcp:<port> (loopback only). Clients\n");
+	printf("                        choose channels and a drop or block policy, see\n");
+	printf("                        tdc_server.h and tdc-load.\n");
+	printf("-R <settings>           Real-time mode: non-blocking reads without the 0.8 s\n");
+	printf("                        read timer and a histogram of the latency from read()\n");
+	printf("                        to the delivery of each event. Settings separated by\n");
+	printf("                        commas:\n");
+	printf("                        poll              wait in poll() (default)\n");
+	printf("                        busy              spin on read(), uses a whole CPU\n");
+	printf("                        lock              lock all memory (mlockall)\n");
+	printf("                        cpu=<n>           run the decoder on CPU n\n");
+	printf("                        prio=<1-99>       SCHED_FIFO priority, needs root or\n");
+	printf("                                          CAP_SYS_NICE\n");
+	printf("                        '-R busy,lock,cpu=3,prio=80 -q -P /tdc' keeps printf\n");
+	printf("                        out of the path. The latency is printed with -s and\n");
+	printf("                        at the end (see -n).\n");
+	printf("-L <file>               Write the latency histogram of -R to <file> at the end\n");
+	printf("-C <file>               Checkpoint the decoder state to <file> and resume from\n");
+	printf("                        it if it exists. A capture file continues at the event\n");
+	printf("                        after the checkpoint. On a device the overflow counters\n");
+	printf("                        are carried over the restart (estimated from the wall\n");
+	printf("                        clock, exact with -y on); the first sample of each\n");
+	printf("                        channel has no edge, as after a loss. The filters (-F)\n");
+	printf("                        come from <file>.\n");
+	printf("-K <seconds>            Checkpoint interval of -C (default 1 second)\n");
+	printf("-W <from>:<to>          Only the events from <from> to <to> ns of a capture\n");
+	printf("                        file. The decoder jumps there with the time index\n");
+	printf("                        <capture>.idx, which is built on the first use and\n");
+	printf("                        again when the capture has changed.\n");
+	printf("-w <settings>           Correct the time walk of the leading edges with the\n");
+	printf("                        pulse model of theory_of_operation/simulations. Each\n");
+	printf("                        falling edge gets the start of its pulse (lead=, in ns)\n");
+	printf("                        from its ToT and the threshold of the channel (-t, or\n");
+	printf("                        th= for a capture file). Settings separated by commas:\n");
+	printf("                        tau=<ns>          decay time of the scintillator\n");
+	printf("                        rc=<ns>           shaping time constant\n");
+	printf("                        thtau=<ns>        rise time of the dynamic threshold\n");
+	printf("                        delay=<ns>        trigger delay of the threshold rise\n");
+	printf("                        th=<0-4095>       threshold of the channels without -t\n");
+	printf("                        The walk table is cached in $XDG_CACHE_HOME/dtot or\n");
+	printf("                        ~/.cache/dtot.\n");
+	printf("-n <events>             Stop after <events> events\n");
+	printf("-q                      Don't print events\n");
 	printf(" -h                     print this help\n");
 }
 
@@ -66,6 +286,36 @@ int main(int argc, char *argv[])
 	int thresholds[TDC_N_CHANNELS] = {-1,-1,-1,-1};
 	int channel, threshold;
 	int snoop = 1;
+	const char *trace_filename = 0;
+	const char *hist_target = 0;
+	double hist_interval = 1;
+	int quiet = 0;
+	int format = -1;
+	int pulse_mode = -1;
+	int sync = -1;
+	tdc_monitor_t *monitor = 0;
+	tdc_monitor_shard_t monitor_shard;
+	const char *shm_name = 0;
+	tdc_shm_t *shm = 0;
+	const char *serve_target = 0;
+	tdc_server_t *server = 0;
+	tdc_filter_t filters[TDC_N_CHANNELS];
+	memset(filters, 0, sizeof(filters));
+	int realtime = 0;
+	tdc_realtime_config_t realtime_config;
+	tdc_latency_t *latency = 0;
+	const char *latency_filename = 0;
+	long max_events = -1;
+	const char *checkpoint_filename = 0;
+	double checkpoint_interval = 1;
+	const char *capture_filename = 0;
+	unsigned long window[2] = {0, 0};
+	unsigned long window_end = ULONG_MAX;
+	int walk_correction = 0;
+	tdc_walk_model_t walk_model;
+	int walk_threshold = -1;
+	tdc_walk_table_t *walk_table = 0;
+	static tdc_walk_t walk;
 	tdc_t *tdc = 0;
 
 	if (argc == 1) {
@@ -77,7 +327,11 @@ int main(int argc, char *argv[])
 	// put ':' in the starting of the 
 	// string so that program can 
 	//distinguish between '?' and ':' 
-	while((opt = getopt(argc, argv, ":he:t:")) != -1) 
+	static struct option long_options[] = {
+		{"serve", required_argument, NULL, 'S'},
+		{NULL, 0, NULL, 0}
+	};
+	while((opt = getopt_long(argc, argv, ":he:t:f:p:y:s:T:H:I:P:S:F:R:L:C:K:W:w:n:q", long_options, NULL)) != -1) 
 	{ 
 		switch(opt) 
 		{ 
@@ -118,6 +372,105 @@ int main(int argc, char *argv[])
 				}
 				thresholds[channel] = threshold;
 				break; 
+			case 'f':
+				if (strcmp(optarg, "frames") == 0) {
+					format = TDC_FORMAT_FRAMES;
+				} else if (strcmp(optarg, "blocks") == 0) {
+					format = TDC_FORMAT_BLOCKS;
+				} else {
+					fprintf(stderr, "invalid format %s, must be 'frames' or 'blocks'\n", optarg);
+					return 1;
+				}
+				break;
+			case 'p':
+				snoop = 0;
+				if (strcmp(optarg, "on") == 0) {
+					pulse_mode = 1;
+				} else if (strcmp(optarg, "off") == 0) {
+					pulse_mode = 0;
+				} else {
+					fprintf(stderr, "invalid pulse mode %s, must be 'on' or 'off'\n", optarg);
+					return 1;
+				}
+				break;
+			case 'y':
+				snoop = 0;
+				if (strcmp(optarg, "on") == 0) {
+					sync = 1;
+				} else if (strcmp(optarg, "off") == 0) {
+					sync = 0;
+				} else {
+					fprintf(stderr, "invalid sync mode %s, must be 'on' or 'off'\n", optarg);
+					return 1;
+				}
+				break;
+			case 's':
+				stats_interval = atof(optarg);
+				if (stats_interval <= 0) {
+					fprintf(stderr, "invalid statistics interval %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'T':
+				trace_filename = optarg;
+				break;
+			case 'H':
+				hist_target = optarg;
+				break;
+			case 'I':
+				hist_interval = atof(optarg);
+				break;
+			case 'P':
+				shm_name = optarg;
+				break;
+			case 'S':
+				serve_target = optarg;
+				break;
+			case 'F':
+				if (!parse_filter(optarg, filters)) {
+					fprintf(stderr, "invalid filter %s\n", optarg);
+					fprintf(stderr, "use option -h for detailed help\n");
+					return 1;
+				}
+				break;
+			case 'R':
+				if (!parse_realtime(optarg, &realtime_config)) {
+					fprintf(stderr, "invalid real-time settings %s\n", optarg);
+					fprintf(stderr, "use option -h for detailed help\n");
+					return 1;
+				}
+				realtime = 1;
+				break;
+			case 'L':
+				latency_filename = optarg;
+				break;
+			case 'C':
+				checkpoint_filename = optarg;
+				break;
+			case 'K':
+				checkpoint_interval = atof(optarg);
+				break;
+			case 'W':
+				if (sscanf(optarg, "%lu:%lu", &window[0], &window[1]) != 2 || window[1] <= window[0]) {
+					fprintf(stderr, "invalid time window %s\n", optarg);
+					fprintf(stderr, "use option -h for detailed help\n");
+					return 1;
+				}
+				break;
+			case 'w':
+				if (!parse_walk(optarg, &walk_model, &walk_threshold)) {
+					fprintf(stderr, "invalid walk model %s\n", optarg);
+					fprintf(stderr, "use option -h for detailed help\n");
+					return 1;
+				}
+				walk_correction = 1;
+				break;
+			case 'n':
+				max_events = atol(optarg);
+				break;
+			case 'q':
+				quiet = 1;
+				break;
 			case ':': 
 				printf("option needs a value\n"); 
 				fprintf(stderr, "use option -h for detailed help\n");
@@ -134,6 +487,7 @@ int main(int argc, char *argv[])
 	for(; optind < argc; optind++){	 
 		//printf("extra arguments: %s\n", argv[optind]); 
 		printf("device: %s\n", argv[optind]); 
+		capture_filename = argv[optind];
 		tdc = tdc_open(argv[optind]);
 		if (!tdc) {
 			fprintf(stderr, "Cannot open device %s\n", optarg);
@@ -143,6 +497,30 @@ int main(int argc, char *argv[])
 		}
 	} 
 
+	if (format != -1) {
+		if (tdc == NULL) {
+			fprintf(stderr, "No device given, cannot set the format. Use -h for help.\n");
+			return 1;
+		}
+		tdc_set_format(tdc, format);
+	}
+
+	if (pulse_mode != -1) {
+		if (tdc == NULL) {
+			fprintf(stderr, "No device given, cannot set the pulse mode. Use -h for help.\n");
+			return 1;
+		}
+		tdc_set_pulse_mode(tdc, pulse_mode);
+	}
+
+	if (sync != -1) {
+		if (tdc == NULL) {
+			fprintf(stderr, "No device given, cannot set the sync mode. Use -h for help.\n");
+			return 1;
+		}
+		tdc_set_sync(tdc, sync);
+	}
+
 	if (enable_pattern != -1) {
 		if (tdc == NULL) {
 			fprintf(stderr, "No device given, cannot send enable pattern. Use -h for help.\n");
@@ -163,25 +541,171 @@ int main(int argc, char *argv[])
 	}
 
 	if (snoop) {
+		for (int ch = 0; tdc && ch < TDC_N_CHANNELS; ++ch) {
+			tdc_set_filter(tdc, ch, &filters[ch]);
+		}
+		tdc_checkpoint_t checkpoint;
+		if (tdc && checkpoint_filename && tdc_checkpoint_read(checkpoint_filename, &checkpoint)) {
+			struct stat st;
+			int mode = fstat(tdc->fd, &st) == 0 && S_ISREG(st.st_mode) ? TDC_RESUME_CAPTURE : TDC_RESUME_LIVE;
+			if (!tdc_checkpoint_restore(tdc, &checkpoint, mode)) {
+				return 1;
+			}
+			fprintf(stderr, "resumed from %s at byte %lu\n", checkpoint_filename, checkpoint.raw_offset);
+		}
+		if (tdc && window[1]) {
+			tdc_index_t *index = tdc_index_open(capture_filename, tdc->format, TDC_INDEX_DEFAULT_INTERVAL);
+			if (!index || !tdc_index_seek(index, tdc, window[0])) {
+				fprintf(stderr, "cannot use a time window on %s\n", capture_filename);
+				return 1;
+			}
+			window_end = tdc_index_end(index, window[0], window[1]);
+			tdc_index_free(index);
+		}
+		if (tdc && walk_correction) {
+			walk_table = tdc_walk_table_open(&walk_model, walk_cache_dir());
+			if (!walk_table) {
+				fprintf(stderr, "the walk model has no solution\n");
+				return 1;
+			}
+			tdc_walk_init(&walk, walk_table);
+			for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+				tdc_walk_set_threshold(&walk, ch, thresholds[ch] != -1 ? thresholds[ch] : walk_threshold);
+			}
+		}
+		struct timespec checkpoint_due;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &checkpoint_due);
+		if (tdc && realtime) {
+			latency = tdc_latency_new();
+			if (!latency) {
+				return 1;
+			}
+			stats_latency = latency;
+		}
+		if (tdc && stats_interval > 0) {
+			pthread_t stats_thread;
+			stats_tdc = tdc;
+			pthread_create(&stats_thread, NULL, print_stats, NULL);
+			pthread_detach(stats_thread);
+		}
+		if (tdc && trace_filename && !tdc_trace_enable(tdc, TDC_TRACE_ALL, 1<<20)) {
+			return 1;
+		}
+		if (tdc && hist_target) {
+			monitor = tdc_monitor_new();
+			if (!tdc_monitor_add_shard(monitor, &monitor_shard) ||
+			    !tdc_monitor_start(monitor, hist_target, hist_interval)) {
+				return 1;
+			}
+		}
+		if (tdc && shm_name) {
+			shm = tdc_shm_create(shm_name, 1<<18);
+			if (!shm) {
+				return 1;
+			}
+		}
+		if (tdc && serve_target) {
+			server = tdc_server_start(serve_target);
+			if (!server) {
+				return 1;
+			}
+		}
+		if (tdc && realtime) {
+			// after all other threads are started, they must not inherit
+			// the CPU and the priority of the decoder
+			if (!tdc_realtime_setup(tdc, &realtime_config)) {
+				fprintf(stderr, "real-time mode is incomplete, see above\n");
+			}
+		}
 		long int previous_time = 0;
-		for (;;) {
+		for (long n = 0; n != max_events; ++n) {
 			tdc_event_t event = tdc_next_event(tdc);
-			if (event.channel == -1) {
+			if (event.channel == -1 || tdc->raw_offset > window_end) {
 				break;
 			}
-			printf("%d %d %20ld     sample=0x%02x:%s   dt=%ld\n",	
-				event.channel, 
-				event.edge, 
-				event.time, 
-				event.sample,
-				sample_to_text(event.sample, event.time, event.edge),
-				event.dt);
+			if (window[1] && (event.time < window[0] || event.time >= window[1])) {
+				--n;
+				continue;
+			}
+			if (monitor) {
+				tdc_monitor_fill(&monitor_shard, &event);
+			}
+			if (shm) {
+				tdc_shm_publish(shm, &event);
+			}
+			if (server) {
+				tdc_server_publish(server, &event);
+			}
+			if (!quiet && event.edge == TDC_EDGE_LOSS) {
+				printf("%d lost %lu words after %ld\n", event.channel, event.lost, event.time);
+			} else if (!quiet && walk_table && event.edge == TDC_EDGE_FALLING && event.tot) {
+				printf("%d %d %20ld     sample=0x%02x:%s   dt=%ld   lead=%.2f\n",
+					event.channel,
+					event.edge,
+					event.time,
+					event.sample,
+					sample_to_text(event.sample, event.time, event.edge),
+					event.dt,
+					tdc_walk_pulse_start(&walk, &event));
+			} else if (!quiet) {
+				printf("%d %d %20ld     sample=0x%02x:%s   dt=%ld\n",	
+					event.channel, 
+					event.edge, 
+					event.time, 
+					event.sample,
+					sample_to_text(event.sample, event.time, event.edge),
+					event.dt);
 
-			previous_time = event.time;
+				previous_time = event.time;
+			}
+			if (latency) {
+				tdc_latency_deliver(latency, tdc);
+			}
+			if (checkpoint_filename) {
+				// the coarse clock is a read of the vDSO page, cheap per event
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+				if (now.tv_sec > checkpoint_due.tv_sec
+						|| (now.tv_sec == checkpoint_due.tv_sec && now.tv_nsec >= checkpoint_due.tv_nsec)) {
+					tdc_checkpoint_take(tdc, &checkpoint);
+					tdc_checkpoint_write(checkpoint_filename, &checkpoint);
+					long ns = now.tv_nsec + (long)(checkpoint_interval*1e9);
+					checkpoint_due.tv_sec  = now.tv_sec + ns/1000000000;
+					checkpoint_due.tv_nsec = ns%1000000000;
+				}
+			}
+		}
+		if (tdc && checkpoint_filename) {
+			tdc_checkpoint_take(tdc, &checkpoint);
+			tdc_checkpoint_write(checkpoint_filename, &checkpoint);
 		}
 	}
 
 	
+	if (shm) {
+		tdc_shm_close(shm);
+	}
+	if (server) {
+		tdc_server_stop(server, 1000);
+	}
+	if (monitor) {
+		tdc_monitor_free(monitor);
+	}
+	if (latency) {
+		tdc_latency_print(stderr, latency);
+		FILE *out = latency_filename ? fopen(latency_filename, "w") : NULL;
+		if (out) {
+			tdc_latency_write(out, latency);
+			fclose(out);
+		} else if (latency_filename) {
+			perror("cannot write the latency histogram");
+		}
+	}
+	tdc_walk_table_free(walk_table);
+	if (tdc && tdc->trace) {
+		tdc_trace_print(stderr, tdc->trace);
+		tdc_trace_write_ring(tdc->trace, trace_filename);
+	}
 	if (tdc) {
 		tdc_close(tdc);
 	}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "tdc_emulator.h"
+
+static volatile int stop = 0;
+
+void handle_signal(int signal)
+{
+	stop = 1;
+}
+
+void print_help(tdc_emu_config_t *config) {
+	printf("usage: tdc-emu [options]\n");
+	printf("\n");
+	printf("Emulates a TDC board on a pseudo terminal. The name of the terminal is\n");
+	printf("printed on startup, use it as <device> for tdc-ctl.\n");
+	printf("\n");
+	printf("available options:\n");
+	printf("-r <rate>       pulse rate per channel at threshold 0 in Hz (default %g)\n", config->rate);
+	printf("-s <scale>      the rate drops by exp(-threshold/scale) (default %g)\n", config->threshold_scale);
+	printf("-w <width>      pulse width in ns (default %ld)\n", config->pulse_width);
+	printf("-b <bytes>      USB packet size in bytes (default %d)\n", config->packet_size);
+	printf("-i <us>         time between USB packets in us (default %ld)\n", config->packet_interval_ns/1000);
+	printf("-q <bytes>      board buffer size in bytes (default %ld)\n", config->queue_size);
+	printf("-e <pattern>    channels enabled on startup, e.g. 1001 (default: none)\n");
+	printf("-S <seed>       random seed (default %u)\n", config->seed);
+	printf("-h              print this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	tdc_emu_config_t config;
+	tdc_emu_default_config(&config);
+
+	int opt;
+	while((opt = getopt(argc, argv, "hr:s:w:b:i:q:e:S:")) != -1) {
+		switch(opt) {
+			case 'h': print_help(&config);                        return 0;
+			case 'r': config.rate               = atof(optarg);      break;
+			case 's': config.threshold_scale    = atof(optarg);      break;
+			case 'w': config.pulse_width        = atol(optarg);      break;
+			case 'b': config.packet_size        = atoi(optarg);      break;
+			case 'i': config.packet_interval_ns = 1000*atol(optarg); break;
+			case 'q': config.queue_size         = atol(optarg);      break;
+			case 'S': config.seed               = atoi(optarg);      break;
+			case 'e':
+				config.enable_pattern = 0;
+				for (int i = 0; i < TDC_N_CHANNELS && optarg[i]; ++i) {
+					if (optarg[i] == '1') {
+						config.enable_pattern |= 1<<i;
+					}
+				}
+				break;
+			default:
+				fprintf(stderr, "use option -h for detailed help\n");
+				return 1;
+		}
+	}
+	if (config.packet_size < 1 || config.queue_size < 5 || config.pulse_width < 1) {
+		fprintf(stderr, "invalid packet size, buffer size or pulse width\n");
+		return 1;
+	}
+
+	tdc_emu_t *emu = tdc_emu_open(&config);
+	if (!emu || !tdc_emu_start(emu)) {
+		fprintf(stderr, "Cannot start emulator\n");
+		return 1;
+	}
+	printf("%s\n", emu->slave_name);
+	fflush(stdout);
+
+	signal(SIGINT,  handle_signal);
+	signal(SIGTERM, handle_signal);
+	while (!stop) {
+		sleep(1);
+		fprintf(stderr, "frames sent %lu  dropped %lu  commands %lu  enabled",
+			emu->frames_sent, emu->frames_dropped, emu->commands_received);
+		for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+			fprintf(stderr, " %d", tdc_emu_enabled(emu, ch));
+		}
+		fprintf(stderr, "  thresholds");
+		for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+			fprintf(stderr, " %d", tdc_emu_threshold(emu, ch));
+		}
+		fprintf(stderr, "\n");
+	}
+	tdc_emu_close(emu);
+	return 0;
+}
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "tdc_server.h"
+
+//////////////////////////////////////////
+// load generator for the event server (tdc-ctl --serve)
+//
+// Starts a number of clients, each in its own thread, that read as fast
+// as they can (or slower with -d) and check that the batches come in
+// order and the times of each channel only go forward. With -n the
+// server runs in this process and publishes synthetic events at full
+// speed, then every client must have all events of its channels minus
+// the ones the server reported as dropped.
+//////////////////////////////////////////
+
+#define MAX_CLIENTS 16
+
+static volatile int stopping = 0;
+
+typedef struct s_load_client_t
+{
+	unsigned      mask;
+	int           policy;
+	int           delay_us; // sleep after each batch
+	pthread_t     thread;
+	tdc_client_t *client;
+	unsigned long events;
+	unsigned long dropped;
+	unsigned long batches;
+	unsigned long errors;
+	double        seconds;
+} load_client_t;
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static void *run_client(void *arg)
+{
+	load_client_t *load = arg;
+	unsigned long last_time[TDC_N_CHANNELS] = {0,};
+	uint64_t last_batch = 0;
+	uint64_t batches = load->client->batches;
+	double start = now_sec();
+	tdc_event_t event;
+	int result;
+	while ((result = tdc_client_next(load->client, &event)) == 1) {
+		++load->events;
+		if (!(load->mask & (1<<event.channel))) {
+			++load->errors;
+		}
+		// a loss has the time of the sample before, edges only go forward
+		if (event.edge != TDC_EDGE_LOSS) {
+			if (event.time < last_time[event.channel]) {
+				++load->errors;
+			}
+			last_time[event.channel] = event.time;
+		}
+		if (load->client->batches != batches) {
+			if (load->client->batch < last_batch) {
+				++load->errors;
+			}
+			last_batch = load->client->batch;
+			batches    = load->client->batches;
+			if (load->delay_us) {
+				usleep(load->delay_us);
+			}
+		}
+	}
+	if (result == -1 && !stopping) {
+		++load->errors;
+	}
+	load->seconds = now_sec() - start;
+	load->dropped = load->client->dropped;
+	load->batches = load->client->batches;
+	tdc_client_close(load->client);
+	return NULL;
+}
+
+// synthetic events: the channels take turns, times go up by 100 ns
+static void publish_events(tdc_server_t *server, long n_events)
+{
+	double start = now_sec();
+	for (long i = 0; i < n_events; ++i) {
+		tdc_event_t event = {0,};
+		event.channel = i%TDC_N_CHANNELS;
+		event.time    = 100*i;
+		event.edge    = (i/TDC_N_CHANNELS)%2 ? TDC_EDGE_FALLING : TDC_EDGE_RISING;
+		event.sample  = event.edge == TDC_EDGE_RISING ? 0x0f : 0xf0;
+		event.dt      = 400;
+		tdc_server_publish(server, &event);
+	}
+	double seconds = now_sec() - start;
+	fprintf(stderr, "published %ld events in %.3f s, %.1f Mevents/s, ring full %lu times\n",
+		n_events, seconds, 1e-6*n_events/seconds, server->publish_waits);
+}
+
+static unsigned parse_mask(const char *text)
+{
+	unsigned mask = 0;
+	for (int i = 0; i < TDC_N_CHANNELS && text[i]; ++i) {
+		if (text[i] == '1') {
+			mask |= 1<<i;
+		}
+	}
+	return mask;
+}
+
+static void print_help()
+{
+	printf("usage: tdc-load <target> [options]\n");
+	printf("\n");
+	printf("Connects clients to the event server at <target> (unix:<path> or tcp:<port>)\n");
+	printf("and reports the rate and the dropped events of each client.\n");
+	printf("\n");
+	printf("available options:\n");
+	printf("-c <clients>    number of clients (default 4, at most %d)\n", MAX_CLIENTS);
+	printf("-m <pattern>    channel pattern of all clients, e.g. 1010 (default 1111)\n");
+	printf("-b              blocking clients, the server waits for them (default: drop)\n");
+	printf("-d <us>         the last client sleeps after each batch to be slow\n");
+	printf("-n <events>     run the server in this process and publish <events>\n");
+	printf("                synthetic events as fast as possible\n");
+	printf("-t <seconds>    disconnect after <seconds> (default: at the end of the stream)\n");
+	printf("-h              print this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int n_clients = 4;
+	unsigned mask = 0xf;
+	int policy = TDC_SERVER_DROP;
+	int delay_us = 0;
+	long n_events = 0;
+	double duration = 0;
+
+	int opt;
+	while((opt = getopt(argc, argv, "hc:m:bd:n:t:")) != -1) {
+		switch(opt) {
+			case 'h': print_help();                  return 0;
+			case 'c': n_clients = atoi(optarg);      break;
+			case 'm': mask      = parse_mask(optarg); break;
+			case 'b': policy    = TDC_SERVER_BLOCK;  break;
+			case 'd': delay_us  = atoi(optarg);      break;
+			case 'n': n_events  = atol(optarg);      break;
+			case 't': duration  = atof(optarg);      break;
+			default:
+				fprintf(stderr, "use option -h for detailed help\n");
+				return 1;
+		}
+	}
+	if (optind >= argc || n_clients < 1 || n_clients > MAX_CLIENTS) {
+		print_help();
+		return 1;
+	}
+	const char *target = argv[optind];
+
+	tdc_server_t *server = NULL;
+	if (n_events > 0) {
+		server = tdc_server_start(target);
+		if (!server) {
+			return 1;
+		}
+	}
+
+	load_client_t clients[MAX_CLIENTS];
+	memset(clients, 0, sizeof(clients));
+	for (int i = 0; i < n_clients; ++i) {
+		load_client_t *load = &clients[i];
+		load->mask     = mask;
+		load->policy   = policy;
+		load->delay_us = i == n_clients-1 ? delay_us : 0;
+		load->client   = tdc_client_open(target, mask, policy);
+		if (!load->client) {
+			fprintf(stderr, "client %d cannot connect to %s\n", i, target);
+			return 1;
+		}
+		pthread_create(&load->thread, NULL, run_client, load);
+	}
+
+	if (server) {
+		publish_events(server, n_events);
+		tdc_server_stop(server, 10000);
+	} else if (duration > 0) {
+		usleep(duration*1e6);
+		stopping = 1;
+		for (int i = 0; i < n_clients; ++i) {
+			shutdown(clients[i].client->fd, SHUT_RDWR);
+		}
+	}
+
+	int failed = 0;
+	printf("client,mask,policy,events,dropped,batches,seconds,events_per_s,errors\n");
+	for (int i = 0; i < n_clients; ++i) {
+		load_client_t *load = &clients[i];
+		pthread_join(load->thread, NULL);
+		printf("%d,%x,%s,%lu,%lu,%lu,%.3f,%.1f,%lu\n", i, load->mask,
+			load->policy == TDC_SERVER_BLOCK ? "block" : "drop", load->events, load->dropped,
+			load->batches, load->seconds, load->events/load->seconds, load->errors);
+		if (load->errors) {
+			failed = 1;
+		}
+		if (server) {
+			unsigned long expected = 0;
+			for (long ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+				if (mask & (1<<ch)) {
+					expected += n_events/TDC_N_CHANNELS + (ch < n_events%TDC_N_CHANNELS);
+				}
+			}
+			if (load->events + load->dropped != expected) {
+				fprintf(stderr, "client %d: %lu events + %lu dropped, expected %lu\n",
+					i, load->events, load->dropped, expected);
+				failed = 1;
+			}
+		}
+	}
+	return failed;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "tdc_shm.h"
+
+static volatile int stop = 0;
+
+void handle_signal(int signal)
+{
+	stop = 1;
+}
+
+void print_help() {
+	printf("usage: tdc-shm <name> [options]\n");
+	printf("\n");
+	printf("Reads the events that tdc-ctl -P <name> publishes in shared memory and\n");
+	printf("prints them like tdc-ctl. Any number of tdc-shm can run at the same time.\n");
+	printf("\n");
+	printf("available options:\n");
+	printf("-o              start with the oldest event in the ring instead of the next one\n");
+	printf("-p <us>         poll interval when there is no event (default 100)\n");
+	printf("-l              list the producer and all consumers with lag and lost events\n");
+	printf("-q              don't print events, only the summary at the end\n");
+	printf("-h              print this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int start = TDC_SHM_START_NOW;
+	int poll_us = 100;
+	int list = 0;
+	int quiet = 0;
+
+	int opt;
+	while((opt = getopt(argc, argv, "hop:lq")) != -1) {
+		switch(opt) {
+			case 'h': print_help();                   return 0;
+			case 'o': start   = TDC_SHM_START_OLDEST; break;
+			case 'p': poll_us = atoi(optarg);         break;
+			case 'l': list    = 1;                    break;
+			case 'q': quiet   = 1;                    break;
+			default:
+				fprintf(stderr, "use option -h for detailed help\n");
+				return 1;
+		}
+	}
+	if (optind >= argc) {
+		print_help();
+		return 1;
+	}
+	const char *name = argv[optind];
+
+	if (list) {
+		if (!tdc_shm_list(stdout, name)) {
+			fprintf(stderr, "Cannot open event ring %s\n", name);
+			return 1;
+		}
+		return 0;
+	}
+
+	tdc_shm_reader_t *reader = tdc_shm_attach(name, start);
+	if (!reader) {
+		fprintf(stderr, "Cannot attach to event ring %s\n", name);
+		return 1;
+	}
+
+	signal(SIGINT,  handle_signal);
+	signal(SIGTERM, handle_signal);
+	unsigned long events = 0;
+	unsigned long overruns = 0;
+	tdc_event_t event;
+	while (!stop) {
+		int result = tdc_shm_read(reader, &event);
+		if (result == -1) {
+			break;
+		}
+		if (result == 0) {
+			usleep(poll_us);
+			continue;
+		}
+		++events;
+		if (reader->overruns != overruns) {
+			fprintf(stderr, "overrun: %lu events lost so far\n", reader->lost);
+			overruns = reader->overruns;
+		}
+		if (quiet) {
+			continue;
+		}
+		if (event.edge == TDC_EDGE_LOSS) {
+			printf("%d lost %lu words after %ld\n", event.channel, event.lost, event.time);
+			continue;
+		}
+		printf("%d %d %20ld     sample=0x%02x   dt=%ld\n",
+			event.channel, event.edge, event.time, event.sample, event.dt);
+	}
+	fprintf(stderr, "%lu events read, %lu lost in %lu overruns\n", events, reader->lost, reader->overruns);
+	tdc_shm_detach(reader);
+	return 0;
+}
@@ -0,0 +1,285 @@
+#include "tdc_control.h"
+#include "tdc_decoder.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+//////////////////////////////////////////
+// tdc::decoder has to give the same events and statistics as
+// tdc_next_event() on random streams with all kinds of damage
+//////////////////////////////////////////
+
+static const char *filename = "testdata_cxx.raw";
+
+struct collect_sink
+{
+	std::vector<tdc_event_t> events;
+
+	void edge(int channel, edge_t edge, std::uint64_t time, std::uint8_t sample, std::uint64_t dt, std::uint64_t tot)
+	{
+		tdc_event_t event = {};
+		event.channel = channel;
+		event.edge    = edge;
+		event.time    = time;
+		event.sample  = sample;
+		event.dt      = dt;
+		event.tot     = tot;
+		events.push_back(event);
+	}
+	void loss(int channel, std::uint64_t time, std::uint64_t lost)
+	{
+		tdc_event_t event = {};
+		event.channel = channel;
+		event.edge    = TDC_EDGE_LOSS;
+		event.time    = time;
+		event.lost    = lost;
+		events.push_back(event);
+	}
+};
+
+static void append_frame(std::vector<unsigned char> &stream, const raw_event_t &r)
+{
+	if (r.kind == TDC_RAW_PULSE) {
+		unsigned long long payload = ((unsigned long long)(r.channel&0x3)<<37)
+		                           | ((unsigned long long)(r.time&0xffffff)<<13)
+		                           | ((r.phase&0x7)<<10) | (r.tot&0x3ff);
+		stream.push_back(0x80 | (TDC_TYPE_PULSE<<4) | ((payload>>35)&0xf));
+		for (int shift = 28; shift >= 0; shift -= 7) {
+			stream.push_back((payload>>shift)&0x7f);
+		}
+		return;
+	}
+	if (r.kind == TDC_RAW_LOSS || r.kind == TDC_RAW_SYNC) {
+		int subtype = r.kind == TDC_RAW_SYNC ? TDC_CONTROL_SYNC : TDC_CONTROL_LOSS;
+		if (r.channel == TDC_TYPE_CONTROL) {
+			subtype = 0xf; // unknown subtype
+		}
+		unsigned long payload = ((unsigned long)(r.channel&0x3)<<26)
+		                      | ((r.kind == TDC_RAW_SYNC ? r.epoch : r.lost)&0x3ffffff);
+		stream.push_back(0x80 | (TDC_TYPE_CONTROL<<4) | subtype);
+		for (int shift = 21; shift >= 0; shift -= 7) {
+			stream.push_back((payload>>shift)&0x7f);
+		}
+		return;
+	}
+	stream.push_back(0x80 | ((r.channel&0x7)<<4) | (r.sample>>4));
+	stream.push_back(((r.sample&0xf)<<3) | ((r.time>>21)&0x7));
+	stream.push_back((r.time>>14)&0x7f);
+	stream.push_back((r.time>> 7)&0x7f);
+	stream.push_back( r.time     &0x7f);
+}
+
+// mostly plausible words with overflows, losses, syncs and invalid channels
+static raw_event_t random_word(unsigned long *time)
+{
+	raw_event_t r = {};
+	int ch = rand()%TDC_N_CHANNELS;
+	int dice = rand()%100;
+	if (dice < 2) {
+		time[ch] = 0;
+	} else if (dice < 3) {
+		time[ch] = rand()%100; // the overflow word was lost
+	} else {
+		time[ch] = (time[ch] + 1 + rand()%0x100000) & 0xffffff;
+	}
+	r.channel = ch;
+	r.time    = time[ch];
+	dice = rand()%100;
+	if (dice < 20) {
+		r.kind  = TDC_RAW_PULSE;
+		r.phase = rand()%8;
+		r.tot   = rand()%1024;
+	} else if (dice < 23) {
+		r.kind = TDC_RAW_LOSS;
+		r.lost = rand()%1000;
+	} else if (dice < 26) {
+		r.kind  = TDC_RAW_SYNC;
+		r.epoch = rand()%4;
+	} else if (dice < 27) {
+		r.kind    = TDC_RAW_LOSS;
+		r.channel = TDC_TYPE_CONTROL; // unknown control word
+	} else {
+		r.kind   = TDC_RAW_SAMPLE;
+		r.sample = rand()%4 ? rand() : (rand()%2 ? 0xff : 0x00);
+		if (rand()%100 == 0) {
+			r.channel = 5 + rand()%2; // impossible channel
+		}
+	}
+	return r;
+}
+
+static std::vector<unsigned char> random_frames(int n)
+{
+	std::vector<unsigned char> stream;
+	unsigned long time[TDC_N_CHANNELS] = {0,};
+	for (int i = 0; i < n; ++i) {
+		append_frame(stream, random_word(time));
+		int dice = rand()%100;
+		if (dice < 2) {
+			stream.push_back(rand()&0x7f); // garbage
+		} else if (dice < 3) {
+			stream.resize(stream.size()-1-rand()%3); // truncated frame
+		}
+	}
+	return stream;
+}
+
+static std::vector<unsigned char> random_blocks(int n)
+{
+	std::vector<unsigned char> stream;
+	unsigned long time[TDC_N_CHANNELS] = {0,};
+	raw_event_t records[TDC_BLOCK_MAX_RECORDS];
+	unsigned char block[TDC_BLOCK_MAX_SIZE];
+	while (n > 0) {
+		int count = 1 + rand()%64;
+		for (int i = 0; i < count; ++i) {
+			records[i] = random_word(time);
+		}
+		int size = pack_raw_block(records, count, block);
+		int dice = rand()%100;
+		if (dice < 3) {
+			block[3+rand()%(size-3)] ^= 1<<(rand()%8); // bad checksum
+		} else if (dice < 4) {
+			block[2] = 0; // empty block
+		} else if (dice < 6) {
+			stream.push_back(rand()); // garbage
+		}
+		stream.insert(stream.end(), block, block+size);
+		n -= count;
+	}
+	return stream;
+}
+
+static void write_file(const std::vector<unsigned char> &stream)
+{
+	int fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	assert(fd != -1);
+	assert(write(fd, stream.data(), stream.size()) == (long)stream.size());
+	close(fd);
+}
+
+static std::vector<tdc_event_t> c_events(tdc_format_t format, long offset, tdc_stats_t *stats)
+{
+	std::vector<tdc_event_t> events;
+	tdc_t *tdc = tdc_open(filename);
+	assert(tdc);
+	tdc->format = format; // a file can't take the mode register write
+	if (offset) {
+		assert(tdc_seek(tdc, offset));
+	}
+	for (;;) {
+		tdc_event_t event = tdc_next_event(tdc);
+		if (event.channel == -1) {
+			break;
+		}
+		events.push_back(event);
+	}
+	*stats = tdc->stats;
+	tdc_close(tdc);
+	return events;
+}
+
+// feeds the stream in random chunks
+template <int Channels>
+static std::vector<tdc_event_t> cxx_events(const std::vector<unsigned char> &stream, tdc_format_t format,
+                                           long offset, tdc_stats_t *stats)
+{
+	collect_sink sink;
+	tdc::decoder<collect_sink, Channels> decoder(sink, format);
+	if (offset) {
+		decoder.resync();
+	}
+	for (size_t pos = offset; pos < stream.size(); ) {
+		size_t size = 1 + rand()%700;
+		if (size > stream.size()-pos) {
+			size = stream.size()-pos;
+		}
+		decoder.feed(stream.data()+pos, size);
+		pos += size;
+	}
+	*stats = decoder.stats();
+	return sink.events;
+}
+
+static void compare_events(const std::vector<tdc_event_t> &a, const std::vector<tdc_event_t> &b)
+{
+	assert(a.size() == b.size());
+	for (size_t i = 0; i < a.size(); ++i) {
+		assert(a[i].channel == b[i].channel);
+		assert(a[i].edge    == b[i].edge);
+		assert(a[i].time    == b[i].time);
+		assert(a[i].sample  == b[i].sample);
+		assert(a[i].dt      == b[i].dt);
+		assert(a[i].lost    == b[i].lost);
+		assert(a[i].tot     == b[i].tot);
+	}
+}
+
+static void compare_stats(const tdc_stats_t &a, const tdc_stats_t &b)
+{
+	assert(a.bytes            == b.bytes);
+	assert(a.resync_bytes     == b.resync_bytes);
+	assert(a.truncated_frames == b.truncated_frames);
+	assert(a.invalid_frames   == b.invalid_frames);
+	assert(a.invalid_blocks   == b.invalid_blocks);
+	assert(a.unsynced_words   == b.unsynced_words);
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		assert(a.frames[ch]         == b.frames[ch]);
+		assert(a.edges[ch][0]       == b.edges[ch][0]);
+		assert(a.edges[ch][1]       == b.edges[ch][1]);
+		assert(a.overflows[ch]      == b.overflows[ch]);
+		assert(a.lost_words[ch]     == b.lost_words[ch]);
+		assert(a.syncs[ch]          == b.syncs[ch]);
+		assert(a.repaired_wraps[ch] == b.repaired_wraps[ch]);
+	}
+}
+
+static void run_compare_test(tdc_format_t format, unsigned seed)
+{
+	srand(seed);
+	std::vector<unsigned char> stream = format == TDC_FORMAT_BLOCKS ? random_blocks(20000) : random_frames(20000);
+	write_file(stream);
+
+	tdc_stats_t c_stats, cxx_stats;
+	std::vector<tdc_event_t> expected = c_events(format, 0, &c_stats);
+	compare_events(expected, cxx_events<TDC_N_CHANNELS>(stream, format, 0, &cxx_stats));
+	compare_stats(c_stats, cxx_stats);
+	assert(expected.size() > 10000);
+
+	// start in the middle like tdc_seek()
+	long offset = stream.size()/3;
+	compare_events(c_events(format, offset, &c_stats), cxx_events<TDC_N_CHANNELS>(stream, format, offset, &cxx_stats));
+	compare_stats(c_stats, cxx_stats);
+
+	// with two channels the words of channel 2 and 3 are invalid, the
+	// others decode like before
+	std::vector<tdc_event_t> two_channels;
+	for (const tdc_event_t &event : expected) {
+		if (event.channel < 2) {
+			two_channels.push_back(event);
+		}
+	}
+	c_events(format, 0, &c_stats);
+	compare_events(two_channels, cxx_events<2>(stream, format, 0, &cxx_stats));
+	assert(cxx_stats.invalid_frames == c_stats.invalid_frames + c_stats.frames[2] + c_stats.frames[3]);
+
+	printf("decoder test %s seed %u: %zu events, %lu invalid frames, %lu invalid blocks, %lu resync bytes\n",
+		format == TDC_FORMAT_BLOCKS ? "blocks" : "frames", seed, expected.size(),
+		c_stats.invalid_frames, c_stats.invalid_blocks, c_stats.resync_bytes);
+}
+
+int main()
+{
+	for (unsigned seed = 1; seed <= 5; ++seed) {
+		run_compare_test(TDC_FORMAT_FRAMES, seed);
+		run_compare_test(TDC_FORMAT_BLOCKS, seed);
+	}
+	unlink(filename);
+	printf("All decoder tests passed!\n");
+	return 0;
+}
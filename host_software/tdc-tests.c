@@ -1,10 +1,24 @@
 #include "tdc_control.h"
+#include "tdc_emulator.h"
+#include "tdc_histogram.h"
+#include "tdc_shm.h"
+#include "tdc_server.h"
+#include "tdc_realtime.h"
+#include "tdc_index.h"
+#include "tdc_batch.h"
+#include "tdc_walk.h"
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 void write_raw_event(int fd, int channel, int timestamp, unsigned char sample)
 {
@@ -18,6 +32,16 @@ void write_raw_event(int fd, int channel, int timestamp, unsigned char sample)
 	 write(fd, data, 5);
 }
 
+void write_control_frame(int fd, int subtype, int channel, unsigned long value)
+{
+	unsigned long payload = ((unsigned long)(channel&0x3)<<26) | (value&0x3ffffff);
+	unsigned char data[5] = {
+		0x80 | (TDC_TYPE_CONTROL<<4) | (subtype&0xf),
+		(payload>>21)&0x7f, (payload>>14)&0x7f, (payload>>7)&0x7f, payload&0x7f
+	};
+	write(fd, data, 5);
+}
+
 char* sample_to_text(unsigned char ch, unsigned long time, int edge)
 {
 	static char str_out[9] = {0,};
@@ -107,12 +131,1286 @@ void run_pulser_test(int channel, int pulse_length, int n_pulses) {
 	tdc_close(tdc);
 }
 
+void *fill_histogram(void *arg)
+{
+	tdc_hist_t *hist = arg;
+	int shard = tdc_hist_add_shard(hist);
+	for (int i = 0; i < 100000; ++i) {
+		tdc_hist_fill(hist, shard, i%12 - 1); // -1 .. 10
+	}
+	return NULL;
+}
+
+// fill from several threads and merge the shards
+void run_histogram_test() {
+	pthread_t threads[4];
+	tdc_hist_t *hist = tdc_hist_new("test", TDC_HIST_FIXED, 5, 0, 10);
+	for (int i = 0; i < 4; ++i) {
+		pthread_create(&threads[i], NULL, fill_histogram, hist);
+	}
+	for (int i = 0; i < 4; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	unsigned long counts[7];
+	tdc_hist_merge(hist, counts);
+	unsigned long n = 100000/12; // number of full -1..10 cycles per thread
+	assert(counts[0] >= 4*n && counts[0] <= 4*(n+1));      // -1
+	assert(counts[1] >= 8*n && counts[1] <= 8*(n+1));      // 0,1
+	assert(counts[5] >= 8*n && counts[5] <= 8*(n+1));      // 8,9
+	assert(counts[6] >= 4*n && counts[6] <= 4*(n+1));      // 10
+	assert(tdc_hist_lower_edge(hist, 1) == 2);
+	tdc_hist_free(hist);
+
+	hist = tdc_hist_new("log", TDC_HIST_LOG, 3, 1, 1000);
+	int shard = tdc_hist_add_shard(hist);
+	tdc_hist_fill(hist, shard, 5);
+	tdc_hist_fill(hist, shard, 50);
+	tdc_hist_fill(hist, shard, 500);
+	tdc_hist_fill(hist, shard, 0);
+	tdc_hist_merge(hist, counts);
+	assert(counts[0] == 1 && counts[1] == 1 && counts[2] == 1 && counts[3] == 1 && counts[4] == 0);
+	tdc_hist_free(hist);
+
+	// monitor with the pulser data: all pulses have the same ToT
+	int fd = open("testdata.raw", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	pulser(fd, 1, 10000001, 101, 100);
+	close(fd);
+	tdc_monitor_t *monitor = tdc_monitor_new();
+	tdc_monitor_shard_t monitor_shard;
+	assert(tdc_monitor_add_shard(monitor, &monitor_shard));
+	tdc_t *tdc = tdc_open("testdata.raw");
+	for (;;) {
+		tdc_event_t event = tdc_next_event(tdc);
+		if (event.channel == -1) {
+			break;
+		}
+		tdc_monitor_fill(&monitor_shard, &event);
+	}
+	tdc_close(tdc);
+	unsigned long tot[1026];
+	tdc_hist_merge(monitor->tot[1], tot);
+	assert(tot[1+101/4] == 100); // 4 ns bins
+
+	// one shard per filling thread, up to TDC_HIST_MAX_SHARDS
+	tdc_monitor_shard_t extra_shard;
+	for (int i = 1; i < TDC_HIST_MAX_SHARDS; ++i) {
+		assert(tdc_monitor_add_shard(monitor, &extra_shard));
+	}
+	assert(!tdc_monitor_add_shard(monitor, &extra_shard));
+
+	// snapshots on a socket: a client that doesn't read doesn't hold up
+	// the next one. The standard snapshot fits into the socket buffer,
+	// a wider tot histogram makes it a few MB, so the send to the stalled
+	// client really blocks.
+	tdc_hist_free(monitor->tot[0]);
+	monitor->tot[0] = tdc_hist_new("tot_ch0", TDC_HIST_FIXED, 1<<18, 0, 1<<20);
+	assert(tdc_monitor_start(monitor, "unix:tdc-tests-hist.sock", 0.05));
+	struct sockaddr_un addr = {.sun_family = AF_UNIX, .sun_path = "tdc-tests-hist.sock"};
+	int stalled = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert(connect(stalled, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+	int reader = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert(connect(reader, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+	struct timeval timeout = {.tv_sec = 2};
+	setsockopt(reader, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	char buffer[4096];
+	long received = 0, count;
+	while ((count = read(reader, buffer, sizeof(buffer))) > 0) {
+		if (received == 0) {
+			assert(strncmp(buffer, "histogram tot_ch0", 17) == 0);
+		}
+		received += count;
+	}
+	assert(count == 0 && received > 0); // the end of the snapshot, not the timeout
+	close(reader);
+	close(stalled);
+	tdc_monitor_free(monitor);
+}
+
+// corrupted input is skipped and shows up in the statistics
+void run_stats_test() {
+	int fd = open("testdata.raw", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	unsigned char garbage[3] = {0x12, 0x34, 0x56};
+	write(fd, garbage, 3);                  // 3 resync bytes
+	write_raw_event(fd, 1, 100, 0xff);      // rising edge
+	write(fd, garbage, 2);                  // 2 resync bytes
+	write_raw_event(fd, 5, 200, 0x00);      // invalid channel
+	unsigned char truncated[2] = {0x90, 0x01};
+	write(fd, truncated, 2);                // truncated frame
+	write_raw_event(fd, 1, 300, 0x0f);      // falling and rising edge
+	write_raw_event(fd, 1,   0, 0xff);      // counter overflow, no edge
+	write_raw_event(fd, 2,  50, 0x00);      // no edge
+	close(fd);
+
+	tdc_t *tdc = tdc_open("testdata.raw");
+	int n_events = 0;
+	while (tdc_next_event(tdc).channel != -1) {
+		++n_events;
+	}
+	tdc_stats_t stats;
+	tdc_get_stats(tdc, &stats);
+	assert(n_events == 3);
+	assert(stats.bytes == 3+5+2+5+2+5+5+5);
+	assert(stats.resync_bytes == 5);
+	assert(stats.invalid_frames == 1);
+	assert(stats.truncated_frames == 1);
+	assert(stats.frames[1] == 3 && stats.frames[2] == 1);
+	assert(stats.edges[1][TDC_EDGE_RISING]  == 2);
+	assert(stats.edges[1][TDC_EDGE_FALLING] == 1);
+	assert(stats.overflows[1] == 1);
+	assert(stats.inconsistent_samples == 0);
+	tdc_close(tdc);
+}
+
+// the same records as 5 byte frames and as blocks give the same events,
+// the blocks need at least 10% less link bandwidth
+void run_block_test() {
+	raw_event_t records[1000], unpacked[TDC_BLOCK_MAX_RECORDS];
+	unsigned char block[TDC_BLOCK_MAX_SIZE];
+	long time[TDC_N_CHANNELS] = {0,};
+	int level[TDC_N_CHANNELS] = {0,};
+	srand(42);
+	for (int i = 0; i < 1000; ++i) {
+		int ch = rand()%TDC_N_CHANNELS;
+		time[ch] += 1 + rand()%1000;
+		records[i].channel = ch;
+		records[i].time    = time[ch];
+		records[i].sample  = level[ch] ? 0xff>>(rand()%8) : ~(0xff>>(rand()%8));
+		records[i].kind    = TDC_RAW_SAMPLE;
+		level[ch] = records[i].sample&0x01;
+	}
+
+	// round trip for all block sizes
+	for (int count = 1; count <= TDC_BLOCK_MAX_RECORDS; ++count) {
+		int size = pack_raw_block(records, count, block);
+		assert(size == 3+TDC_BLOCK_PAYLOAD_SIZE(count)+1);
+		assert(block[0] == TDC_BLOCK_SYNC_0 && block[1] == TDC_BLOCK_SYNC_1 && block[2] == count);
+		assert(unpack_raw_block(block+3, count, unpacked) == size-4);
+		for (int i = 0; i < count; ++i) {
+			assert(unpacked[i].channel == records[i].channel);
+			assert(unpacked[i].time    == records[i].time);
+			assert(unpacked[i].sample  == records[i].sample);
+		}
+	}
+
+	// pulse records have 42 bits
+	raw_event_t mixed[3] = {records[0], records[1], records[2]};
+	mixed[1].kind  = TDC_RAW_PULSE;
+	mixed[1].phase = 5;
+	mixed[1].tot   = 1000;
+	int size = pack_raw_block(mixed, 3, block);
+	assert(size == 3+(35+42+35+7)/8+1);
+	assert(unpack_raw_block(block+3, 3, unpacked) == size-4);
+	assert(unpacked[1].kind == TDC_RAW_PULSE && unpacked[1].channel == mixed[1].channel);
+	assert(unpacked[1].time == mixed[1].time && unpacked[1].phase == 5 && unpacked[1].tot == 1000);
+	assert(unpacked[2].kind == TDC_RAW_SAMPLE && unpacked[2].sample == mixed[2].sample);
+
+	int fd = open("testdata.raw", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	for (int i = 0; i < 1000; ++i) {
+		write_raw_event(fd, records[i].channel, records[i].time, records[i].sample);
+	}
+	close(fd);
+	tdc_event_t events[2000];
+	int n_events = 0;
+	tdc_t *tdc = tdc_open("testdata.raw");
+	for (;;) {
+		tdc_event_t event = tdc_next_event(tdc);
+		if (event.channel == -1) {
+			break;
+		}
+		assert(n_events < 2000);
+		events[n_events++] = event;
+	}
+	unsigned long frame_bytes = tdc->stats.bytes;
+	tdc_close(tdc);
+
+	fd = open("testdata.raw", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	unsigned char garbage[3] = {0x12, TDC_BLOCK_SYNC_0, 0x56};
+	write(fd, garbage, 3);                  // 3 resync bytes
+	for (int i = 0; i < 1000; i += TDC_EMU_BLOCK_RECORDS) {
+		int count = 1000-i < TDC_EMU_BLOCK_RECORDS ? 1000-i : TDC_EMU_BLOCK_RECORDS;
+		write(fd, block, pack_raw_block(&records[i], count, block));
+	}
+	size = pack_raw_block(records, 10, block);
+	block[5] ^= 0x01;
+	write(fd, block, size);                 // bad checksum
+	close(fd);
+	tdc = tdc_open("testdata.raw");
+	tdc->format = TDC_FORMAT_BLOCKS; // a file can't take the mode register write
+	for (int i = 0; i < n_events; ++i) {
+		tdc_event_t event = tdc_next_event(tdc);
+		assert(event.channel == events[i].channel);
+		assert(event.time    == events[i].time);
+		assert(event.edge    == events[i].edge);
+	}
+	assert(tdc_next_event(tdc).channel == -1);
+	tdc_stats_t stats;
+	tdc_get_stats(tdc, &stats);
+	assert(stats.resync_bytes == 3);
+	assert(stats.invalid_blocks == 1);
+	unsigned long block_bytes = stats.bytes - 3 - size;
+	printf("block test: %d events, %lu bytes as frames, %lu bytes as blocks\n",
+		n_events, frame_bytes, block_bytes);
+	assert(10*block_bytes < 9*frame_bytes);
+	tdc_close(tdc);
+}
+
+// loss markers become loss events, and the decoder doesn't make up an
+// edge between the last sample before the loss and the first one after
+void run_loss_test() {
+	int fd = open("testdata.raw", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	write_raw_event(fd, 1, 100, 0x0f);      // rising edge
+	write_control_frame(fd, TDC_CONTROL_LOSS, 1, 7);
+	write_raw_event(fd, 1, 300, 0x00);      // low after the loss, no edge
+	write_control_frame(fd, 0xf, 0, 0);     // unknown control frame
+	write_raw_event(fd, 1, 400, 0xf0);      // rising and falling edge
+	close(fd);
+
+	tdc_t *tdc = tdc_open("testdata.raw");
+	tdc_event_t event = tdc_next_event(tdc);
+	assert(event.channel == 1 && event.edge == TDC_EDGE_RISING && event.time == 100*8+4);
+	event = tdc_next_event(tdc);
+	assert(event.channel == 1 && event.edge == TDC_EDGE_LOSS && event.lost == 7);
+	event = tdc_next_event(tdc);
+	assert(event.channel == 1 && event.edge == TDC_EDGE_RISING && event.time == 400*8);
+	event = tdc_next_event(tdc);
+	assert(event.channel == 1 && event.edge == TDC_EDGE_FALLING && event.time == 400*8+4);
+	assert(tdc_next_event(tdc).channel == -1);
+	assert(tdc->stats.lost_words[1] == 7);
+	assert(tdc->stats.invalid_frames == 1);
+	tdc_close(tdc);
+
+	// loss records in blocks have 35 bits
+	raw_event_t records[2] = {
+		{.channel = 2, .kind = TDC_RAW_LOSS, .lost = 0x3ffffff},
+		{.channel = 3, .time = 1234, .sample = 0x3f, .kind = TDC_RAW_SAMPLE},
+	}, unpacked[2];
+	unsigned char block[TDC_BLOCK_MAX_SIZE];
+	int size = pack_raw_block(records, 2, block);
+	assert(size == 3+TDC_BLOCK_PAYLOAD_SIZE(2)+1);
+	assert(unpack_raw_block(block+3, 2, unpacked) == size-4);
+	assert(unpacked[0].kind == TDC_RAW_LOSS && unpacked[0].channel == 2 && unpacked[0].lost == 0x3ffffff);
+	assert(unpacked[1].kind == TDC_RAW_SAMPLE && unpacked[1].channel == 3 && unpacked[1].time == 1234);
+
+	// an emulator with a slow link drops records, what arrives is still consistent
+	for (int format = TDC_FORMAT_FRAMES; format <= TDC_FORMAT_BLOCKS; ++format) {
+		tdc_emu_config_t config;
+		tdc_emu_default_config(&config);
+		config.rate        = 200000;
+		config.pulse_width = 101;
+		config.packet_size = 64;
+		tdc_emu_t *emu = tdc_emu_open(&config);
+		assert(emu);
+		assert(tdc_emu_start(emu));
+		tdc = tdc_open(emu->slave_name);
+		assert(tdc);
+		tdc_set_format(tdc, format);
+		tdc_enable_channels(tdc, TDC_CH0 | TDC_CH2);
+
+		int rising[TDC_N_CHANNELS] = {0,}; // -1: unknown after a loss
+		unsigned long lost = 0, n_losses = 0;
+		for (int i = 0; i < 20000; ++i) {
+			event = tdc_next_event(tdc);
+			assert(event.channel == 0 || event.channel == 2);
+			int ch = event.channel;
+			if (event.edge == TDC_EDGE_LOSS) {
+				assert(event.lost > 0);
+				lost += event.lost;
+				++n_losses;
+				rising[ch] = -1;
+			} else if (event.edge == TDC_EDGE_RISING) {
+				assert(rising[ch] != 1);
+				rising[ch] = 1;
+			} else {
+				assert(rising[ch] != 0);
+				if (rising[ch] == 1) {
+					assert(event.dt == config.pulse_width);
+				}
+				rising[ch] = 0;
+			}
+		}
+		assert(n_losses > 0);
+		assert(lost == tdc->stats.lost_words[0] + tdc->stats.lost_words[2]);
+		assert(lost <= emu->frames_dropped);
+		printf("loss test: %lu loss events, %lu words lost, %lu frames sent, %lu dropped\n",
+			n_losses, lost, emu->frames_sent, emu->frames_dropped);
+		tdc_close(tdc);
+		tdc_emu_close(emu);
+	}
+}
+
+// sync frames give the epoch, missed counter overflows are repaired
+// and decoding can start in the middle of a capture
+void run_sync_test() {
+	int fd = open("testdata.raw", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	write_control_frame(fd, TDC_CONTROL_SYNC, 1, 5);
+	write_raw_event(fd, 1, 0x900000, 0x0f); // rising edge in epoch 5
+	write_raw_event(fd, 1, 0x000100, 0xf0); // overflow frame lost, falling edge in epoch 6
+	write_control_frame(fd, TDC_CONTROL_SYNC, 1, 6);
+	write_control_frame(fd, TDC_CONTROL_SYNC, 1, 9); // three overflows missed
+	write_raw_event(fd, 1, 0x000010, 0x0f); // rising edge in epoch 9
+	write_raw_event(fd, 1, 0,        0xff); // counter overflow
+	write_raw_event(fd, 1, 0x000005, 0x00); // falling edge in epoch 10
+	close(fd);
+
+	unsigned long expected[4] = {
+		((5UL<<24) + 0x900000)*8 + 4, ((6UL<<24) + 0x100)*8 + 4,
+		((9UL<<24) + 0x10)*8 + 4,     ((10UL<<24) + 0x5)*8,
+	};
+	tdc_t *tdc = tdc_open("testdata.raw");
+	for (int i = 0; i < 4; ++i) {
+		tdc_event_t event = tdc_next_event(tdc);
+		assert(event.channel == 1 && event.time == expected[i]);
+		assert(event.edge == (i%2 ? TDC_EDGE_FALLING : TDC_EDGE_RISING));
+	}
+	assert(tdc_next_event(tdc).channel == -1);
+	assert(tdc->stats.syncs[1] == 3);
+	assert(tdc->stats.repaired_wraps[1] == 3);
+	assert(tdc->stats.overflows[1] == 2);
+
+	// start in the middle of the second frame, the channel is 
+	// unsynced until the first sync frame
+	assert(tdc_seek(tdc, 7));
+	for (int i = 2; i < 4; ++i) {
+		tdc_event_t event = tdc_next_event(tdc);
+		assert(event.channel == 1 && event.time == expected[i]);
+	}
+	assert(tdc_next_event(tdc).channel == -1);
+	assert(tdc->stats.unsynced_words == 1);
+	assert(tdc->stats.resync_bytes == 3);
+	tdc_close(tdc);
+}
+
+tdc_event_t shm_test_event(unsigned long i)
+{
+	tdc_event_t event = {0,};
+	event.channel = i%TDC_N_CHANNELS;
+	event.edge    = i%2 ? TDC_EDGE_FALLING : TDC_EDGE_RISING;
+	event.time    = i;
+	event.dt      = 3*i;
+	return event;
+}
+
+#define SHM_TEST_EVENTS 2000000
+
+void *shm_producer(void *arg)
+{
+	tdc_shm_t *shm = arg;
+	for (unsigned long i = 0; i < SHM_TEST_EVENTS; ++i) {
+		tdc_event_t event = shm_test_event(i);
+		tdc_shm_publish(shm, &event);
+	}
+	tdc_shm_close(shm);
+	return NULL;
+}
+
+// every event read is complete and in order, what a slow reader
+// misses is counted as lost
+typedef struct {
+	tdc_shm_reader_t *reader;
+	int               slow;
+	unsigned long     read;
+} shm_consumer_t;
+
+void *shm_consumer(void *arg)
+{
+	shm_consumer_t *consumer = arg;
+	tdc_shm_reader_t *reader = consumer->reader;
+	unsigned long read = 0, next = 0;
+	tdc_event_t event;
+	while (tdc_shm_read_wait(reader, &event, 10) == 1) {
+		assert(event.time >= next);
+		assert(event.dt == 3*event.time && event.channel == event.time%TDC_N_CHANNELS);
+		next = event.time+1;
+		++read;
+		if (consumer->slow && read%1024 == 0) {
+			usleep(100);
+		}
+	}
+	assert(read + reader->lost == SHM_TEST_EVENTS);
+	consumer->read = read;
+	return NULL;
+}
+
+// pulses are filtered by deadtime, ToT and prescaler, before the events are built
+void run_filter_test() {
+	// {gap before the pulse, width} in ns on channel 2
+	long pulses[10][2] = {
+		{1000, 100}, {50, 100},  // the second one starts in the deadtime
+		{1000, 3}, {1000, 5000}, // too short, too long
+		{1000, 100}, {1000, 100}, {1000, 100}, {1000, 100}, {1000, 100}, {1000, 100},
+	};
+	int fd = open("testdata.raw", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	for (int i = 0; i < 10; ++i) {
+		write_nanosecond_event(fd, 2, pulses[i][0], i == 0);
+		write_nanosecond_event(fd, 2, pulses[i][1], 0);
+		write_raw_event(fd, 1, 100*i, i%2 ? 0x00 : 0xff); // not filtered
+	}
+	close(fd);
+
+	unsigned long rise[10], fall[10];
+	tdc_t *tdc = tdc_open("testdata.raw");
+	for (int i = 0; i < 10; ) {
+		tdc_event_t event = tdc_next_event(tdc);
+		assert(event.channel != -1);
+		if (event.channel == 2 && event.edge == TDC_EDGE_RISING) {
+			rise[i] = event.time;
+		} else if (event.channel == 2) {
+			fall[i++] = event.time;
+		}
+	}
+	tdc_close(tdc);
+
+	tdc_filter_t filter = {0,};
+	filter.deadtime   = 500;
+	filter.min_tot    = 10;
+	filter.max_tot    = 2000;
+	filter.prescale_n = 1; // P4 and P5 are the first two pulses after P0 that are left
+	filter.prescale_m = 2;
+	int kept[4] = {0, 5, 7, 9};
+	for (int polarity = TDC_POLARITY_BOTH; polarity <= TDC_POLARITY_FALLING; ++polarity) {
+		filter.polarity = polarity;
+		tdc = tdc_open("testdata.raw");
+		tdc_set_filter(tdc, 2, &filter);
+		int n = 0, n_other = 0;
+		unsigned long previous = 0;
+		for (;;) {
+			tdc_event_t event = tdc_next_event(tdc);
+			if (event.channel == -1) {
+				break;
+			}
+			if (event.channel != 2) {
+				++n_other;
+				continue;
+			}
+			int pulse = kept[polarity == TDC_POLARITY_BOTH ? n/2 : n];
+			int rising = polarity == TDC_POLARITY_BOTH ? n%2 == 0 : polarity == TDC_POLARITY_RISING;
+			assert(event.edge == (rising ? TDC_EDGE_RISING : TDC_EDGE_FALLING));
+			assert(event.time == (rising ? rise[pulse] : fall[pulse]));
+			assert(event.dt == event.time - previous); // dt to the previous returned event
+			assert(event.tot == (rising ? 0 : fall[pulse]-rise[pulse])); // also without the rising edge
+			previous = event.time;
+			++n;
+		}
+		assert(n == (polarity == TDC_POLARITY_BOTH ? 8 : 4));
+		assert(n_other == 10);
+		assert(tdc->stats.filter_passed[2]    == (unsigned long)n);
+		assert(tdc->stats.filter_deadtime[2]  == 2);
+		assert(tdc->stats.filter_tot[2]       == 4);
+		assert(tdc->stats.filter_prescaled[2] == 6);
+		assert(tdc->stats.filter_polarity[2]  == (polarity == TDC_POLARITY_BOTH ? 0 : 4));
+		assert(tdc->stats.filter_passed[1] == 0);
+		tdc_close(tdc);
+	}
+
+	// pulse records: the ToT is known right away
+	raw_event_t records[3] = {{0,}};
+	for (int i = 0; i < 3; ++i) {
+		records[i].kind    = TDC_RAW_PULSE;
+		records[i].channel = 3;
+		records[i].time    = 1000*(i+1);
+		records[i].phase   = i;
+		records[i].tot     = i == 1 ? 3 : 200;
+	}
+	unsigned char block[TDC_BLOCK_MAX_SIZE];
+	fd = open("testdata.raw", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	write(fd, block, pack_raw_block(records, 3, block));
+	close(fd);
+	tdc = tdc_open("testdata.raw");
+	tdc->format = TDC_FORMAT_BLOCKS; // a file can't take the mode register write
+	memset(&filter, 0, sizeof(filter));
+	filter.min_tot = 10;
+	tdc_set_filter(tdc, 3, &filter);
+	for (int i = 0; i < 3; i += 2) {
+		unsigned long fall_time = records[i].time*8 + records[i].phase;
+		tdc_event_t event = tdc_next_event(tdc);
+		assert(event.channel == 3 && event.edge == TDC_EDGE_RISING && event.time == fall_time-200);
+		event = tdc_next_event(tdc);
+		assert(event.channel == 3 && event.edge == TDC_EDGE_FALLING && event.time == fall_time);
+		assert(event.dt == 200 && event.tot == 200);
+	}
+	assert(tdc_next_event(tdc).channel == -1);
+	assert(tdc->stats.filter_tot[3] == 2 && tdc->stats.filter_passed[3] == 4);
+	tdc_close(tdc);
+}
+
+// events published in shared memory for several readers
+void run_shm_test() {
+	const char *name = "/tdc-tests";
+	tdc_shm_t *shm = tdc_shm_create(name, 1000);
+	assert(shm && shm->mask == 1023);
+
+	// a reader that starts with the oldest event reads all events, one that
+	// attaches later only the new ones
+	tdc_shm_reader_t *oldest = tdc_shm_attach(name, TDC_SHM_START_OLDEST);
+	assert(oldest);
+	for (unsigned long i = 0; i < 100; ++i) {
+		tdc_event_t event = shm_test_event(i);
+		tdc_shm_publish(shm, &event);
+	}
+	tdc_shm_reader_t *now = tdc_shm_attach(name, TDC_SHM_START_NOW);
+	tdc_event_t event = shm_test_event(100);
+	tdc_shm_publish(shm, &event);
+	assert(tdc_shm_lag(oldest) == 101 && tdc_shm_lag(now) == 1);
+	for (unsigned long i = 0; i <= 100; ++i) {
+		assert(tdc_shm_read(oldest, &event) == 1 && event.time == i && event.dt == 3*i);
+	}
+	assert(tdc_shm_read(oldest, &event) == 0);
+	assert(tdc_shm_read(now, &event) == 1 && event.time == 100);
+	assert(tdc_shm_read(now, &event) == 0);
+
+	// overrun: the reader continues half a ring behind the producer
+	for (unsigned long i = 101; i < 5101; ++i) {
+		event = shm_test_event(i);
+		tdc_shm_publish(shm, &event);
+	}
+	assert(tdc_shm_read(now, &event) == 1 && event.time == 5101-512);
+	assert(now->overruns == 1 && now->lost == 5101-512-101);
+	assert(now->consumer->lost == now->lost);
+	tdc_shm_detach(now);
+
+	// all consumer entries taken, a detached entry is reused
+	tdc_shm_reader_t *readers[TDC_SHM_MAX_CONSUMERS];
+	for (int i = 1; i < TDC_SHM_MAX_CONSUMERS; ++i) {
+		readers[i] = tdc_shm_attach(name, TDC_SHM_START_NOW);
+		assert(readers[i]);
+	}
+	assert(tdc_shm_attach(name, TDC_SHM_START_NOW) == NULL);
+	tdc_shm_detach(readers[5]);
+	readers[5] = tdc_shm_attach(name, TDC_SHM_START_NOW);
+	assert(readers[5]);
+	for (int i = 1; i < TDC_SHM_MAX_CONSUMERS; ++i) {
+		tdc_shm_detach(readers[i]);
+	}
+	tdc_shm_detach(oldest);
+	tdc_shm_close(shm);
+	assert(tdc_shm_attach(name, TDC_SHM_START_NOW) == NULL);
+
+	// concurrent producer and readers
+	shm = tdc_shm_create(name, 1<<12);
+	pthread_t producer, threads[4];
+	shm_consumer_t consumers[4];
+	for (int i = 0; i < 4; ++i) {
+		consumers[i].reader = tdc_shm_attach(name, TDC_SHM_START_OLDEST);
+		consumers[i].slow   = i == 3;
+		assert(consumers[i].reader);
+		pthread_create(&threads[i], NULL, shm_consumer, &consumers[i]);
+	}
+	pthread_create(&producer, NULL, shm_producer, shm);
+	pthread_join(producer, NULL);
+	for (int i = 0; i < 4; ++i) {
+		pthread_join(threads[i], NULL);
+		tdc_shm_reader_t *reader = consumers[i].reader;
+		printf("shm test: reader %d read %lu events, lost %lu in %lu overruns\n",
+			i, consumers[i].read, reader->lost, reader->overruns);
+		tdc_shm_detach(reader);
+	}
+	assert(consumers[3].read < SHM_TEST_EVENTS); // the slow reader fell behind
+}
+
+typedef struct {
+	tdc_client_t *client;
+	unsigned      mask;
+	int           slow;
+	unsigned long read;
+	unsigned long dropped;
+} server_client_t;
+
+void *server_client(void *arg)
+{
+	server_client_t *test = arg;
+	unsigned long next[TDC_N_CHANNELS] = {0,};
+	uint64_t batches = test->client->batches;
+	tdc_event_t event;
+	int result;
+	while ((result = tdc_client_next(test->client, &event)) == 1) {
+		assert(test->mask & (1<<event.channel));
+		assert(event.time >= next[event.channel]);
+		if (event.time%1000 == 999) {
+			assert(event.edge == TDC_EDGE_LOSS && event.lost == 3*event.time && event.dt == 0);
+		} else {
+			assert(event.edge == (event.time%2 ? TDC_EDGE_FALLING : TDC_EDGE_RISING));
+			assert(event.dt == 3*event.time && event.lost == 0);
+			assert(event.tot == (event.edge == TDC_EDGE_FALLING ? event.time%500 : 0));
+		}
+		next[event.channel] = event.time+1;
+		++test->read;
+		if (test->slow && test->client->batches != batches) {
+			batches = test->client->batches;
+			usleep(2000);
+		}
+	}
+	assert(result == 0);
+	test->dropped = test->client->dropped;
+	tdc_client_close(test->client);
+	return NULL;
+}
+
+// events streamed to local clients with channel masks, blocking
+// clients get every event, slow dropping clients know what they missed
+void run_server_test() {
+	const char *target = "unix:tdc-tests.sock";
+	tdc_server_t *server = tdc_server_start(target);
+	assert(server);
+	server_client_t clients[4] = {
+		{NULL, 0xf, 0}, {NULL, 0x5, 0}, {NULL, 0x8, 0}, {NULL, 0xf, 1},
+	};
+	int policies[4] = {TDC_SERVER_BLOCK, TDC_SERVER_BLOCK, TDC_SERVER_DROP, TDC_SERVER_DROP};
+	pthread_t threads[4];
+	for (int i = 0; i < 4; ++i) {
+		clients[i].client = tdc_client_open(target, clients[i].mask, policies[i]);
+		assert(clients[i].client);
+		pthread_create(&threads[i], NULL, server_client, &clients[i]);
+	}
+	const unsigned long n_events = 1000000;
+	for (unsigned long i = 0; i < n_events; ++i) {
+		tdc_event_t event = shm_test_event(i);
+		if (i%1000 == 999) {
+			event.edge = TDC_EDGE_LOSS;
+			event.lost = 3*i; // sent in place of dt
+			event.dt   = 0;
+		} else if (event.edge == TDC_EDGE_FALLING) {
+			event.tot  = i%500;
+		}
+		tdc_server_publish(server, &event);
+	}
+	tdc_server_stop(server, 10000);
+	for (int i = 0; i < 4; ++i) {
+		pthread_join(threads[i], NULL);
+		unsigned long expected = 0;
+		for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+			expected += clients[i].mask & (1<<ch) ? n_events/TDC_N_CHANNELS : 0;
+		}
+		printf("server test: client %d read %lu events, %lu dropped\n", i, clients[i].read, clients[i].dropped);
+		assert(clients[i].read + clients[i].dropped == expected);
+		if (policies[i] == TDC_SERVER_BLOCK) {
+			assert(clients[i].dropped == 0);
+		}
+	}
+	assert(clients[3].dropped > 0);
+	assert(access("tdc-tests.sock", F_OK) == -1);
+}
+
+double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// read from the board emulator through a pseudo terminal. USB packets 
+// are not aligned to frames, so this also checks that split frames
+// are put together again
+void run_emulator_test(int pulse_length, int n_events, tdc_format_t format, int pulse_mode) {
+	tdc_emu_config_t config;
+	tdc_emu_default_config(&config);
+	config.rate            = 20000;
+	config.threshold_scale = 256;
+	config.pulse_width     = pulse_length;
+	tdc_emu_t *emu = tdc_emu_open(&config);
+	assert(emu);
+	assert(tdc_emu_start(emu));
+
+	tdc_t *tdc = tdc_open(emu->slave_name);
+	assert(tdc);
+	tdc_set_format(tdc, format);
+	tdc_set_pulse_mode(tdc, pulse_mode);
+	tdc_set_sync(tdc, 1);
+	tdc_set_channel_threshold(tdc, 1, 1234);
+	tdc_enable_channels(tdc, TDC_CH0 | TDC_CH2);
+
+	int rising[TDC_N_CHANNELS] = {0,};
+	for (int i = 0; i < n_events; ++i) {
+		tdc_event_t event = tdc_next_event(tdc);
+		assert(event.channel == 0 || event.channel == 2);
+		if (event.edge == TDC_EDGE_RISING) {
+			assert(!rising[event.channel]);
+			rising[event.channel] = 1;
+		} else {
+			assert(rising[event.channel]);
+			assert(event.dt == pulse_length);
+			rising[event.channel] = 0;
+		}
+	}
+	assert(tdc_emu_threshold(emu, 1) == 1234);
+	assert(tdc->stats.invalid_blocks == 0);
+	assert(tdc->stats.invalid_frames == 0);
+	assert(tdc->stats.repaired_wraps[0] == 0 && tdc->stats.repaired_wraps[2] == 0);
+	unsigned long n_frames = tdc->stats.frames[0] + tdc->stats.frames[2];
+	if (pulse_mode && pulse_length < 1024) { // one record per pulse
+		assert(10*n_frames < 6*n_events);
+	}
+	assert( tdc_emu_enabled(emu, 0) && !tdc_emu_enabled(emu, 1));
+	assert( tdc_emu_enabled(emu, 2) && !tdc_emu_enabled(emu, 3));
+
+	// a high threshold stops the pulses on channel 0
+	unsigned long commands = emu->commands_received;
+	tdc_set_channel_threshold(tdc, 0, 4095);
+	while (emu->commands_received < commands+3) {
+		usleep(1000);
+	}
+	usleep(10000);
+	unsigned long frames = emu->channel_frames[0];
+	for (double end = now_sec()+0.1; now_sec() < end; ) {
+		tdc_event_t event = tdc_next_event(tdc);
+		assert(event.channel == 0 || event.channel == 2);
+	}
+	assert(emu->channel_frames[0] - frames <= 3); // only counter overflow and sync frames
+	printf("emulator test: %d events from %lu frames, %lu frames sent, %lu dropped, %lu syncs\n", 
+		n_events, n_frames, emu->frames_sent, emu->frames_dropped, tdc->stats.syncs[0]+tdc->stats.syncs[2]);
+
+	tdc_close(tdc);
+	tdc_emu_close(emu);
+}
+
+// real-time mode on the emulator: non-blocking reads with poll() or busy
+// polling, every event gets a latency, and a hangup ends the stream
+// instead of leaving the decoder waiting
+void run_realtime_test(int busy_poll, int n_events) {
+	tdc_emu_config_t config;
+	tdc_emu_default_config(&config);
+	config.rate            = 20000;
+	config.threshold_scale = 256;
+	tdc_emu_t *emu = tdc_emu_open(&config);
+	assert(emu);
+	assert(tdc_emu_start(emu));
+
+	tdc_t *tdc = tdc_open(emu->slave_name);
+	assert(tdc);
+	tdc_realtime_config_t realtime;
+	tdc_realtime_default_config(&realtime);
+	realtime.busy_poll = busy_poll;
+	assert(tdc_realtime_setup(tdc, &realtime));
+	assert(tdc->read_mode == (busy_poll ? TDC_READ_BUSY : TDC_READ_POLL));
+	tdc_latency_t *latency = tdc_latency_new();
+	assert(latency);
+	tdc_enable_channels(tdc, TDC_CH0 | TDC_CH2);
+
+	for (int i = 0; i < n_events; ++i) {
+		tdc_event_t event = tdc_next_event(tdc);
+		assert(event.channel == 0 || event.channel == 2);
+		tdc_latency_deliver(latency, tdc);
+	}
+	assert(latency->count == n_events);
+	assert(tdc->read_ns > 0);
+	assert(tdc_latency_quantile(latency, 0.5) < 1e6);
+	assert(tdc_latency_quantile(latency, 0.5) <= tdc_latency_quantile(latency, 0.999));
+	printf("real-time test (%s): ", busy_poll ? "busy" : "poll");
+	tdc_latency_print(stdout, latency);
+
+	tdc_emu_close(emu);
+	int end = 0;
+	for (int i = 0; i < 1000000 && !end; ++i) {
+		end = tdc_next_event(tdc).channel == -1;
+	}
+	assert(end);
+	tdc_latency_free(latency);
+	tdc_close(tdc);
+}
+
+// random pulses on all channels with counter overflows, sync frames and
+// loss markers, as frames or blocks (with pulse records)
+void write_checkpoint_capture(tdc_format_t format, int n_records) {
+	raw_event_t records[n_records];
+	long time[TDC_N_CHANNELS] = {0,};
+	int level[TDC_N_CHANNELS] = {0,};
+	srand(7);
+	for (int i = 0; i < n_records; ++i) {
+		int ch = rand()%TDC_N_CHANNELS;
+		long next = time[ch] + 1 + rand()%(1<<22);
+		records[i].kind    = TDC_RAW_SAMPLE;
+		records[i].channel = ch;
+		if (i%401 == 400) {
+			records[i].kind  = TDC_RAW_SYNC;
+			records[i].epoch = time[ch]>>24;
+			time[ch] &= ~0xffffffL; // the words after it count from the sync
+			continue;
+		}
+		if (i%503 == 502) {
+			records[i].kind = TDC_RAW_LOSS;
+			records[i].lost = 3;
+			continue;
+		}
+		if ((next>>24) != (time[ch]>>24)) {
+			next = next & ~0xffffffL; // overflow word
+			records[i].sample = level[ch] ? 0xff : 0x00;
+		} else if (format == TDC_FORMAT_BLOCKS && !level[ch] && i%97 == 96) {
+			records[i].kind  = TDC_RAW_PULSE;
+			records[i].phase = rand()%8;
+			records[i].tot   = 10 + rand()%1000;
+		} else {
+			records[i].sample = level[ch] ? 0xff>>(1+rand()%7) : ~(0xff>>(1+rand()%7));
+			level[ch] = !level[ch];
+		}
+		records[i].time = next & 0xffffff;
+		time[ch] = next;
+	}
+	int fd = open("testdata.raw", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	unsigned char block[TDC_BLOCK_MAX_SIZE];
+	for (int i = 0; i < n_records; ) {
+		if (format == TDC_FORMAT_FRAMES) {
+			if (records[i].kind == TDC_RAW_SYNC) {
+				write_control_frame(fd, TDC_CONTROL_SYNC, records[i].channel, records[i].epoch);
+			} else if (records[i].kind == TDC_RAW_LOSS) {
+				write_control_frame(fd, TDC_CONTROL_LOSS, records[i].channel, records[i].lost);
+			} else {
+				write_raw_event(fd, records[i].channel, records[i].time, records[i].sample);
+			}
+			++i;
+		} else {
+			int count = n_records-i < TDC_EMU_BLOCK_RECORDS ? n_records-i : TDC_EMU_BLOCK_RECORDS;
+			write(fd, block, pack_raw_block(&records[i], count, block));
+			i += count;
+		}
+	}
+	close(fd);
+}
+
+tdc_t *open_checkpoint_capture(tdc_format_t format) {
+	tdc_t *tdc = tdc_open("testdata.raw");
+	tdc->format = format; // a file can't take the mode register write
+	tdc_filter_t filter = {0,};
+	filter.deadtime = 20000000; // holds pulses of channel 2 across checkpoints
+	tdc_set_filter(tdc, 2, &filter);
+	return tdc;
+}
+
+// a capture decoded in two parts with a checkpoint in between gives the
+// same events as in one go, wherever the checkpoint is
+void run_checkpoint_test(tdc_format_t format) {
+	const int n_records = 3000;
+	write_checkpoint_capture(format, n_records);
+	tdc_event_t events[2*n_records];
+	int n_events = 0;
+	tdc_t *tdc = open_checkpoint_capture(format);
+	for (;;) {
+		tdc_event_t event = tdc_next_event(tdc);
+		if (event.channel == -1) {
+			break;
+		}
+		events[n_events++] = event;
+	}
+	assert(tdc->stats.overflows[0] > 3 && tdc->stats.filter_deadtime[2] > 0);
+	tdc_close(tdc);
+
+	int splits[] = {0, 1, 2, 17, n_events/3, n_events/2+1, n_events-1, n_events};
+	for (int s = 0; s < (int)(sizeof(splits)/sizeof(splits[0])); ++s) {
+		tdc_checkpoint_t checkpoint;
+		tdc = open_checkpoint_capture(format);
+		for (int i = 0; i < splits[s]; ++i) {
+			tdc_next_event(tdc);
+		}
+		tdc_checkpoint_take(tdc, &checkpoint);
+		if (s == 3) {
+			assert(tdc_checkpoint_write("testdata.checkpoint", &checkpoint));
+			memset(&checkpoint, 0, sizeof(checkpoint));
+			assert(tdc_checkpoint_read("testdata.checkpoint", &checkpoint));
+			unlink("testdata.checkpoint");
+		}
+		tdc_close(tdc);
+
+		tdc = tdc_open("testdata.raw");
+		assert(tdc_checkpoint_restore(tdc, &checkpoint, TDC_RESUME_CAPTURE));
+		for (int i = splits[s]; i < n_events; ++i) {
+			tdc_event_t event = tdc_next_event(tdc);
+			assert(event.channel == events[i].channel);
+			assert(event.edge    == events[i].edge);
+			assert(event.time    == events[i].time);
+			assert(event.dt      == events[i].dt);
+			assert(event.tot     == events[i].tot);
+		}
+		assert(tdc_next_event(tdc).channel == -1);
+		tdc_close(tdc);
+	}
+
+	// a damaged checkpoint is refused
+	tdc_checkpoint_t checkpoint;
+	tdc = open_checkpoint_capture(format);
+	tdc_next_event(tdc);
+	tdc_checkpoint_take(tdc, &checkpoint);
+	checkpoint.time[1] ^= 0x10;
+	assert(!tdc_checkpoint_restore(tdc, &checkpoint, TDC_RESUME_CAPTURE));
+	tdc_close(tdc);
+	printf("checkpoint test (%s): %d events\n", format == TDC_FORMAT_FRAMES ? "frames" : "blocks", n_events);
+}
+
+// after a live restart the overflows in the gap are estimated from the
+// wall clock and the channel starts without an edge
+void run_checkpoint_live_test() {
+	int fd = open("testdata.raw", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	write_raw_event(fd, 1, 0x10,   0x00);
+	write_raw_event(fd, 1, 0,      0x00); // counter overflow
+	write_raw_event(fd, 1, 0x1000, 0x0f); // rising edge in epoch 1
+	close(fd);
+	tdc_t *tdc = tdc_open("testdata.raw");
+	tdc_event_t event = tdc_next_event(tdc);
+	assert(event.channel == 1 && event.time == ((1UL<<24) + 0x1000)*8 + 4);
+	tdc_checkpoint_t checkpoint;
+	tdc_checkpoint_take(tdc, &checkpoint);
+	tdc_close(tdc);
+
+	// 3 counter periods and 0x2000 ticks later
+	long gap = (3L<<24) + 0x2000;
+	fd = open("testdata.raw", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	write_raw_event(fd, 1, 0x3000, 0xff); // high since the rising edge, no edge
+	write_raw_event(fd, 1, 0x3100, 0x00); // falling edge
+	close(fd);
+	tdc = tdc_open("testdata.raw");
+	assert(tdc_checkpoint_restore(tdc, &checkpoint, TDC_RESUME_LIVE));
+	assert(tdc->started[1] == TDC_STARTED_RESUMED && tdc->started[0] == 0);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	tdc->resume_wall_ns = now.tv_sec*1000000000UL + now.tv_nsec - gap*8;
+	event = tdc_next_event(tdc);
+	assert(event.channel == 1 && event.edge == TDC_EDGE_FALLING);
+	assert(event.time == ((4UL<<24) + 0x3100)*8);
+	assert(tdc->overflow_count[1] == 4 && tdc->stats.overflows[1] == 3);
+	assert(tdc_next_event(tdc).channel == -1);
+	tdc_close(tdc);
+}
+
+typedef struct s_index_test_t
+{
+	tdc_event_t *events;
+	long         n;
+} index_test_t;
+
+static int collect_event(const tdc_event_t *event, void *arg)
+{
+	index_test_t *result = arg;
+	result->events[result->n++] = *event;
+	return 1;
+}
+
+// a query gives the same events as decoding everything and taking the
+// ones in the window
+void run_index_test(tdc_format_t format) {
+	const int n_records = 3000;
+	write_checkpoint_capture(format, n_records);
+	tdc_event_t events[2*n_records], found[2*n_records];
+	int n_events = 0;
+	tdc_t *tdc = tdc_open("testdata.raw");
+	tdc->format = format;
+	for (;;) {
+		tdc_event_t event = tdc_next_event(tdc);
+		if (event.channel == -1) {
+			break;
+		}
+		events[n_events++] = event;
+	}
+	unsigned long end = tdc->previous_time[0];
+	tdc_close(tdc);
+
+	unlink("testdata.raw.idx");
+	tdc_index_t *index = tdc_index_open("testdata.raw", format, 100);
+	assert(index && index->header.n_entries > 10);
+	for (long i = 1; i < (long)index->header.n_entries; ++i) {
+		assert(index->entries[i].time >= index->entries[i-1].time);
+		assert(index->entries[i].offset > index->entries[i-1].offset);
+	}
+	// the second time the side-car file is read
+	tdc_index_t *side_car = tdc_index_open("testdata.raw", format, 1);
+	assert(side_car && side_car->header.n_entries == index->header.n_entries);
+	assert(memcmp(side_car->entries, index->entries, index->header.n_entries*sizeof(tdc_index_entry_t)) == 0);
+	tdc_index_free(side_car);
+	unlink("testdata.raw.idx");
+
+	srand(11);
+	for (int q = 0; q < 50; ++q) {
+		unsigned long t0 = q == 0 ? 0 : rand()%end;
+		unsigned long t1 = t0 + (q%2 ? 10000000 : 100000000); // 10 or 100 ms
+		index_test_t result = {found, 0};
+		tdc = tdc_open("testdata.raw");
+		long n = tdc_index_query(index, tdc, t0, t1, collect_event, &result);
+		tdc_close(tdc);
+		assert(n == result.n);
+		int k = 0;
+		for (int i = 0; i < n_events; ++i) {
+			if (events[i].time >= t0 && events[i].time < t1) {
+				assert(k < n);
+				assert(found[k].channel == events[i].channel);
+				assert(found[k].edge    == events[i].edge);
+				assert(found[k].time    == events[i].time);
+				assert(found[k].dt      == events[i].dt);
+				assert(found[k].tot     == events[i].tot);
+				++k;
+			}
+		}
+		assert(k == n);
+	}
+	printf("index test (%s): %d events, %lu entries\n", format == TDC_FORMAT_FRAMES ? "frames" : "blocks",
+		n_events, (unsigned long)index->header.n_entries);
+	tdc_index_free(index);
+}
+
+static void assert_same_event(const tdc_event_t *a, const tdc_event_t *b)
+{
+	assert(a->channel == b->channel && a->edge == b->edge && a->time == b->time);
+	assert(a->sample == b->sample && a->dt == b->dt && a->lost == b->lost && a->tot == b->tot);
+}
+
+// the packed events and the batches give back the events of the decoder
+void run_batch_test() {
+	const int n_records = 3000;
+	assert(sizeof(tdc_packed_event_t) == 16);
+	write_checkpoint_capture(TDC_FORMAT_FRAMES, n_records);
+	tdc_event_t events[2*n_records], back[2*n_records];
+	int n_events = 0, n_losses = 0;
+	tdc_t *tdc = open_checkpoint_capture(TDC_FORMAT_FRAMES);
+	for (;;) {
+		tdc_event_t event = tdc_next_event(tdc);
+		if (event.channel == -1) {
+			break;
+		}
+		n_losses += event.edge == TDC_EDGE_LOSS;
+		events[n_events++] = event;
+	}
+	tdc_close(tdc);
+	assert(n_losses > 0);
+
+	tdc_packed_event_t packed[2*n_records], packed_back[2*n_records];
+	tdc_event_history_t history;
+	tdc_pack_events(events, n_events, packed);
+	tdc_event_history_init(&history);
+	tdc_unpack_events(packed, n_events, back, &history);
+	for (int i = 0; i < n_events; ++i) {
+		assert_same_event(&back[i], &events[i]);
+	}
+
+	// in batches of 128 straight from the decoder
+	tdc_batch_t *batch = tdc_batch_new(100);
+	assert(batch->capacity == 128);
+	assert((uintptr_t)batch->time%TDC_BATCH_ALIGN == 0 && (uintptr_t)batch->tot%TDC_BATCH_ALIGN == 0);
+	assert((uintptr_t)batch->channel%TDC_BATCH_ALIGN == 0 && (uintptr_t)batch->edge%TDC_BATCH_ALIGN == 0);
+	assert((uintptr_t)batch->sample%TDC_BATCH_ALIGN == 0);
+	tdc = open_checkpoint_capture(TDC_FORMAT_FRAMES);
+	tdc_event_history_init(&history);
+	int n = 0;
+	for (;;) {
+		long count = tdc_batch_fill(batch, tdc);
+		if (count == 0) {
+			break;
+		}
+		for (long i = count; i < batch->capacity; ++i) {
+			assert(batch->edge[i] == TDC_BATCH_NO_EDGE && batch->time[i] == 0);
+		}
+		assert(tdc_batch_to_events(batch, back, &history) == count);
+		for (long i = 0; i < count; ++i) {
+			assert_same_event(&back[i], &events[n++]);
+		}
+	}
+	assert(n == n_events);
+	tdc_close(tdc);
+
+	// events -> batch -> packed -> batch -> events
+	assert(tdc_batch_from_events(batch, events, n_events) == 128);
+	assert(tdc_batch_to_packed(batch, packed_back) == 128);
+	assert(memcmp(packed_back, packed, 128*sizeof(tdc_packed_event_t)) == 0);
+	assert(tdc_batch_from_packed(batch, packed+5, 3) == 3);
+	assert(batch->edge[3] == TDC_BATCH_NO_EDGE);
+	tdc_event_history_init(&history);
+	history.previous_time[events[5].channel] = events[5].time - events[5].dt;
+	tdc_batch_to_events(batch, back, &history);
+	assert_same_event(&back[0], &events[5]);
+	tdc_batch_free(batch);
+}
+
+// the amplitude in DAC counts of a pulse with the ToT, by bisection
+static double walk_test_amplitude(const tdc_walk_model_t *model, int setting, double tot)
+{
+	double lo = setting*1.0000001, hi = setting*1e4, t;
+	for (int i = 0; i < 100; ++i) {
+		double mid = sqrt(lo*hi);
+		tdc_walk_model(model, mid, setting, &t);
+		if (t < tot) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return hi;
+}
+
+void run_walk_test() {
+	const tdc_walk_model_t model = {.tau = 40, .RC = 10, .threshold_tau = 50, .trigger_delay = 10};
+	const tdc_walk_model_t bad   = {.tau = 0,  .RC = 10, .threshold_tau = 50, .trigger_delay = 10};
+	assert(tdc_walk_table_build(&bad, 1) == NULL);
+	char cache_dir[] = "/tmp/tdc-tests-walk-XXXXXX";
+	assert(mkdtemp(cache_dir));
+	tdc_walk_table_t *table = tdc_walk_table_open(&model, cache_dir);
+	tdc_walk_table_t *built = tdc_walk_table_build(&model, 3); // the rows don't depend on the threads
+	assert(table && built && memcmp(table, built, sizeof(tdc_walk_table_t)) == 0);
+	tdc_walk_table_free(built);
+
+	// the table against the model at the columns above the smallest ToT
+	// (the trigger delay, where the walk of small pulses is not known)
+	const int settings[] = {64, 1024, 2048, 4096};
+	for (int s = 0; s < 4; ++s) {
+		int setting = settings[s];
+		for (int j = 4; j < 48; ++j) {
+			double tot, amplitude = walk_test_amplitude(&model, setting, j*TDC_WALK_TOT_STEP);
+			double walk = tdc_walk_model(&model, amplitude, setting, &tot);
+			assert(walk > 0 && fabs(tot - j*TDC_WALK_TOT_STEP) < 1e-3);
+			assert(fabs(walk - (double)table->walk[setting/TDC_WALK_SETTING_STEP][j]/TDC_WALK_SCALE) < 0.02);
+		}
+	}
+	// the walk shrinks with the amplitude and grows with the threshold
+	for (int j = 4; j < TDC_WALK_N_TOT; ++j) {
+		assert(table->walk[32][j] <= table->walk[32][j-1]);
+		assert(table->walk[32][j] <= table->walk[48][j]);
+	}
+
+	// interpolated between the rows and the columns, at integer ToTs
+	static tdc_walk_t walk;
+	tdc_walk_init(&walk, table);
+	tdc_walk_set_threshold(&walk, 1, 1000);
+	tdc_walk_set_threshold(&walk, 2, 3333);
+	tdc_walk_set_threshold(&walk, 3, -1);
+	for (unsigned int tot = 24; tot < 300; ++tot) {
+		double t;
+		double walk_1 = tdc_walk_model(&model, walk_test_amplitude(&model, 1000, tot), 1000, &t);
+		double walk_2 = tdc_walk_model(&model, walk_test_amplitude(&model, 3333, tot), 3333, &t);
+		assert(fabs(tdc_walk_of(&walk, 1, tot) - walk_1) < 0.05);
+		assert(fabs(tdc_walk_of(&walk, 2, tot) - walk_2) < 0.05);
+		assert(tdc_walk_of(&walk, 3, tot) == 0);
+	}
+	assert(tdc_walk_of(&walk, 1, 5000) == tdc_walk_of(&walk, 1, 1024));
+	tdc_event_t falling = {.channel = 2, .edge = TDC_EDGE_FALLING, .time = 10000, .dt = 90, .tot = 40};
+	assert(tdc_walk_pulse_start(&walk, &falling) == 10000 - 40 - tdc_walk_of(&walk, 2, 40));
+	falling.tot = 0;
+	assert(isnan(tdc_walk_pulse_start(&walk, &falling)));
+
+	// The ToT comes from the rising edge, not from dt: with a filter that
+	// drops the rising edges dt is the time to the previous falling edge.
+	// After a loss the rising edge is unknown, that falling edge gets no
+	// correction.
+	int fd = open("testdata.raw", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	write_raw_event(fd, 1,  0, 0x00);
+	write_raw_event(fd, 1, 10, 0x0f); // rising edge at 84
+	write_raw_event(fd, 1, 20, 0xf0); // falling edge at 164
+	write_raw_event(fd, 1, 30, 0x0f); // rising edge at 244
+	write_control_frame(fd, TDC_CONTROL_LOSS, 1, 3);
+	write_raw_event(fd, 1, 40, 0xf8); // falling edge at 325
+	write_raw_event(fd, 1, 50, 0x0f); // rising edge at 404
+	write_raw_event(fd, 1, 60, 0x00); // falling edge at 480
+	close(fd);
+	const unsigned long fall_times[3] = {164, 325, 480}, tots[3] = {80, 0, 76};
+	const tdc_polarity_t polarities[2] = {TDC_POLARITY_BOTH, TDC_POLARITY_FALLING};
+	for (int p = 0; p < 2; ++p) {
+		tdc_polarity_t polarity = polarities[p];
+		tdc_t *tdc = tdc_open("testdata.raw");
+		tdc->format = TDC_FORMAT_FRAMES;
+		tdc_filter_t filter = {.polarity = polarity};
+		tdc_set_filter(tdc, 1, &filter);
+		tdc_batch_t *batch = tdc_batch_new(16);
+		assert(tdc_batch_fill(batch, tdc) == (polarity == TDC_POLARITY_BOTH ? 7 : 4));
+		tdc_close(tdc);
+		tdc_event_t events[16];
+		tdc_event_history_t history;
+		tdc_event_history_init(&history);
+		tdc_batch_to_events(batch, events, &history);
+		float walk_ns[16];
+		tdc_walk_batch(&walk, batch, walk_ns);
+		int n = 0;
+		for (int i = 0; i < batch->n; ++i) {
+			if (events[i].edge != TDC_EDGE_FALLING) {
+				continue;
+			}
+			assert(events[i].time == fall_times[n] && events[i].tot == tots[n]);
+			if (tots[n]) {
+				assert(walk_ns[i] == tdc_walk_of(&walk, 1, tots[n]));
+				assert(tdc_walk_pulse_start(&walk, &events[i]) == fall_times[n] - tots[n] - tdc_walk_of(&walk, 1, tots[n]));
+			} else {
+				assert(walk_ns[i] == 0 && isnan(tdc_walk_pulse_start(&walk, &events[i])));
+			}
+			++n;
+		}
+		assert(n == 3);
+		tdc_batch_free(batch);
+	}
+
+	// per batch as per event, on the events of a capture with ToTs over
+	// the whole table
+	const int n_records = 3000;
+	write_checkpoint_capture(TDC_FORMAT_FRAMES, n_records);
+	tdc_t *tdc = open_checkpoint_capture(TDC_FORMAT_FRAMES);
+	tdc_batch_t *batch = tdc_batch_new(2*n_records);
+	assert(tdc_batch_fill(batch, tdc) > n_records);
+	tdc_close(tdc);
+	for (long i = 0; i < batch->n; ++i) {
+		batch->tot[i] = batch->edge[i] == TDC_EDGE_FALLING ? 1 + (i*37)%1100 : batch->tot[i];
+	}
+	float *walk_ns = malloc(sizeof(float)*batch->capacity);
+	tdc_walk_batch(&walk, batch, walk_ns);
+	int n_falling = 0;
+	for (long i = 0; i < batch->n; ++i) { // the padding after n is not written
+		if (batch->edge[i] == TDC_EDGE_FALLING) {
+			++n_falling;
+			assert(fabs(walk_ns[i] - tdc_walk_of(&walk, batch->channel[i], batch->tot[i])) < 1e-4);
+		} else {
+			assert(walk_ns[i] == 0);
+		}
+	}
+	assert(n_falling > 1000);
+	free(walk_ns);
+	tdc_batch_free(batch);
+
+	// the cache: read back, another file for another model, a damaged
+	// file is built again
+	char filename[4096];
+	snprintf(filename, sizeof(filename), "%s/tdc-walk-%016lx.tab", cache_dir, (unsigned long)table->key);
+	assert(access(filename, R_OK) == 0);
+	tdc_walk_table_t *cached = tdc_walk_table_open(&model, cache_dir);
+	assert(memcmp(cached, table, sizeof(tdc_walk_table_t)) == 0);
+	tdc_walk_table_free(cached);
+	tdc_walk_model_t other = model;
+	other.trigger_delay = 12;
+	cached = tdc_walk_table_open(&other, cache_dir);
+	assert(cached->key != table->key && memcmp(cached->walk, table->walk, sizeof(table->walk)) != 0);
+	char other_filename[4096];
+	snprintf(other_filename, sizeof(other_filename), "%s/tdc-walk-%016lx.tab", cache_dir, (unsigned long)cached->key);
+	tdc_walk_table_free(cached);
+	FILE *out = fopen(filename, "r+");
+	fseek(out, 4, SEEK_SET);
+	fputc(0xff, out); // the version
+	fclose(out);
+	cached = tdc_walk_table_open(&model, cache_dir);
+	assert(memcmp(cached, table, sizeof(tdc_walk_table_t)) == 0);
+	tdc_walk_table_free(cached);
+	unlink(filename);
+	unlink(other_filename);
+	assert(rmdir(cache_dir) == 0);
+	tdc_walk_table_free(table);
+}
 int main()
 {
 
 	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
 		run_pulser_test(ch, 101, 1000);
 	}
+	run_stats_test();
+	run_histogram_test();
+	run_block_test();
+	run_loss_test();
+	run_sync_test();
+	run_filter_test();
+	run_checkpoint_test(TDC_FORMAT_FRAMES);
+	run_checkpoint_test(TDC_FORMAT_BLOCKS);
+	run_checkpoint_live_test();
+	run_index_test(TDC_FORMAT_FRAMES);
+	run_index_test(TDC_FORMAT_BLOCKS);
+	run_batch_test();
+	run_walk_test();
+	run_shm_test();
+	run_server_test();
+	run_emulator_test(101,  20000, TDC_FORMAT_FRAMES, 0);
+	run_emulator_test(5,    20000, TDC_FORMAT_FRAMES, 0);
+	run_emulator_test(101,  20000, TDC_FORMAT_BLOCKS, 0);
+	run_emulator_test(101,  20000, TDC_FORMAT_FRAMES, 1);
+	run_emulator_test(5,    20000, TDC_FORMAT_FRAMES, 1);
+	run_emulator_test(2000, 20000, TDC_FORMAT_FRAMES, 1); // too long for pulse records
+	run_emulator_test(101,  20000, TDC_FORMAT_BLOCKS, 1);
+	run_realtime_test(0, 20000);
+	run_realtime_test(1, 20000);
 
 
 	printf("All tests passed!\n");
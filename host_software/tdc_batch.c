@@ -0,0 +1,144 @@
+#include "tdc_batch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void tdc_event_history_init(tdc_event_history_t *history)
+{
+	memset(history, 0, sizeof(tdc_event_history_t));
+}
+
+void tdc_pack_events(const tdc_event_t *events, long n, tdc_packed_event_t *packed)
+{
+	for (long i = 0; i < n; ++i) {
+		tdc_pack_event(&events[i], &packed[i]);
+	}
+}
+
+void tdc_unpack_events(const tdc_packed_event_t *packed, long n, tdc_event_t *events, tdc_event_history_t *history)
+{
+	for (long i = 0; i < n; ++i) {
+		tdc_event_t *event = &events[i];
+		event->channel = packed[i].channel;
+		event->time    = packed[i].time;
+		event->edge    = packed[i].edge;
+		event->sample  = packed[i].sample;
+		tdc_event_restore_dt(event, packed[i].tot, history);
+	}
+}
+
+static long round_up(long n)
+{
+	return (n + TDC_BATCH_ALIGN-1)/TDC_BATCH_ALIGN*TDC_BATCH_ALIGN;
+}
+
+tdc_batch_t *tdc_batch_new(long capacity)
+{
+	capacity = round_up(capacity > 0 ? capacity : 1);
+	// the arrays one after the other, each size is a multiple of the alignment
+	long size = capacity*(sizeof(uint64_t) + sizeof(uint32_t) + 3);
+	unsigned char *memory = aligned_alloc(TDC_BATCH_ALIGN, size);
+	tdc_batch_t *batch = malloc(sizeof(tdc_batch_t));
+	if (!memory || !batch) {
+		free(memory);
+		free(batch);
+		return NULL;
+	}
+	batch->capacity = capacity;
+	batch->time     = (uint64_t*)memory;
+	batch->tot      = (uint32_t*)(memory + capacity*sizeof(uint64_t));
+	batch->channel  = memory + capacity*(sizeof(uint64_t) + sizeof(uint32_t));
+	batch->edge     = batch->channel + capacity;
+	batch->sample   = batch->edge + capacity;
+	memset(memory, 0, size);
+	memset(batch->edge, TDC_BATCH_NO_EDGE, capacity);
+	batch->n = 0;
+	return batch;
+}
+
+void tdc_batch_free(tdc_batch_t *batch)
+{
+	if (batch) {
+		free(batch->time);
+		free(batch);
+	}
+}
+
+void tdc_batch_clear(tdc_batch_t *batch)
+{
+	long n = batch->n;
+	memset(batch->time,    0, n*sizeof(uint64_t));
+	memset(batch->tot,     0, n*sizeof(uint32_t));
+	memset(batch->channel, 0, n);
+	memset(batch->edge,    TDC_BATCH_NO_EDGE, n);
+	memset(batch->sample,  0, n);
+	batch->n = 0;
+}
+
+long tdc_batch_fill(tdc_batch_t *batch, tdc_t *tdc)
+{
+	tdc_batch_clear(batch);
+	while (batch->n < batch->capacity) {
+		tdc_event_t event = tdc_next_event(tdc);
+		if (event.channel == -1) {
+			break;
+		}
+		tdc_batch_append(batch, &event);
+	}
+	return batch->n;
+}
+
+long tdc_batch_from_events(tdc_batch_t *batch, const tdc_event_t *events, long n)
+{
+	tdc_batch_clear(batch);
+	if (n > batch->capacity) {
+		n = batch->capacity;
+	}
+	for (long i = 0; i < n; ++i) {
+		tdc_batch_append(batch, &events[i]);
+	}
+	return n;
+}
+
+long tdc_batch_to_events(const tdc_batch_t *batch, tdc_event_t *events, tdc_event_history_t *history)
+{
+	for (long i = 0; i < batch->n; ++i) {
+		tdc_event_t *event = &events[i];
+		event->channel = batch->channel[i];
+		event->time    = batch->time[i];
+		event->edge    = batch->edge[i];
+		event->sample  = batch->sample[i];
+		tdc_event_restore_dt(event, batch->tot[i], history);
+	}
+	return batch->n;
+}
+
+long tdc_batch_from_packed(tdc_batch_t *batch, const tdc_packed_event_t *packed, long n)
+{
+	tdc_batch_clear(batch);
+	if (n > batch->capacity) {
+		n = batch->capacity;
+	}
+	for (long i = 0; i < n; ++i) {
+		batch->time[i]    = packed[i].time;
+		batch->tot[i]     = packed[i].tot;
+		batch->channel[i] = packed[i].channel;
+		batch->edge[i]    = packed[i].edge;
+		batch->sample[i]  = packed[i].sample;
+	}
+	batch->n = n;
+	return n;
+}
+
+long tdc_batch_to_packed(const tdc_batch_t *batch, tdc_packed_event_t *packed)
+{
+	for (long i = 0; i < batch->n; ++i) {
+		packed[i].time     = batch->time[i];
+		packed[i].tot      = batch->tot[i];
+		packed[i].channel  = batch->channel[i];
+		packed[i].edge     = batch->edge[i];
+		packed[i].sample   = batch->sample[i];
+		packed[i].reserved = 0;
+	}
+	return batch->n;
+}
@@ -0,0 +1,122 @@
+#ifndef TDC_BATCH_H
+#define TDC_BATCH_H
+
+#include "tdc_control.h"
+
+#include <stdint.h>
+
+//////////////////////////////////////////
+// compact event layouts for batch processing
+//
+// tdc_event_t has 48 bytes on x86_64 for about 12 bytes of information.
+// Two layouts for code that keeps or loops over many events:
+//
+//   tdc_packed_event_t  16 bytes, one event per record (4 per cache line)
+//   tdc_batch_t         structure of arrays: time, tot, channel, edge and
+//                       sample each in its own array, so a loop reads only
+//                       the arrays it needs, and the compiler can vectorize
+//                       it. The arrays are aligned to TDC_BATCH_ALIGN and the
+//                       capacity is a multiple of it.
+//
+// Both store tdc_event_t::tot of falling edges (0: unknown) and
+// tdc_event_t::lost of loss events in one field. Values above 2^32-1 are
+// saturated. dt is the time since the previous event of the channel,
+// tdc_event_history_t rebuilds it when events are converted back. It is
+// exact if the history starts with the stream.
+//////////////////////////////////////////
+
+#define TDC_BATCH_ALIGN   64   // bytes, a cache line and an AVX-512 register
+#define TDC_BATCH_NO_EDGE 0xff // tdc_batch_t::edge behind the last event
+
+typedef struct s_tdc_packed_event_t
+{
+	uint64_t time;    // tdc_event_t::time in [ns]
+	uint32_t tot;     // falling edges: ToT in [ns] (0: unknown), losses: lost words, 0 otherwise
+	uint8_t  channel;
+	uint8_t  edge;    // edge_t
+	uint8_t  sample;
+	uint8_t  reserved;
+} tdc_packed_event_t;
+
+typedef struct s_tdc_batch_t
+{
+	long      n;        // events in the batch
+	long      capacity;
+	uint64_t *time;
+	uint32_t *tot;
+	uint8_t  *channel;
+	uint8_t  *edge;
+	uint8_t  *sample;
+} tdc_batch_t;
+
+// the time of the last edge of each channel, for tdc_event_t::dt
+typedef struct s_tdc_event_history_t
+{
+	uint64_t previous_time[TDC_N_CHANNELS];
+} tdc_event_history_t;
+
+static inline uint32_t tdc_event_tot(const tdc_event_t *event)
+{
+	unsigned long value = event->edge == TDC_EDGE_LOSS ? event->lost : event->edge == TDC_EDGE_FALLING ? event->tot : 0;
+	return value > UINT32_MAX ? UINT32_MAX : value;
+}
+
+static inline void tdc_pack_event(const tdc_event_t *event, tdc_packed_event_t *packed)
+{
+	packed->time     = event->time;
+	packed->tot      = tdc_event_tot(event);
+	packed->channel  = event->channel;
+	packed->edge     = event->edge;
+	packed->sample   = event->sample;
+	packed->reserved = 0;
+}
+
+// the inverse of tdc_event_tot(): dt, tot and lost of an event, updates the history
+static inline void tdc_event_restore_dt(tdc_event_t *event, uint32_t tot, tdc_event_history_t *history)
+{
+	int ch = event->channel;
+	event->lost = 0;
+	event->tot  = 0;
+	if (event->edge == TDC_EDGE_LOSS) { // the decoder keeps the previous time
+		event->dt   = 0;
+		event->lost = tot;
+		return;
+	}
+	if (event->edge == TDC_EDGE_FALLING) {
+		event->tot = tot;
+	}
+	event->dt = event->time - history->previous_time[ch];
+	history->previous_time[ch] = event->time;
+}
+
+void tdc_event_history_init(tdc_event_history_t *history);
+void tdc_pack_events(const tdc_event_t *events, long n, tdc_packed_event_t *packed);
+void tdc_unpack_events(const tdc_packed_event_t *packed, long n, tdc_event_t *events, tdc_event_history_t *history);
+
+// One allocation for all arrays. The capacity is rounded up to a multiple
+// of TDC_BATCH_ALIGN. The entries from n to the capacity are 0 with the
+// edge TDC_BATCH_NO_EDGE, so a vectorized loop may run over whole multiples
+// of TDC_BATCH_ALIGN without a scalar tail.
+tdc_batch_t *tdc_batch_new(long capacity);
+void         tdc_batch_free(tdc_batch_t *batch);
+void         tdc_batch_clear(tdc_batch_t *batch);
+static inline void tdc_batch_append(tdc_batch_t *batch, const tdc_event_t *event)
+{
+	long i = batch->n++;
+	batch->time[i]    = event->time;
+	batch->tot[i]     = tdc_event_tot(event);
+	batch->channel[i] = event->channel;
+	batch->edge[i]    = event->edge;
+	batch->sample[i]  = event->sample;
+}
+// Decodes events into an empty batch until it is full or the input ends.
+// Returns the number of events, 0 at the end of the input.
+long tdc_batch_fill(tdc_batch_t *batch, tdc_t *tdc);
+// The batch takes events from the array (as many as fit), or gives them
+// back. Both return the number of events converted.
+long tdc_batch_from_events(tdc_batch_t *batch, const tdc_event_t *events, long n);
+long tdc_batch_to_events(const tdc_batch_t *batch, tdc_event_t *events, tdc_event_history_t *history);
+long tdc_batch_from_packed(tdc_batch_t *batch, const tdc_packed_event_t *packed, long n);
+long tdc_batch_to_packed(const tdc_batch_t *batch, tdc_packed_event_t *packed);
+
+#endif
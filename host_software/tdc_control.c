@@ -1,9 +1,12 @@
 #include "tdc_control.h"
+#include "tdc_trace.h"
+#include "tdc_rules.h"
 // POSIX header
 #include <termios.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <poll.h>
 
 // C header
 #include <stdio.h>
@@ -11,6 +14,29 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+
+// Statistics counters have a single writer, so a relaxed load and store
+// is enough to increment them. Other threads read them with relaxed loads
+// and never see torn values.
+#define STAT_ADD(counter, n) __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED)+(n), __ATOMIC_RELAXED)
+#define STAT_INC(counter)    STAT_ADD(counter, 1)
+
+// trace points compile to nothing without TDC_TRACE
+#ifdef TDC_TRACE
+#define TRACE_ON(tdc) ((tdc)->trace != NULL)
+#else
+#define TRACE_ON(tdc) 0
+#endif
+
+int tdc_trace_available()
+{
+#ifdef TDC_TRACE
+	return 1;
+#else
+	return 0;
+#endif
+}
 
 tdc_t *tdc_open(const char *filename)
 {
@@ -60,18 +86,49 @@ tdc_t *tdc_open(const char *filename)
 		new_tdc->time[i] = 0;
 		new_tdc->previous_time[i] = 0;
 		new_tdc->overflow_count[i] = 0;
+		new_tdc->rise_time[i] = 0;
 		new_tdc->sample[i] = 0;
 		new_tdc->sample_idx[i] = 0;
+		new_tdc->lost[i] = 0;
+		new_tdc->started[i] = 0;
+		new_tdc->unsynced[i] = 0;
 		for (int s = 0; s < 8; ++s) {
 			new_tdc->sample_stat[i][s] = 0;
 		}
 		new_tdc->sample_stat_total = 0;
 	}
+	new_tdc->read_pos   = 0;
+	new_tdc->read_len   = 0;
+	new_tdc->raw_offset = 0;
+	new_tdc->read_mode  = TDC_READ_BLOCKING;
+	new_tdc->read_ns    = 0;
+	new_tdc->format        = TDC_FORMAT_FRAMES;
+	new_tdc->mode_register = 0;
+	new_tdc->block         = malloc(sizeof(raw_event_t)*TDC_BLOCK_MAX_RECORDS);
+	new_tdc->block_pos     = 0;
+	new_tdc->block_len     = 0;
+	new_tdc->block_offset  = 0;
+	new_tdc->resume_wall_ns = 0;
+	new_tdc->queued        = 0;
+	new_tdc->queued_event  = malloc(sizeof(tdc_event_t));
+	new_tdc->filtered      = 0;
+	new_tdc->rising        = 0;
+	memset(new_tdc->filter, 0, sizeof(new_tdc->filter));
+	memset(new_tdc->filter_state, 0, sizeof(new_tdc->filter_state));
+	memset(&new_tdc->stats, 0, sizeof(tdc_stats_t));
+	new_tdc->trace = NULL;
 	return new_tdc;
 }
 
 void tdc_close(tdc_t *tdc)
 {
+	close(tdc->fd);
+	if (tdc->trace) {
+		free(tdc->trace->ring);
+		free(tdc->trace);
+	}
+	free(tdc->block);
+	free(tdc->queued_event);
 	free(tdc);
 }
 
@@ -82,6 +139,8 @@ void tdc_enable_channels(tdc_t *tdc, char pattern)
 		if (!(pattern & (1<<ch))) { // if channel is disabled 
 			printf("resetting overflow_count for ch=%d\n", ch);
 			tdc->overflow_count[ch] = 0;
+			tdc->time[ch]           = 0;
+			tdc->started[ch]        = 0; // the counter starts with time 0 when enabled
 		}
 	}
 	// build the message;
@@ -110,10 +169,91 @@ void tdc_set_channel_threshold(tdc_t *tdc, int channel, int threshold)
 }
 
 
+static void set_mode_bit(tdc_t *tdc, unsigned char bit, int value)
+{
+	if (value) {
+		tdc->mode_register |= bit;
+	} else {
+		tdc->mode_register &= ~bit;
+	}
+	unsigned char msg = (12<<4) | tdc->mode_register;
+	write(tdc->fd, &msg, 1);
+}
+
+void tdc_set_format(tdc_t *tdc, tdc_format_t format)
+{
+	set_mode_bit(tdc, TDC_MODE_BLOCKS, format == TDC_FORMAT_BLOCKS);
+	tdc->format    = format;
+	tdc->block_pos = 0;
+	tdc->block_len = 0;
+}
+
+void tdc_set_pulse_mode(tdc_t *tdc, int enable)
+{
+	set_mode_bit(tdc, TDC_MODE_PULSES, enable);
+}
+
+void tdc_set_sync(tdc_t *tdc, int enable)
+{
+	set_mode_bit(tdc, TDC_MODE_SYNC, enable);
+}
+
+int tdc_seek(tdc_t *tdc, unsigned long offset)
+{
+	if (lseek(tdc->fd, offset, SEEK_SET) == (off_t)-1) {
+		return 0;
+	}
+	tdc->read_pos      = 0;
+	tdc->read_len      = 0;
+	tdc->raw_offset    = offset;
+	tdc->block_pos     = 0;
+	tdc->block_len     = 0;
+	tdc->queued        = 0;
+	tdc->rising        = 0;
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		tdc->filter_state[ch].state = 0;
+		tdc->sample_idx[ch] = 0;
+		tdc->started[ch]    = 0;
+		tdc->unsynced[ch]   = 1;
+	}
+	return 1;
+}
+
+// 4 bit subtype and 28 bit payload of control frames and records, returns 0 for unknown subtypes
+static int unpack_control_payload(int subtype, unsigned long payload, raw_event_t *new_raw_event)
+{
+	new_raw_event->time    = 0;
+	new_raw_event->sample  = 0;
+	new_raw_event->phase   = 0;
+	new_raw_event->tot     = 0;
+	new_raw_event->lost    = 0;
+	new_raw_event->epoch   = 0;
+	new_raw_event->channel = (payload>>26) & 0x3;
+	if (subtype == TDC_CONTROL_LOSS) {
+		new_raw_event->lost  = payload & 0x3ffffff;
+		new_raw_event->kind  = TDC_RAW_LOSS;
+		return 1;
+	}
+	if (subtype == TDC_CONTROL_SYNC) {
+		new_raw_event->epoch = payload & 0x3ffffff;
+		new_raw_event->kind  = TDC_RAW_SYNC;
+		return 1;
+	}
+	new_raw_event->channel = TDC_TYPE_CONTROL;
+	return 0;
+}
+
 int unpack_raw_event(unsigned char *five_bytes, raw_event_t *new_raw_event)
 {
 	new_raw_event->channel = (five_bytes[0]>>4)&0x7;
 
+	if (new_raw_event->channel == TDC_TYPE_CONTROL) {
+		unsigned long payload = 0;
+		for (int i = 1; i < 5; ++i) {
+			payload = (payload<<7) | (five_bytes[i]&0x7f);
+		}
+		return unpack_control_payload(five_bytes[0]&0x0f, payload, new_raw_event);
+	}
 	if (new_raw_event->channel >= TDC_N_CHANNELS) {
 		//printf("impossible channel number %d\n", new_raw_event->channel);
 		return 0;
@@ -129,9 +269,136 @@ int unpack_raw_event(unsigned char *five_bytes, raw_event_t *new_raw_event)
 	new_raw_event->sample |= (five_bytes[0]&0x0f)   ; new_raw_event->sample <<= 4;
 	new_raw_event->sample |= (five_bytes[1]&0x78)>>3;
 
+	new_raw_event->kind  = TDC_RAW_SAMPLE;
+	new_raw_event->phase = 0;
+	new_raw_event->tot   = 0;
+	new_raw_event->lost  = 0;
+	new_raw_event->epoch = 0;
 	return 1;	
 }
 
+// 39 bits: 2 bit channel, 24 bit time, 3 bit phase, 10 bit time over threshold
+static void unpack_pulse_payload(unsigned long long payload, raw_event_t *new_raw_event)
+{
+	new_raw_event->channel = (payload>>37) & 0x3;
+	new_raw_event->time    = (payload>>13) & 0xffffff;
+	new_raw_event->phase   = (payload>>10) & 0x7;
+	new_raw_event->tot     =  payload      & 0x3ff;
+	new_raw_event->sample  = 0;
+	new_raw_event->kind    = TDC_RAW_PULSE;
+	new_raw_event->lost    = 0;
+	new_raw_event->epoch   = 0;
+}
+
+int unpack_pulse_event(unsigned char *six_bytes, raw_event_t *new_raw_event)
+{
+	unsigned long long payload = six_bytes[0]&0x0f;
+	for (int i = 1; i < 6; ++i) {
+		payload = (payload<<7) | (six_bytes[i]&0x7f);
+	}
+	unpack_pulse_payload(payload, new_raw_event);
+	return 1;
+}
+
+// Records are stored MSB first without gaps. The first 3 bits are the channel,
+// TDC_TYPE_PULSE or TDC_TYPE_CONTROL, which tells the length of the record. 
+// Takes the next record from the n_bits oldest bits, returns 0 if more bits 
+// are needed. Unknown control records get the channel TDC_TYPE_CONTROL.
+static inline int take_record(unsigned long long bits, int *n_bits, raw_event_t *record)
+{
+	if (*n_bits < 3) {
+		return 0;
+	}
+	int type = (bits>>(*n_bits-3)) & 0x7;
+	if (type == TDC_TYPE_PULSE) {
+		if (*n_bits < TDC_PULSE_RECORD_BITS) {
+			return 0;
+		}
+		*n_bits -= TDC_PULSE_RECORD_BITS;
+		unpack_pulse_payload(bits>>*n_bits, record);
+		return 1;
+	}
+	if (*n_bits < TDC_RECORD_BITS) {
+		return 0;
+	}
+	*n_bits -= TDC_RECORD_BITS;
+	unsigned long long value = bits>>*n_bits;
+	if (type == TDC_TYPE_CONTROL) {
+		unpack_control_payload((value>>28) & 0xf, value & 0xfffffff, record);
+		return 1;
+	}
+	record->channel = type;
+	record->time    = (value>>8) & 0xffffff;
+	record->sample  = value & 0xff;
+	record->kind    = TDC_RAW_SAMPLE;
+	record->phase   = 0;
+	record->tot     = 0;
+	record->lost    = 0;
+	record->epoch   = 0;
+	return 1;
+}
+
+int unpack_raw_block(unsigned char *payload, int count, raw_event_t *records)
+{
+	unsigned long long bits = 0;
+	int n_bits = 0, size = 0;
+	for (int i = 0; i < count; ++i) {
+		while (!take_record(bits, &n_bits, &records[i])) {
+			bits = (bits<<8) | payload[size++];
+			n_bits += 8;
+		}
+	}
+	return size;
+}
+
+int pack_raw_block(raw_event_t *records, int count, unsigned char *block)
+{
+	unsigned char *payload = block+3;
+	unsigned long long bits = 0;
+	int n_bits = 0, size = 0;
+	for (int i = 0; i < count; ++i) {
+		if (records[i].kind == TDC_RAW_PULSE) {
+			bits = (bits<<TDC_PULSE_RECORD_BITS)
+			     | ((unsigned long long)TDC_TYPE_PULSE<<39)
+			     | ((unsigned long long)(records[i].channel&0x3)<<37)
+			     | ((records[i].time&0xffffff)<<13)
+			     | ((records[i].phase&0x7)<<10)
+			     | (records[i].tot&0x3ff);
+			n_bits += TDC_PULSE_RECORD_BITS;
+		} else if (records[i].kind == TDC_RAW_LOSS || records[i].kind == TDC_RAW_SYNC) {
+			int sync = records[i].kind == TDC_RAW_SYNC;
+			bits = (bits<<TDC_RECORD_BITS)
+			     | ((unsigned long long)TDC_TYPE_CONTROL<<32)
+			     | ((unsigned long long)(sync ? TDC_CONTROL_SYNC : TDC_CONTROL_LOSS)<<28)
+			     | ((unsigned long long)(records[i].channel&0x3)<<26)
+			     | ((sync ? records[i].epoch : records[i].lost)&0x3ffffff);
+			n_bits += TDC_RECORD_BITS;
+		} else {
+			bits = (bits<<TDC_RECORD_BITS) 
+			     | ((unsigned long long)(records[i].channel&0x7)<<32)
+			     | ((records[i].time&0xffffff)<<8)
+			     | records[i].sample;
+			n_bits += TDC_RECORD_BITS;
+		}
+		while (n_bits >= 8) {
+			n_bits -= 8;
+			payload[size++] = bits>>n_bits;
+		}
+	}
+	if (n_bits) { // zero padding
+		payload[size++] = bits<<(8-n_bits);
+	}
+	unsigned char checksum = count;
+	for (int i = 0; i < size; ++i) {
+		checksum ^= payload[i];
+	}
+	block[0] = TDC_BLOCK_SYNC_0;
+	block[1] = TDC_BLOCK_SYNC_1;
+	block[2] = count;
+	block[3+size] = checksum;
+	return 3+size+1;
+}
+
 int too_quickly(double threshold_sec)
 {
 	static struct timespec then = {.tv_sec=0};
@@ -158,41 +425,433 @@ raw_event_t eof_raw_event() {
 	return eof_raw_evt;
 }
 
-raw_event_t next_raw_event(tdc_t *tdc)
+static void trace_read(tdc_t *tdc, unsigned long long start, int size)
 {
-	raw_event_t new_raw_evt;
-	unsigned char data[5]; // 5 bytes for one event
-	do {
-		data[0] = data[1] = data[2] = data[3] = data[4] = 0;
+	tdc_trace_t *trace = tdc->trace;
+	unsigned long long end = tdc_cycles();
+	if (trace->flags & TDC_TRACE_COUNTERS) {
+		++trace->read_calls;
+		trace->read_cycles += end - start;
+		++trace->read_size_hist[tdc_trace_bin(size)];
+		++trace->batch_cycles_hist[tdc_trace_bin(start - trace->batch_start)];
+	}
+	trace->batch_start = end;
+	tdc_trace_record(trace, end, TDC_TP_READ, size);
+}
+
+static void trace_resync(tdc_t *tdc, int kind)
+{
+	tdc_trace_record(tdc->trace, tdc_cycles(), TDC_TP_RESYNC, kind);
+}
+
+// returns the next input byte or -1 on EOF
+static int next_byte(tdc_t *tdc)
+{
+	if (tdc->read_pos == tdc->read_len) {
+		unsigned long long start = TRACE_ON(tdc) ? tdc_cycles() : 0;
+		// a tty returns whatever arrived so far, 
+		//   frames may be split between two reads
 		int result;
-		// read 5 bytes;
-			while( ((result=read(tdc->fd, &data[0], 5)) != 5) ) {
-				if (!result && too_quickly(0.1)) {// EOF
-					return eof_raw_event();
+		while ((result=read(tdc->fd, tdc->read_buffer, TDC_READ_BUFFER_SIZE)) <= 0) {
+			if (!result && too_quickly(0.1)) { // EOF
+				return -1;
+			}
+			if (result == -1 && errno != EINTR && errno != EAGAIN) { // e.g. EIO on hangup
+				return -1;
+			}
+			if (result == -1 && errno == EAGAIN && tdc->read_mode == TDC_READ_POLL) {
+				struct pollfd pfd = {.fd = tdc->fd, .events = POLLIN};
+				poll(&pfd, 1, -1);
+			}
+		}
+		if (tdc->read_mode != TDC_READ_BLOCKING) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			tdc->read_ns = now.tv_sec*1000000000UL + now.tv_nsec;
+		}
+		tdc->read_pos = 0;
+		tdc->read_len = result;
+		STAT_ADD(tdc->stats.bytes, result);
+		TDC_PROBE1(read, result);
+		if (TRACE_ON(tdc)) {
+			trace_read(tdc, start, result);
+		}
+	}
+	++tdc->raw_offset;
+	return tdc->read_buffer[tdc->read_pos++];
+}
+
+// reads blocks until one is valid, returns 0 on EOF
+static int next_block(tdc_t *tdc)
+{
+	int previous = -1;
+	for (;;) {
+		// everything up to the sync word is skipped
+		int byte = next_byte(tdc);
+		if (byte == -1) {
+			return 0;
+		}
+		if (previous != TDC_BLOCK_SYNC_0 || byte != TDC_BLOCK_SYNC_1) {
+			if (previous != -1) {
+				STAT_INC(tdc->stats.resync_bytes);
+				TDC_PROBE2(resync, 0, tdc->raw_offset);
+				if (TRACE_ON(tdc)) {
+					trace_resync(tdc, 0);
 				}
 			}
+			previous = byte;
+			continue;
+		}
+		previous = -1;
+		unsigned long offset = tdc->raw_offset - 2;
+
+		int count = next_byte(tdc);
+		if (count == -1) {
+			return 0;
+		}
+		// the length of the payload is only known after looking at the records
+		unsigned long long start = TRACE_ON(tdc) ? tdc_cycles() : 0;
+		unsigned char checksum = count;
+		unsigned long long bits = 0;
+		int n_bits = 0;
+		for (int i = 0; i < count; ++i) {
+			while (!take_record(bits, &n_bits, &tdc->block[i])) {
+				if ((byte = next_byte(tdc)) == -1) {
+					return 0;
+				}
+				bits      = (bits<<8) | byte;
+				n_bits   += 8;
+				checksum ^= byte;
+			}
+		}
+		if (TRACE_ON(tdc)) {
+			tdc->trace->unpack_calls  += count;
+			tdc->trace->unpack_cycles += tdc_cycles() - start;
+		}
+		if ((byte = next_byte(tdc)) == -1) {
+			return 0;
+		}
+		if (count == 0 || byte != checksum) {
+			// the search for the next sync word starts after this block
+			STAT_INC(tdc->stats.invalid_blocks);
+			TDC_PROBE2(resync, 3, tdc->raw_offset);
+			if (TRACE_ON(tdc)) {
+				trace_resync(tdc, 3);
+			}
+			continue;
+		}
+		tdc->block_pos    = 0;
+		tdc->block_len    = count;
+		tdc->block_offset = offset;
+		return 1;
+	}
+}
 
-		// check if data[0] is a header, if not read and shift until this is the case
-		while((data[0]&0x80) != 0x80 ) {
-			data[0] = data[1];
-			data[1] = data[2];
-			data[2] = data[3];
-			data[3] = data[4];
-			while((result=read(tdc->fd, &data[4], 1)) != 1) {
-				if (!result && too_quickly(0.1)) {
-		 			return eof_raw_event();
+static raw_event_t block_raw_event(tdc_t *tdc)
+{
+	for (;;) {
+		while (tdc->block_pos < tdc->block_len) {
+			raw_event_t *record = &tdc->block[tdc->block_pos++];
+			if (record->channel < TDC_N_CHANNELS) {
+				STAT_INC(tdc->stats.frames[record->channel]);
+				TDC_PROBE1(frame, record->channel);
+				if (TRACE_ON(tdc)) {
+					tdc_trace_record(tdc->trace, tdc_cycles(), TDC_TP_FRAME, record->channel);
 				}
+				return *record;
+			}
+			STAT_INC(tdc->stats.invalid_frames);
+			TDC_PROBE2(resync, 2, tdc->raw_offset);
+			if (TRACE_ON(tdc)) {
+				trace_resync(tdc, 2);
 			}
 		}
-	} while (!unpack_raw_event(data, &new_raw_evt));
-	// check for impossible channel number because that could cause SEGFAULTS later
+		if (!next_block(tdc)) {
+			return eof_raw_event();
+		}
+	}
+}
+
+static raw_event_t raw_event(tdc_t *tdc)
+{
+	if (tdc->format == TDC_FORMAT_BLOCKS) {
+		return block_raw_event(tdc);
+	}
+	raw_event_t new_raw_evt;
+	unsigned char data[6]; // 5 bytes for one event, 6 for a pulse
+	int n = 0;             // number of bytes collected in data
+	int length = 5;
+	for (;;) {
+		int byte = next_byte(tdc);
+		if (byte == -1) {
+			return eof_raw_event();
+		}
+		if (byte&0x80) { // a header starts a new frame, an incomplete frame is dropped
+			if (n != 0) {
+				STAT_INC(tdc->stats.truncated_frames);
+				TDC_PROBE2(resync, 1, tdc->raw_offset);
+				if (TRACE_ON(tdc)) {
+					trace_resync(tdc, 1);
+				}
+			}
+			n = 0;
+			length = ((byte>>4)&0x7) == TDC_TYPE_PULSE ? 6 : 5;
+		} else if (n == 0) { // not a header, skip until we find one
+			STAT_INC(tdc->stats.resync_bytes);
+			TDC_PROBE2(resync, 0, tdc->raw_offset);
+			if (TRACE_ON(tdc)) {
+				trace_resync(tdc, 0);
+			}
+			continue;
+		}
+		data[n++] = byte;
+		if (n == length) {
+			n = 0;
+			// check for impossible channel number because that could cause SEGFAULTS later
+			int valid;
+			if (TRACE_ON(tdc)) {
+				unsigned long long start = tdc_cycles();
+				valid = length == 6 ? unpack_pulse_event(data, &new_raw_evt) : unpack_raw_event(data, &new_raw_evt);
+				unsigned long long end = tdc_cycles();
+				++tdc->trace->unpack_calls;
+				tdc->trace->unpack_cycles += end - start;
+				if (valid) {
+					tdc_trace_record(tdc->trace, end, TDC_TP_FRAME, new_raw_evt.channel);
+				}
+			} else {
+				valid = length == 6 ? unpack_pulse_event(data, &new_raw_evt) : unpack_raw_event(data, &new_raw_evt);
+			}
+			if (valid) {
+				STAT_INC(tdc->stats.frames[new_raw_evt.channel]);
+				TDC_PROBE1(frame, new_raw_evt.channel);
+				return new_raw_evt;
+			}
+			STAT_INC(tdc->stats.invalid_frames);
+			TDC_PROBE2(resync, 2, tdc->raw_offset);
+			if (TRACE_ON(tdc)) {
+				trace_resync(tdc, 2);
+			}
+		}
+	}
+}
+
+raw_event_t next_raw_event(tdc_t *tdc)
+{
+	if (!TRACE_ON(tdc)) {
+		return raw_event(tdc);
+	}
+	unsigned long long start = tdc_cycles();
+	raw_event_t new_raw_evt = raw_event(tdc);
+	tdc->trace->raw_cycles += tdc_cycles() - start;
 	return new_raw_evt;
 }
 
-tdc_event_t tdc_next_event(tdc_t *tdc)
+// the overflow rule is tdc_counter_overflowed() in tdc_rules.h
+static void resume_time(tdc_t *tdc, int ch, unsigned long time);
+
+static inline void update_time(tdc_t *tdc, int ch, unsigned long time)
+{
+	if (tdc->started[ch] == TDC_STARTED_RESUMED) {
+		resume_time(tdc, ch, time);
+	} else if (tdc_counter_overflowed(tdc->started[ch], tdc->time[ch], time)) {
+		++tdc->overflow_count[ch];
+		STAT_INC(tdc->stats.overflows[ch]);
+	}
+	tdc->started[ch] = 1;
+	tdc->time[ch]    = time;
+}
+
+// builds the event of an edge that is returned
+static inline void make_event(tdc_t *tdc, tdc_event_t *new_event, int ch, edge_t edge, unsigned long time, unsigned char sample)
+{
+	new_event->channel = ch;
+	new_event->time    = time;
+	new_event->dt      = time - tdc->previous_time[ch];
+	new_event->edge    = edge;
+	new_event->sample  = sample;
+	new_event->lost    = 0;
+	new_event->tot     = edge == TDC_EDGE_FALLING && (tdc->rising & (1<<ch)) ? time - tdc->rise_time[ch] : 0;
+	tdc->previous_time[ch] = time;
+	if (tdc->sample_stat_total < 100000) {
+		++tdc->sample_stat[ch][time%8];
+		++tdc->sample_stat_total;
+	}
+	STAT_INC(tdc->stats.edges[ch][edge]);
+}
+
+//////////////////////////////////////////
+// filter stage, see tdc_filter_t
+//////////////////////////////////////////
+
+enum filter_state {
+	FILTER_IDLE,     // between pulses
+	FILTER_OPEN,     // the rising edge passed, so does the falling edge
+	FILTER_HELD,     // the rising edge waits for the ToT of the pulse
+	FILTER_DEADTIME, // the pulse is rejected, so is the falling edge
+	FILTER_TOT,
+	FILTER_PRESCALED,
+};
+
+void tdc_set_filter(tdc_t *tdc, int channel, const tdc_filter_t *filter)
+{
+	if (filter) {
+		tdc->filter[channel] = *filter;
+	} else {
+		memset(&tdc->filter[channel], 0, sizeof(tdc_filter_t));
+	}
+	memset(&tdc->filter_state[channel], 0, sizeof(tdc_filter_state_t));
+	tdc->filtered = 0;
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		tdc_filter_t *f = &tdc->filter[ch];
+		if (f->deadtime || f->min_tot || f->max_tot || f->prescale_m > 1 || f->polarity != TDC_POLARITY_BOTH) {
+			tdc->filtered |= 1<<ch;
+		}
+	}
+}
+
+static inline int has_tot_window(tdc_filter_t *filter)
+{
+	return filter->min_tot || filter->max_tot;
+}
+
+static inline int prescale(tdc_filter_t *filter, tdc_filter_state_t *state)
+{
+	if (filter->prescale_m < 2) {
+		return 1;
+	}
+	int keep = state->prescale_count < filter->prescale_n;
+	if (++state->prescale_count == filter->prescale_m) {
+		state->prescale_count = 0;
+	}
+	return keep;
+}
+
+static inline void reject(tdc_t *tdc, int ch, int reason, int n_edges)
+{
+	tdc->filter_state[ch].state = reason;
+	switch (reason) {
+		case FILTER_DEADTIME:  STAT_ADD(tdc->stats.filter_deadtime[ch],  n_edges); break;
+		case FILTER_TOT:       STAT_ADD(tdc->stats.filter_tot[ch],       n_edges); break;
+		case FILTER_PRESCALED: STAT_ADD(tdc->stats.filter_prescaled[ch], n_edges); break;
+	}
+}
+
+// the last step: builds the event if the polarity is selected
+static inline int pass(tdc_t *tdc, tdc_event_t *new_event, int ch, edge_t edge, unsigned long time, unsigned char sample)
+{
+	tdc_polarity_t polarity = tdc->filter[ch].polarity;
+	if ((polarity == TDC_POLARITY_RISING && edge != TDC_EDGE_RISING) ||
+	    (polarity == TDC_POLARITY_FALLING && edge != TDC_EDGE_FALLING)) {
+		STAT_INC(tdc->stats.filter_polarity[ch]);
+		return 0;
+	}
+	STAT_INC(tdc->stats.filter_passed[ch]);
+	make_event(tdc, new_event, ch, edge, time, sample);
+	return 1;
+}
+
+// Decides on an edge of a filtered channel. Returns 1 if new_event is an
+// event to return, which may be a held rising edge with the falling
+// edge queued behind it.
+static int filter_edge(tdc_t *tdc, tdc_event_t *new_event, int ch, edge_t edge, unsigned long time, unsigned char sample)
+{
+	tdc_filter_t       *filter = &tdc->filter[ch];
+	tdc_filter_state_t *state  = &tdc->filter_state[ch];
+	if (edge == TDC_EDGE_RISING) {
+		if (state->state == FILTER_HELD) { // the falling edge was lost
+			STAT_INC(tdc->stats.filter_tot[ch]);
+		}
+		if (filter->deadtime) {
+			if (state->last_rise && time - state->last_rise < filter->deadtime) {
+				reject(tdc, ch, FILTER_DEADTIME, 1);
+				return 0;
+			}
+			state->last_rise = time;
+		}
+		if (has_tot_window(filter)) {
+			state->state       = FILTER_HELD;
+			state->held_time   = time;
+			state->held_sample = sample;
+			return 0;
+		}
+		if (!prescale(filter, state)) {
+			reject(tdc, ch, FILTER_PRESCALED, 1);
+			return 0;
+		}
+		state->state = FILTER_OPEN;
+		return pass(tdc, new_event, ch, edge, time, sample);
+	}
+
+	// falling edge
+	int previous = state->state;
+	state->state = FILTER_IDLE;
+	switch (previous) {
+		case FILTER_OPEN:
+			return pass(tdc, new_event, ch, edge, time, sample);
+		case FILTER_DEADTIME:
+		case FILTER_TOT:
+		case FILTER_PRESCALED:
+			reject(tdc, ch, previous, 1);
+			state->state = FILTER_IDLE;
+			return 0;
+		case FILTER_HELD:
+			break;
+		default: // no rising edge before, the ToT is unknown
+			if (has_tot_window(filter)) {
+				STAT_INC(tdc->stats.filter_tot[ch]);
+				return 0;
+			}
+			return pass(tdc, new_event, ch, edge, time, sample);
+	}
+	unsigned long tot = time - state->held_time;
+	if (tot < filter->min_tot || (filter->max_tot && tot > filter->max_tot)) {
+		reject(tdc, ch, FILTER_TOT, 2);
+		state->state = FILTER_IDLE;
+		return 0;
+	}
+	if (!prescale(filter, state)) {
+		reject(tdc, ch, FILTER_PRESCALED, 2);
+		state->state = FILTER_IDLE;
+		return 0;
+	}
+	if (pass(tdc, new_event, ch, TDC_EDGE_RISING, state->held_time, state->held_sample)) {
+		if (pass(tdc, tdc->queued_event, ch, edge, time, sample)) {
+			tdc->queued = 1;
+		}
+		return 1;
+	}
+	return pass(tdc, new_event, ch, edge, time, sample);
+}
+
+// Returns 1 if the edge becomes an event. The rising edge is kept before
+// the filter, so the falling edge has its ToT even if the filter drops the
+// rising edge.
+static inline int take_edge(tdc_t *tdc, tdc_event_t *new_event, int ch, edge_t edge, unsigned long time, unsigned char sample)
 {
-	tdc_event_t new_event;
+	if (edge == TDC_EDGE_RISING) {
+		tdc->rise_time[ch] = time;
+		tdc->rising       |= 1<<ch;
+	}
+	int taken = 1;
+	if (tdc->filtered & (1<<ch)) {
+		taken = filter_edge(tdc, new_event, ch, edge, time, sample);
+	} else {
+		make_event(tdc, new_event, ch, edge, time, sample);
+	}
+	if (edge == TDC_EDGE_FALLING) {
+		tdc->rising &= ~(1<<ch);
+	}
+	return taken;
+}
+
+static tdc_event_t next_event(tdc_t *tdc)
+{
+	tdc_event_t new_event = {.lost = 0};
 	int need_to_scan = 1;
+	if (tdc->queued) {
+		tdc->queued = 0;
+		return *tdc->queued_event;
+	}
 	for (;;) {
 		if (need_to_scan) {
 			//printf("scanning\n");
@@ -208,38 +867,16 @@ tdc_event_t tdc_next_event(tdc_t *tdc)
 					int indicator = (sample>>(*idx-1))&0x03;
 					//printf("idx %d    indicator %d\n", *idx, indicator);
 					--*idx;
-					switch(indicator) {
-						case 1: //rising edge
-							new_event.channel = ch;
-							new_event.time    = ( ( tdc->time[ch] + (tdc->overflow_count[ch]<<24) ) << 3 ) + (7-*idx);
-							new_event.dt      = new_event.time - tdc->previous_time[ch];
-							tdc->previous_time[ch] = new_event.time;
-							new_event.edge    = TDC_EDGE_RISING;
-							new_event.sample  = sample;
-							if (tdc->sample_stat_total < 100000) {
-								++tdc->sample_stat[ch][7-*idx];
-								++tdc->sample_stat_total;
-							}
+					if (indicator == 1 || indicator == 2) { // 1: rising edge, 2: falling edge
+						unsigned long time = tdc_edge_ns(tdc->overflow_count[ch], tdc->time[ch], *idx+1);
+						edge_t edge = indicator == 1 ? TDC_EDGE_RISING : TDC_EDGE_FALLING;
+						if (take_edge(tdc, &new_event, ch, edge, time, sample)) {
 							return new_event;
-						break;
-						case 2: //falling edge
-							new_event.channel = ch;
-							new_event.time    = ( ( tdc->time[ch] + (tdc->overflow_count[ch]<<24) ) << 3 ) + (7-*idx);
-							new_event.dt      = new_event.time - tdc->previous_time[ch];
-							tdc->previous_time[ch] = new_event.time;
-							new_event.edge    = TDC_EDGE_FALLING;
-							new_event.sample  = sample;
-							if (tdc->sample_stat_total < 100000) {
-								++tdc->sample_stat[ch][7-*idx];
-								++tdc->sample_stat_total;
-							}
-							return new_event;
-						break;
+						}
 					}
 				}
 			}
 		}
-
 		// no events pending. Load new data
 		raw_event_t revent = next_raw_event(tdc);
 		int           ch = revent.channel;
@@ -247,14 +884,76 @@ tdc_event_t tdc_next_event(tdc_t *tdc)
 			new_event.channel = -1;
 			return new_event;
 		}
+		if (revent.kind == TDC_RAW_SYNC) {
+			// the epoch is the truth, the words up to the next overflow are later than the sync
+			STAT_INC(tdc->stats.syncs[ch]);
+			if (tdc->started[ch] && !tdc->unsynced[ch] && tdc->overflow_count[ch] != revent.epoch) {
+				long missed = (long)revent.epoch - (long)tdc->overflow_count[ch];
+				STAT_ADD(tdc->stats.repaired_wraps[ch], labs(missed));
+			}
+			tdc_apply_sync(&tdc->started[ch], &tdc->time[ch], &tdc->overflow_count[ch], revent.epoch);
+			tdc->rising &= ~(1<<ch); // a ToT across the sync would mix the old and the new time
+			if (tdc->unsynced[ch]) {
+				tdc->unsynced[ch] = 0;
+				tdc->lost[ch]     = 1; // the level is unknown
+			}
+			need_to_scan = 0;
+			continue;
+		}
+		if (tdc->unsynced[ch]) {
+			STAT_INC(tdc->stats.unsynced_words);
+			need_to_scan = 0;
+			continue;
+		}
+		if (revent.kind == TDC_RAW_LOSS) {
+			// the level after the lost words is unknown, edges between the
+			// last sample and the next one would be made up
+			tdc->lost[ch] = 1;
+			tdc->rising  &= ~(1<<ch);
+			if (tdc->filter_state[ch].state == FILTER_HELD) { // the pulse is incomplete
+				STAT_INC(tdc->stats.filter_tot[ch]);
+			}
+			tdc->filter_state[ch].state = FILTER_IDLE;
+			STAT_ADD(tdc->stats.lost_words[ch], revent.lost);
+			new_event.channel = ch;
+			new_event.time    = tdc_word_ns(tdc->overflow_count[ch], tdc->time[ch]);
+			new_event.dt      = 0;
+			new_event.edge    = TDC_EDGE_LOSS;
+			new_event.sample  = 0;
+			new_event.lost    = revent.lost;
+			return new_event;
+		}
+		if (revent.kind == TDC_RAW_PULSE) {
+			// return the rising edge now and the falling edge with the next call,
+			// afterwards the channel is low like after a sample with a falling edge
+			update_time(tdc, ch, revent.time);
+			unsigned long fall_time = tdc_word_ns(tdc->overflow_count[ch], revent.time) + revent.phase;
+			unsigned long rise_time = fall_time - revent.tot;
+			tdc->sample[ch]     = tdc_sample_after_pulse(revent.phase);
+			tdc->sample_idx[ch] = 0;
+			tdc->lost[ch]       = 0;
+			int rising = take_edge(tdc, &new_event, ch, TDC_EDGE_RISING, rise_time, 0xff>>(rise_time%8));
+			tdc_event_t *falling = rising ? tdc->queued_event : &new_event;
+			if (take_edge(tdc, falling, ch, TDC_EDGE_FALLING, fall_time, ~(0xff>>(fall_time%8)))) {
+				if (!rising) {
+					return new_event;
+				}
+				tdc->queued = 1;
+			}
+			if (rising) {
+				return new_event;
+			}
+			need_to_scan = 0;
+			continue;
+		}
 		unsigned char new_sample = revent.sample;
 		//if (ch == 0)
 			//printf("NEW channel %d, time %d, old_sample %02x, sample %02x\n", revent.channel, revent.time, tdc->sample[ch], new_sample);
-		if (revent.time == 0) {
-			++tdc->overflow_count[ch]; // overflow of the hardware counter
-			//printf("cahnnel %d overflow %ld  time %ld \n", ch, tdc->overflow_count[ch], revent.time);
-		} 
-		tdc->time[ch] = revent.time;
+		update_time(tdc, ch, revent.time);
+		if (tdc->lost[ch]) { // no edge at the start of the first sample after a loss
+			tdc->sample[ch] = tdc_sample_after_loss(new_sample);
+			tdc->lost[ch]   = 0;
+		}
 		if (stays_high_between_samples(tdc->sample[ch], new_sample)) {
 			tdc->sample[ch] = new_sample;
 			if (new_sample == 0xff) { // no edge there
@@ -275,40 +974,49 @@ tdc_event_t tdc_next_event(tdc_t *tdc)
 			}
 			continue;
 		}
-		new_event.channel = ch;
-		new_event.time    = (tdc->time[ch] + (tdc->overflow_count[ch]<<24)) << 3; 
-		new_event.dt      = new_event.time - tdc->previous_time[ch];
-		tdc->previous_time[ch] = new_event.time;
-		new_event.sample   = new_sample;
+		// the edge is at the start of the sample
+		unsigned long time = tdc_edge_ns(tdc->overflow_count[ch], tdc->time[ch], 8);
+		edge_t edge;
 		//printf("goes goes_low_between_samples?\n");
 		if (goes_low_between_samples(tdc->sample[ch], new_sample)) {
-			//printf("goes goes_low_between_samples!\n");
-			new_event.edge  = TDC_EDGE_FALLING;
-			tdc->sample[ch] = new_sample;
-			tdc->sample_idx[ch] = 7;
-			if (tdc->sample_stat_total < 100000) {
-				++tdc->sample_stat[ch][0];
-				++tdc->sample_stat_total;
-			}
-			return new_event;
+			edge = TDC_EDGE_FALLING;
+		} else if (goes_high_between_samples(tdc->sample[ch], new_sample)) {
+			edge = TDC_EDGE_RISING;
+		} else {
+			// you should never get here
+			STAT_INC(tdc->stats.inconsistent_samples);
+			continue;
 		}
-		//printf("goes goes_high_between_samples?\n");
-		if (goes_high_between_samples(tdc->sample[ch], new_sample)) {
-			//printf("goes goes_high_between_samples!\n");
-			new_event.edge  = TDC_EDGE_RISING;
-			tdc->sample[ch] = new_sample;
-			tdc->sample_idx[ch] = 7;
-			if (tdc->sample_stat_total < 100000) {
-				++tdc->sample_stat[ch][0];
-				++tdc->sample_stat_total;
-			}
+		tdc->sample[ch]     = new_sample;
+		tdc->sample_idx[ch] = 7;
+		if (take_edge(tdc, &new_event, ch, edge, time, new_sample)) {
 			return new_event;
 		}
-		printf("you should never see this text\n" );
+		need_to_scan = 1;
 	}
 
 }
 
+tdc_event_t tdc_next_event(tdc_t *tdc)
+{
+	if (!TRACE_ON(tdc)) {
+		tdc_event_t new_event = next_event(tdc);
+		TDC_PROBE2(event, new_event.channel, new_event.edge);
+		return new_event;
+	}
+	tdc_trace_t *trace = tdc->trace;
+	unsigned long long raw_cycles = trace->raw_cycles;
+	unsigned long long start      = tdc_cycles();
+	tdc_event_t new_event = next_event(tdc);
+	unsigned long long end        = tdc_cycles();
+	if (trace->flags & TDC_TRACE_COUNTERS) {
+		++trace->events;
+		trace->event_cycles += (end - start) - (trace->raw_cycles - raw_cycles);
+	}
+	tdc_trace_record(trace, end, TDC_TP_EVENT, new_event.channel | (new_event.edge<<8));
+	return new_event;
+}
+
 int stays_high_between_samples(unsigned char last_sample, unsigned char new_sample)
 {   
 	// last_sample  new_sample
@@ -354,3 +1062,289 @@ int tdc_get_level(tdc_t *tdc, int channel)
 {
 	return (tdc->sample[channel]>>tdc->sample_idx[channel]) & 0x01;
 }
+
+// The first word of a channel after TDC_RESUME_LIVE. Of all overflow counts
+// the one is taken that puts the word closest to the time that passed since
+// the checkpoint, but never before the last word.
+static void resume_time(tdc_t *tdc, int ch, unsigned long time)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long gap = ((long)(now.tv_sec*1000000000UL + now.tv_nsec) - (long)tdc->resume_wall_ns)/8;
+	long last = (tdc->overflow_count[ch]<<24) + tdc->time[ch];
+	long overflow = (last + (gap > 0 ? gap : 0) - (long)time + (1L<<23)) >> 24;
+	if (overflow < (long)tdc->overflow_count[ch]) {
+		overflow = tdc->overflow_count[ch];
+	}
+	if ((overflow<<24) + (long)time < last) {
+		++overflow;
+	}
+	STAT_ADD(tdc->stats.overflows[ch], overflow - tdc->overflow_count[ch]);
+	tdc->overflow_count[ch] = overflow;
+}
+
+// FNV-1a over everything after the checksum field
+static uint32_t checkpoint_checksum(const tdc_checkpoint_t *checkpoint)
+{
+	const unsigned char *bytes = (const unsigned char*)checkpoint;
+	uint32_t hash = 2166136261u;
+	for (size_t i = offsetof(tdc_checkpoint_t, wall_ns); i < sizeof(tdc_checkpoint_t); ++i) {
+		hash = (hash ^ bytes[i])*16777619u;
+	}
+	return hash;
+}
+
+_Static_assert(sizeof(tdc_checkpoint_t) == TDC_CHECKPOINT_SIZE, "the checkpoint layout depends on the ABI");
+_Static_assert(offsetof(tdc_checkpoint_t, queued_event) == 400, "the checkpoint layout depends on the ABI");
+
+static void checkpoint_event(tdc_checkpoint_event_t *to, const tdc_event_t *from)
+{
+	to->time    = from->time;
+	to->dt      = from->dt;
+	to->lost    = from->lost;
+	to->tot     = from->tot;
+	to->channel = from->channel;
+	to->edge    = from->edge;
+	to->sample  = from->sample;
+}
+
+static void restore_event(tdc_event_t *to, const tdc_checkpoint_event_t *from)
+{
+	memset(to, 0, sizeof(tdc_event_t));
+	to->time    = from->time;
+	to->dt      = from->dt;
+	to->lost    = from->lost;
+	to->tot     = from->tot;
+	to->channel = from->channel;
+	to->edge    = from->edge;
+	to->sample  = from->sample;
+}
+
+static void checkpoint_filter(tdc_checkpoint_filter_t *to, const tdc_filter_t *from)
+{
+	to->deadtime   = from->deadtime;
+	to->min_tot    = from->min_tot;
+	to->max_tot    = from->max_tot;
+	to->prescale_n = from->prescale_n;
+	to->prescale_m = from->prescale_m;
+	to->polarity   = from->polarity;
+}
+
+static void restore_filter(tdc_filter_t *to, const tdc_checkpoint_filter_t *from)
+{
+	memset(to, 0, sizeof(tdc_filter_t));
+	to->deadtime   = from->deadtime;
+	to->min_tot    = from->min_tot;
+	to->max_tot    = from->max_tot;
+	to->prescale_n = from->prescale_n;
+	to->prescale_m = from->prescale_m;
+	to->polarity   = from->polarity;
+}
+
+static void checkpoint_filter_state(tdc_checkpoint_filter_state_t *to, const tdc_filter_state_t *from)
+{
+	to->last_rise      = from->last_rise;
+	to->held_time      = from->held_time;
+	to->state          = from->state;
+	to->prescale_count = from->prescale_count;
+	to->held_sample    = from->held_sample;
+}
+
+static void restore_filter_state(tdc_filter_state_t *to, const tdc_checkpoint_filter_state_t *from)
+{
+	memset(to, 0, sizeof(tdc_filter_state_t));
+	to->last_rise      = from->last_rise;
+	to->held_time      = from->held_time;
+	to->state          = from->state;
+	to->prescale_count = from->prescale_count;
+	to->held_sample    = from->held_sample;
+}
+
+void tdc_checkpoint_take(tdc_t *tdc, tdc_checkpoint_t *checkpoint)
+{
+	memset(checkpoint, 0, sizeof(tdc_checkpoint_t)); // the padding is part of the checksum
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	checkpoint->magic         = TDC_CHECKPOINT_MAGIC;
+	checkpoint->version       = TDC_CHECKPOINT_VERSION;
+	checkpoint->size          = sizeof(tdc_checkpoint_t);
+	checkpoint->wall_ns       = now.tv_sec*1000000000UL + now.tv_nsec;
+	checkpoint->raw_offset    = tdc->raw_offset;
+	checkpoint->block_offset  = tdc->block_offset;
+	checkpoint->block_pos     = tdc->block_pos;
+	checkpoint->block_len     = tdc->block_len;
+	checkpoint->format        = tdc->format;
+	checkpoint->mode_register = tdc->mode_register;
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		checkpoint->time[ch]           = tdc->time[ch];
+		checkpoint->previous_time[ch]  = tdc->previous_time[ch];
+		checkpoint->overflow_count[ch] = tdc->overflow_count[ch];
+		checkpoint->rise_time[ch]      = tdc->rise_time[ch];
+		checkpoint->sample[ch]         = tdc->sample[ch];
+		checkpoint->sample_idx[ch]     = tdc->sample_idx[ch];
+		checkpoint->lost[ch]           = tdc->lost[ch];
+		checkpoint->started[ch]        = tdc->started[ch];
+		checkpoint->unsynced[ch]       = tdc->unsynced[ch];
+		for (int s = 0; s < 8; ++s) {
+			checkpoint->sample_stat[ch][s] = tdc->sample_stat[ch][s];
+		}
+		checkpoint_filter(&checkpoint->filter[ch], &tdc->filter[ch]);
+		checkpoint_filter_state(&checkpoint->filter_state[ch], &tdc->filter_state[ch]);
+	}
+	checkpoint->sample_stat_total = tdc->sample_stat_total;
+	checkpoint->queued            = tdc->queued;
+	if (tdc->queued) {
+		checkpoint_event(&checkpoint->queued_event, tdc->queued_event);
+	}
+	checkpoint->filtered = tdc->filtered;
+	checkpoint->rising   = tdc->rising;
+	checkpoint->checksum = checkpoint_checksum(checkpoint);
+}
+
+int tdc_checkpoint_restore(tdc_t *tdc, const tdc_checkpoint_t *checkpoint, int mode)
+{
+	if (checkpoint->magic != TDC_CHECKPOINT_MAGIC || checkpoint->version != TDC_CHECKPOINT_VERSION
+			|| checkpoint->size != sizeof(tdc_checkpoint_t) || checkpoint->checksum != checkpoint_checksum(checkpoint)) {
+		fprintf(stderr, "invalid checkpoint\n");
+		return 0;
+	}
+	tdc->format        = checkpoint->format;
+	tdc->mode_register = checkpoint->mode_register;
+	if (mode == TDC_RESUME_CAPTURE) {
+		// the records of a block that are left are read again
+		int in_block = checkpoint->block_pos < checkpoint->block_len;
+		unsigned long offset = in_block ? checkpoint->block_offset : checkpoint->raw_offset;
+		if (!tdc_seek(tdc, offset)) {
+			fprintf(stderr, "cannot seek to the checkpoint at %lu: %s\n", offset, strerror(errno));
+			return 0;
+		}
+		if (in_block && (!next_block(tdc) || tdc->block_len != checkpoint->block_len
+				|| tdc->raw_offset != checkpoint->raw_offset)) {
+			fprintf(stderr, "the capture has no block at %lu like the checkpoint\n", offset);
+			return 0;
+		}
+		tdc->block_pos = checkpoint->block_pos;
+	}
+	tdc->block_offset = checkpoint->block_offset;
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		tdc->time[ch]           = checkpoint->time[ch];
+		tdc->previous_time[ch]  = checkpoint->previous_time[ch];
+		tdc->overflow_count[ch] = checkpoint->overflow_count[ch];
+		tdc->rise_time[ch]      = checkpoint->rise_time[ch];
+		tdc->sample[ch]         = checkpoint->sample[ch];
+		tdc->sample_idx[ch]     = checkpoint->sample_idx[ch];
+		tdc->lost[ch]           = checkpoint->lost[ch];
+		tdc->started[ch]        = checkpoint->started[ch];
+		tdc->unsynced[ch]       = checkpoint->unsynced[ch];
+		for (int s = 0; s < 8; ++s) {
+			tdc->sample_stat[ch][s] = checkpoint->sample_stat[ch][s];
+		}
+		restore_filter(&tdc->filter[ch], &checkpoint->filter[ch]);
+		restore_filter_state(&tdc->filter_state[ch], &checkpoint->filter_state[ch]);
+	}
+	tdc->sample_stat_total = checkpoint->sample_stat_total;
+	tdc->queued            = checkpoint->queued;
+	restore_event(tdc->queued_event, &checkpoint->queued_event);
+	tdc->filtered          = checkpoint->filtered;
+	tdc->rising            = checkpoint->rising;
+	if (mode == TDC_RESUME_LIVE) {
+		tdc->resume_wall_ns = checkpoint->wall_ns;
+		tdc->rising         = 0;
+		for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+			// the edges of the last sample were returned before the
+			// checkpoint or are lost with the pulses in the gap
+			tdc->sample_idx[ch] = 0;
+			tdc->lost[ch]       = 1;
+			if (tdc->started[ch]) {
+				tdc->started[ch] = TDC_STARTED_RESUMED;
+			}
+			if (tdc->filter_state[ch].state == FILTER_HELD) {
+				tdc->filter_state[ch].state = FILTER_IDLE;
+			}
+		}
+	}
+	return 1;
+}
+
+int tdc_checkpoint_write(const char *filename, const tdc_checkpoint_t *checkpoint)
+{
+	char tmp_name[4096];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", filename);
+	int fd = open(tmp_name, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1) {
+		fprintf(stderr, "cannot write checkpoint %s: %s\n", tmp_name, strerror(errno));
+		return 0;
+	}
+	int ok = write(fd, checkpoint, sizeof(tdc_checkpoint_t)) == sizeof(tdc_checkpoint_t) && fsync(fd) == 0;
+	close(fd);
+	if (!ok || rename(tmp_name, filename) == -1) {
+		fprintf(stderr, "cannot write checkpoint %s: %s\n", filename, strerror(errno));
+		unlink(tmp_name);
+		return 0;
+	}
+	return 1;
+}
+
+int tdc_checkpoint_read(const char *filename, tdc_checkpoint_t *checkpoint)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		return 0;
+	}
+	int ok = read(fd, checkpoint, sizeof(tdc_checkpoint_t)) == sizeof(tdc_checkpoint_t);
+	close(fd);
+	return ok;
+}
+
+void tdc_get_stats(tdc_t *tdc, tdc_stats_t *stats)
+{
+	unsigned long *src = &tdc->stats.bytes;
+	unsigned long *dst = &stats->bytes;
+	int n = (sizeof(tdc_stats_t) - offsetof(tdc_stats_t, bytes)) / sizeof(unsigned long);
+	for (int i = 0; i < n; ++i) {
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stats->time = now.tv_sec + 1e-9*now.tv_nsec;
+}
+
+// one line with the rates between two snapshots
+void tdc_print_stats(FILE *out, tdc_stats_t *previous, tdc_stats_t *current)
+{
+	double dt = current->time - previous->time;
+	if (dt <= 0) {
+		return;
+	}
+	fprintf(out, "stats %.3f MB/s", 1e-6*(current->bytes - previous->bytes)/dt);
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		fprintf(out, " | ch%d frames %.0f Hz rising %.0f Hz falling %.0f Hz ovf %lu lost %lu", ch,
+			(current->frames[ch] - previous->frames[ch])/dt,
+			(current->edges[ch][TDC_EDGE_RISING]  - previous->edges[ch][TDC_EDGE_RISING])/dt,
+			(current->edges[ch][TDC_EDGE_FALLING] - previous->edges[ch][TDC_EDGE_FALLING])/dt,
+			current->overflows[ch], current->lost_words[ch]);
+	}
+	unsigned long syncs = 0, repaired = 0;
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		syncs    += current->syncs[ch];
+		repaired += current->repaired_wraps[ch];
+	}
+	fprintf(out, " | resync %lu truncated %lu invalid %lu inconsistent %lu bad_blocks %lu syncs %lu repaired %lu",
+		current->resync_bytes, current->truncated_frames,
+		current->invalid_frames, current->inconsistent_samples,
+		current->invalid_blocks, syncs, repaired);
+	unsigned long passed = 0, deadtime = 0, tot = 0, prescaled = 0, polarity = 0;
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		passed    += current->filter_passed[ch];
+		deadtime  += current->filter_deadtime[ch];
+		tot       += current->filter_tot[ch];
+		prescaled += current->filter_prescaled[ch];
+		polarity  += current->filter_polarity[ch];
+	}
+	if (passed + deadtime + tot + prescaled + polarity) {
+		fprintf(out, " | filter passed %lu deadtime %lu tot %lu prescaled %lu polarity %lu",
+			passed, deadtime, tot, prescaled, polarity);
+	}
+	fprintf(out, "\n");
+	fflush(out);
+}
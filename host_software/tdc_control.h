@@ -1,8 +1,121 @@
 #ifndef GET_EVENT_H
 #define GET_EVENT_H
 
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define TDC_N_CHANNELS 4
 #define TDC_THRESHOLD_RANGE 4096
+#define TDC_READ_BUFFER_SIZE 4096
+
+// block format, see gateware/src/block_encoder.vhd
+#define TDC_BLOCK_SYNC_0      0xa5
+#define TDC_BLOCK_SYNC_1      0x5a
+#define TDC_BLOCK_MAX_RECORDS 255
+#define TDC_RECORD_BITS       35 // 3 bit channel, 24 bit time, 8 bit sample
+#define TDC_PULSE_RECORD_BITS 42 // 3 bit type, 2 bit channel, 24 bit time, 3 bit phase, 10 bit ToT
+#define TDC_BLOCK_PAYLOAD_SIZE(count) (((count)*TDC_RECORD_BITS+7)/8) // without pulse records
+#define TDC_BLOCK_MAX_SIZE    (3+(TDC_BLOCK_MAX_RECORDS*TDC_PULSE_RECORD_BITS+7)/8+1)
+
+// the channel field of pulse frames and records (6 byte frames)
+#define TDC_TYPE_PULSE 4
+// the channel field of control frames and records (5 byte frames, 35 bit records),
+// followed by a 4 bit subtype and 28 bits payload
+#define TDC_TYPE_CONTROL 7
+#define TDC_CONTROL_LOSS 0 // 2 bit channel, 26 bit number of words the board dropped
+#define TDC_CONTROL_SYNC 1 // 2 bit channel, 26 bit epoch: overflows of the 24 bit time counter
+
+// mode register (address 12)
+#define TDC_MODE_BLOCKS 0x01
+#define TDC_MODE_PULSES 0x02
+#define TDC_MODE_SYNC   0x04
+
+//////////////////////////////////////////
+// decoder statistics
+// counters are written by the decoding thread only,
+// use tdc_get_stats() to read them from any thread
+//////////////////////////////////////////
+typedef struct s_tdc_stats_t
+{
+	double        time;                           // CLOCK_MONOTONIC of the snapshot in [s]
+	unsigned long bytes;                          // bytes read from the device
+	unsigned long frames[TDC_N_CHANNELS];         // valid frames
+	unsigned long edges[TDC_N_CHANNELS][2];       // events, indexed by edge_t
+	unsigned long overflows[TDC_N_CHANNELS];      // 24 bit counter overflows
+	unsigned long resync_bytes;                   // bytes skipped while searching a header
+	unsigned long truncated_frames;               // frames interrupted by the next header
+	unsigned long invalid_frames;                 // frames with an impossible channel number
+	unsigned long inconsistent_samples;           // samples that fit no edge pattern
+	unsigned long invalid_blocks;                 // blocks with a bad checksum or no records
+	unsigned long lost_words[TDC_N_CHANNELS];     // words dropped by the board, from loss markers
+	unsigned long syncs[TDC_N_CHANNELS];          // sync frames
+	unsigned long repaired_wraps[TDC_N_CHANNELS]; // counter overflows corrected by sync frames
+	unsigned long unsynced_words;                 // words skipped after tdc_seek() until the channel's sync
+	// filter stage (tdc_set_filter()), in edges
+	unsigned long filter_passed[TDC_N_CHANNELS];    // edges returned by a channel with a filter
+	unsigned long filter_deadtime[TDC_N_CHANNELS];  // pulses that started in the deadtime
+	unsigned long filter_tot[TDC_N_CHANNELS];       // pulses outside the ToT window
+	unsigned long filter_prescaled[TDC_N_CHANNELS]; // pulses removed by the prescaler
+	unsigned long filter_polarity[TDC_N_CHANNELS];  // edges of the polarity that is not selected
+} tdc_stats_t;
+
+typedef enum e_tdc_format_t
+{
+	TDC_FORMAT_FRAMES, // 5 byte frames, 7 data bits per byte (default after power up)
+	TDC_FORMAT_BLOCKS, // blocks of bit packed 35 bit records
+} tdc_format_t;
+
+//////////////////////////////////////////
+// filter stage
+// Pulses are rejected on the per-channel decoder state, before a
+// tdc_event_t is built for them. The steps in order:
+//   deadtime   a pulse that starts less than 'deadtime' ns after the rising
+//              edge of the previous pulse that was not in the deadtime
+//   ToT window pulses shorter than min_tot or longer than max_tot ns. The
+//              rising edge is held back until the falling edge is known,
+//              so the edges of other channels can overtake it.
+//   prescaler  of every prescale_m pulses that are left, the first
+//              prescale_n are kept
+//   polarity   only the selected edges of the remaining pulses are returned
+// An all zero tdc_filter_t lets everything pass. Losses are never filtered.
+//////////////////////////////////////////
+typedef enum e_tdc_polarity_t
+{
+	TDC_POLARITY_BOTH,
+	TDC_POLARITY_RISING,  // only rising edges
+	TDC_POLARITY_FALLING, // only falling edges
+} tdc_polarity_t;
+
+typedef struct s_tdc_filter_t
+{
+	unsigned long  deadtime;   // [ns], 0: off
+	unsigned long  min_tot;    // [ns]
+	unsigned long  max_tot;    // [ns], 0: no upper limit
+	unsigned int   prescale_n; // keep prescale_n of every prescale_m pulses,
+	unsigned int   prescale_m; //   prescale_m < 2: off
+	tdc_polarity_t polarity;
+} tdc_filter_t;
+
+typedef struct s_tdc_filter_state_t
+{
+	int           state;       // see tdc_control.c
+	unsigned long last_rise;   // rising edge that started the deadtime
+	unsigned long held_time;   // rising edge waiting for its falling edge
+	unsigned char held_sample;
+	unsigned int  prescale_count;
+} tdc_filter_state_t;
+
+// how next_byte() waits for input, see tdc_realtime.h
+typedef enum e_tdc_read_mode_t
+{
+	TDC_READ_BLOCKING, // blocking read() with the VMIN/VTIME of tdc_open()
+	TDC_READ_POLL,     // non-blocking read(), poll() when nothing arrived
+	TDC_READ_BUSY,     // non-blocking read() in a loop, never sleeps
+} tdc_read_mode_t;
 
 //////////////////////////////////////////
 // main tdc data structure 
@@ -14,10 +127,34 @@ typedef struct s_tdc_t
 	unsigned long time[TDC_N_CHANNELS];
 	unsigned long previous_time[TDC_N_CHANNELS];
 	unsigned long overflow_count[TDC_N_CHANNELS];
+	unsigned long rise_time[TDC_N_CHANNELS]; // the last rising edge, before the filter
+	int           rising;       // bit ch: rise_time[ch] is the rising edge of the current pulse
 	unsigned char sample[TDC_N_CHANNELS];
 	int           sample_idx[TDC_N_CHANNELS];
+	int           lost[TDC_N_CHANNELS]; // words were lost, the next sample sets the level
+	int           started[TDC_N_CHANNELS];  // a word arrived, the next time 0 is a counter overflow,
+	                                        //   TDC_STARTED_RESUMED after tdc_checkpoint_restore()
+	int           unsynced[TDC_N_CHANNELS]; // after tdc_seek(), words are skipped until a sync frame
 	int           sample_stat[TDC_N_CHANNELS][8];
 	int           sample_stat_total;
+	unsigned char read_buffer[TDC_READ_BUFFER_SIZE];
+	int           read_pos, read_len;
+	unsigned long raw_offset; // number of bytes consumed from fd
+	tdc_read_mode_t read_mode;
+	unsigned long read_ns;    // CLOCK_MONOTONIC of the last read(), not in TDC_READ_BLOCKING
+	tdc_format_t  format;
+	unsigned char mode_register;
+	struct s_raw_event_t *block; // records of the current block
+	int           block_pos, block_len;
+	unsigned long block_offset; // raw_offset at the sync word of the current block
+	int           queued;       // queued_event is returned with the next call
+	struct s_event_t *queued_event; // the falling edge after a pulse record or a held rising edge
+	int           filtered;     // a channel has a filter
+	tdc_filter_t  filter[TDC_N_CHANNELS];
+	tdc_filter_state_t filter_state[TDC_N_CHANNELS];
+	unsigned long resume_wall_ns; // CLOCK_REALTIME of the checkpoint of TDC_RESUME_LIVE
+	tdc_stats_t   stats;
+	struct s_tdc_trace_t *trace; // NULL unless tracing is enabled, see tdc_trace.h
 } tdc_t;
 
 
@@ -38,20 +175,41 @@ enum tdc_enable_channel_bits {
 void tdc_enable_channels(tdc_t *tdc, char pattern);
 void tdc_reset_overflow_counter(tdc_t *tdc, char pattern);
 void tdc_set_channel_threshold(tdc_t *tdc, int channel, int threshold);
+// Switches the board and the decoder to another stream format. Data that
+// is already on the way in the old format is skipped as resync bytes or
+// invalid blocks, so better switch while all channels are disabled.
+void tdc_set_format(tdc_t *tdc, tdc_format_t format);
+// In pulse mode the board pairs the edges of clean pulses shorter than 1024 ns
+// and sends one record per pulse, everything else is sent as samples.
+void tdc_set_pulse_mode(tdc_t *tdc, int enable);
+// With sync frames every channel sends its counter overflow count (epoch) in 
+// the middle of each counter period (every 134 ms). The decoder takes the 
+// epoch from them, so missed overflows are repaired and tdc_seek() works.
+void tdc_set_sync(tdc_t *tdc, int enable);
+// Continues decoding a capture file at byte 'offset'. The state of the channels 
+// is unknown there, so the events of a channel start after its next sync frame.
+// Returns 0 if the input can't seek.
+int  tdc_seek(tdc_t *tdc, unsigned long offset);
+// Sets the filter of a channel, NULL removes it. See tdc_filter_t.
+void tdc_set_filter(tdc_t *tdc, int channel, const tdc_filter_t *filter);
 
 typedef enum e_edge_t
 {
 	TDC_EDGE_FALLING,
 	TDC_EDGE_RISING,
+	TDC_EDGE_LOSS,    // the board dropped data of this channel, see tdc_event_t::lost
 } edge_t;
 
 typedef struct s_event_t
 {
 	int           channel;
-	unsigned long time;    // in units of [1 ns]
+	unsigned long time;    // in units of [1 ns], for losses the time of the last sample before
 	edge_t        edge;
 	unsigned char sample;
 	unsigned long dt; // ns since previous pulse
+	unsigned long lost; // TDC_EDGE_LOSS: number of words the board dropped
+	unsigned long tot;  // TDC_EDGE_FALLING: time over threshold in [ns], 0 if the
+	                    //   rising edge is unknown (after a loss, a sync frame or a seek)
 } tdc_event_t;
 
 tdc_event_t   tdc_next_event(tdc_t *tdc);
@@ -59,18 +217,148 @@ double    tdc_smooth_time(tdc_t *tdc, tdc_event_t *event);
 
 int tdc_get_level(tdc_t *tdc, int channel);
 
+//////////////////////////////////////////
+// checkpoints
+// The decoder state between two tdc_next_event() calls: time, overflow
+// count, sample and sample statistics of every channel, pending edges,
+// filters and the number of input bytes consumed (raw_offset). After
+// tdc_checkpoint_restore() the decoder continues with the event that
+// would have come next:
+//   TDC_RESUME_CAPTURE  the input is the same capture file, decoding goes
+//                       on at raw_offset as if it had never stopped
+//   TDC_RESUME_LIVE     the input is the device after a restart, the words
+//                       in between are gone. Each channel starts like after
+//                       a loss (no edge is made up across the gap) and the
+//                       counter overflows in the gap are taken from the
+//                       CLOCK_REALTIME time since the checkpoint. That is
+//                       right if the checkpoint was taken soon after the
+//                       last read and the clock is off by less than half a
+//                       counter period (67 ms). Sync frames correct it.
+// The statistics are not part of a checkpoint.
+//////////////////////////////////////////
+#define TDC_CHECKPOINT_MAGIC   0x4b434454 // "TDCK"
+#define TDC_CHECKPOINT_VERSION 3
+#define TDC_CHECKPOINT_SIZE    736 // bytes, checked at compile time
+#define TDC_STARTED_RESUMED    2 // tdc_t::started, the overflow count is estimated with the next word
+
+enum tdc_resume_mode {
+	TDC_RESUME_CAPTURE,
+	TDC_RESUME_LIVE,
+};
+
+// The file layout has only fixed-width fields at their natural alignment
+// with explicit padding, so it is the same in 32 and 64 bit builds (of
+// the same byte order). tdc_event_t, tdc_filter_t and tdc_filter_state_t
+// are converted to the types below.
+typedef struct s_tdc_checkpoint_event_t
+{
+	uint64_t time;
+	uint64_t dt;
+	uint64_t lost;
+	uint64_t tot;
+	int32_t  channel;
+	int32_t  edge;
+	uint8_t  sample;
+	uint8_t  pad[7];
+} tdc_checkpoint_event_t;
+
+typedef struct s_tdc_checkpoint_filter_t
+{
+	uint64_t deadtime;
+	uint64_t min_tot;
+	uint64_t max_tot;
+	uint32_t prescale_n;
+	uint32_t prescale_m;
+	int32_t  polarity;
+	uint32_t pad;
+} tdc_checkpoint_filter_t;
+
+typedef struct s_tdc_checkpoint_filter_state_t
+{
+	uint64_t last_rise;
+	uint64_t held_time;
+	int32_t  state;
+	uint32_t prescale_count;
+	uint8_t  held_sample;
+	uint8_t  pad[7];
+} tdc_checkpoint_filter_state_t;
+
+typedef struct s_tdc_checkpoint_t
+{
+	uint32_t                      magic;
+	uint32_t                      version;
+	uint32_t                      size;     // sizeof(tdc_checkpoint_t), TDC_CHECKPOINT_SIZE
+	uint32_t                      checksum; // FNV-1a of the bytes after this field
+	uint64_t                      wall_ns;  // CLOCK_REALTIME when it was taken
+	uint64_t                      raw_offset;
+	uint64_t                      block_offset;
+	int32_t                       block_pos, block_len; // records of the current block
+	int32_t                       format;
+	int32_t                       mode_register;
+	uint64_t                      time[TDC_N_CHANNELS];
+	uint64_t                      previous_time[TDC_N_CHANNELS];
+	uint64_t                      overflow_count[TDC_N_CHANNELS];
+	uint64_t                      rise_time[TDC_N_CHANNELS];
+	uint8_t                       sample[TDC_N_CHANNELS];
+	int32_t                       sample_idx[TDC_N_CHANNELS];
+	int32_t                       lost[TDC_N_CHANNELS];
+	int32_t                       started[TDC_N_CHANNELS];
+	int32_t                       unsynced[TDC_N_CHANNELS];
+	int32_t                       sample_stat[TDC_N_CHANNELS][8];
+	int32_t                       sample_stat_total;
+	int32_t                       queued;
+	int32_t                       filtered;
+	int32_t                       rising;
+	uint32_t                      pad;
+	tdc_checkpoint_event_t        queued_event;
+	tdc_checkpoint_filter_t       filter[TDC_N_CHANNELS];
+	tdc_checkpoint_filter_state_t filter_state[TDC_N_CHANNELS];
+} tdc_checkpoint_t;
+
+void tdc_checkpoint_take(tdc_t *tdc, tdc_checkpoint_t *checkpoint);
+// Returns 0 if the checkpoint is invalid or the capture can't be positioned
+// at its raw_offset. After a failed TDC_RESUME_CAPTURE the decoder may have
+// moved, open the capture again.
+int  tdc_checkpoint_restore(tdc_t *tdc, const tdc_checkpoint_t *checkpoint, int mode);
+// The file is replaced atomically (write, fsync, rename), a crash leaves
+// the old or the new checkpoint. Both return 0 on error.
+int  tdc_checkpoint_write(const char *filename, const tdc_checkpoint_t *checkpoint);
+int  tdc_checkpoint_read(const char *filename, tdc_checkpoint_t *checkpoint);
+
+void tdc_get_stats(tdc_t *tdc, tdc_stats_t *stats);
+void tdc_print_stats(FILE *out, tdc_stats_t *previous, tdc_stats_t *current);
+
 //////////////////////////////////////////
 // internal data structures
 //////////////////////////////////////////
 
+typedef enum e_raw_kind_t
+{
+	TDC_RAW_SAMPLE,
+	TDC_RAW_PULSE,
+	TDC_RAW_LOSS,
+	TDC_RAW_SYNC,
+} raw_kind_t;
+
 typedef struct s_raw_event_t
 {
-	int           channel;
-	unsigned long time;    // in units of [8 ns]
-	unsigned char sample;
+	int            channel;
+	unsigned long  time;    // in units of [8 ns], of the falling edge for pulses
+	unsigned char  sample;
+	unsigned char  kind;    // raw_kind_t
+	unsigned char  phase;   // pulses: falling edge inside the 8 ns tick
+	unsigned short tot;     // pulses: time over threshold in [1 ns]
+	unsigned int   lost;    // losses: number of words the board dropped
+	unsigned int   epoch;   // syncs: number of counter overflows
 } raw_event_t;
 
-raw_event_t upack_raw_event(unsigned char *five_bytes);
+int         unpack_raw_event(unsigned char *five_bytes, raw_event_t *new_raw_event);
+int         unpack_pulse_event(unsigned char *six_bytes, raw_event_t *new_raw_event);
+// block payload <-> records, unpack_raw_block() returns the number of payload
+// bytes, pack_raw_block() writes a complete block with sync word, count and
+// checksum and returns its size in bytes
+int         unpack_raw_block(unsigned char *payload, int count, raw_event_t *records);
+int         pack_raw_block(raw_event_t *records, int count, unsigned char *block);
 raw_event_t next_raw_event(tdc_t *tdc);
 
 int stays_high_between_samples(unsigned char last_sample, unsigned char new_sample);
@@ -78,10 +366,8 @@ int stays_low_between_samples (unsigned char last_sample, unsigned char new_samp
 int goes_high_between_samples (unsigned char last_sample, unsigned char new_sample);
 int goes_low_between_samples  (unsigned char last_sample, unsigned char new_sample);
 
-
-
-
-
-
+#ifdef __cplusplus
+}
 #endif
 
+#endif
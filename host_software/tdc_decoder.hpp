@@ -0,0 +1,398 @@
+#ifndef TDC_DECODER_HPP
+#define TDC_DECODER_HPP
+
+#include "tdc_control.h"
+#include "tdc_rules.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+//////////////////////////////////////////
+// header-only C++17 decoder
+//
+// tdc::decoder decodes the same byte stream as tdc_next_event(), but
+// pushes every event into a sink instead of returning it. The sink type
+// is a template parameter, so decoding and the processing in the sink
+// are inlined into one loop. A sink has two member functions:
+//
+//   void edge(int channel, edge_t edge, uint64_t time, uint8_t sample, uint64_t dt, uint64_t tot);
+//   void loss(int channel, uint64_t time, uint64_t lost);
+//
+// tot is tdc_event_t::tot: the time over threshold of a falling edge,
+// 0 for rising edges and if the rising edge wasn't seen.
+// With Channels == TDC_N_CHANNELS the sink sees exactly the events of
+// tdc_next_event() in the same order, and stats() counts like tdc_t::stats.
+// A smaller Channels treats the frames of the other channels as invalid.
+// The decoder does no I/O: feed() takes chunks of any size, frames and
+// blocks may be split between chunks. Unlike tdc_t there are no sample
+// statistics for tdc_smooth_time() and no trace points.
+//////////////////////////////////////////
+
+namespace tdc {
+
+template <class Sink, int Channels = TDC_N_CHANNELS>
+class decoder
+{
+	static_assert(Channels >= 1 && Channels <= TDC_N_CHANNELS, "the board has 4 channels");
+
+public:
+	explicit decoder(Sink &sink, tdc_format_t format = TDC_FORMAT_FRAMES)
+		: sink_(sink), format_(format)
+	{
+		std::memset(&stats_, 0, sizeof(stats_));
+		for (int ch = 0; ch < Channels; ++ch) {
+			time_[ch]           = 0;
+			previous_time_[ch]  = 0;
+			overflow_count_[ch] = 0;
+			sample_[ch]         = 0;
+			lost_[ch]           = false;
+			started_[ch]        = 0;
+			unsynced_[ch]       = false;
+			rise_time_[ch]      = 0;
+			rising_[ch]         = false;
+		}
+	}
+
+	// decodes 'size' bytes, incomplete frames and blocks are kept for the next call
+	void feed(const unsigned char *data, std::size_t size)
+	{
+		stats_.bytes += size;
+		if (format_ == TDC_FORMAT_BLOCKS) {
+			for (std::size_t i = 0; i < size; ++i) {
+				block_byte(data[i]);
+			}
+		} else {
+			for (std::size_t i = 0; i < size; ++i) {
+				frame_byte(data[i]);
+			}
+		}
+	}
+
+	// Like tdc_seek(): the next bytes are from another position in the stream.
+	// Events of a channel start after its next sync frame.
+	void resync()
+	{
+		n_           = 0;
+		block_state_ = block_search;
+		previous_    = -1;
+		for (int ch = 0; ch < Channels; ++ch) {
+			started_[ch]  = 0;
+			unsynced_[ch] = true;
+			rising_[ch]   = false;
+		}
+	}
+
+	// the format can only be switched between blocks or frames
+	void set_format(tdc_format_t format)
+	{
+		format_      = format;
+		n_           = 0;
+		block_state_ = block_search;
+		previous_    = -1;
+	}
+
+	int level(int channel) const { return sample_[channel] & 0x01; }
+	const tdc_stats_t &stats() const { return stats_; }
+
+private:
+	//////////////////////////////////////////
+	// 5 and 6 byte frames, see raw_event() in tdc_control.c
+	//////////////////////////////////////////
+	inline void frame_byte(unsigned char byte)
+	{
+		if (byte & 0x80) { // a header starts a new frame, an incomplete frame is dropped
+			if (n_ != 0) {
+				++stats_.truncated_frames;
+			}
+			n_      = 0;
+			length_ = ((byte>>4) & 0x7) == TDC_TYPE_PULSE ? 6 : 5;
+		} else if (n_ == 0) { // not a header, skip until we find one
+			++stats_.resync_bytes;
+			return;
+		}
+		data_[n_++] = byte;
+		if (n_ < length_) {
+			return;
+		}
+		n_ = 0;
+
+		int type = (data_[0]>>4) & 0x7;
+		if (type == TDC_TYPE_PULSE) {
+			std::uint64_t payload = data_[0] & 0x0f;
+			for (int i = 1; i < 6; ++i) {
+				payload = (payload<<7) | (data_[i] & 0x7f);
+			}
+			pulse_payload(payload);
+		} else if (type == TDC_TYPE_CONTROL) {
+			std::uint32_t payload = 0;
+			for (int i = 1; i < 5; ++i) {
+				payload = (payload<<7) | (data_[i] & 0x7f);
+			}
+			control_payload(data_[0] & 0x0f, payload);
+		} else if (type < Channels) {
+			std::uint32_t time = data_[1] & 0x07;
+			time = (time<<7) | (data_[2] & 0x7f);
+			time = (time<<7) | (data_[3] & 0x7f);
+			time = (time<<7) | (data_[4] & 0x7f);
+			unsigned char sample = ((data_[0] & 0x0f)<<4) | ((data_[1] & 0x78)>>3);
+			++stats_.frames[type];
+			sample_word(type, time, sample);
+		} else {
+			++stats_.invalid_frames;
+		}
+	}
+
+	//////////////////////////////////////////
+	// blocks, see next_block() in tdc_control.c. Records are only
+	// decoded after the checksum of their block was checked.
+	//////////////////////////////////////////
+	enum block_state_t { block_search, block_count, block_payload, block_checksum };
+
+	inline void block_byte(unsigned char byte)
+	{
+		switch (block_state_) {
+			case block_search:
+				if (previous_ != TDC_BLOCK_SYNC_0 || byte != TDC_BLOCK_SYNC_1) {
+					if (previous_ != -1) {
+						++stats_.resync_bytes;
+					}
+					previous_ = byte;
+					return;
+				}
+				previous_    = -1;
+				block_state_ = block_count;
+				return;
+			case block_count:
+				count_       = byte;
+				checksum_    = byte;
+				bits_        = 0;
+				n_bits_      = 0;
+				n_records_   = 0;
+				block_state_ = count_ ? block_payload : block_checksum;
+				return;
+			case block_payload:
+				bits_      = (bits_<<8) | byte;
+				n_bits_   += 8;
+				checksum_ ^= byte;
+				while (n_records_ < count_ && take_record()) {
+				}
+				if (n_records_ == count_) {
+					block_state_ = block_checksum;
+				}
+				return;
+			case block_checksum:
+				block_state_ = block_search;
+				if (count_ == 0 || byte != checksum_) {
+					++stats_.invalid_blocks;
+					return;
+				}
+				for (int i = 0; i < count_; ++i) {
+					block_record(records_[i]);
+				}
+				return;
+		}
+	}
+
+	// takes the next record from the oldest bits, the record keeps
+	// its type bits, bit 63 marks 42 bit pulse records
+	inline bool take_record()
+	{
+		if (n_bits_ < 3) {
+			return false;
+		}
+		int type = (bits_>>(n_bits_-3)) & 0x7;
+		int size = type == TDC_TYPE_PULSE ? TDC_PULSE_RECORD_BITS : TDC_RECORD_BITS;
+		if (n_bits_ < size) {
+			return false;
+		}
+		n_bits_ -= size;
+		std::uint64_t value = (bits_>>n_bits_) & ((1ULL<<size)-1);
+		records_[n_records_++] = type == TDC_TYPE_PULSE ? value | (1ULL<<63) : value;
+		return true;
+	}
+
+	inline void block_record(std::uint64_t value)
+	{
+		if (value>>63) {
+			pulse_payload(value & ((1ULL<<39)-1));
+			return;
+		}
+		int type = (value>>32) & 0x7;
+		if (type == TDC_TYPE_CONTROL) {
+			control_payload((value>>28) & 0xf, value & 0xfffffff);
+		} else if (type < Channels) {
+			++stats_.frames[type];
+			sample_word(type, (value>>8) & 0xffffff, value & 0xff);
+		} else {
+			++stats_.invalid_frames;
+		}
+	}
+
+	//////////////////////////////////////////
+	// payloads shared by frames and blocks
+	//////////////////////////////////////////
+
+	// 2 bit channel, 24 bit time, 3 bit phase, 10 bit time over threshold
+	inline void pulse_payload(std::uint64_t payload)
+	{
+		int ch = (payload>>37) & 0x3;
+		if (ch >= Channels) {
+			++stats_.invalid_frames;
+			return;
+		}
+		++stats_.frames[ch];
+		pulse_word(ch, (payload>>13) & 0xffffff, (payload>>10) & 0x7, payload & 0x3ff);
+	}
+
+	// 4 bit subtype, 2 bit channel and 26 bit value
+	inline void control_payload(int subtype, std::uint32_t payload)
+	{
+		int ch = (payload>>26) & 0x3;
+		if ((subtype != TDC_CONTROL_LOSS && subtype != TDC_CONTROL_SYNC) || ch >= Channels) {
+			++stats_.invalid_frames;
+			return;
+		}
+		++stats_.frames[ch];
+		if (subtype == TDC_CONTROL_SYNC) {
+			sync_word(ch, payload & 0x3ffffff);
+		} else {
+			loss_word(ch, payload & 0x3ffffff);
+		}
+	}
+
+	//////////////////////////////////////////
+	// words to events, see next_event() in tdc_control.c
+	//////////////////////////////////////////
+
+	inline std::uint64_t coarse_time(int ch) const
+	{
+		return tdc_word_ns(overflow_count_[ch], time_[ch]);
+	}
+
+	inline void update_time(int ch, std::uint64_t time)
+	{
+		if (tdc_counter_overflowed(started_[ch], time_[ch], time)) {
+			++overflow_count_[ch];
+			++stats_.overflows[ch];
+		}
+		started_[ch] = 1;
+		time_[ch]    = time;
+	}
+
+	inline void emit_edge(int ch, edge_t edge, std::uint64_t time, unsigned char sample)
+	{
+		std::uint64_t dt  = time - previous_time_[ch];
+		std::uint64_t tot = 0;
+		previous_time_[ch] = time;
+		if (edge == TDC_EDGE_RISING) {
+			rise_time_[ch] = time;
+			rising_[ch]    = true;
+		} else {
+			tot         = rising_[ch] ? time - rise_time_[ch] : 0;
+			rising_[ch] = false;
+		}
+		++stats_.edges[ch][edge];
+		sink_.edge(ch, edge, time, sample, dt, tot);
+	}
+
+	inline void sync_word(int ch, std::uint64_t epoch)
+	{
+		++stats_.syncs[ch];
+		if (started_[ch] && !unsynced_[ch] && overflow_count_[ch] != epoch) {
+			long missed = (long)epoch - (long)overflow_count_[ch];
+			stats_.repaired_wraps[ch] += std::labs(missed);
+		}
+		tdc_apply_sync(&started_[ch], &time_[ch], &overflow_count_[ch], epoch);
+		rising_[ch] = false; // a ToT across the sync would mix the old and the new time
+		if (unsynced_[ch]) {
+			unsynced_[ch] = false;
+			lost_[ch]     = true;
+		}
+	}
+
+	inline void loss_word(int ch, std::uint64_t lost)
+	{
+		if (unsynced_[ch]) {
+			++stats_.unsynced_words;
+			return;
+		}
+		lost_[ch]   = true;
+		rising_[ch] = false;
+		stats_.lost_words[ch] += lost;
+		sink_.loss(ch, coarse_time(ch), lost);
+	}
+
+	inline void pulse_word(int ch, std::uint64_t time, int phase, int tot)
+	{
+		if (unsynced_[ch]) {
+			++stats_.unsynced_words;
+			return;
+		}
+		update_time(ch, time);
+		std::uint64_t fall_time = coarse_time(ch) + phase;
+		std::uint64_t rise_time = fall_time - tot;
+		sample_[ch] = tdc_sample_after_pulse(phase);
+		lost_[ch]   = false;
+		emit_edge(ch, TDC_EDGE_RISING,  rise_time, 0xff>>(rise_time%8));
+		emit_edge(ch, TDC_EDGE_FALLING, fall_time, ~(0xff>>(fall_time%8)));
+	}
+
+	inline void sample_word(int ch, std::uint64_t time, unsigned char new_sample)
+	{
+		if (unsynced_[ch]) {
+			++stats_.unsynced_words;
+			return;
+		}
+		update_time(ch, time);
+		if (lost_[ch]) { // no edge at the start of the first sample after a loss
+			sample_[ch] = tdc_sample_after_loss(new_sample);
+			lost_[ch]   = false;
+		}
+		// edge k (see tdc_rules.h) is set as bit k-1, the earliest edge is k = 8
+		unsigned bits  = ((sample_[ch] & 0x01)<<8) | new_sample;
+		unsigned edges = (bits ^ (bits>>1)) & 0xff;
+		sample_[ch] = new_sample;
+		while (edges) {
+			int k = 32 - __builtin_clz(edges);
+			edges &= ~(1u<<(k-1));
+			emit_edge(ch, (bits>>(k-1)) & 0x01 ? TDC_EDGE_RISING : TDC_EDGE_FALLING,
+				tdc_edge_ns(overflow_count_[ch], time_[ch], k), new_sample);
+		}
+	}
+
+	Sink         &sink_;
+	tdc_format_t  format_;
+	tdc_stats_t   stats_;
+
+	// channel state, same meaning and types as in tdc_t for the rules of tdc_rules.h
+	unsigned long time_[Channels];
+	std::uint64_t previous_time_[Channels];
+	unsigned long overflow_count_[Channels];
+	unsigned char sample_[Channels];
+	bool          lost_[Channels];
+	int           started_[Channels];
+	bool          unsynced_[Channels];
+	std::uint64_t rise_time_[Channels]; // of the last rising edge, for the ToT
+	bool          rising_[Channels];    // rise_time_ belongs to the current pulse
+
+	// frame assembly
+	unsigned char data_[6];
+	int           n_      = 0;
+	int           length_ = 5;
+
+	// block assembly
+	block_state_t block_state_ = block_search;
+	int           previous_    = -1;
+	int           count_       = 0;
+	unsigned char checksum_    = 0;
+	std::uint64_t bits_        = 0;
+	int           n_bits_      = 0;
+	int           n_records_   = 0;
+	std::uint64_t records_[TDC_BLOCK_MAX_RECORDS];
+};
+
+} // namespace tdc
+
+#endif
@@ -0,0 +1,483 @@
+#define _GNU_SOURCE
+#include "tdc_emulator.h"
+
+// POSIX header
+#include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+// C header
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#define EMU_WRAP_NS (8L<<24) // the 24 bit time counter runs with 125 MHz
+
+void tdc_emu_default_config(tdc_emu_config_t *config)
+{
+	config->rate               = 10000;
+	config->threshold_scale    = 1000;
+	config->pulse_width        = 100;
+	config->packet_size        = 512;
+	config->packet_interval_ns = 125000; // one USB 2.0 high speed micro frame
+	config->queue_size         = 16384;
+	config->enable_pattern     = 0;
+	config->seed               = 1;
+}
+
+static long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+int tdc_emu_threshold(tdc_emu_t *emu, int channel)
+{
+	return (emu->registers>>(12*channel)) & 0xfff;
+}
+
+int tdc_emu_enabled(tdc_emu_t *emu, int channel)
+{
+	return (emu->registers>>(60+channel)) & 0x1;
+}
+
+// time until the next pulse of a channel in [ns]
+static long random_interval(tdc_emu_t *emu, int channel)
+{
+	double rate = emu->config.rate * exp(-tdc_emu_threshold(emu, channel)/emu->config.threshold_scale);
+	if (rate <= 0) {
+		return LONG_MAX/4;
+	}
+	double u  = (rand_r(&emu->rand_state)+1.0)/(RAND_MAX+2.0);
+	double dt = -log(u)/rate*1e9;
+	if (dt > LONG_MAX/4) {
+		return LONG_MAX/4;
+	}
+	return dt < 1 ? 1 : (long)dt;
+}
+
+static void enable_channel(tdc_emu_t *emu, int channel, long t)
+{
+	emu->pulse_state[channel] = EMU_PULSE_RAW;
+	// the tdc counter starts at zero after reset, which produces a frame with time 0
+	emu->enable_time[channel] = t;
+	emu->next_wrap[channel]   = t;
+	emu->next_sync[channel]   = t + EMU_WRAP_NS/2;
+	emu->level[channel]       = 0;
+	emu->next_edge[channel]   = t + random_interval(emu, channel);
+}
+
+// returns space for n bytes at the end of the queue, NULL if the board buffers are full
+static unsigned char *queue_space(tdc_emu_t *emu, long n)
+{
+	if (emu->queue_len - emu->queue_head + n > emu->config.queue_size) {
+		return NULL;
+	}
+	if (emu->queue_len + n > emu->config.queue_size) {
+		memmove(emu->queue, emu->queue+emu->queue_head, emu->queue_len-emu->queue_head);
+		emu->queue_len -= emu->queue_head;
+		emu->queue_head = 0;
+	}
+	return &emu->queue[emu->queue_len];
+}
+
+static int block_format(tdc_emu_t *emu)
+{
+	return (emu->registers>>48) & TDC_MODE_BLOCKS;
+}
+
+static void push_block(tdc_emu_t *emu)
+{
+	if (emu->block_len == 0) {
+		return;
+	}
+	unsigned char block[TDC_BLOCK_MAX_SIZE];
+	int size = pack_raw_block(emu->block, emu->block_len, block);
+	unsigned char *data = queue_space(emu, size);
+	if (data) {
+		memcpy(data, block, size);
+		emu->queue_len += size;
+		emu->frames_sent += emu->block_len;
+		for (int i = 0; i < emu->block_len; ++i) {
+			++emu->channel_frames[emu->block[i].channel];
+		}
+	} else {
+		emu->frames_dropped += emu->block_len;
+		for (int i = 0; i < emu->block_len; ++i) {
+			raw_event_t *record = &emu->block[i];
+			emu->lost[record->channel] += record->kind == TDC_RAW_LOSS ? record->lost : 1;
+		}
+	}
+	emu->block_len = 0;
+}
+
+static int pulse_mode(tdc_emu_t *emu)
+{
+	return (emu->registers>>48) & TDC_MODE_PULSES;
+}
+
+static int sync_mode(tdc_emu_t *emu)
+{
+	return (emu->registers>>48) & TDC_MODE_SYNC;
+}
+
+// returns 0 if the board buffers are full
+static int emit_record(tdc_emu_t *emu, raw_event_t *record)
+{
+	if (block_format(emu)) {
+		emu->block[emu->block_len++] = *record;
+		if (emu->block_len == TDC_EMU_BLOCK_RECORDS) {
+			push_block(emu);
+		}
+		return 1;
+	}
+	int size = record->kind == TDC_RAW_PULSE ? 6 : 5;
+	unsigned char *data = queue_space(emu, size);
+	if (!data) {
+		++emu->frames_dropped;
+		return 0;
+	}
+	long time = record->time;
+	if (record->kind == TDC_RAW_LOSS || record->kind == TDC_RAW_SYNC) {
+		int sync = record->kind == TDC_RAW_SYNC;
+		unsigned long payload = ((unsigned long)(record->channel&0x3)<<26) 
+		                      | ((sync ? record->epoch : record->lost)&0x3ffffff);
+		data[0] = 0x80 | (TDC_TYPE_CONTROL<<4) | (sync ? TDC_CONTROL_SYNC : TDC_CONTROL_LOSS);
+		for (int i = 1; i < 5; ++i) {
+			data[i] = (payload>>(7*(4-i))) & 0x7f;
+		}
+	} else if (record->kind == TDC_RAW_PULSE) {
+		unsigned long long payload = ((unsigned long long)(record->channel&0x3)<<37)
+		                           | ((unsigned long long)(time&0xffffff)<<13)
+		                           | ((record->phase&0x7)<<10)
+		                           | (record->tot&0x3ff);
+		data[0] = 0x80 | (TDC_TYPE_PULSE<<4) | ((payload>>35)&0xf);
+		for (int i = 1; i < 6; ++i) {
+			data[i] = (payload>>(7*(5-i))) & 0x7f;
+		}
+	} else {
+		unsigned char sample = record->sample;
+		int channel = record->channel;
+		data[0] = 0x80 | ((channel&0x7)<<4) | (sample>>4);
+		data[1] = 0x00 | (( sample&0xf)<<3) | ((time>>21)&0x7);
+		data[2] = 0x00                      | ((time>>14)&0x7f);
+		data[3] = 0x00                      | ((time>> 7)&0x7f);
+		data[4] = 0x00                      | ((time>> 0)&0x7f);
+	}
+	emu->queue_len += size;
+	++emu->frames_sent;
+	++emu->channel_frames[record->channel];
+	return 1;
+}
+
+// dropped records are reported with a loss marker in front of the 
+// next record of the channel that fits, like tdc.vhd does
+static void push_record(tdc_emu_t *emu, raw_event_t *record)
+{
+	int channel = record->channel;
+	if (emu->lost[channel]) {
+		raw_event_t marker = {.channel = channel, .kind = TDC_RAW_LOSS, .lost = emu->lost[channel]};
+		if (marker.lost > 0x3ffffff) {
+			marker.lost = 0x3ffffff;
+		}
+		if (!emit_record(emu, &marker)) {
+			++emu->lost[channel];
+			return;
+		}
+		emu->lost[channel] = 0;
+	}
+	if (!emit_record(emu, record)) {
+		++emu->lost[channel];
+	}
+}
+
+static void push_sample(tdc_emu_t *emu, int channel, long time, unsigned char sample)
+{
+	raw_event_t record = {.channel = channel, .time = time, .sample = sample, .kind = TDC_RAW_SAMPLE};
+	push_record(emu, &record);
+}
+
+static void push_pulse(tdc_emu_t *emu, int channel, long time, int phase, int tot)
+{
+	raw_event_t record = {.channel = channel, .time = time, .kind = TDC_RAW_PULSE, .phase = phase, .tot = tot};
+	push_record(emu, &record);
+}
+
+// 0..01..1: number of zeros, 1..10..0: number of ones, -1 for other patterns
+static int rise_position(unsigned char sample)
+{
+	for (int a = 0; a < 8; ++a) {
+		if (sample == 0xff>>a) {
+			return a;
+		}
+	}
+	return -1;
+}
+static int fall_position(unsigned char sample)
+{
+	return rise_position(~sample);
+}
+
+// the pulse pairing of tdc.vhd, but only called for ticks with edges or 
+// a counter overflow, the ticks in between have no edges
+static void board_sample(tdc_emu_t *emu, int channel, long tick, long time, int level, unsigned char sample)
+{
+	int edges = sample != (level ? 0xff : 0x00);
+	if (!pulse_mode(emu)) {
+		emu->pulse_state[channel] = EMU_PULSE_RAW;
+	}
+	if (emu->pulse_state[channel] == EMU_PULSE_HIGH) {
+		int  fall  = fall_position(sample);
+		long ticks = (tick - emu->lead_tick[channel])/8;
+		if (fall != -1 && ticks <= 127 && time > emu->lead_time[channel]) {
+			push_pulse(emu, channel, time, fall, 8*ticks + fall - emu->lead_phase[channel]);
+			emu->pulse_state[channel] = EMU_PULSE_LOW;
+			return;
+		}
+		// too long, several edges or over a counter overflow
+		push_sample(emu, channel, emu->lead_time[channel], emu->lead_sample[channel]);
+		emu->pulse_state[channel] = EMU_PULSE_RAW;
+	}
+	if (emu->pulse_state[channel] == EMU_PULSE_LOW) {
+		if (sample == 0x00 && time != 0) {
+			return;
+		}
+		if (time != 0 && time != 0xffffff) { // pulses over a counter overflow are sent as samples
+			int rise = rise_position(sample);
+			if (rise != -1) {
+				emu->lead_tick[channel]   = tick;
+				emu->lead_time[channel]   = time;
+				emu->lead_phase[channel]  = rise;
+				emu->lead_sample[channel] = sample;
+				emu->pulse_state[channel] = EMU_PULSE_HIGH;
+				return;
+			}
+			// 0..01..10..0: the whole pulse is inside this tick
+			for (int a = 0; a < 7; ++a) {
+				for (int b = 1; a+b < 8; ++b) {
+					if (sample == ((0xff>>a) & ~(0xff>>(a+b)))) {
+						push_pulse(emu, channel, time, a+b, b);
+						return;
+					}
+				}
+			}
+		}
+		emu->pulse_state[channel] = EMU_PULSE_RAW;
+	}
+	if (edges || time == 0) {
+		push_sample(emu, channel, time, sample);
+	}
+	if (pulse_mode(emu) && !(sample&0x01)) {
+		emu->pulse_state[channel] = EMU_PULSE_LOW;
+	}
+}
+
+// one frame for the 8 ns tick starting at 'tick'
+static void emit_frame(tdc_emu_t *emu, int channel, long tick)
+{
+	int level = emu->level[channel];
+	unsigned char sample = 0;
+	for (int i = 0; i < 8; ++i) {
+		// sample bit 7 is the first nanosecond of the tick
+		while (emu->next_edge[channel] <= tick+i) {
+			emu->level[channel] = !emu->level[channel];
+			if (emu->level[channel]) {
+				emu->next_edge[channel] += emu->config.pulse_width;
+			} else {
+				emu->next_edge[channel] += random_interval(emu, channel);
+			}
+		}
+		sample |= emu->level[channel]<<(7-i);
+	}
+	if (tick >= emu->next_wrap[channel]) {
+		emu->next_wrap[channel] += EMU_WRAP_NS;
+	}
+	long time = ((tick - emu->enable_time[channel])/8) & 0xffffff;
+	board_sample(emu, channel, tick, time, level, sample);
+	if (tick >= emu->next_sync[channel]) {
+		// in the middle of the counter period, after the word of this tick
+		emu->next_sync[channel] += EMU_WRAP_NS;
+		if (sync_mode(emu)) {
+			raw_event_t record = {.channel = channel, .kind = TDC_RAW_SYNC, 
+			                      .epoch = (tick - emu->enable_time[channel])/EMU_WRAP_NS};
+			push_record(emu, &record);
+		}
+	}
+}
+
+// emit all frames of ticks that are complete at time t, in time order
+static void generate_frames(tdc_emu_t *emu, long t)
+{
+	for (;;) {
+		int  channel = -1;
+		long tick    = 0;
+		for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+			if (emu->enable_time[ch] < 0) {
+				continue;
+			}
+			long next = emu->next_edge[ch] < emu->next_wrap[ch] ? emu->next_edge[ch] : emu->next_wrap[ch];
+			next = next < emu->next_sync[ch] ? next : emu->next_sync[ch];
+			next = emu->enable_time[ch] + (next - emu->enable_time[ch])/8*8;
+			if (channel == -1 || next < tick) {
+				channel = ch;
+				tick    = next;
+			}
+		}
+		if (channel == -1 || tick+8 > t) {
+			return;
+		}
+		emit_frame(emu, channel, tick);
+	}
+}
+
+// decode register writes like ft232h_async_fifo.vhd does
+static void handle_commands(tdc_emu_t *emu, long t)
+{
+	unsigned char msg[64];
+	long n = read(emu->master, msg, sizeof(msg));
+	for (long i = 0; i < n; ++i) {
+		int addr = msg[i]>>4;
+		unsigned long old_registers = emu->registers;
+		unsigned long new_registers = old_registers & ~(0xfUL<<(4*addr));
+		new_registers |= (unsigned long)(msg[i]&0xf)<<(4*addr);
+		emu->registers = new_registers;
+		++emu->commands_received;
+		if (((old_registers ^ new_registers)>>48) & TDC_MODE_BLOCKS) {
+			emu->block_len = 0; // the block encoder is reset
+		}
+		for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+			if (emu->pulse_state[ch] == EMU_PULSE_RAW && !emu->level[ch]) {
+				emu->pulse_state[ch] = EMU_PULSE_LOW; // the tdc leaves p_raw with the next low sample
+			}
+		}
+		for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+			int was_enabled = (old_registers>>(60+ch)) & 0x1;
+			int is_enabled  = (new_registers>>(60+ch)) & 0x1;
+			if (!was_enabled && is_enabled) {
+				enable_channel(emu, ch, t);
+			} else if (was_enabled && !is_enabled) {
+				emu->enable_time[ch] = -1;
+			} else if (is_enabled && addr/3 == ch && !emu->level[ch]) {
+				// threshold changed, the waiting time for the next pulse changes
+				emu->next_edge[ch] = t + random_interval(emu, ch);
+			}
+		}
+	}
+}
+
+static void flush_packet(tdc_emu_t *emu)
+{
+	push_block(emu); // instead of the block encoder timeout
+	long n = emu->queue_len - emu->queue_head;
+	if (n > emu->config.packet_size) {
+		n = emu->config.packet_size;
+	}
+	if (n == 0) {
+		return;
+	}
+	long result = write(emu->master, emu->queue+emu->queue_head, n);
+	if (result > 0) { // nothing written means the host doesn't read (like TXE# high)
+		emu->queue_head += result;
+		if (emu->queue_head == emu->queue_len) {
+			emu->queue_head = emu->queue_len = 0;
+		}
+	}
+}
+
+static void *emulator_thread(void *arg)
+{
+	tdc_emu_t *emu = arg;
+	long next_packet = 0;
+	while (emu->running) {
+		long t = now_ns() - emu->start_ns;
+		handle_commands(emu, t);
+		generate_frames(emu, t);
+		if (t >= next_packet) {
+			flush_packet(emu);
+			next_packet += emu->config.packet_interval_ns;
+			if (next_packet < t) {
+				next_packet = t + emu->config.packet_interval_ns;
+			}
+		}
+		long wakeup = emu->start_ns + next_packet;
+		struct timespec ts = {.tv_sec = wakeup/1000000000L, .tv_nsec = wakeup%1000000000L};
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+	return NULL;
+}
+
+tdc_emu_t *tdc_emu_open(const tdc_emu_config_t *config)
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+		perror("Couldn't create pseudo terminal");
+		if (master != -1) {
+			close(master);
+		}
+		return NULL;
+	}
+
+	tdc_emu_t *emu = calloc(1, sizeof(tdc_emu_t));
+	emu->config = *config;
+	emu->master = master;
+	strncpy(emu->slave_name, ptsname(master), sizeof(emu->slave_name)-1);
+
+	// keep the slave open and in raw mode, otherwise frames
+	// would be echoed back as commands before tdc_open() is called
+	emu->slave = open(emu->slave_name, O_RDWR | O_NOCTTY);
+	struct termios raw;
+	if (emu->slave == -1 || tcgetattr(emu->slave, &raw) != 0) {
+		perror("Couldn't open pseudo terminal slave");
+		tdc_emu_close(emu);
+		return NULL;
+	}
+	cfmakeraw(&raw);
+	tcsetattr(emu->slave, TCSANOW, &raw);
+
+	emu->queue      = malloc(config->queue_size);
+	emu->rand_state = config->seed;
+	emu->registers  = (unsigned long)(config->enable_pattern&0xf)<<60;
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		emu->enable_time[ch] = -1;
+	}
+	return emu;
+}
+
+int tdc_emu_start(tdc_emu_t *emu)
+{
+	emu->start_ns = now_ns();
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		if (tdc_emu_enabled(emu, ch)) {
+			enable_channel(emu, ch, 0);
+		}
+	}
+	emu->running = 1;
+	if (pthread_create(&emu->thread, NULL, emulator_thread, emu) != 0) {
+		emu->running = 0;
+		return 0;
+	}
+	return 1;
+}
+
+void tdc_emu_stop(tdc_emu_t *emu)
+{
+	if (emu->running) {
+		emu->running = 0;
+		pthread_join(emu->thread, NULL);
+	}
+}
+
+void tdc_emu_close(tdc_emu_t *emu)
+{
+	tdc_emu_stop(emu);
+	if (emu->slave != -1) {
+		close(emu->slave);
+	}
+	close(emu->master);
+	free(emu->queue);
+	free(emu);
+}
@@ -0,0 +1,92 @@
+#ifndef TDC_EMULATOR_H
+#define TDC_EMULATOR_H
+
+#include "tdc_control.h"
+
+#include <pthread.h>
+
+//////////////////////////////////////////
+// board emulator on a pseudo terminal
+//
+// The emulator owns the master side of a pty pair. The slave side
+// (tdc_emu_t::slave_name) can be opened with tdc_open() like the
+// serial port of a real board. Frames are sent in USB packets of
+// up to packet_size bytes every packet_interval_ns, commands written
+// by tdc_enable_channels() and tdc_set_channel_threshold() are
+// decoded like the gateware does (ft232h_async_fifo.vhd).
+// In the block format (tdc_set_format()) records are collected into
+// blocks of up to TDC_EMU_BLOCK_RECORDS, a partly filled block is sent
+// with the next USB packet. In pulse mode (tdc_set_pulse_mode()) the
+// edges of clean pulses are paired like in tdc.vhd. Records that don't
+// fit into the queue are dropped and reported with a loss marker. Sync
+// frames (tdc_set_sync()) are sent like by tdc.vhd.
+//////////////////////////////////////////
+
+#define TDC_EMU_BLOCK_RECORDS 64 // max_records of block_encoder.vhd
+
+enum tdc_emu_pulse_state {
+	EMU_PULSE_LOW,  // waiting for the leading edge
+	EMU_PULSE_HIGH, // waiting for the falling edge
+	EMU_PULSE_RAW,  // sending samples until the input is low
+};
+
+typedef struct s_tdc_emu_config_t
+{
+	double rate;               // pulse rate per channel at threshold 0 in [Hz]
+	double threshold_scale;    // rate drops by exp(-threshold/threshold_scale)
+	long   pulse_width;        // in units of [1 ns]
+	int    packet_size;        // bytes per USB packet (512 for the FT232H)
+	long   packet_interval_ns; // time between two USB packets
+	long   queue_size;         // bytes that fit into the board buffers before frames are dropped
+	char   enable_pattern;     // channels enabled at startup, the gateware starts with none
+	unsigned int seed;
+} tdc_emu_config_t;
+
+void tdc_emu_default_config(tdc_emu_config_t *config);
+
+typedef struct s_tdc_emu_t
+{
+	tdc_emu_config_t config;
+	int              master;
+	int              slave;
+	char             slave_name[64];
+	pthread_t        thread;
+	volatile int     running;
+
+	// board state, only touched by the emulator thread
+	long             start_ns;                     // CLOCK_MONOTONIC at tdc_emu_start()
+	volatile unsigned long registers;              // same layout as in the gateware
+	long             enable_time[TDC_N_CHANNELS];  // in [ns] since start, -1 if disabled
+	long             next_edge[TDC_N_CHANNELS];    // in [ns] since start
+	long             next_wrap[TDC_N_CHANNELS];    // in [ns] since start
+	long             next_sync[TDC_N_CHANNELS];    // in [ns] since start, sync frames in the middle of the period
+	int              level[TDC_N_CHANNELS];
+	unsigned int     rand_state;
+	unsigned char   *queue;
+	long             queue_head;
+	long             queue_len;
+	raw_event_t      block[TDC_EMU_BLOCK_RECORDS];
+	int              block_len;
+	int              pulse_state[TDC_N_CHANNELS];  // tdc_emu_pulse_state
+	long             lead_tick[TDC_N_CHANNELS];    // leading edge of the current pulse
+	long             lead_time[TDC_N_CHANNELS];
+	int              lead_phase[TDC_N_CHANNELS];
+	unsigned char    lead_sample[TDC_N_CHANNELS];
+	unsigned long    lost[TDC_N_CHANNELS];         // dropped records not reported yet
+
+	// statistics, can be read from other threads
+	volatile unsigned long frames_sent;
+	volatile unsigned long channel_frames[TDC_N_CHANNELS];
+	volatile unsigned long frames_dropped;
+	volatile unsigned long commands_received;
+} tdc_emu_t;
+
+tdc_emu_t *tdc_emu_open(const tdc_emu_config_t *config);
+int        tdc_emu_start(tdc_emu_t *emu);
+void       tdc_emu_stop(tdc_emu_t *emu);
+void       tdc_emu_close(tdc_emu_t *emu);
+
+int        tdc_emu_threshold(tdc_emu_t *emu, int channel);
+int        tdc_emu_enabled(tdc_emu_t *emu, int channel);
+
+#endif
@@ -0,0 +1,305 @@
+#include "tdc_histogram.h"
+
+// POSIX header
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// C header
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+tdc_hist_t *tdc_hist_new(const char *name, tdc_hist_binning_t binning, int n_bins, double min, double max)
+{
+	if (n_bins < 1 || max <= min || (binning == TDC_HIST_LOG && min <= 0)) {
+		fprintf(stderr, "invalid histogram binning for %s\n", name);
+		return NULL;
+	}
+	tdc_hist_t *hist = calloc(1, sizeof(tdc_hist_t));
+	snprintf(hist->name, sizeof(hist->name), "%s", name);
+	hist->binning = binning;
+	hist->n_bins  = n_bins;
+	hist->min     = min;
+	hist->max     = max;
+	if (binning == TDC_HIST_LOG) {
+		hist->offset = log(min);
+		hist->scale  = n_bins/(log(max)-log(min));
+	} else {
+		hist->offset = min;
+		hist->scale  = n_bins/(max-min);
+	}
+	return hist;
+}
+
+void tdc_hist_free(tdc_hist_t *hist)
+{
+	if (!hist) {
+		return;
+	}
+	for (int i = 0; i < hist->n_shards; ++i) {
+		free(hist->shard[i]);
+	}
+	free(hist);
+}
+
+// adding shards is rare, a lock keeps the shard indices of all
+// histograms of a monitor in step
+static pthread_mutex_t shard_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int tdc_hist_add_shard(tdc_hist_t *hist)
+{
+	pthread_mutex_lock(&shard_mutex);
+	int shard = hist->n_shards;
+	if (shard == TDC_HIST_MAX_SHARDS) {
+		pthread_mutex_unlock(&shard_mutex);
+		fprintf(stderr, "too many shards for histogram %s\n", hist->name);
+		return -1;
+	}
+	hist->shard[shard] = calloc(hist->n_bins+2, sizeof(unsigned long));
+	__atomic_store_n(&hist->n_shards, shard+1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&shard_mutex);
+	return shard;
+}
+
+double tdc_hist_lower_edge(tdc_hist_t *hist, int bin)
+{
+	double x = hist->offset + bin/hist->scale;
+	return hist->binning == TDC_HIST_LOG ? exp(x) : x;
+}
+
+void tdc_hist_merge(tdc_hist_t *hist, unsigned long *counts)
+{
+	memset(counts, 0, sizeof(unsigned long)*(hist->n_bins+2));
+	int n_shards = __atomic_load_n(&hist->n_shards, __ATOMIC_ACQUIRE);
+	for (int s = 0; s < n_shards; ++s) {
+		for (int bin = 0; bin < hist->n_bins+2; ++bin) {
+			counts[bin] += __atomic_load_n(&hist->shard[s][bin], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// text snapshot: one header line, then "<lower edge> <count>" per bin
+void tdc_hist_write(FILE *out, tdc_hist_t *hist)
+{
+	unsigned long *counts = malloc(sizeof(unsigned long)*(hist->n_bins+2));
+	tdc_hist_merge(hist, counts);
+	unsigned long entries = 0;
+	for (int bin = 0; bin < hist->n_bins+2; ++bin) {
+		entries += counts[bin];
+	}
+	fprintf(out, "histogram %s %s %d %g %g underflow %lu overflow %lu entries %lu\n",
+		hist->name, hist->binning == TDC_HIST_LOG ? "log" : "fixed", 
+		hist->n_bins, hist->min, hist->max,
+		counts[0], counts[hist->n_bins+1], entries);
+	for (int bin = 0; bin < hist->n_bins; ++bin) {
+		fprintf(out, "%g %lu\n", tdc_hist_lower_edge(hist, bin), counts[bin+1]);
+	}
+	free(counts);
+}
+
+tdc_monitor_t *tdc_monitor_new()
+{
+	tdc_monitor_t *monitor = calloc(1, sizeof(tdc_monitor_t));
+	char name[32];
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		sprintf(name, "tot_ch%d", ch);
+		monitor->tot[ch]   = tdc_hist_new(name, TDC_HIST_FIXED, 1024, 0, 4096);
+		sprintf(name, "dt_ch%d", ch);
+		monitor->dt[ch]    = tdc_hist_new(name, TDC_HIST_LOG, 400, 1, 1e10);
+		sprintf(name, "phase_ch%d", ch);
+		monitor->phase[ch] = tdc_hist_new(name, TDC_HIST_FIXED, 8, 0, 8);
+	}
+	monitor->listen_fd = -1;
+	return monitor;
+}
+
+void tdc_monitor_free(tdc_monitor_t *monitor)
+{
+	tdc_monitor_stop(monitor);
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		tdc_hist_free(monitor->tot[ch]);
+		tdc_hist_free(monitor->dt[ch]);
+		tdc_hist_free(monitor->phase[ch]);
+	}
+	free(monitor);
+}
+
+int tdc_monitor_add_shard(tdc_monitor_t *monitor, tdc_monitor_shard_t *shard)
+{
+	static pthread_mutex_t monitor_mutex = PTHREAD_MUTEX_INITIALIZER;
+	memset(shard, 0, sizeof(tdc_monitor_shard_t));
+	shard->monitor = monitor;
+	// all histograms get their shards in the same order, the indices match
+	int ok = 1;
+	pthread_mutex_lock(&monitor_mutex);
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		shard->shard = tdc_hist_add_shard(monitor->tot[ch]);
+		int dt_shard    = tdc_hist_add_shard(monitor->dt[ch]);
+		int phase_shard = tdc_hist_add_shard(monitor->phase[ch]);
+		if (shard->shard == -1 || dt_shard == -1 || phase_shard == -1) {
+			ok = 0;
+		}
+	}
+	pthread_mutex_unlock(&monitor_mutex);
+	return ok;
+}
+
+void tdc_monitor_write(FILE *out, tdc_monitor_t *monitor)
+{
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		tdc_hist_write(out, monitor->tot[ch]);
+		tdc_hist_write(out, monitor->dt[ch]);
+		tdc_hist_write(out, monitor->phase[ch]);
+	}
+}
+
+// the file is replaced atomically, readers never see half a snapshot
+static void write_snapshot_file(tdc_monitor_t *monitor)
+{
+	char tmp_name[sizeof(monitor->target)+8];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", monitor->target);
+	FILE *out = fopen(tmp_name, "w");
+	if (!out) {
+		perror("cannot write histogram snapshot");
+		return;
+	}
+	tdc_monitor_write(out, monitor);
+	fclose(out);
+	rename(tmp_name, monitor->target);
+}
+
+#define SNAPSHOT_CLIENT_TIMEOUT_MS 200 // a client that doesn't read is dropped
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec-start->tv_sec)*1000 + (now.tv_nsec-start->tv_nsec)/1000000;
+}
+
+// The clients get a send timeout and a deadline for the whole snapshot,
+// so one that connects and doesn't read can't stall the thread.
+static void serve_snapshot(tdc_monitor_t *monitor, char *snapshot, size_t size)
+{
+	int client;
+	while ((client = accept(monitor->listen_fd, NULL, NULL)) != -1) {
+		struct timeval timeout = {.tv_sec = 0, .tv_usec = SNAPSHOT_CLIENT_TIMEOUT_MS*1000};
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (size_t done = 0; done < size; ) {
+			ssize_t result = send(client, snapshot+done, size-done, MSG_NOSIGNAL);
+			if (result <= 0 || elapsed_ms(&start) > SNAPSHOT_CLIENT_TIMEOUT_MS) {
+				break;
+			}
+			done += result;
+		}
+		close(client);
+	}
+}
+
+static void *monitor_thread(void *arg)
+{
+	tdc_monitor_t *monitor = arg;
+	char  *snapshot = NULL;
+	size_t size     = 0;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (monitor->running) {
+		if (monitor->listen_fd == -1) {
+			write_snapshot_file(monitor);
+		} else {
+			// clients get the snapshot of the last interval
+			free(snapshot);
+			FILE *out = open_memstream(&snapshot, &size);
+			tdc_monitor_write(out, monitor);
+			fclose(out);
+		}
+		long interval_ns = monitor->interval*1e9;
+		next.tv_sec  += (next.tv_nsec + interval_ns)/1000000000L;
+		next.tv_nsec  = (next.tv_nsec + interval_ns)%1000000000L;
+		for (;;) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long remaining_ms = (next.tv_sec-now.tv_sec)*1000 + (next.tv_nsec-now.tv_nsec)/1000000;
+			if (!monitor->running) {
+				break;
+			}
+			if (monitor->listen_fd == -1) {
+				if (remaining_ms <= 0) {
+					break;
+				}
+				usleep(remaining_ms < 100 ? remaining_ms*1000 : 100000);
+				continue;
+			}
+			// waiting clients are served even if the snapshot took longer
+			// than the interval, otherwise they would never get one
+			struct pollfd pfd = {.fd = monitor->listen_fd, .events = POLLIN};
+			long wait_ms = remaining_ms <= 0 ? 0 : remaining_ms < 100 ? remaining_ms : 100;
+			if (poll(&pfd, 1, wait_ms) > 0) {
+				serve_snapshot(monitor, snapshot, size);
+			}
+			if (remaining_ms <= 0) {
+				break;
+			}
+		}
+	}
+	free(snapshot);
+	return NULL;
+}
+
+// target is a file name or unix:<socket path>
+int tdc_monitor_start(tdc_monitor_t *monitor, const char *target, double interval)
+{
+	if (interval <= 0) {
+		fprintf(stderr, "invalid histogram interval %g\n", interval);
+		return 0;
+	}
+	monitor->interval = interval;
+	if (strncmp(target, "unix:", 5) == 0) {
+		struct sockaddr_un addr = {.sun_family = AF_UNIX};
+		strncpy(addr.sun_path, target+5, sizeof(addr.sun_path)-1);
+		strncpy(monitor->target, target+5, sizeof(monitor->target)-1);
+		unlink(addr.sun_path);
+		monitor->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (monitor->listen_fd == -1 || 
+		    bind(monitor->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+		    listen(monitor->listen_fd, 16) == -1) {
+			int err = errno;
+			fprintf(stderr, "cannot serve histograms on %s: %s\n", target+5, strerror(err));
+			if (monitor->listen_fd != -1) {
+				close(monitor->listen_fd);
+			}
+			monitor->listen_fd = -1;
+			return 0;
+		}
+	} else {
+		strncpy(monitor->target, target, sizeof(monitor->target)-1);
+	}
+	monitor->running = 1;
+	if (pthread_create(&monitor->thread, NULL, monitor_thread, monitor) != 0) {
+		monitor->running = 0;
+		return 0;
+	}
+	return 1;
+}
+
+void tdc_monitor_stop(tdc_monitor_t *monitor)
+{
+	if (monitor->running) {
+		monitor->running = 0;
+		pthread_join(monitor->thread, NULL);
+		if (monitor->listen_fd == -1) {
+			write_snapshot_file(monitor); // final snapshot
+		} else {
+			close(monitor->listen_fd);
+			unlink(monitor->target);
+			monitor->listen_fd = -1;
+		}
+	}
+}
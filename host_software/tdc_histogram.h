@@ -0,0 +1,118 @@
+#ifndef TDC_HISTOGRAM_H
+#define TDC_HISTOGRAM_H
+
+#include "tdc_control.h"
+
+#include <stdio.h>
+#include <pthread.h>
+#include <math.h>
+
+//////////////////////////////////////////
+// histograms for online monitoring
+//
+// Every filling thread gets its own shard of counters (one writer per
+// shard, no locks, no atomic read-modify-write). Readers merge all
+// shards with relaxed loads, so snapshots can be taken at any time
+// from any thread without slowing down the filling thread.
+//////////////////////////////////////////
+
+#define TDC_HIST_MAX_SHARDS 16
+
+typedef enum e_tdc_hist_binning_t
+{
+	TDC_HIST_FIXED, // equal bin width between min and max
+	TDC_HIST_LOG,   // equal bin width in log(value), min > 0
+} tdc_hist_binning_t;
+
+typedef struct s_tdc_hist_t
+{
+	char               name[32];
+	tdc_hist_binning_t binning;
+	int                n_bins;
+	double             min, max;
+	double             offset, scale;                  // bin = (value-offset)*scale (or log(value))
+	unsigned long     *shard[TDC_HIST_MAX_SHARDS];     // n_bins+2 counters: underflow, bins, overflow
+	int                n_shards;
+} tdc_hist_t;
+
+tdc_hist_t *tdc_hist_new(const char *name, tdc_hist_binning_t binning, int n_bins, double min, double max);
+void        tdc_hist_free(tdc_hist_t *hist);
+int         tdc_hist_add_shard(tdc_hist_t *hist); // once per filling thread, returns the shard index
+double      tdc_hist_lower_edge(tdc_hist_t *hist, int bin);
+void        tdc_hist_merge(tdc_hist_t *hist, unsigned long *counts); // n_bins+2 counts
+void        tdc_hist_write(FILE *out, tdc_hist_t *hist);
+
+static inline void tdc_hist_fill(tdc_hist_t *hist, int shard, double value)
+{
+	int bin;
+	if (hist->binning == TDC_HIST_LOG) {
+		value = value > 0 ? log(value) : -1e300;
+	}
+	double x = (value - hist->offset)*hist->scale;
+	if (x < 0) {
+		bin = 0;
+	} else if (x >= hist->n_bins) {
+		bin = hist->n_bins+1;
+	} else {
+		bin = 1 + (int)x;
+	}
+	unsigned long *counter = &hist->shard[shard][bin];
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED)+1, __ATOMIC_RELAXED);
+}
+
+//////////////////////////////////////////
+// monitor: the standard set of histograms per channel
+// and a service thread that publishes snapshots
+//////////////////////////////////////////
+
+typedef struct s_tdc_monitor_t
+{
+	tdc_hist_t *tot[TDC_N_CHANNELS];   // time over threshold in [ns]
+	tdc_hist_t *dt[TDC_N_CHANNELS];    // time between rising edges in [ns]
+	tdc_hist_t *phase[TDC_N_CHANNELS]; // edge position inside the 8 ns sample
+
+	// snapshot service
+	char        target[256]; // file name or unix:<socket path>
+	double      interval;    // in [s]
+	int         listen_fd;
+	pthread_t   thread;
+	volatile int running;
+} tdc_monitor_t;
+
+// per filling thread state
+typedef struct s_tdc_monitor_shard_t
+{
+	tdc_monitor_t *monitor;
+	int            shard;
+	unsigned long  last_rising[TDC_N_CHANNELS];
+	int            rising_seen[TDC_N_CHANNELS];
+} tdc_monitor_shard_t;
+
+tdc_monitor_t *tdc_monitor_new();
+void           tdc_monitor_free(tdc_monitor_t *monitor);
+int            tdc_monitor_add_shard(tdc_monitor_t *monitor, tdc_monitor_shard_t *shard); // 0 if no shard is left
+void           tdc_monitor_write(FILE *out, tdc_monitor_t *monitor);
+int            tdc_monitor_start(tdc_monitor_t *monitor, const char *target, double interval);
+void           tdc_monitor_stop(tdc_monitor_t *monitor);
+
+static inline void tdc_monitor_fill(tdc_monitor_shard_t *shard, tdc_event_t *event)
+{
+	tdc_monitor_t *monitor = shard->monitor;
+	int ch = event->channel;
+	if (event->edge == TDC_EDGE_LOSS) { // no ToT or dt across lost data
+		shard->rising_seen[ch] = 0;
+		return;
+	}
+	tdc_hist_fill(monitor->phase[ch], shard->shard, event->time%8);
+	if (event->edge == TDC_EDGE_RISING) {
+		if (shard->rising_seen[ch]) {
+			tdc_hist_fill(monitor->dt[ch], shard->shard, event->time - shard->last_rising[ch]);
+		}
+		shard->last_rising[ch] = event->time;
+		shard->rising_seen[ch] = 1;
+	} else if (shard->rising_seen[ch]) {
+		tdc_hist_fill(monitor->tot[ch], shard->shard, event->time - shard->last_rising[ch]);
+	}
+}
+
+#endif
@@ -0,0 +1,294 @@
+#include "tdc_index.h"
+#include "tdc_rules.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// per-channel state of the builder, the rules of next_event() without the events
+typedef struct s_index_channel_t
+{
+	unsigned long overflow_count;
+	unsigned long word_time;
+	unsigned long previous_time;
+	unsigned long rise_time;
+	unsigned char sample;
+	int           started;
+	int           lost;
+	int           rising;
+} index_channel_t;
+
+static inline unsigned long word_ns(const index_channel_t *c)
+{
+	return tdc_word_ns(c->overflow_count, c->word_time);
+}
+
+static void update_time(index_channel_t *c, unsigned long time)
+{
+	c->overflow_count += tdc_counter_overflowed(c->started, c->word_time, time);
+	c->started   = 1;
+	c->word_time = time;
+}
+
+static void update_sample(index_channel_t *c, unsigned char sample)
+{
+	if (c->lost) { // no edge at the start of the first sample after a loss
+		c->sample = tdc_sample_after_loss(sample);
+		c->lost   = 0;
+	}
+	int k = tdc_last_edge(c->sample, sample);
+	if (k) {
+		// the last edge decides: a falling edge ends the pulse, a rising one starts the next
+		c->previous_time = tdc_edge_ns(c->overflow_count, c->word_time, k);
+		c->rising        = (sample>>(k-1)) & 1;
+		if (c->rising) {
+			c->rise_time = c->previous_time;
+		}
+	}
+	c->sample = sample;
+}
+
+static void add_entry(tdc_index_t *index, unsigned long offset, index_channel_t *channels)
+{
+	if (index->header.n_entries == (uint64_t)index->capacity) {
+		index->capacity = index->capacity ? 2*index->capacity : 1024;
+		index->entries  = realloc(index->entries, index->capacity*sizeof(tdc_index_entry_t));
+	}
+	tdc_index_entry_t *entry = &index->entries[index->header.n_entries++];
+	memset(entry, 0, sizeof(tdc_index_entry_t));
+	entry->offset   = offset;
+	entry->min_time = ULONG_MAX;
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		index_channel_t *c = &channels[ch];
+		entry->overflow_count[ch] = c->overflow_count;
+		entry->previous_time[ch]  = c->previous_time;
+		entry->rise_time[ch]      = c->rise_time;
+		entry->word_time[ch]      = c->word_time;
+		entry->sample[ch]         = c->sample;
+		entry->started |= c->started << ch;
+		entry->lost    |= c->lost << ch;
+		entry->rising  |= c->rising << ch;
+		if (c->started) {
+			// the edges of a word are inside its 8 ns, the rising edge of
+			// a pulse record is up to 1023 ns before the word
+			unsigned long t = word_ns(c);
+			if (t+8 > entry->time) {
+				entry->time = t+8;
+			}
+			t = t > 1024 ? t-1024 : 0;
+			if (t < entry->min_time) {
+				entry->min_time = t;
+			}
+		}
+	}
+	if (entry->min_time == ULONG_MAX) {
+		entry->min_time = 0;
+	}
+}
+
+tdc_index_t *tdc_index_build(const char *capture, tdc_format_t format, long interval)
+{
+	tdc_t *tdc = tdc_open(capture);
+	if (!tdc) {
+		return NULL;
+	}
+	tdc->format = format; // a file can't take the mode register write
+	struct stat st;
+	fstat(tdc->fd, &st);
+
+	tdc_index_t *index = calloc(1, sizeof(tdc_index_t));
+	index->header.magic        = TDC_INDEX_MAGIC;
+	index->header.version      = TDC_INDEX_VERSION;
+	index->header.entry_size   = sizeof(tdc_index_entry_t);
+	index->header.format       = format;
+	index->header.interval     = interval;
+	index->header.capture_size = st.st_size;
+
+	index_channel_t channels[TDC_N_CHANNELS];
+	memset(channels, 0, sizeof(channels));
+	add_entry(index, 0, channels);
+	long words = 0;
+	for (;;) {
+		raw_event_t revent = next_raw_event(tdc);
+		int ch = revent.channel;
+		if (ch == -1) {
+			break;
+		}
+		index_channel_t *c = &channels[ch];
+		switch (revent.kind) {
+			case TDC_RAW_SYNC:
+				tdc_apply_sync(&c->started, &c->word_time, &c->overflow_count, revent.epoch);
+				c->rising = 0;
+				break;
+			case TDC_RAW_LOSS:
+				c->lost   = 1;
+				c->rising = 0;
+				break;
+			case TDC_RAW_PULSE:
+				update_time(c, revent.time);
+				c->previous_time = word_ns(c) + revent.phase;
+				c->sample        = tdc_sample_after_pulse(revent.phase);
+				c->lost          = 0;
+				c->rising        = 0;
+				break;
+			default:
+				update_time(c, revent.time);
+				update_sample(c, revent.sample);
+				break;
+		}
+		// in block format only between blocks, the decoder can't start inside one
+		if (++words >= interval && tdc->block_pos == tdc->block_len) {
+			add_entry(index, tdc->raw_offset, channels);
+			words = 0;
+		}
+	}
+	tdc_close(tdc);
+	return index;
+}
+
+void tdc_index_free(tdc_index_t *index)
+{
+	if (index) {
+		free(index->entries);
+		free(index);
+	}
+}
+
+int tdc_index_write(const char *filename, const tdc_index_t *index)
+{
+	char tmp_name[4096];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", filename);
+	FILE *out = fopen(tmp_name, "w");
+	if (!out) {
+		fprintf(stderr, "cannot write index %s: %s\n", tmp_name, strerror(errno));
+		return 0;
+	}
+	int ok = fwrite(&index->header, sizeof(tdc_index_header_t), 1, out) == 1
+		&& fwrite(index->entries, sizeof(tdc_index_entry_t), index->header.n_entries, out) == index->header.n_entries
+		&& fflush(out) == 0 && fsync(fileno(out)) == 0;
+	ok = fclose(out) == 0 && ok;
+	if (!ok || rename(tmp_name, filename) == -1) {
+		fprintf(stderr, "cannot write index %s: %s\n", filename, strerror(errno));
+		unlink(tmp_name);
+		return 0;
+	}
+	return 1;
+}
+
+tdc_index_t *tdc_index_read(const char *filename)
+{
+	FILE *in = fopen(filename, "r");
+	if (!in) {
+		return NULL;
+	}
+	tdc_index_t *index = calloc(1, sizeof(tdc_index_t));
+	tdc_index_header_t *header = &index->header;
+	if (fread(header, sizeof(tdc_index_header_t), 1, in) != 1 || header->magic != TDC_INDEX_MAGIC
+			|| header->version != TDC_INDEX_VERSION || header->entry_size != sizeof(tdc_index_entry_t)
+			|| header->n_entries == 0) {
+		fclose(in);
+		free(index);
+		return NULL;
+	}
+	index->capacity = header->n_entries;
+	index->entries  = malloc(header->n_entries*sizeof(tdc_index_entry_t));
+	if (fread(index->entries, sizeof(tdc_index_entry_t), header->n_entries, in) != header->n_entries) {
+		fclose(in);
+		tdc_index_free(index);
+		return NULL;
+	}
+	fclose(in);
+	return index;
+}
+
+tdc_index_t *tdc_index_open(const char *capture, tdc_format_t format, long interval)
+{
+	char filename[4096];
+	snprintf(filename, sizeof(filename), "%s.idx", capture);
+	struct stat st;
+	if (stat(capture, &st) == -1) {
+		return NULL;
+	}
+	tdc_index_t *index = tdc_index_read(filename);
+	if (index && index->header.format == (uint32_t)format && index->header.capture_size == (uint64_t)st.st_size) {
+		return index;
+	}
+	tdc_index_free(index); // the capture grew or was replaced
+	index = tdc_index_build(capture, format, interval);
+	if (index) {
+		tdc_index_write(filename, index);
+	}
+	return index;
+}
+
+long tdc_index_find(const tdc_index_t *index, unsigned long t)
+{
+	long lo = 0, hi = index->header.n_entries; // the entry is in [lo, hi)
+	while (hi - lo > 1) {
+		long mid = (lo + hi)/2;
+		if (index->entries[mid].time <= t) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+int tdc_index_seek(const tdc_index_t *index, tdc_t *tdc, unsigned long t)
+{
+	const tdc_index_entry_t *entry = &index->entries[tdc_index_find(index, t)];
+	tdc->format = index->header.format;
+	if (!tdc_seek(tdc, entry->offset)) {
+		return 0;
+	}
+	tdc->rising = entry->rising;
+	for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+		tdc->time[ch]           = entry->word_time[ch];
+		tdc->overflow_count[ch] = entry->overflow_count[ch];
+		tdc->previous_time[ch]  = entry->previous_time[ch];
+		tdc->rise_time[ch]      = entry->rise_time[ch];
+		tdc->sample[ch]         = entry->sample[ch];
+		tdc->started[ch]        = (entry->started>>ch) & 1;
+		tdc->lost[ch]           = (entry->lost>>ch) & 1;
+		tdc->unsynced[ch]       = 0;
+	}
+	return 1;
+}
+
+unsigned long tdc_index_end(const tdc_index_t *index, unsigned long t0, unsigned long t1)
+{
+	long last = tdc_index_find(index, t0) + 1;
+	while (last < (long)index->header.n_entries && index->entries[last].min_time < t1) {
+		++last;
+	}
+	return last < (long)index->header.n_entries ? index->entries[last].offset : ULONG_MAX;
+}
+
+long tdc_index_query(const tdc_index_t *index, tdc_t *tdc, unsigned long t0, unsigned long t1,
+                     tdc_index_callback_t callback, void *arg)
+{
+	if (!tdc_index_seek(index, tdc, t0)) {
+		return -1;
+	}
+	unsigned long stop = tdc_index_end(index, t0, t1);
+	long n = 0;
+	for (;;) {
+		tdc_event_t event = tdc_next_event(tdc);
+		if (event.channel == -1 || tdc->raw_offset > stop) {
+			break;
+		}
+		if (event.time >= t0 && event.time < t1) {
+			++n;
+			if (!callback(&event, arg)) {
+				break;
+			}
+		}
+	}
+	return n;
+}
@@ -0,0 +1,100 @@
+#ifndef TDC_INDEX_H
+#define TDC_INDEX_H
+
+#include "tdc_control.h"
+
+#include <stdint.h>
+
+//////////////////////////////////////////
+// sparse time index over capture files
+//
+// A side-car file (by convention <capture>.idx) with one entry every
+// 'interval' words of the capture. An entry holds the byte offset and the
+// per-channel state the decoder has there: counter time, overflow count,
+// last sample, time of the last edge and of the rising edge of an open
+// pulse, for the ToT of its falling edge. tdc_index_seek() puts a decoder
+// at the last entry before a time, so a time window in the middle of a
+// long capture costs the decoding of the window and on average half an
+// interval in front of it, instead of everything from byte 0.
+//
+// The index is built from the raw words (next_raw_event()), without
+// building events, so it runs at the speed of the word decoding. In block
+// format the entries are at block boundaries.
+//
+// The channels are not in time order with each other in the stream, so
+// every entry has two times in [ns]:
+//   time      all edges in front of the entry are earlier
+//   min_time  all edges behind the entry are later or at the same time
+// time grows with the entries, min_time may drop when a channel starts.
+// Filters (tdc_set_filter()) start idle at the entry, a held pulse across
+// the entry and the deadtime of the pulse before it are not known.
+//////////////////////////////////////////
+
+#define TDC_INDEX_MAGIC   0x49434454 // "TDCI"
+#define TDC_INDEX_VERSION 2
+#define TDC_INDEX_DEFAULT_INTERVAL 65536 // words, 2 kB of index per 320 kB of frames
+
+typedef struct s_tdc_index_entry_t
+{
+	uint64_t offset;   // byte offset in the capture
+	uint64_t time;     // [ns], see above
+	uint64_t min_time; // [ns]
+	uint64_t overflow_count[TDC_N_CHANNELS];
+	uint64_t previous_time[TDC_N_CHANNELS]; // [ns] of the last edge, for tdc_event_t::dt
+	uint64_t rise_time[TDC_N_CHANNELS];     // [ns] of the last rising edge, for tdc_event_t::tot
+	uint32_t word_time[TDC_N_CHANNELS];     // 24 bit counter of the last word
+	uint8_t  sample[TDC_N_CHANNELS];
+	uint8_t  started;  // bit mask of channels that had a word
+	uint8_t  lost;     // bit mask of channels after a loss marker
+	uint8_t  rising;   // bit mask of channels with a valid rise_time, tdc_t::rising
+	uint8_t  pad;
+} tdc_index_entry_t;
+
+typedef struct s_tdc_index_header_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entry_size;   // sizeof(tdc_index_entry_t)
+	uint32_t format;       // tdc_format_t of the capture
+	uint64_t interval;
+	uint64_t capture_size; // bytes of the capture when it was indexed
+	uint64_t n_entries;
+} tdc_index_header_t;
+
+typedef struct s_tdc_index_t
+{
+	tdc_index_header_t header;
+	tdc_index_entry_t *entries;
+	long               capacity;
+} tdc_index_t;
+
+// Decodes the capture once and returns the index or NULL if the capture
+// can't be opened. The first entry is at offset 0.
+tdc_index_t *tdc_index_build(const char *capture, tdc_format_t format, long interval);
+void         tdc_index_free(tdc_index_t *index);
+// The side-car file is replaced atomically, like a checkpoint. Both return
+// 0/NULL on error, tdc_index_read() also if the file is not an index.
+int          tdc_index_write(const char *filename, const tdc_index_t *index);
+tdc_index_t *tdc_index_read(const char *filename);
+// Reads <capture>.idx if it fits the capture (same format and size) and
+// builds and writes it otherwise. NULL if the capture can't be read.
+tdc_index_t *tdc_index_open(const char *capture, tdc_format_t format, long interval);
+
+// the last entry with time <= t, entry 0 if there is none
+long tdc_index_find(const tdc_index_t *index, unsigned long t);
+// Sets the decoder to the state of the last entry before t. The events
+// from tdc_next_event() start there, with all events at and after t.
+// Returns 0 if the capture can't seek.
+int  tdc_index_seek(const tdc_index_t *index, tdc_t *tdc, unsigned long t);
+// The byte offset of the first entry behind which all events are at or
+// after t1, ULONG_MAX if there is none. Starts the search at the entry of t0.
+unsigned long tdc_index_end(const tdc_index_t *index, unsigned long t0, unsigned long t1);
+// Calls 'callback' for each event with t0 <= time < t1 and returns the
+// number of events, or -1 if the capture can't seek. The events are in
+// stream order like from tdc_next_event(). Decoding stops at the first
+// entry behind the window. A callback that returns 0 stops the query.
+typedef int (*tdc_index_callback_t)(const tdc_event_t *event, void *arg);
+long tdc_index_query(const tdc_index_t *index, tdc_t *tdc, unsigned long t0, unsigned long t1,
+                     tdc_index_callback_t callback, void *arg);
+
+#endif
@@ -0,0 +1,154 @@
+#define _GNU_SOURCE // CPU_SET and pthread_setaffinity_np
+#include "tdc_realtime.h"
+
+// POSIX header
+#include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+// C header
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define PREFAULT_STACK_SIZE (256*1024)
+
+void tdc_realtime_default_config(tdc_realtime_config_t *config)
+{
+	config->busy_poll   = 0;
+	config->lock_memory = 0;
+	config->cpu         = -1;
+	config->priority    = 0;
+}
+
+// VMIN=1, VTIME=0 and O_NONBLOCK: read() returns what is there or EAGAIN.
+// VMIN=0 would return 0 for "nothing yet", which next_byte() can't tell
+// from the end of a file.
+static int setup_device(tdc_t *tdc)
+{
+	struct termios raw;
+	if (tcgetattr(tdc->fd, &raw) == 0) {
+		raw.c_cc[VMIN] = 1; raw.c_cc[VTIME] = 0;
+		if (tcsetattr(tdc->fd, TCSANOW, &raw) < 0) {
+			fprintf(stderr, "cannot set VMIN/VTIME: %s\n", strerror(errno));
+			return 0;
+		}
+		// only serial drivers know the flag, a pty or a file doesn't need it
+		struct serial_struct serial;
+		if (ioctl(tdc->fd, TIOCGSERIAL, &serial) == 0) {
+			serial.flags |= ASYNC_LOW_LATENCY;
+			if (ioctl(tdc->fd, TIOCSSERIAL, &serial) != 0) {
+				fprintf(stderr, "cannot set the low latency flag: %s\n", strerror(errno));
+			}
+		}
+	}
+	int flags = fcntl(tdc->fd, F_GETFL);
+	if (flags == -1 || fcntl(tdc->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		fprintf(stderr, "cannot make the device non-blocking: %s\n", strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+// touch the stack once, after mlockall() the pages stay
+static void prefault_stack()
+{
+	unsigned char stack[PREFAULT_STACK_SIZE];
+	memset(stack, 0, sizeof(stack));
+	__asm__ __volatile__("" : : "r"(stack) : "memory"); // keeps the memset
+}
+
+int tdc_realtime_setup(tdc_t *tdc, const tdc_realtime_config_t *config)
+{
+	int ok = setup_device(tdc);
+	if (ok) {
+		tdc->read_mode = config->busy_poll ? TDC_READ_BUSY : TDC_READ_POLL;
+	}
+	if (config->lock_memory) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+			prefault_stack();
+		} else {
+			fprintf(stderr, "cannot lock memory: %s\n", strerror(errno));
+			ok = 0;
+		}
+	}
+	if (config->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(config->cpu, &cpus);
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (err) {
+			fprintf(stderr, "cannot pin the thread to CPU %d: %s\n", config->cpu, strerror(err));
+			ok = 0;
+		}
+	}
+	if (config->priority > 0) {
+		struct sched_param param = {.sched_priority = config->priority};
+		int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (err) {
+			fprintf(stderr, "cannot set SCHED_FIFO priority %d: %s\n", config->priority, strerror(err));
+			ok = 0;
+		}
+	}
+	return ok;
+}
+
+tdc_latency_t *tdc_latency_new()
+{
+	tdc_latency_t *latency = calloc(1, sizeof(tdc_latency_t));
+	latency->hist  = tdc_hist_new("latency_ns", TDC_HIST_LOG, 80, 10, 1e9);
+	latency->shard = latency->hist ? tdc_hist_add_shard(latency->hist) : -1;
+	if (latency->shard == -1) {
+		tdc_latency_free(latency);
+		return NULL;
+	}
+	return latency;
+}
+
+void tdc_latency_free(tdc_latency_t *latency)
+{
+	tdc_hist_free(latency->hist);
+	free(latency);
+}
+
+double tdc_latency_quantile(tdc_latency_t *latency, double q)
+{
+	tdc_hist_t *hist = latency->hist;
+	unsigned long max_ns = __atomic_load_n(&latency->max_ns, __ATOMIC_RELAXED);
+	unsigned long counts[hist->n_bins+2];
+	tdc_hist_merge(hist, counts);
+	unsigned long entries = 0;
+	for (int bin = 0; bin < hist->n_bins+2; ++bin) {
+		entries += counts[bin];
+	}
+	unsigned long sum = 0;
+	for (int bin = 0; bin < hist->n_bins+1; ++bin) {
+		sum += counts[bin];
+		if (entries && sum >= q*entries) {
+			double edge = tdc_hist_lower_edge(hist, bin); // upper edge of counts[bin]
+			return edge < max_ns ? edge : max_ns;
+		}
+	}
+	return max_ns;
+}
+
+void tdc_latency_print(FILE *out, tdc_latency_t *latency)
+{
+	fprintf(out, "latency: %lu events   50%% < %.0f ns   99%% < %.0f ns   99.9%% < %.0f ns   max %lu ns\n",
+		__atomic_load_n(&latency->count, __ATOMIC_RELAXED),
+		tdc_latency_quantile(latency, 0.5),
+		tdc_latency_quantile(latency, 0.99),
+		tdc_latency_quantile(latency, 0.999),
+		__atomic_load_n(&latency->max_ns, __ATOMIC_RELAXED));
+}
+
+void tdc_latency_write(FILE *out, tdc_latency_t *latency)
+{
+	tdc_hist_write(out, latency->hist);
+}
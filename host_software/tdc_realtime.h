@@ -0,0 +1,75 @@
+#ifndef TDC_REALTIME_H
+#define TDC_REALTIME_H
+
+#include "tdc_control.h"
+#include "tdc_histogram.h"
+
+#include <stdio.h>
+#include <time.h>
+
+//////////////////////////////////////////
+// real-time acquisition
+//
+// tdc_realtime_setup() prepares the device and the calling thread, which
+// must be the thread that calls tdc_next_event():
+//   device   non-blocking reads with VMIN=1, VTIME=0, so read() returns
+//            whatever arrived without waiting for more bytes, and the
+//            low latency flag of the serial driver (for the FT232H the
+//            ftdi_sio latency timer drops from 16 ms to 1 ms)
+//   waiting  poll() on the device or busy polling with read()
+//   memory   mlockall() and a prefaulted stack, no page faults later
+//   thread   pinned to one CPU and/or SCHED_FIFO with a priority
+//
+// The latency histogram measures the time from the read() that returned
+// the last byte of an event to the point where the program calls
+// tdc_latency_deliver() after handing the event on.
+//////////////////////////////////////////
+
+typedef struct s_tdc_realtime_config_t
+{
+	int busy_poll;   // spin on read() instead of poll()
+	int lock_memory; // mlockall() and prefault the stack
+	int cpu;         // pin the thread to this CPU, -1: no pinning
+	int priority;    // SCHED_FIFO priority 1..99, 0: keep the scheduler
+} tdc_realtime_config_t;
+
+void tdc_realtime_default_config(tdc_realtime_config_t *config);
+// Returns 1 if all settings took effect. Each setting that fails (e.g.
+// SCHED_FIFO without the permission) is reported on stderr, the others
+// stay in place and 0 is returned.
+int  tdc_realtime_setup(tdc_t *tdc, const tdc_realtime_config_t *config);
+
+//////////////////////////////////////////
+// read to delivery latency
+//////////////////////////////////////////
+
+typedef struct s_tdc_latency_t
+{
+	tdc_hist_t   *hist;   // in [ns], log binning
+	int           shard;
+	unsigned long count;  // written by the delivering thread only
+	unsigned long max_ns;
+} tdc_latency_t;
+
+tdc_latency_t *tdc_latency_new(); // NULL if the histogram can't be made
+void           tdc_latency_free(tdc_latency_t *latency);
+// upper bin edge below which the fraction q of all deliveries lies
+double         tdc_latency_quantile(tdc_latency_t *latency, double q);
+// one line: count, median, 99%, 99.9% and maximum
+void           tdc_latency_print(FILE *out, tdc_latency_t *latency);
+// the histogram in the format of tdc_hist_write()
+void           tdc_latency_write(FILE *out, tdc_latency_t *latency);
+
+static inline void tdc_latency_deliver(tdc_latency_t *latency, tdc_t *tdc)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	unsigned long ns = now.tv_sec*1000000000UL + now.tv_nsec - tdc->read_ns;
+	tdc_hist_fill(latency->hist, latency->shard, ns);
+	__atomic_store_n(&latency->count, latency->count+1, __ATOMIC_RELAXED);
+	if (ns > latency->max_ns) {
+		__atomic_store_n(&latency->max_ns, ns, __ATOMIC_RELAXED);
+	}
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef TDC_RULES_H
+#define TDC_RULES_H
+
+//////////////////////////////////////////
+// decoder rules shared by tdc_control.c, tdc_index.c and tdc_decoder.hpp (private)
+//
+// The index builder follows the per-channel state of next_event() without
+// building events, the C++ decoder builds the same events. All of them use
+// these helpers, so they can't drift apart when a rule changes.
+//
+// Edges are numbered by k = 1..8 in the 9 bits (bit 0 of the previous
+// sample)<<8 | sample: edge k is between bit k and bit k-1, at 8-k ns
+// after the start of the word. k = 8 is the edge between two samples.
+//////////////////////////////////////////
+
+// [ns] of the start of a word
+static inline unsigned long tdc_word_ns(unsigned long overflow_count, unsigned long time)
+{
+	return ((overflow_count<<24) + time) << 3;
+}
+
+static inline unsigned long tdc_edge_ns(unsigned long overflow_count, unsigned long time, int k)
+{
+	return tdc_word_ns(overflow_count, time) + 8 - k;
+}
+
+// The 24 bit counter overflowed if the time is 0 (the board always sends a
+// word then) or goes backwards (that word was lost). The first word of a
+// channel has time 0 because the counter starts when the channel is enabled.
+static inline int tdc_counter_overflowed(int started, unsigned long last_time, unsigned long time)
+{
+	return started && (time == 0 || time < last_time);
+}
+
+// a sync frame: the epoch is the overflow count, the counter is at 0
+static inline void tdc_apply_sync(int *started, unsigned long *time, unsigned long *overflow_count, unsigned long epoch)
+{
+	*overflow_count = epoch;
+	*time           = 0;
+	*started        = 1;
+}
+
+// the previous sample for the first sample after a loss: no edge at its start
+static inline unsigned char tdc_sample_after_loss(unsigned char sample)
+{
+	return (sample&0x80) ? 0xff : 0x00;
+}
+
+// the channel is low after a pulse record with the falling edge at 'phase'
+static inline unsigned char tdc_sample_after_pulse(int phase)
+{
+	return ~(0xff>>phase);
+}
+
+// k of the last edge of a sample after 'previous', 0 if there is none
+static inline int tdc_last_edge(unsigned char previous, unsigned char sample)
+{
+	unsigned int bits  = ((previous&0x01)<<8) | sample;
+	unsigned int edges = (bits ^ (bits>>1)) & 0xff; // bit k-1 set: bits k and k-1 differ
+	return edges ? __builtin_ctz(edges) + 1 : 0;
+}
+
+#endif
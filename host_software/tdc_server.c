@@ -0,0 +1,636 @@
+#define _GNU_SOURCE
+#include "tdc_server.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_EVENTS   (1<<16)
+#define SOCKET_BUFFER (4<<20)
+#define CLIENT_BUFFER (1<<20)
+#define MAX_IOV       64
+#define N_MASKS       (1<<TDC_N_CHANNELS)
+
+struct s_tdc_server_batch_t
+{
+	int                 refs;
+	uint64_t            number;
+	int                 n_events;
+	tdc_event_t        *events;
+	unsigned            count[N_MASKS];   // events per channel mask
+	tdc_server_event_t *encoded[N_MASKS]; // the events of a mask, encoded on first use
+};
+
+typedef struct s_queue_entry_t
+{
+	tdc_server_frame_t  header;
+	tdc_server_batch_t *batch; // NULL for the frame that confirms a hello
+	tdc_server_event_t *events; // the events of the client's channels in the batch
+} queue_entry_t;
+
+struct s_tdc_server_client_t
+{
+	int            fd;
+	int            id;
+	unsigned       mask;  // 0 until the first hello
+	int            policy;
+	unsigned char  hello[sizeof(tdc_server_hello_t)];
+	size_t         hello_size;
+	queue_entry_t *queue;
+	int            first, count;
+	size_t         offset; // bytes of the first entry that were sent
+	uint64_t       sent, dropped;
+};
+
+static double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e3 + ts.tv_nsec*1e-6;
+}
+
+//////////////////////////////////////////
+// batches
+//////////////////////////////////////////
+
+static tdc_server_batch_t *new_batch(tdc_server_t *server, int n_events)
+{
+	tdc_server_batch_t *batch = calloc(1, sizeof(tdc_server_batch_t));
+	batch->refs     = 1;
+	batch->number   = server->n_batches++;
+	batch->n_events = n_events;
+	batch->events   = malloc(n_events*sizeof(tdc_event_t));
+	unsigned per_channel[TDC_N_CHANNELS] = {0,};
+	for (int i = 0; i < n_events; ++i) {
+		batch->events[i] = server->ring[(server->ring_tail+i) & server->mask];
+		++per_channel[batch->events[i].channel & (TDC_N_CHANNELS-1)];
+	}
+	for (unsigned mask = 0; mask < N_MASKS; ++mask) {
+		for (int ch = 0; ch < TDC_N_CHANNELS; ++ch) {
+			if (mask & (1<<ch)) {
+				batch->count[mask] += per_channel[ch];
+			}
+		}
+	}
+	return batch;
+}
+
+static tdc_server_event_t *encoded_events(tdc_server_batch_t *batch, unsigned mask)
+{
+	if (!batch->encoded[mask]) {
+		tdc_server_event_t *out = calloc(batch->count[mask], sizeof(tdc_server_event_t));
+		batch->encoded[mask] = out;
+		for (int i = 0; i < batch->n_events; ++i) {
+			tdc_event_t *event = &batch->events[i];
+			if (!(mask & (1<<event->channel))) {
+				continue;
+			}
+			out->time    = event->time;
+			out->value   = event->edge == TDC_EDGE_LOSS ? event->lost : event->dt;
+			out->tot     = event->tot > UINT32_MAX ? UINT32_MAX : event->tot;
+			out->channel = event->channel;
+			out->edge    = event->edge;
+			out->sample  = event->sample;
+			++out;
+		}
+	}
+	return batch->encoded[mask];
+}
+
+static void unref_batch(tdc_server_batch_t *batch)
+{
+	if (--batch->refs > 0) {
+		return;
+	}
+	for (int mask = 0; mask < N_MASKS; ++mask) {
+		free(batch->encoded[mask]);
+	}
+	free(batch->events);
+	free(batch);
+}
+
+//////////////////////////////////////////
+// clients
+//////////////////////////////////////////
+
+// room for the confirmations of a few hellos on top of the batches
+static int queue_size(tdc_server_t *server)
+{
+	return server->queue_batches+4;
+}
+
+static void add_client(tdc_server_t *server, int fd)
+{
+	for (int i = 0; i < TDC_SERVER_MAX_CLIENTS; ++i) {
+		if (server->clients[i]) {
+			continue;
+		}
+		int size = SOCKET_BUFFER, one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails on unix sockets
+		tdc_server_client_t *client = calloc(1, sizeof(tdc_server_client_t));
+		client->fd    = fd;
+		client->id    = i;
+		client->queue = calloc(queue_size(server), sizeof(queue_entry_t));
+		server->clients[i] = client;
+		return;
+	}
+	fprintf(stderr, "server: all %d client slots are taken\n", TDC_SERVER_MAX_CLIENTS);
+	close(fd);
+}
+
+static void remove_client(tdc_server_t *server, tdc_server_client_t *client)
+{
+	fprintf(stderr, "server: client %d disconnected, %lu events sent, %lu dropped\n",
+		client->id, client->sent, client->dropped);
+	for (int i = 0; i < client->count; ++i) {
+		queue_entry_t *entry = &client->queue[(client->first+i) % queue_size(server)];
+		if (entry->batch) {
+			unref_batch(entry->batch);
+		}
+	}
+	server->clients[client->id] = NULL;
+	close(client->fd);
+	free(client->queue);
+	free(client);
+}
+
+static queue_entry_t *queue_entry(tdc_server_t *server, tdc_server_client_t *client, int i)
+{
+	return &client->queue[(client->first+i) % queue_size(server)];
+}
+
+// the entries after 'i' move one place forward
+static void queue_remove(tdc_server_t *server, tdc_server_client_t *client, int i)
+{
+	for (; i < client->count-1; ++i) {
+		*queue_entry(server, client, i) = *queue_entry(server, client, i+1);
+	}
+	--client->count;
+}
+
+static void queue_push(tdc_server_t *server, tdc_server_client_t *client, tdc_server_batch_t *batch, uint32_t n_events)
+{
+	queue_entry_t *entry = queue_entry(server, client, client->count++);
+	entry->header.magic    = TDC_SERVER_FRAME_MAGIC;
+	entry->header.n_events = n_events;
+	entry->header.batch    = batch ? batch->number : server->n_batches;
+	entry->header.dropped  = client->dropped;
+	entry->batch           = batch;
+	entry->events          = NULL;
+	if (batch) {
+		entry->events = encoded_events(batch, client->mask);
+		++batch->refs;
+	}
+}
+
+static void distribute(tdc_server_t *server, tdc_server_batch_t *batch)
+{
+	for (int i = 0; i < TDC_SERVER_MAX_CLIENTS; ++i) {
+		tdc_server_client_t *client = server->clients[i];
+		if (!client || batch->count[client->mask] == 0) {
+			continue;
+		}
+		if (client->count >= server->queue_batches) {
+			// drop the oldest batch that isn't partially sent (blocking
+			// clients never get here, see client_is_full())
+			int drop = client->offset ? 1 : 0;
+			while (drop < client->count && !queue_entry(server, client, drop)->batch) {
+				++drop;
+			}
+			if (drop == client->count) { // only confirmations, drop the new batch
+				client->dropped += batch->count[client->mask];
+				continue;
+			}
+			queue_entry_t *entry = queue_entry(server, client, drop);
+			client->dropped += entry->header.n_events;
+			unref_batch(entry->batch);
+			queue_remove(server, client, drop);
+		}
+		queue_push(server, client, batch, batch->count[client->mask]);
+	}
+}
+
+// a blocking client with a full queue stops the server from taking events out of the ring
+static int client_is_full(tdc_server_t *server)
+{
+	for (int i = 0; i < TDC_SERVER_MAX_CLIENTS; ++i) {
+		tdc_server_client_t *client = server->clients[i];
+		if (client && client->policy == TDC_SERVER_BLOCK && client->count >= server->queue_batches) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void read_hello(tdc_server_t *server, tdc_server_client_t *client)
+{
+	for (;;) {
+		ssize_t result = recv(client->fd, client->hello+client->hello_size,
+			sizeof(client->hello)-client->hello_size, MSG_DONTWAIT);
+		if (result == -1 && (errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+		if (result <= 0) {
+			remove_client(server, client);
+			return;
+		}
+		client->hello_size += result;
+		if (client->hello_size < sizeof(client->hello)) {
+			continue;
+		}
+		client->hello_size = 0;
+		tdc_server_hello_t hello;
+		memcpy(&hello, client->hello, sizeof(hello));
+		if (hello.magic != TDC_SERVER_HELLO_MAGIC || client->count >= queue_size(server)) {
+			fprintf(stderr, "server: client %d sent an invalid hello\n", client->id);
+			remove_client(server, client);
+			return;
+		}
+		client->mask   = hello.channel_mask & (N_MASKS-1);
+		client->policy = hello.policy == TDC_SERVER_BLOCK ? TDC_SERVER_BLOCK : TDC_SERVER_DROP;
+		queue_push(server, client, NULL, 0); // confirms the subscription
+	}
+}
+
+// sends as much of the queue as the socket takes, returns 0 if the client is gone
+static int send_queue(tdc_server_t *server, tdc_server_client_t *client)
+{
+	while (client->count > 0) {
+		struct iovec iov[MAX_IOV];
+		int n_iov = 0;
+		size_t skip = client->offset;
+		for (int i = 0; i < client->count && n_iov+2 <= MAX_IOV; ++i) {
+			queue_entry_t *entry = queue_entry(server, client, i);
+			size_t header_size  = sizeof(entry->header);
+			size_t payload_size = entry->header.n_events*sizeof(tdc_server_event_t);
+			if (skip < header_size) {
+				iov[n_iov].iov_base = (char*)&entry->header + skip;
+				iov[n_iov].iov_len  = header_size - skip;
+				++n_iov;
+				skip = 0;
+			} else {
+				skip -= header_size;
+			}
+			if (payload_size > 0) {
+				iov[n_iov].iov_base = (char*)entry->events + skip;
+				iov[n_iov].iov_len  = payload_size - skip;
+				++n_iov;
+			}
+			skip = 0;
+		}
+		struct msghdr msg = {.msg_iov = iov, .msg_iovlen = n_iov};
+		ssize_t result = sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (result == -1 && (errno == EAGAIN || errno == EINTR)) {
+			return 1;
+		}
+		if (result <= 0) {
+			remove_client(server, client);
+			return 0;
+		}
+		size_t done = client->offset + result;
+		while (client->count > 0) {
+			queue_entry_t *entry = queue_entry(server, client, 0);
+			size_t size = sizeof(entry->header) + entry->header.n_events*sizeof(tdc_server_event_t);
+			if (done < size) {
+				break;
+			}
+			done -= size;
+			client->sent += entry->header.n_events;
+			if (entry->batch) {
+				unref_batch(entry->batch);
+			}
+			client->first = (client->first+1) % queue_size(server);
+			--client->count;
+		}
+		client->offset = done;
+	}
+	return 1;
+}
+
+//////////////////////////////////////////
+// server thread
+//////////////////////////////////////////
+
+static int all_sent(tdc_server_t *server)
+{
+	for (int i = 0; i < TDC_SERVER_MAX_CLIENTS; ++i) {
+		if (server->clients[i] && server->clients[i]->count > 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void *server_thread(void *arg)
+{
+	tdc_server_t *server = arg;
+	double pending_since = -1; // time of the first event of a partial batch
+	double deadline = 0;
+	for (;;) {
+		int running = server->running;
+		if (!running && deadline == 0) {
+			deadline = now_ms() + server->timeout_ms;
+		}
+
+		// take full batches out of the ring, a partial batch after flush_ms
+		unsigned long head = __atomic_load_n(&server->ring_head, __ATOMIC_ACQUIRE);
+		while (head != server->ring_tail && !client_is_full(server)) {
+			unsigned long available = head - server->ring_tail;
+			if (available < (unsigned long)server->batch_events && running) {
+				if (pending_since < 0) {
+					pending_since = now_ms();
+				}
+				if (now_ms() - pending_since < server->flush_ms) {
+					break;
+				}
+			}
+			int n_events = available < (unsigned long)server->batch_events ? available : server->batch_events;
+			tdc_server_batch_t *batch = new_batch(server, n_events);
+			__atomic_store_n(&server->ring_tail, server->ring_tail+n_events, __ATOMIC_RELEASE);
+			distribute(server, batch);
+			unref_batch(batch);
+			pending_since = -1;
+		}
+		if (!running && (head == server->ring_tail && all_sent(server))) {
+			break;
+		}
+		if (!running && now_ms() > deadline) {
+			break;
+		}
+
+		struct pollfd fds[TDC_SERVER_MAX_CLIENTS+1];
+		tdc_server_client_t *polled[TDC_SERVER_MAX_CLIENTS+1];
+		int n_fds = 0;
+		if (running) {
+			fds[n_fds].fd     = server->listen_fd;
+			fds[n_fds].events = POLLIN;
+			polled[n_fds++]   = NULL;
+		}
+		for (int i = 0; i < TDC_SERVER_MAX_CLIENTS; ++i) {
+			tdc_server_client_t *client = server->clients[i];
+			if (client) {
+				fds[n_fds].fd     = client->fd;
+				fds[n_fds].events = POLLIN | (client->count > 0 ? POLLOUT : 0);
+				polled[n_fds++]   = client;
+			}
+		}
+		// the publishing thread doesn't wake us up, the ring is checked every millisecond
+		unsigned long backlog = __atomic_load_n(&server->ring_head, __ATOMIC_ACQUIRE) - server->ring_tail;
+		int timeout = backlog >= (unsigned long)server->batch_events && !client_is_full(server) ? 0 : 1;
+		if (poll(fds, n_fds, timeout) <= 0) {
+			continue;
+		}
+		for (int i = 0; i < n_fds; ++i) {
+			if (!fds[i].revents) {
+				continue;
+			}
+			if (!polled[i]) {
+				int fd;
+				while ((fd = accept(server->listen_fd, NULL, NULL)) != -1) {
+					add_client(server, fd);
+				}
+				continue;
+			}
+			tdc_server_client_t *client = polled[i];
+			if ((fds[i].revents & POLLOUT) && !send_queue(server, client)) {
+				continue;
+			}
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				read_hello(server, client);
+			}
+		}
+	}
+	for (int i = 0; i < TDC_SERVER_MAX_CLIENTS; ++i) {
+		if (server->clients[i]) {
+			remove_client(server, server->clients[i]);
+		}
+	}
+	return NULL;
+}
+
+//////////////////////////////////////////
+// server API
+//////////////////////////////////////////
+
+// returns the listening socket or -1
+static int listen_on(const char *target)
+{
+	int fd = -1;
+	int ok = 0;
+	if (strncmp(target, "unix:", 5) == 0) {
+		struct sockaddr_un addr = {.sun_family = AF_UNIX};
+		strncpy(addr.sun_path, target+5, sizeof(addr.sun_path)-1);
+		unlink(addr.sun_path);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		ok = fd != -1 && bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+	} else if (strncmp(target, "tcp:", 4) == 0) {
+		struct sockaddr_in addr = {.sin_family = AF_INET};
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port        = htons(atoi(target+4));
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		int one = 1;
+		ok = fd != -1 && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0
+		              && bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+	} else {
+		fprintf(stderr, "server target %s is neither unix:<path> nor tcp:<port>\n", target);
+		return -1;
+	}
+	if (!ok || listen(fd, 16) == -1) {
+		int err = errno;
+		fprintf(stderr, "cannot serve events on %s: %s\n", target, strerror(err));
+		if (fd != -1) {
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
+
+tdc_server_t *tdc_server_start(const char *target)
+{
+	int fd = listen_on(target);
+	if (fd == -1) {
+		return NULL;
+	}
+	tdc_server_t *server = calloc(1, sizeof(tdc_server_t));
+	server->ring          = malloc(RING_EVENTS*sizeof(tdc_event_t));
+	server->mask          = RING_EVENTS-1;
+	server->listen_fd     = fd;
+	server->batch_events  = 4096;
+	server->queue_batches = 64;
+	server->flush_ms      = 10;
+	server->running       = 1;
+	strncpy(server->target, target, sizeof(server->target)-1);
+	if (pthread_create(&server->thread, NULL, server_thread, server) != 0) {
+		close(fd);
+		free(server->ring);
+		free(server);
+		return NULL;
+	}
+	return server;
+}
+
+void tdc_server_stop(tdc_server_t *server, int timeout_ms)
+{
+	server->timeout_ms = timeout_ms;
+	server->running    = 0;
+	pthread_join(server->thread, NULL);
+	close(server->listen_fd);
+	if (strncmp(server->target, "unix:", 5) == 0) {
+		unlink(server->target+5);
+	}
+	free(server->ring);
+	free(server);
+}
+
+void tdc_server_wait_for_space(tdc_server_t *server)
+{
+	for (;;) {
+		server->tail_cache = __atomic_load_n(&server->ring_tail, __ATOMIC_ACQUIRE);
+		if (server->head - server->tail_cache <= server->mask) {
+			return;
+		}
+		++server->publish_waits;
+		sched_yield();
+	}
+}
+
+//////////////////////////////////////////
+// client API
+//////////////////////////////////////////
+
+static int read_header(tdc_client_t *client);
+
+tdc_client_t *tdc_client_open(const char *target, unsigned channel_mask, int policy)
+{
+	int fd = -1;
+	int ok = 0;
+	if (strncmp(target, "unix:", 5) == 0) {
+		struct sockaddr_un addr = {.sun_family = AF_UNIX};
+		strncpy(addr.sun_path, target+5, sizeof(addr.sun_path)-1);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		ok = fd != -1 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+	} else if (strncmp(target, "tcp:", 4) == 0) {
+		struct sockaddr_in addr = {.sin_family = AF_INET};
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port        = htons(atoi(target+4));
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		ok = fd != -1 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+	}
+	if (!ok) {
+		if (fd != -1) {
+			close(fd);
+		}
+		return NULL;
+	}
+	int size = SOCKET_BUFFER;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	tdc_client_t *client = calloc(1, sizeof(tdc_client_t));
+	client->fd     = fd;
+	client->buffer = malloc(CLIENT_BUFFER);
+	// the empty frame that confirms the hello is the first frame, after
+	// it the server sends every batch of the subscribed channels
+	if (!tdc_client_subscribe(client, channel_mask, policy) ||
+	    read_header(client) != 1 || client->remaining != 0) {
+		tdc_client_close(client);
+		return NULL;
+	}
+	return client;
+}
+
+void tdc_client_close(tdc_client_t *client)
+{
+	close(client->fd);
+	free(client->buffer);
+	free(client);
+}
+
+int tdc_client_subscribe(tdc_client_t *client, unsigned channel_mask, int policy)
+{
+	tdc_server_hello_t hello = {TDC_SERVER_HELLO_MAGIC, channel_mask, policy, 0};
+	return send(client->fd, &hello, sizeof(hello), MSG_NOSIGNAL) == sizeof(hello);
+}
+
+// makes sure that 'need' bytes are in the buffer, returns 0 at the end
+// of the stream and -1 on error
+static int fill(tdc_client_t *client, size_t need)
+{
+	while (client->size - client->pos < need) {
+		size_t available = client->size - client->pos;
+		memmove(client->buffer, client->buffer+client->pos, available);
+		client->size = available;
+		client->pos  = 0;
+		ssize_t result = recv(client->fd, client->buffer+client->size, CLIENT_BUFFER-client->size, 0);
+		if (result == -1 && errno == EINTR) {
+			continue;
+		}
+		if (result < 0) {
+			return -1;
+		}
+		if (result == 0) {
+			return available == 0 && client->remaining == 0 ? 0 : -1;
+		}
+		client->size += result;
+	}
+	return 1;
+}
+
+static int read_header(tdc_client_t *client)
+{
+	int result = fill(client, sizeof(tdc_server_frame_t));
+	if (result <= 0) {
+		return result;
+	}
+	tdc_server_frame_t header;
+	memcpy(&header, client->buffer+client->pos, sizeof(header));
+	if (header.magic != TDC_SERVER_FRAME_MAGIC) {
+		return -1;
+	}
+	client->pos      += sizeof(header);
+	client->remaining = header.n_events;
+	client->batch     = header.batch;
+	client->dropped   = header.dropped;
+	++client->batches;
+	return 1;
+}
+
+int tdc_client_next(tdc_client_t *client, tdc_event_t *event)
+{
+	while (client->remaining == 0) {
+		int result = read_header(client);
+		if (result <= 0) {
+			return result;
+		}
+	}
+	int result = fill(client, sizeof(tdc_server_event_t));
+	if (result <= 0) {
+		return -1;
+	}
+	tdc_server_event_t record;
+	memcpy(&record, client->buffer+client->pos, sizeof(record));
+	client->pos += sizeof(record);
+	--client->remaining;
+	memset(event, 0, sizeof(tdc_event_t));
+	event->channel = record.channel;
+	event->time    = record.time;
+	event->edge    = record.edge;
+	event->sample  = record.sample;
+	event->tot     = record.tot;
+	if (record.edge == TDC_EDGE_LOSS) {
+		event->lost = record.value;
+	} else {
+		event->dt   = record.value;
+	}
+	return 1;
+}
@@ -0,0 +1,142 @@
+#ifndef TDC_SERVER_H
+#define TDC_SERVER_H
+
+#include "tdc_control.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+//////////////////////////////////////////
+// event stream server for local clients
+//
+// The decoder thread hands every event to tdc_server_publish(), which
+// only puts it into a ring that the server thread drains. The server
+// thread packs the events into batches and sends them to all clients on
+// a unix domain socket or a loopback TCP port with writev(), one frame
+// header per client and batch followed by the event records. A batch is
+// encoded once per channel mask and shared by all clients with that mask.
+//
+// Each client chooses its channel mask and policy with a hello message,
+// which it can send again at any time:
+//   TDC_SERVER_DROP   if the client is too slow its oldest batches are
+//                     dropped, the frame header counts the lost events
+//   TDC_SERVER_BLOCK  the server waits for the client, which in the end
+//                     blocks tdc_server_publish() and the decoder
+//
+// All values on the wire are little endian.
+//////////////////////////////////////////
+
+#define TDC_SERVER_FRAME_MAGIC 0x54434454 // "TDCT", "TDCS" before the records had the ToT
+#define TDC_SERVER_HELLO_MAGIC 0x43434454 // "TDCC"
+
+enum tdc_server_policy {
+	TDC_SERVER_DROP,
+	TDC_SERVER_BLOCK,
+};
+
+// client -> server
+typedef struct s_tdc_server_hello_t
+{
+	uint32_t magic;
+	uint32_t channel_mask; // bit n: channel n
+	uint32_t policy;       // enum tdc_server_policy
+	uint32_t reserved;
+} tdc_server_hello_t;
+
+// server -> client, followed by n_events records
+typedef struct s_tdc_server_frame_t
+{
+	uint32_t magic;
+	uint32_t n_events;
+	uint64_t batch;   // batch number, counts all batches of the server
+	uint64_t dropped; // events of the client's channels dropped so far
+} tdc_server_frame_t;
+
+typedef struct s_tdc_server_event_t
+{
+	uint64_t time;    // tdc_event_t::time
+	uint64_t value;   // tdc_event_t::dt, or tdc_event_t::lost for TDC_EDGE_LOSS
+	uint32_t tot;     // tdc_event_t::tot, saturated at 2^32-1
+	uint8_t  channel;
+	uint8_t  edge;
+	uint8_t  sample;
+	uint8_t  reserved;
+} tdc_server_event_t;
+
+#define TDC_SERVER_MAX_CLIENTS 32
+
+typedef struct s_tdc_server_batch_t tdc_server_batch_t;
+typedef struct s_tdc_server_client_t tdc_server_client_t;
+
+typedef struct s_tdc_server_t
+{
+	// ring between tdc_server_publish() and the server thread
+	tdc_event_t  *ring;
+	unsigned long mask;
+	unsigned long head;       // written by the publishing thread only
+	unsigned long tail_cache; // the publishing thread's copy of tail
+	unsigned long ring_head __attribute__((aligned(64)));
+	unsigned long ring_tail __attribute__((aligned(64)));
+	unsigned long publish_waits; // tdc_server_publish() found the ring full
+
+	// server thread
+	char                 target[256];
+	int                  listen_fd;
+	int                  batch_events; // events per batch
+	int                  queue_batches; // batches queued per client before the policy applies
+	int                  flush_ms;     // a partial batch is sent after this time
+	unsigned long        n_batches;
+	tdc_server_client_t *clients[TDC_SERVER_MAX_CLIENTS];
+	pthread_t            thread;
+	volatile int         running;
+	int                  timeout_ms;
+} tdc_server_t;
+
+// target is unix:<socket path> or tcp:<port>, a TCP server only listens
+// on the loopback interface. Returns NULL on error.
+tdc_server_t *tdc_server_start(const char *target);
+// Sends the events that are still in the ring, waits up to 'timeout_ms'
+// until the clients have them and stops the server. Clients that
+// disconnect are reported on stderr with their sent and dropped events.
+void          tdc_server_stop(tdc_server_t *server, int timeout_ms);
+
+// slow path of tdc_server_publish(): waits until the server thread made room
+void          tdc_server_wait_for_space(tdc_server_t *server);
+
+static inline void tdc_server_publish(tdc_server_t *server, const tdc_event_t *event)
+{
+	if (server->head - server->tail_cache > server->mask) {
+		tdc_server_wait_for_space(server);
+	}
+	server->ring[server->head & server->mask] = *event;
+	++server->head;
+	__atomic_store_n(&server->ring_head, server->head, __ATOMIC_RELEASE);
+}
+
+//////////////////////////////////////////
+// client side
+//////////////////////////////////////////
+
+typedef struct s_tdc_client_t
+{
+	int            fd;
+	unsigned char *buffer;
+	size_t         size;    // bytes in the buffer
+	size_t         pos;     // next byte to decode
+	uint32_t       remaining; // events left in the current frame
+	uint64_t       batch;   // number of the current batch
+	uint64_t       batches; // frames received
+	uint64_t       dropped; // events dropped by the server for this client
+} tdc_client_t;
+
+// Connects to a server and subscribes to the channels in channel_mask.
+// Returns NULL on error.
+tdc_client_t *tdc_client_open(const char *target, unsigned channel_mask, int policy);
+void          tdc_client_close(tdc_client_t *client);
+// changes the subscription of an open client, returns 0 on error
+int           tdc_client_subscribe(tdc_client_t *client, unsigned channel_mask, int policy);
+// Returns 1 and the next event, 0 at the end of the stream and -1 on error.
+int           tdc_client_next(tdc_client_t *client, tdc_event_t *event);
+
+#endif
@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include "tdc_shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static size_t shm_size(unsigned long n_slots)
+{
+	return sizeof(tdc_shm_header_t) + n_slots*sizeof(tdc_shm_slot_t);
+}
+
+tdc_shm_t *tdc_shm_create(const char *name, unsigned long n_slots)
+{
+	unsigned long size = 1;
+	while (size < n_slots) {
+		size <<= 1;
+	}
+	n_slots = size;
+
+	// a ring left over by a crashed producer is replaced
+	shm_unlink(name);
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (fd == -1) {
+		perror("cannot create shared memory");
+		return NULL;
+	}
+	if (ftruncate(fd, shm_size(n_slots)) == -1) {
+		perror("cannot size shared memory");
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	tdc_shm_header_t *header = mmap(NULL, shm_size(n_slots), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		perror("cannot map shared memory");
+		shm_unlink(name);
+		return NULL;
+	}
+	// the object is zero filled, consumers wait for the magic
+	header->slot_size    = sizeof(tdc_shm_slot_t);
+	header->n_slots      = n_slots;
+	header->producer_pid = getpid();
+	__atomic_store_n(&header->magic, TDC_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	tdc_shm_t *shm = malloc(sizeof(tdc_shm_t));
+	snprintf(shm->name, sizeof(shm->name), "%s", name);
+	shm->header = header;
+	shm->size   = shm_size(n_slots);
+	shm->head   = 0;
+	shm->mask   = n_slots-1;
+	return shm;
+}
+
+void tdc_shm_close(tdc_shm_t *shm)
+{
+	__atomic_store_n(&shm->header->closed, 1, __ATOMIC_RELEASE);
+	munmap(shm->header, shm->size);
+	shm_unlink(shm->name);
+	free(shm);
+}
+
+// takes a free consumer entry or the entry of a consumer that died
+static tdc_shm_consumer_t *claim_consumer(tdc_shm_header_t *header)
+{
+	int pid = getpid();
+	for (int pass = 0; pass < 2; ++pass) {
+		for (int i = 0; i < TDC_SHM_MAX_CONSUMERS; ++i) {
+			tdc_shm_consumer_t *consumer = &header->consumers[i];
+			int owner = __atomic_load_n(&consumer->pid, __ATOMIC_ACQUIRE);
+			if (owner != 0 && (pass == 0 || !(kill(owner, 0) == -1 && errno == ESRCH))) {
+				continue;
+			}
+			if (__atomic_compare_exchange_n(&consumer->pid, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				return consumer;
+			}
+		}
+	}
+	return NULL;
+}
+
+// maps an existing ring, returns NULL if there is none
+static tdc_shm_header_t *map_ring(const char *name, int prot, size_t *size)
+{
+	int fd = shm_open(name, (prot & PROT_WRITE) ? O_RDWR : O_RDONLY, 0);
+	if (fd == -1) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(tdc_shm_header_t)) {
+		close(fd);
+		return NULL;
+	}
+	tdc_shm_header_t *header = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		return NULL;
+	}
+	if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != TDC_SHM_MAGIC
+		|| header->slot_size != sizeof(tdc_shm_slot_t)
+		|| shm_size(header->n_slots) > (size_t)st.st_size) {
+		fprintf(stderr, "%s is not a tdc event ring of this version\n", name);
+		munmap(header, st.st_size);
+		return NULL;
+	}
+	*size = st.st_size;
+	return header;
+}
+
+tdc_shm_reader_t *tdc_shm_attach(const char *name, int start)
+{
+	size_t size;
+	tdc_shm_header_t *header = map_ring(name, PROT_READ | PROT_WRITE, &size);
+	if (!header) {
+		return NULL;
+	}
+	tdc_shm_consumer_t *consumer = claim_consumer(header);
+	if (!consumer) {
+		fprintf(stderr, "%s: all %d consumer entries are taken\n", name, TDC_SHM_MAX_CONSUMERS);
+		munmap(header, size);
+		return NULL;
+	}
+
+	tdc_shm_reader_t *reader = malloc(sizeof(tdc_shm_reader_t));
+	reader->header   = header;
+	reader->size     = size;
+	reader->consumer = consumer;
+	reader->mask     = header->n_slots-1;
+	reader->lost     = 0;
+	reader->overruns = 0;
+	unsigned long head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	if (start == TDC_SHM_START_OLDEST && head > header->n_slots) {
+		reader->cursor = head - header->n_slots + 1;
+	} else if (start == TDC_SHM_START_OLDEST) {
+		reader->cursor = 0;
+	} else {
+		reader->cursor = head;
+	}
+	__atomic_store_n(&consumer->cursor, reader->cursor, __ATOMIC_RELAXED);
+	__atomic_store_n(&consumer->lost, 0, __ATOMIC_RELAXED);
+	return reader;
+}
+
+void tdc_shm_detach(tdc_shm_reader_t *reader)
+{
+	__atomic_store_n(&reader->consumer->pid, 0, __ATOMIC_RELEASE);
+	munmap(reader->header, reader->size);
+	free(reader);
+}
+
+// The slot at the cursor was overwritten. Reading continues half a ring
+// behind the producer, so that the next overrun doesn't follow right away.
+static void overrun(tdc_shm_reader_t *reader, unsigned long head)
+{
+	unsigned long next = head - reader->header->n_slots/2;
+	if (head < reader->header->n_slots/2 || next < reader->cursor) {
+		next = reader->cursor + 1;
+	}
+	reader->lost += next - reader->cursor;
+	++reader->overruns;
+	reader->cursor = next;
+	__atomic_store_n(&reader->consumer->lost, reader->lost, __ATOMIC_RELAXED);
+}
+
+int tdc_shm_read(tdc_shm_reader_t *reader, tdc_event_t *event)
+{
+	tdc_shm_header_t *header = reader->header;
+	for (;;) {
+		unsigned long head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+		if (reader->cursor == head) {
+			if (!__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE)) {
+				return 0;
+			}
+			if (reader->cursor == __atomic_load_n(&header->head, __ATOMIC_ACQUIRE)) {
+				return -1;
+			}
+			continue;
+		}
+		if (head - reader->cursor > header->n_slots) {
+			overrun(reader, head);
+			continue;
+		}
+		// the event is valid if the sequence number is the same before and after the copy
+		tdc_shm_slot_t *slot = &header->slots[reader->cursor & reader->mask];
+		unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == reader->cursor+1) {
+			*event = slot->event;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+				++reader->cursor;
+				__atomic_store_n(&reader->consumer->cursor, reader->cursor, __ATOMIC_RELAXED);
+				return 1;
+			}
+		}
+		overrun(reader, head);
+	}
+}
+
+int tdc_shm_read_wait(tdc_shm_reader_t *reader, tdc_event_t *event, int poll_us)
+{
+	int result;
+	while ((result = tdc_shm_read(reader, event)) == 0) {
+		usleep(poll_us);
+	}
+	return result;
+}
+
+unsigned long tdc_shm_lag(tdc_shm_reader_t *reader)
+{
+	return __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE) - reader->cursor;
+}
+
+int tdc_shm_list(FILE *out, const char *name)
+{
+	size_t size;
+	tdc_shm_header_t *header = map_ring(name, PROT_READ, &size);
+	if (!header) {
+		return 0;
+	}
+	unsigned long head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	fprintf(out, "producer %d, %lu events published, ring of %lu events%s\n",
+		header->producer_pid, head, header->n_slots,
+		__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE) ? ", closed" : "");
+	for (int i = 0; i < TDC_SHM_MAX_CONSUMERS; ++i) {
+		tdc_shm_consumer_t *consumer = &header->consumers[i];
+		int pid = __atomic_load_n(&consumer->pid, __ATOMIC_ACQUIRE);
+		if (pid == 0) {
+			continue;
+		}
+		unsigned long cursor = __atomic_load_n(&consumer->cursor, __ATOMIC_RELAXED);
+		fprintf(out, "consumer %2d: pid %d, lag %lu, lost %lu%s\n", i, pid, head - cursor,
+			__atomic_load_n(&consumer->lost, __ATOMIC_RELAXED),
+			kill(pid, 0) == -1 && errno == ESRCH ? " (dead)" : "");
+	}
+	munmap(header, size);
+	return 1;
+}
@@ -0,0 +1,115 @@
+#ifndef TDC_SHM_H
+#define TDC_SHM_H
+
+#include "tdc_control.h"
+
+#include <stdio.h>
+
+//////////////////////////////////////////
+// event broadcast through POSIX shared memory
+//
+// The process that owns the device publishes every event into a ring
+// in shared memory (tdc_shm_create(), tdc_shm_publish()). Any number of
+// consumers attach and detach at run time (tdc_shm_attach()), each with
+// its own cursor. The producer never waits for a consumer: a consumer
+// that falls behind by more than the ring size misses events, which it
+// sees as an overrun with the number of lost events. Slots are guarded
+// by a sequence number, so a consumer never returns a half written event.
+// Cursors and losses of all consumers are visible in the shared header,
+// tdc_shm_list() shows them.
+//////////////////////////////////////////
+
+#define TDC_SHM_MAGIC         0x74646331 // "tdc1"
+#define TDC_SHM_MAX_CONSUMERS 16
+
+typedef struct s_tdc_shm_slot_t
+{
+	unsigned long seq;   // index+1 of the event in the slot, 0 while it is written
+	tdc_event_t   event;
+} __attribute__((aligned(64))) tdc_shm_slot_t;
+
+typedef struct s_tdc_shm_consumer_t
+{
+	int           pid;    // 0 if the entry is free
+	unsigned long cursor; // index of the next event the consumer reads
+	unsigned long lost;   // events overwritten before the consumer read them
+} __attribute__((aligned(64))) tdc_shm_consumer_t;
+
+typedef struct s_tdc_shm_header_t
+{
+	unsigned int       magic;
+	unsigned int       slot_size;      // sizeof(tdc_shm_slot_t) of the producer
+	unsigned long      n_slots;        // power of 2
+	int                producer_pid;
+	int                closed;         // the producer is done, no more events
+	unsigned long      head __attribute__((aligned(64))); // index of the next event
+	tdc_shm_consumer_t consumers[TDC_SHM_MAX_CONSUMERS];
+	tdc_shm_slot_t     slots[];
+} tdc_shm_header_t;
+
+// producer side
+typedef struct s_tdc_shm_t
+{
+	char              name[64];
+	tdc_shm_header_t *header;
+	size_t            size;
+	unsigned long     head; // private copy of header->head
+	unsigned long     mask;
+} tdc_shm_t;
+
+// Creates (or replaces) the shared memory object 'name' (e.g. "/tdc") with
+// n_slots events, rounded up to a power of 2. Returns NULL on error.
+tdc_shm_t *tdc_shm_create(const char *name, unsigned long n_slots);
+// Marks the ring as closed, consumers read the rest and then get EOF.
+// The shared memory object is removed, attached consumers keep their mapping.
+void       tdc_shm_close(tdc_shm_t *shm);
+
+static inline void tdc_shm_publish(tdc_shm_t *shm, const tdc_event_t *event)
+{
+	tdc_shm_slot_t *slot = &shm->header->slots[shm->head & shm->mask];
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->event = *event;
+	__atomic_store_n(&slot->seq, shm->head+1, __ATOMIC_RELEASE);
+	++shm->head;
+	__atomic_store_n(&shm->header->head, shm->head, __ATOMIC_RELEASE);
+}
+
+// consumer side
+typedef struct s_tdc_shm_reader_t
+{
+	tdc_shm_header_t   *header;
+	size_t              size;
+	tdc_shm_consumer_t *consumer; // our entry in the header
+	unsigned long       cursor;
+	unsigned long       mask;
+	unsigned long       lost;     // events lost in overruns
+	unsigned long       overruns; // number of overruns
+} tdc_shm_reader_t;
+
+enum tdc_shm_start {
+	TDC_SHM_START_NOW,    // only events published after attaching
+	TDC_SHM_START_OLDEST, // the oldest event that is still in the ring
+};
+
+// Attaches to a ring, returns NULL if there is none or all consumer
+// entries are taken. Entries of consumers that died are taken over.
+tdc_shm_reader_t *tdc_shm_attach(const char *name, int start);
+void              tdc_shm_detach(tdc_shm_reader_t *reader);
+
+// Returns 1 and the next event, 0 if there is no new event yet and -1 if
+// the producer closed the ring and all events were read. After an overrun
+// reading continues with the oldest event that is still in the ring,
+// reader->lost and reader->overruns count what was missed.
+int               tdc_shm_read(tdc_shm_reader_t *reader, tdc_event_t *event);
+// like tdc_shm_read(), but waits (polling every 'poll_us') until there is
+// an event or the ring is closed
+int               tdc_shm_read_wait(tdc_shm_reader_t *reader, tdc_event_t *event, int poll_us);
+// number of published events the reader didn't read yet
+unsigned long     tdc_shm_lag(tdc_shm_reader_t *reader);
+
+// prints one line per attached consumer: pid, lag and lost events,
+// returns 0 if there is no ring
+int               tdc_shm_list(FILE *out, const char *name);
+
+#endif
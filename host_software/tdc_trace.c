@@ -0,0 +1,90 @@
+#include "tdc_control.h"
+#include "tdc_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int tdc_trace_enable(tdc_t *tdc, unsigned int flags, unsigned long ring_size)
+{
+	if (!tdc_trace_available()) {
+		fprintf(stderr, "tracing is not compiled in, rebuild with TRACE=1\n");
+		return 0;
+	}
+	tdc_trace_disable(tdc);
+	tdc_trace_t *trace = calloc(1, sizeof(tdc_trace_t));
+	trace->flags = flags;
+	if (flags & TDC_TRACE_RING) {
+		// round up to a power of two
+		trace->ring_size = 1;
+		while (trace->ring_size < ring_size) {
+			trace->ring_size <<= 1;
+		}
+		trace->ring = malloc(sizeof(tdc_trace_record_t)*trace->ring_size);
+	}
+	trace->batch_start = tdc_cycles();
+	tdc->trace = trace;
+	return 1;
+}
+
+void tdc_trace_disable(tdc_t *tdc)
+{
+	if (tdc->trace) {
+		free(tdc->trace->ring);
+		free(tdc->trace);
+		tdc->trace = NULL;
+	}
+}
+
+static void print_hist(FILE *out, const char *name, const char *unit, unsigned long *hist)
+{
+	fprintf(out, "%s:\n", name);
+	for (int bin = 0; bin < TDC_TRACE_HIST_BINS; ++bin) {
+		if (hist[bin]) {
+			fprintf(out, "  %12llu .. %12llu %s : %lu\n",
+				bin ? 1ULL<<(bin-1) : 0, (1ULL<<bin)-1, unit, hist[bin]);
+		}
+	}
+}
+
+void tdc_trace_print(FILE *out, tdc_trace_t *trace)
+{
+	if (!trace) {
+		return;
+	}
+	unsigned long frames = trace->unpack_calls ? trace->unpack_calls : 1;
+	unsigned long events = trace->events ? trace->events : 1;
+	unsigned long reads  = trace->read_calls ? trace->read_calls : 1;
+	fprintf(out, "read():           %lu calls, %.1f cycles/call\n",
+		trace->read_calls, (double)trace->read_cycles/reads);
+	fprintf(out, "unpack_raw_event: %lu frames, %.1f cycles/frame\n",
+		trace->unpack_calls, (double)trace->unpack_cycles/frames);
+	fprintf(out, "next_raw_event:   %.1f cycles/frame without read()\n",
+		(double)(trace->raw_cycles - trace->read_cycles)/frames);
+	fprintf(out, "tdc_next_event:   %lu events, %.1f cycles/event without next_raw_event()\n",
+		trace->events, (double)trace->event_cycles/events);
+	print_hist(out, "bytes per read()", "bytes", trace->read_size_hist);
+	print_hist(out, "decode time per read buffer", "cycles", trace->batch_cycles_hist);
+	if (trace->flags & TDC_TRACE_RING) {
+		fprintf(out, "trace ring: %lu records, %lu kept\n", trace->ring_pos,
+			trace->ring_pos < trace->ring_size ? trace->ring_pos : trace->ring_size);
+	}
+}
+
+// raw dump of the ring, oldest record first
+int tdc_trace_write_ring(tdc_trace_t *trace, const char *filename)
+{
+	if (!trace || !trace->ring) {
+		return 0;
+	}
+	FILE *out = fopen(filename, "wb");
+	if (!out) {
+		perror("cannot open trace file");
+		return 0;
+	}
+	unsigned long first = trace->ring_pos < trace->ring_size ? 0 : trace->ring_pos - trace->ring_size;
+	for (unsigned long i = first; i < trace->ring_pos; ++i) {
+		fwrite(&trace->ring[i & (trace->ring_size-1)], sizeof(tdc_trace_record_t), 1, out);
+	}
+	fclose(out);
+	return 1;
+}
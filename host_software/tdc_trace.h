@@ -0,0 +1,109 @@
+#ifndef TDC_TRACE_H
+#define TDC_TRACE_H
+
+#include <stdio.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+//////////////////////////////////////////
+// hot path tracing
+//
+// The trace points in tdc_control.c are only compiled in with
+// -DTDC_TRACE (make TRACE=1). Even then they cost a single pointer
+// test until tdc_trace_enable() is called for a tdc handle.
+// With -DTDC_USDT the trace points are also static probes (provider
+// "tdc") that can be attached with perf, bpftrace or systemtap.
+//////////////////////////////////////////
+
+#define TDC_TRACE_HIST_BINS 32 // log2 bins
+
+enum tdc_trace_flags {
+	TDC_TRACE_COUNTERS = 0x01, // cycle counters and histograms
+	TDC_TRACE_RING     = 0x02, // binary record of every trace point
+	TDC_TRACE_ALL      = 0x03,
+};
+
+typedef enum e_tdc_trace_point_t
+{
+	TDC_TP_READ,   // value: bytes returned by read()
+	TDC_TP_RESYNC, // value: 0 skipped byte, 1 truncated frame, 2 invalid channel, 3 invalid block
+	TDC_TP_FRAME,  // value: channel
+	TDC_TP_EVENT,  // value: channel | edge<<8
+} tdc_trace_point_t;
+
+typedef struct s_tdc_trace_record_t
+{
+	unsigned long long cycles;
+	unsigned int       point; // tdc_trace_point_t
+	unsigned int       value;
+} tdc_trace_record_t;
+
+typedef struct s_tdc_trace_t
+{
+	unsigned int       flags;
+
+	unsigned long      read_calls;
+	unsigned long long read_cycles;                        // spent inside read()
+	unsigned long      read_size_hist[TDC_TRACE_HIST_BINS];   // bytes per read()
+	unsigned long      batch_cycles_hist[TDC_TRACE_HIST_BINS];// decode cycles per read buffer
+	unsigned long long batch_start;                        // end of the previous read()
+
+	unsigned long      unpack_calls;
+	unsigned long long unpack_cycles;
+	unsigned long      events;
+	unsigned long long event_cycles;                       // tdc_next_event() without next_raw_event()
+	unsigned long long raw_cycles;                         // next_raw_event() including read()
+
+	tdc_trace_record_t *ring;
+	unsigned long       ring_size;                         // power of two
+	unsigned long       ring_pos;                          // total number of records
+} tdc_trace_t;
+
+static inline unsigned long long tdc_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline int tdc_trace_bin(unsigned long long value)
+{
+	int bin = value ? 64 - __builtin_clzll(value) : 0;
+	return bin < TDC_TRACE_HIST_BINS ? bin : TDC_TRACE_HIST_BINS-1;
+}
+
+static inline void tdc_trace_record(tdc_trace_t *trace, unsigned long long cycles,
+                                    tdc_trace_point_t point, unsigned int value)
+{
+	if (trace->flags & TDC_TRACE_RING) {
+		tdc_trace_record_t *record = &trace->ring[trace->ring_pos++ & (trace->ring_size-1)];
+		record->cycles = cycles;
+		record->point  = point;
+		record->value  = value;
+	}
+}
+
+#if defined(TDC_USDT) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TDC_PROBE1(name, a)    DTRACE_PROBE1(tdc, name, a)
+#define TDC_PROBE2(name, a, b) DTRACE_PROBE2(tdc, name, a, b)
+#else
+#define TDC_PROBE1(name, a)
+#define TDC_PROBE2(name, a, b)
+#endif
+
+struct s_tdc_t;
+
+int  tdc_trace_available();
+int  tdc_trace_enable(struct s_tdc_t *tdc, unsigned int flags, unsigned long ring_size);
+void tdc_trace_disable(struct s_tdc_t *tdc);
+void tdc_trace_print(FILE *out, tdc_trace_t *trace);
+int  tdc_trace_write_ring(tdc_trace_t *trace, const char *filename);
+
+#endif
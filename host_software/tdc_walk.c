@@ -0,0 +1,419 @@
+#include "tdc_walk.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(((tdc_walk_table_t*)0)->walk) == 33410, "the table size in tdc_walk.h is out of date");
+
+//////////////////////////////////////////
+// the pulse model, the same functions as
+// theory_of_operation/simulations/dtot_amplitude.cpp
+//////////////////////////////////////////
+
+// log1mexp(a) := log(1-exp(-a)), a > 0
+static double log1mexp(double a)
+{
+	if (a < 0.693) return log(-expm1(-a));
+	else           return log1p(-exp(-a));
+}
+
+// logexpm1(a) := log(exp(a)-1), a > 0
+static double logexpm1(double a)
+{
+	if (a < 37) return log(expm1(a));
+	else        return a;
+}
+
+static double log_q_analytic(double t, double tau, double RC)
+{
+	if (tau == RC) {
+		return log(t/tau) - t/tau;
+	}
+	if (RC > tau) {
+		return log(RC/(RC-tau)) + log1mexp(t*(RC-tau)/RC/tau) - t/RC;
+	} else {
+		return log(RC/(tau-RC)) + logexpm1(t*(tau-RC)/RC/tau) - t/RC;
+	}
+}
+
+static double q_analytic(double t, double tau, double RC)
+{
+	if (tau == RC) {
+		return t/tau*exp(-t/tau);
+	}
+	return RC/(tau-RC)*(exp(t/tau*(tau-RC)/RC)-1)*exp(-t/RC);
+}
+
+static double diff_q_analytic(double t, double tau, double RC)
+{
+	if (tau == RC) {
+		return ((tau-t)*exp(-t/tau))/tau/tau;
+	}
+	return exp((t*(tau-RC))/(RC*tau)-t/RC)/tau-(exp(-t/RC)*(exp(t*(tau-RC)/(RC*tau))-1))/(tau-RC);
+}
+
+static double diff2_q_analytic(double t, double tau, double RC)
+{
+	if (tau == RC) {
+		return -((2*tau-t)*exp(-t/tau))/tau/tau/tau;
+	}
+	return -(exp(-t/tau)*(tau*tau*exp(t/tau)-RC*RC*exp(t/RC)))/(RC*exp(t/RC)*tau*tau*tau-RC*RC*exp(t/RC)*tau*tau);
+}
+
+// the peak of the pulse, zero of the first derivative by Newton's method
+static double q_tmax(double tau, double RC)
+{
+	double tmax = 0;
+	for (int i = 0; i < 100; ++i) {
+		double dtmax = -diff_q_analytic(tmax, tau, RC)/diff2_q_analytic(tmax, tau, RC);
+		tmax += dtmax;
+		if (fabs(dtmax) < 1e-9) {
+			break;
+		}
+	}
+	return tmax;
+}
+
+// the crossing of the rising pulse with the threshold by bisection, -1 if
+// the pulse stays below it. tmax from q_tmax().
+static double t_leading_edge(double tau, double RC, double tmax, double threshold)
+{
+	double tmin = 0;
+	double log_threshold = log(threshold);
+	if (log_q_analytic(tmax, tau, RC) < log_threshold) {
+		return -1;
+	}
+	while (tmax-tmin >= 1e-9) {
+		double tmed = 0.5*(tmin+tmax);
+		if (log_q_analytic(tmed, tau, RC) > log_threshold) {
+			tmax = tmed;
+		} else {
+			tmin = tmed;
+		}
+	}
+	return 0.5*(tmin+tmax);
+}
+
+static double dynamic_threshold(double t, double t0, double threshold_low, double threshold_high, double tau_threshold)
+{
+	if (t < t0) {
+		return threshold_low;
+	}
+	return threshold_low + (1-exp(-(t-t0)/tau_threshold))*(threshold_high-threshold_low);
+}
+
+static int below_threshold(const tdc_walk_model_t *m, double t, double t0, double threshold_low, double threshold_high)
+{
+	return log_q_analytic(t, m->tau, m->RC)
+		< log(dynamic_threshold(t, t0, threshold_low, threshold_high, m->threshold_tau));
+}
+
+// the time over the dynamic threshold for a pulse that crosses the low
+// threshold at t_leading
+static double dtot(const tdc_walk_model_t *m, double t_leading, double threshold_low, double threshold_high)
+{
+	double t0 = t_leading + m->trigger_delay; // start of the threshold rise
+	// find a point after the crossing
+	double t_trailing_max = t0;
+	do {
+		t_trailing_max += m->tau + m->RC;
+	} while (!below_threshold(m, t_trailing_max, t0, threshold_low, threshold_high));
+	// the crossing is between t0 and t_trailing_max
+	double t_trailing_min = t0;
+	while (t_trailing_max-t_trailing_min >= 1e-9) {
+		double t_med = 0.5*(t_trailing_min+t_trailing_max);
+		if (below_threshold(m, t_med, t0, threshold_low, threshold_high)) {
+			t_trailing_max = t_med;
+		} else {
+			t_trailing_min = t_med;
+		}
+	}
+	return 0.5*(t_trailing_min+t_trailing_max) - t_leading;
+}
+
+static int model_valid(const tdc_walk_model_t *m)
+{
+	return m->tau > 0 && m->RC > 0 && m->threshold_tau > 0 && m->trigger_delay >= 0;
+}
+
+// walk and ToT of a pulse with the amplitude in DAC counts, -1 if it
+// doesn't cross the threshold. The pulse is normalized to 1 at the peak.
+static double walk_of_amplitude(const tdc_walk_model_t *m, double tmax, double qmax, double amplitude, int setting, double *tot)
+{
+	double threshold_low  = qmax*(setting < 1 ? 1 : setting)/amplitude;
+	double threshold_high = qmax*TDC_THRESHOLD_RANGE/amplitude;
+	double walk = t_leading_edge(m->tau, m->RC, tmax, threshold_low);
+	if (walk >= 0 && tot) {
+		*tot = dtot(m, walk, threshold_low, threshold_high);
+	}
+	return walk;
+}
+
+double tdc_walk_model(const tdc_walk_model_t *model, double amplitude, int setting, double *tot)
+{
+	if (!model_valid(model)) {
+		return -1;
+	}
+	double tmax = q_tmax(model->tau, model->RC);
+	double qmax = q_analytic(tmax, model->tau, model->RC);
+	return walk_of_amplitude(model, tmax, qmax, amplitude, setting, tot);
+}
+
+//////////////////////////////////////////
+// table generation
+//////////////////////////////////////////
+
+#define AMPLITUDE_SAMPLES 2048
+#define AMPLITUDE_RANGE   1000 // the largest amplitude relative to the threshold
+
+static uint16_t table_value(double walk)
+{
+	double value = walk*TDC_WALK_SCALE + 0.5;
+	return value < 0 ? 0 : value > UINT16_MAX ? UINT16_MAX : (uint16_t)value;
+}
+
+// One row: the walk and ToT of log-spaced amplitudes from just above the
+// threshold, with the ToT made monotonic, inverted at the ToT of each
+// column by linear interpolation. ToTs below the smallest pulse get its
+// walk, above the largest the walk of the largest.
+static void build_row(const tdc_walk_model_t *m, double tmax, double qmax, int setting, uint16_t *row)
+{
+	static __thread double walks[AMPLITUDE_SAMPLES], tots[AMPLITUDE_SAMPLES];
+	double a0 = setting < 1 ? 1 : setting;
+	int n = 0;
+	for (int i = 0; i < AMPLITUDE_SAMPLES; ++i) {
+		double amplitude = a0*(1 + 1e-6)*pow(AMPLITUDE_RANGE, (double)i/(AMPLITUDE_SAMPLES-1));
+		double tot;
+		double walk = walk_of_amplitude(m, tmax, qmax, amplitude, setting, &tot);
+		if (walk < 0) {
+			continue;
+		}
+		if (n > 0 && tot <= tots[n-1]) {
+			continue;
+		}
+		walks[n] = walk;
+		tots[n]  = tot;
+		++n;
+	}
+	int k = 0;
+	for (int j = 0; j < TDC_WALK_N_TOT; ++j) {
+		double tot = j*TDC_WALK_TOT_STEP;
+		while (k < n && tots[k] < tot) {
+			++k;
+		}
+		double walk;
+		if (n == 0) {
+			walk = 0;
+		} else if (k == 0) {
+			walk = walks[0];
+		} else if (k == n) {
+			walk = walks[n-1];
+		} else {
+			double f = (tot - tots[k-1])/(tots[k] - tots[k-1]);
+			walk = walks[k-1] + f*(walks[k] - walks[k-1]);
+		}
+		row[j] = table_value(walk);
+	}
+}
+
+typedef struct s_build_job_t
+{
+	tdc_walk_table_t *table;
+	double            tmax, qmax;
+	int               next_row; // atomic
+} build_job_t;
+
+static void *build_thread(void *arg)
+{
+	build_job_t *job = arg;
+	for (;;) {
+		int r = __atomic_fetch_add(&job->next_row, 1, __ATOMIC_RELAXED);
+		if (r >= TDC_WALK_N_SETTINGS) {
+			break;
+		}
+		build_row(&job->table->model, job->tmax, job->qmax, r*TDC_WALK_SETTING_STEP, job->table->walk[r]);
+	}
+	return NULL;
+}
+
+// FNV-1a over the model and everything that decides the layout of the table
+static uint64_t table_key(const tdc_walk_model_t *model)
+{
+	struct {
+		tdc_walk_model_t model;
+		uint32_t         layout[6];
+	} key;
+	memset(&key, 0, sizeof(key));
+	key.model     = *model;
+	key.layout[0] = TDC_WALK_VERSION;
+	key.layout[1] = TDC_WALK_SETTING_STEP;
+	key.layout[2] = TDC_WALK_N_SETTINGS;
+	key.layout[3] = TDC_WALK_TOT_STEP;
+	key.layout[4] = TDC_WALK_N_TOT;
+	key.layout[5] = TDC_WALK_SCALE;
+	const unsigned char *p = (const unsigned char*)&key;
+	uint64_t hash = 0xcbf29ce484222325ul;
+	for (size_t i = 0; i < sizeof(key); ++i) {
+		hash = (hash ^ p[i]) * 0x100000001b3ul;
+	}
+	return hash;
+}
+
+tdc_walk_table_t *tdc_walk_table_build(const tdc_walk_model_t *model, int n_threads)
+{
+	if (!model_valid(model)) {
+		return NULL;
+	}
+	tdc_walk_table_t *table = calloc(1, sizeof(tdc_walk_table_t));
+	table->magic   = TDC_WALK_MAGIC;
+	table->version = TDC_WALK_VERSION;
+	table->key     = table_key(model);
+	table->model   = *model;
+
+	build_job_t job = {.table = table};
+	job.tmax = q_tmax(model->tau, model->RC);
+	job.qmax = q_analytic(job.tmax, model->tau, model->RC);
+	if (n_threads <= 0) {
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (n_threads > TDC_WALK_N_SETTINGS) {
+		n_threads = TDC_WALK_N_SETTINGS;
+	}
+	pthread_t threads[TDC_WALK_N_SETTINGS];
+	int started = 0;
+	for (; started < n_threads-1; ++started) {
+		if (pthread_create(&threads[started], NULL, build_thread, &job) != 0) {
+			break;
+		}
+	}
+	build_thread(&job); // this thread helps, and does it all if no thread starts
+	for (int i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	return table;
+}
+
+void tdc_walk_table_free(tdc_walk_table_t *table)
+{
+	free(table);
+}
+
+static tdc_walk_table_t *read_table(const char *filename, const tdc_walk_model_t *model)
+{
+	FILE *in = fopen(filename, "r");
+	if (!in) {
+		return NULL;
+	}
+	tdc_walk_table_t *table = malloc(sizeof(tdc_walk_table_t));
+	int ok = fread(table, sizeof(tdc_walk_table_t), 1, in) == 1
+		&& table->magic == TDC_WALK_MAGIC && table->version == TDC_WALK_VERSION
+		&& table->key == table_key(model) && memcmp(&table->model, model, sizeof(tdc_walk_model_t)) == 0;
+	fclose(in);
+	if (!ok) {
+		free(table);
+		return NULL;
+	}
+	return table;
+}
+
+static int write_table(const char *filename, const tdc_walk_table_t *table)
+{
+	char tmp_name[4096+32];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.%d.tmp", filename, (int)getpid());
+	FILE *out = fopen(tmp_name, "w");
+	if (!out) {
+		fprintf(stderr, "cannot write walk table %s: %s\n", tmp_name, strerror(errno));
+		return 0;
+	}
+	int ok = fwrite(table, sizeof(tdc_walk_table_t), 1, out) == 1
+		&& fflush(out) == 0 && fsync(fileno(out)) == 0;
+	ok = fclose(out) == 0 && ok;
+	if (!ok || rename(tmp_name, filename) == -1) {
+		fprintf(stderr, "cannot write walk table %s: %s\n", filename, strerror(errno));
+		unlink(tmp_name);
+		return 0;
+	}
+	return 1;
+}
+
+tdc_walk_table_t *tdc_walk_table_open(const tdc_walk_model_t *model, const char *cache_dir)
+{
+	if (!cache_dir) {
+		return tdc_walk_table_build(model, 0);
+	}
+	char filename[4096];
+	snprintf(filename, sizeof(filename), "%s/tdc-walk-%016lx.tab", cache_dir, (unsigned long)table_key(model));
+	tdc_walk_table_t *table = read_table(filename, model);
+	if (table) {
+		return table;
+	}
+	table = tdc_walk_table_build(model, 0);
+	if (table) {
+		write_table(filename, table);
+	}
+	return table;
+}
+
+//////////////////////////////////////////
+// correction
+//////////////////////////////////////////
+
+void tdc_walk_init(tdc_walk_t *walk, const tdc_walk_table_t *table)
+{
+	memset(walk, 0, sizeof(tdc_walk_t));
+	walk->table = table;
+}
+
+void tdc_walk_set_threshold(tdc_walk_t *walk, int channel, int setting)
+{
+	float *row = walk->row[channel&(TDC_N_CHANNELS-1)];
+	if (setting < 0) {
+		memset(row, 0, sizeof(walk->row[0]));
+		return;
+	}
+	if (setting > TDC_THRESHOLD_RANGE) {
+		setting = TDC_THRESHOLD_RANGE;
+	}
+	int r = setting/TDC_WALK_SETTING_STEP;
+	const uint16_t *lo = walk->table->walk[r];
+	const uint16_t *hi = walk->table->walk[r < TDC_WALK_N_SETTINGS-1 ? r+1 : r];
+	float f = (float)(setting%TDC_WALK_SETTING_STEP)/TDC_WALK_SETTING_STEP;
+	for (int j = 0; j < TDC_WALK_N_TOT; ++j) {
+		row[j] = (lo[j] + f*(hi[j] - lo[j]))*(1.0f/TDC_WALK_SCALE);
+	}
+	row[TDC_WALK_N_TOT] = row[TDC_WALK_N_TOT-1];
+}
+
+// The same interpolation as tdc_walk_of() over whole blocks of
+// TDC_BATCH_ALIGN events, without branches: the events that are not falling
+// edges read the row of zeros. The loads from the rows are gathers, so
+// there is an AVX2 version next to the baseline x86-64 one, selected when
+// the program starts.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+__attribute__((target_clones("avx2","default")))
+#endif
+void tdc_walk_batch(const tdc_walk_t *restrict walk, const tdc_batch_t *batch, float *restrict walk_ns)
+{
+	const float *rows = &walk->row[0][0];
+	const uint32_t max_tot = (TDC_WALK_N_TOT-1)*TDC_WALK_TOT_STEP;
+	const int      stride  = TDC_WALK_N_TOT+1;
+	for (long block = 0; block < batch->n; block += TDC_BATCH_ALIGN) {
+		const uint32_t *tot     = batch->tot + block;
+		const uint8_t  *channel = batch->channel + block;
+		const uint8_t  *edge    = batch->edge + block;
+		float          *out     = walk_ns + block;
+		for (int i = 0; i < TDC_BATCH_ALIGN; ++i) {
+			uint32_t t = tot[i] < max_tot ? tot[i] : max_tot;
+			int      c = channel[i]&(TDC_N_CHANNELS-1);
+			int      r = edge[i] == TDC_EDGE_FALLING && tot[i] ? c : TDC_N_CHANNELS;
+			int      k = r*stride + t/TDC_WALK_TOT_STEP; // int: gathers take signed 32 bit indices
+			float    f = (float)(t%TDC_WALK_TOT_STEP)*(1.0f/TDC_WALK_TOT_STEP);
+			out[i] = rows[k] + f*(rows[k+1] - rows[k]);
+		}
+	}
+}
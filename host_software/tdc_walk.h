@@ -0,0 +1,114 @@
+#ifndef TDC_WALK_H
+#define TDC_WALK_H
+
+#include "tdc_control.h"
+#include "tdc_batch.h"
+
+#include <math.h>
+#include <stdint.h>
+
+//////////////////////////////////////////
+// time-walk correction of leading edges
+//
+// A small pulse crosses the low threshold later than a large one that
+// starts at the same time. The ToT measures the amplitude, so the delay
+// of the rising edge (the walk) is a function of the ToT and the
+// threshold setting. The function comes from the analytic pulse model of
+// theory_of_operation/simulations (dtot_amplitude.cpp): a pulse
+// A*q(t)/q_max starting at t=0, the low threshold at the setting (DAC
+// counts) and the high threshold at full scale (TDC_THRESHOLD_RANGE).
+// The walk is t_leading_edge(), the time from the start of the pulse to
+// the crossing of the low threshold.
+//
+// The table has one row per TDC_WALK_SETTING_STEP threshold counts and
+// one column per TDC_WALK_TOT_STEP ns of ToT, in 1/TDC_WALK_SCALE ns as
+// uint16_t: sizeof(((tdc_walk_table_t*)0)->walk) is 65*257*2 = 33410 bytes.
+// The rows are computed in parallel and cached on disk, keyed by the model
+// parameters. For each channel the row of its threshold is interpolated
+// once, the correction of an event is a linear interpolation in the ToT.
+//
+// The correction belongs to the falling edge, which has the ToT
+// (tdc_event_t::tot, also with a filter that drops the rising edges):
+//   start of the pulse = falling time - ToT - walk
+// tdc_walk_batch() computes the walk of all falling edges of a batch.
+// A falling edge without a known ToT (the first one after a loss or a
+// sync frame) gets no correction.
+//////////////////////////////////////////
+
+#define TDC_WALK_MAGIC        0x57434454 // "TDCW"
+#define TDC_WALK_VERSION      1
+#define TDC_WALK_SETTING_STEP 64   // DAC counts per row
+#define TDC_WALK_N_SETTINGS   (TDC_THRESHOLD_RANGE/TDC_WALK_SETTING_STEP + 1)
+#define TDC_WALK_TOT_STEP     4    // ns per column
+#define TDC_WALK_N_TOT        257  // 0 .. 1024 ns, the range of pulse records
+#define TDC_WALK_SCALE        32   // table units per ns
+
+// the parameters of the model in [ns]
+typedef struct s_tdc_walk_model_t
+{
+	double tau;           // scintillator decay time
+	double RC;            // shaping time constant
+	double threshold_tau; // rise time of the dynamic threshold
+	double trigger_delay; // from the leading edge to the start of the rise
+} tdc_walk_model_t;
+
+typedef struct s_tdc_walk_table_t
+{
+	uint32_t         magic;
+	uint32_t         version;
+	uint64_t         key;   // FNV-1a of the model and the table layout
+	tdc_walk_model_t model;
+	uint16_t         walk[TDC_WALK_N_SETTINGS][TDC_WALK_N_TOT];
+} tdc_walk_table_t;
+
+typedef struct s_tdc_walk_t
+{
+	const tdc_walk_table_t *table;
+	// per channel: the row of the threshold in [ns], one more entry for
+	// the interpolation at the end. All 0 for channels without threshold.
+	// Row TDC_N_CHANNELS stays 0, tdc_walk_batch() uses it for the events
+	// that are not falling edges.
+	float row[TDC_N_CHANNELS+1][TDC_WALK_N_TOT+1] __attribute__((aligned(TDC_BATCH_ALIGN)));
+} tdc_walk_t;
+
+// Computes the table with 'n_threads' threads (0: one per CPU).
+// Returns NULL if the model has no solution (e.g. tau <= 0).
+tdc_walk_table_t *tdc_walk_table_build(const tdc_walk_model_t *model, int n_threads);
+// Reads the table of the model from cache_dir, or builds it and writes it
+// there (atomically). cache_dir NULL: no cache.
+tdc_walk_table_t *tdc_walk_table_open(const tdc_walk_model_t *model, const char *cache_dir);
+void              tdc_walk_table_free(tdc_walk_table_t *table);
+// the walk in [ns] straight from the model, for tests and plots; -1 if
+// the pulse doesn't cross the threshold
+double            tdc_walk_model(const tdc_walk_model_t *model, double amplitude, int setting, double *tot);
+
+void tdc_walk_init(tdc_walk_t *walk, const tdc_walk_table_t *table);
+// the threshold of a channel in DAC counts, -1: no correction
+void tdc_walk_set_threshold(tdc_walk_t *walk, int channel, int setting);
+
+// walk in [ns] for a ToT in [ns]
+static inline float tdc_walk_of(const tdc_walk_t *walk, int channel, unsigned int tot)
+{
+	const float *row = walk->row[channel&(TDC_N_CHANNELS-1)];
+	if (tot >= (TDC_WALK_N_TOT-1)*TDC_WALK_TOT_STEP) {
+		return row[TDC_WALK_N_TOT-1];
+	}
+	unsigned int i = tot/TDC_WALK_TOT_STEP;
+	float f = (float)(tot%TDC_WALK_TOT_STEP)*(1.0f/TDC_WALK_TOT_STEP);
+	return row[i] + f*(row[i+1] - row[i]);
+}
+
+// the start of the pulse of a falling edge in [ns], NAN if the ToT is unknown
+static inline double tdc_walk_pulse_start(const tdc_walk_t *walk, const tdc_event_t *event)
+{
+	if (!event->tot) {
+		return NAN;
+	}
+	return (double)(event->time - event->tot) - tdc_walk_of(walk, event->channel, event->tot);
+}
+
+// walk_ns[i] for every event of the batch: the walk of falling edges with
+// a known ToT, 0 for the other events. walk_ns needs room for batch->capacity floats.
+void tdc_walk_batch(const tdc_walk_t *restrict walk, const tdc_batch_t *batch, float *restrict walk_ns);
+
+#endif
@@ -0,0 +1,591 @@
+#include <iostream>
+#include <sstream>
+#include <cmath>
+
+// Finds threshold_min, threshold_tau and trigger_delay of dtot_amplitude.cpp
+// for a given pulse shape (tau, RC) and ToT budget. The objective is
+//
+//   J = -D + weight*E
+//
+//   D  dynamic range log(a_hi/a_lo) in amplitude, from a_lo = 2*threshold_min
+//      (twice the amplitude that just triggers) to a_hi where the ToT
+//      reaches the budget
+//   E  mean squared deviation of the ToT from a straight line in log(a)
+//      between a_lo and a_hi, converted to log(a). sqrt(E) is the relative
+//      amplitude error of a linear calibration.
+//
+// The ToT comes from root finders (leading edge, trailing edge, a_hi). Their
+// derivatives are taken by implicit differentiation: if h(t,p) = 0 defines
+// t(p), then dt/dp = -(dh/dp)/(dh/dt), with dh/dt from diff_q_analytic().
+// With the gradient, BFGS needs far fewer objective evaluations than a grid.
+// Both are run and the evaluations are reported on stderr, the BFGS
+// iterations go to stdout.
+
+double L(double t, double tau_SCI)
+{
+	return exp(-t/tau_SCI)/tau_SCI;
+}
+
+// log1mexp(a) := log(1-exp(-a)), a > 0
+double log1mexp(double a) {
+	if (a < 0.693) return log(-expm1(-a)); // log( -(exp(-a)-1))
+	else           return log1p(-exp(-a)); // log( 1 + -exp(-a))
+}
+
+// logexpm1(a) := log(exp(a)-1), a > 0
+double logexpm1(double a) {
+	if (a < 37)  return log(expm1(a));
+	else         return a;
+
+}
+
+double log_q_analytic(double t, double tau, double RC)
+{
+	if (tau == RC) {
+		return log(t/tau) - t/tau;
+	}
+	if (RC > tau) {
+		return log(RC/(RC-tau)) + log1mexp(t*(RC-tau)/RC/tau) - t/RC;
+	}
+	else {
+		return log(RC/(tau-RC)) + logexpm1(t*(tau-RC)/RC/tau) -t/RC;
+	}
+}
+
+double q_analytic(double t, double tau, double RC)
+{
+	if (tau == RC) {
+		return t/tau*exp(-t/tau);
+	}
+
+	return RC/(tau-RC)*(exp(t/tau*(tau-RC)/RC)-1)*exp(-t/RC);
+}
+
+double diff_q_analytic(double t, double tau, double RC)
+{
+	if (tau == RC) {
+		return ((tau-t)*exp(-t/tau))/tau/tau;
+	}
+
+	return exp((t*(tau-RC))/(RC*tau)-t/RC)/tau-(exp(-t/RC) *(exp(t*(tau-RC)/(RC*tau))-1))/(tau-RC);
+}
+
+double diff2_q_analytic(double t, double tau, double RC)
+{
+	if (tau == RC) {
+		return -((2*tau-t)*exp(-t/tau))/tau/tau/tau;
+	}
+	return -(exp(-t/tau)*(tau*tau*exp(t/tau)-RC*RC*exp(t/RC)))/(RC*exp(t/RC)*tau*tau*tau-RC*RC*exp(t/RC)*tau*tau);
+}
+
+double q_tmax(double tau, double RC)
+{
+	// find zero of first derivative using Newton method
+	double tmax = 0;
+	for(;;)
+	{
+		double height = diff_q_analytic(tmax,tau,RC);
+		double slope  = diff2_q_analytic(tmax,tau,RC);
+		double dtmax  = -height/slope;
+		tmax += dtmax;
+		if (dtmax < 1e-9) {
+			return tmax;
+		}
+	}
+}
+
+double t_leading_edge(double tau, double RC, double threshold)
+{
+	double tmin = 0;
+	double tmax = q_tmax(tau, RC);
+
+	// is it even possible to find a solution?
+	if (log_q_analytic(tmax, tau, RC) < log(threshold)) {
+		return -1; // no
+	}
+
+	for (;;)
+	{
+		double tmed = 0.5*(tmin+tmax);
+		if (tmax-tmin < 1e-9) {
+			return tmed;
+		}
+		double log_qmed = log_q_analytic(tmed,tau,RC);
+		if (log_qmed > log(threshold)) {
+			tmax = tmed;
+		} else {
+			tmin = tmed;
+		}
+	}
+}
+
+double dynamic_threshold(double t, double t0, double threshold_low, double threshold_high, double tau_threshold)
+{
+	if (t < t0) {
+		return threshold_low;
+	}
+	return threshold_low + (1-exp(-(t-t0)/tau_threshold))*(threshold_high-threshold_low);
+}
+
+// the threshold parameters, index of the gradients
+enum { THRESHOLD_MIN, THRESHOLD_TAU, TRIGGER_DELAY, N_PARAMS };
+
+#define TH_LOW (1.0/4096) // smallest threshold_min, see params_from_y()
+
+long n_dtot = 0; // ToT evaluations (root finder runs) of all objective evaluations
+
+// dtot() of dtot_amplitude.cpp for the pulse amplitude 'a' relative to the
+// high threshold, plus the derivatives of the ToT with respect to the
+// parameters (grad) and to the amplitude (dT_da)
+double dtot_grad(double tau, double RC, double a, const double *p, double *grad, double *dT_da)
+{
+	++n_dtot;
+	double qmax = q_analytic(q_tmax(tau, RC), tau, RC);
+	double threshold_min  = p[THRESHOLD_MIN];
+	double tau_threshold  = p[THRESHOLD_TAU];
+	double trigger_delay  = p[TRIGGER_DELAY];
+	double threshold_high = qmax/a;
+	double threshold_low  = threshold_high*threshold_min;
+
+	double t_lead = t_leading_edge(tau, RC, threshold_low);
+	for (int i = 0; i < N_PARAMS; ++i) {
+		grad[i] = 0;
+	}
+	*dT_da = 0;
+	if (t_lead < 0) {
+		return 0;
+	}
+	// h = log q(t) - log(threshold_low) = 0 at the leading edge
+	double slope_lead = diff_q_analytic(t_lead, tau, RC)/q_analytic(t_lead, tau, RC);
+	double dlead[N_PARAMS] = {1/(slope_lead*threshold_min), 0, 0};
+	double dlead_da = -1/(slope_lead*a);
+
+	// trailing edge, the same search as in dtot()
+	double t0 = t_lead + trigger_delay;
+	double t_trailing_max = t0;
+	for (;;)
+	{
+		t_trailing_max += tau+RC;
+		if (log_q_analytic(t_trailing_max,tau,RC) <
+		       log(dynamic_threshold(t_trailing_max, t0,
+		       	                 threshold_low, threshold_high, tau_threshold))) {
+			break;
+		}
+	}
+	double t_trailing_min = t0;
+	while (t_trailing_max-t_trailing_min >= 1e-9) {
+		double t_med = 0.5*(t_trailing_min+t_trailing_max);
+		if (log_q_analytic(t_med,tau,RC) <
+		       log(dynamic_threshold(t_med, t0,
+		       	                 threshold_low, threshold_high, tau_threshold))) {
+			t_trailing_max = t_med;
+		} else {
+			t_trailing_min = t_med;
+		}
+	}
+	double t_trail = 0.5*(t_trailing_min+t_trailing_max);
+
+	// the pulse was below the low threshold before the delay ended:
+	// the ToT is the trigger delay
+	if (log_q_analytic(t0,tau,RC) < log(threshold_low)) {
+		grad[TRIGGER_DELAY] = 1;
+		return trigger_delay;
+	}
+
+	// h = log q(t) - log(threshold(t)) = 0 at the trailing edge
+	double decay    = exp(-(t_trail-t0)/tau_threshold);
+	double range    = threshold_high-threshold_low;
+	double thr      = threshold_low + (1-decay)*range;
+	double thr_dt   = decay/tau_threshold*range;
+	double dh_dt    = diff_q_analytic(t_trail, tau, RC)/q_analytic(t_trail, tau, RC) - thr_dt/thr;
+	double dh_dt0   = thr_dt/thr;
+	double dh[N_PARAMS] = {
+		-threshold_high*decay/thr,                                    // threshold_min
+		decay*(t_trail-t0)/(tau_threshold*tau_threshold)*range/thr, // threshold_tau
+		0,                                                            // only through t0
+	};
+	double dt0[N_PARAMS] = {dlead[0], dlead[1], dlead[2]+1};
+	for (int i = 0; i < N_PARAMS; ++i) {
+		double dtrail = -(dh[i] + dh_dt0*dt0[i])/dh_dt;
+		grad[i] = dtrail - dlead[i];
+	}
+	// the thresholds scale with 1/a
+	double dtrail_da = -(1/a + dh_dt0*dlead_da)/dh_dt;
+	*dT_da = dtrail_da - dlead_da;
+	return t_trail - t_lead;
+}
+
+#define N_POINTS 32 // amplitudes for the linearity
+
+struct objective_t
+{
+	double J;
+	double grad[N_PARAMS];
+	double a_lo, a_hi; // dynamic range
+	double rms;        // sqrt(E), relative amplitude error
+};
+
+// Returns 0 if the parameters give no dynamic range: the ToT of a_lo is
+// over the budget or the budget is never reached.
+int objective(double tau, double RC, double tot_budget, double weight, const double *p, objective_t *result)
+{
+	double grad[N_PARAMS], dT_da;
+
+	// a_hi: T(a_hi) = tot_budget, search in log(a)
+	double a_lo = 2*p[THRESHOLD_MIN];
+	if (dtot_grad(tau, RC, a_lo, p, grad, &dT_da) >= tot_budget) {
+		return 0;
+	}
+	double x_min = log(a_lo), x_max = x_min;
+	for (;;) {
+		x_max += 1;
+		if (x_max > 30) {
+			return 0;
+		}
+		if (dtot_grad(tau, RC, exp(x_max), p, grad, &dT_da) > tot_budget) {
+			break;
+		}
+		x_min = x_max;
+	}
+	while (x_max-x_min > 1e-10) {
+		double x_med = 0.5*(x_min+x_max);
+		if (dtot_grad(tau, RC, exp(x_med), p, grad, &dT_da) > tot_budget) {
+			x_max = x_med;
+		} else {
+			x_min = x_med;
+		}
+	}
+	double a_hi = exp(0.5*(x_min+x_max));
+	dtot_grad(tau, RC, a_hi, p, grad, &dT_da);
+	// T(a_hi, p) = budget: da_hi/dp = -(dT/dp)/(dT/da)
+	double dx_lo[N_PARAMS] = {1/p[THRESHOLD_MIN], 0, 0};
+	double dx_hi[N_PARAMS];
+	for (int i = 0; i < N_PARAMS; ++i) {
+		dx_hi[i] = -grad[i]/dT_da/a_hi;
+	}
+
+	// ToT at log spaced amplitudes and its total derivative, the
+	// amplitudes move with a_lo and a_hi
+	double x[N_POINTS], T[N_POINTS], dx[N_POINTS][N_PARAMS], dT[N_POINTS][N_PARAMS];
+	double x_lo = log(a_lo), x_hi = log(a_hi);
+	for (int n = 0; n < N_POINTS; ++n) {
+		double u = (double)n/(N_POINTS-1);
+		x[n] = x_lo + u*(x_hi-x_lo);
+		T[n] = dtot_grad(tau, RC, exp(x[n]), p, grad, &dT_da);
+		for (int i = 0; i < N_PARAMS; ++i) {
+			dx[n][i] = (1-u)*dx_lo[i] + u*dx_hi[i];
+			dT[n][i] = grad[i] + dT_da*exp(x[n])*dx[n][i];
+		}
+	}
+
+	// straight line T = alpha + beta*x
+	double x_mean = 0, T_mean = 0;
+	for (int n = 0; n < N_POINTS; ++n) {
+		x_mean += x[n]/N_POINTS;
+		T_mean += T[n]/N_POINTS;
+	}
+	double Sxx = 0, SxT = 0;
+	for (int n = 0; n < N_POINTS; ++n) {
+		Sxx += (x[n]-x_mean)*(x[n]-x_mean);
+		SxT += (x[n]-x_mean)*(T[n]-T_mean);
+	}
+	double beta = SxT/Sxx;
+	double r[N_POINTS], E = 0;
+	for (int n = 0; n < N_POINTS; ++n) {
+		r[n] = T[n]-T_mean-beta*(x[n]-x_mean);
+		E += r[n]*r[n]/(N_POINTS*beta*beta);
+	}
+
+	result->J    = -(x_hi-x_lo) + weight*E;
+	result->a_lo = a_lo;
+	result->a_hi = a_hi;
+	result->rms  = sqrt(E);
+	for (int i = 0; i < N_PARAMS; ++i) {
+		double dx_mean = 0, dT_mean = 0;
+		for (int n = 0; n < N_POINTS; ++n) {
+			dx_mean += dx[n][i]/N_POINTS;
+			dT_mean += dT[n][i]/N_POINTS;
+		}
+		double dSxx = 0, dSxT = 0, rdr = 0;
+		for (int n = 0; n < N_POINTS; ++n) {
+			dSxx += 2*(x[n]-x_mean)*(dx[n][i]-dx_mean);
+			dSxT += (dx[n][i]-dx_mean)*(T[n]-T_mean) + (x[n]-x_mean)*(dT[n][i]-dT_mean);
+			// alpha and beta are the least squares solution, their
+			// derivatives drop out of sum(r*dr)
+			rdr  += r[n]*(dT[n][i]-beta*dx[n][i]);
+		}
+		double dbeta = (dSxT-beta*dSxx)/Sxx;
+		double dE = 2*rdr/(N_POINTS*beta*beta) - 2*E/beta*dbeta;
+		result->grad[i] = -(dx_hi[i]-dx_lo[i]) + weight*dE;
+	}
+	return 1;
+}
+
+//////////////////////////////////////////
+// unconstrained coordinates y for the optimizers:
+// threshold_min = TH_LOW + (1-TH_LOW)/(1+exp(-y0)), threshold_tau = exp(y1),
+// trigger_delay = exp(y2)
+// Without a lower limit threshold_min runs to 0 and threshold_tau to
+// infinity, the threshold becomes a ramp from 0. The limit is one step
+// of the 12 bit threshold DAC (TDC_THRESHOLD_RANGE in host_software).
+//////////////////////////////////////////
+
+long   n_objective = 0;
+double J_target    = -HUGE_VAL; // the grid optimum
+long   n_to_target = 0;         // evaluations until J <= J_target
+
+void params_from_y(const double *y, double *p)
+{
+	p[THRESHOLD_MIN] = TH_LOW + (1-TH_LOW)/(1+exp(-y[0]));
+	p[THRESHOLD_TAU] = exp(y[1]);
+	p[TRIGGER_DELAY] = exp(y[2]);
+}
+
+// J and dJ/dy, returns HUGE_VAL if there is no dynamic range
+double objective_y(double tau, double RC, double tot_budget, double weight, const double *y, double *grad_y, objective_t *result)
+{
+	++n_objective;
+	double p[N_PARAMS];
+	params_from_y(y, p);
+	if (!objective(tau, RC, tot_budget, weight, p, result)) {
+		return HUGE_VAL;
+	}
+	if (result->J <= J_target && !n_to_target) {
+		n_to_target = n_objective;
+	}
+	double sigmoid = (p[THRESHOLD_MIN]-TH_LOW)/(1-TH_LOW);
+	grad_y[0] = result->grad[0]*(1-TH_LOW)*sigmoid*(1-sigmoid);
+	grad_y[1] = result->grad[1]*p[THRESHOLD_TAU];
+	grad_y[2] = result->grad[2]*p[TRIGGER_DELAY];
+	return result->J;
+}
+
+// quasi-Newton with the BFGS update of the inverse Hessian and a
+// backtracking line search. Steps are limited to MAX_STEP in y, the
+// first one would otherwise jump by the size of the gradient.
+#define MAX_STEP 1.0
+double bfgs(double tau, double RC, double tot_budget, double weight, double *y, objective_t *best)
+{
+	double H[N_PARAMS][N_PARAMS] = {{1,0,0},{0,1,0},{0,0,1}};
+	double g[N_PARAMS];
+	double J = objective_y(tau, RC, tot_budget, weight, y, g, best);
+	if (J == HUGE_VAL) {
+		return J;
+	}
+	for (int iter = 0; iter < 200; ++iter) {
+		double p[N_PARAMS];
+		params_from_y(y, p);
+		std::cout << iter << " " << n_objective << " " << J << " "
+		          << p[THRESHOLD_MIN] << " " << p[THRESHOLD_TAU] << " " << p[TRIGGER_DELAY] << " "
+		          << best->a_hi/best->a_lo << " " << best->rms << std::endl;
+
+		double gnorm = 0;
+		for (int i = 0; i < N_PARAMS; ++i) {
+			gnorm = fmax(gnorm, fabs(g[i]));
+		}
+		if (gnorm < 1e-6) {
+			break;
+		}
+		double d[N_PARAMS], slope = 0;
+		for (int i = 0; i < N_PARAMS; ++i) {
+			d[i] = 0;
+			for (int j = 0; j < N_PARAMS; ++j) {
+				d[i] -= H[i][j]*g[j];
+			}
+			slope += d[i]*g[i];
+		}
+		if (slope >= 0) { // lost the descent direction, start over
+			for (int i = 0; i < N_PARAMS; ++i) {
+				for (int j = 0; j < N_PARAMS; ++j) {
+					H[i][j] = i == j;
+				}
+				d[i] = -g[i];
+			}
+			slope = 0;
+			for (int i = 0; i < N_PARAMS; ++i) {
+				slope += d[i]*g[i];
+			}
+		}
+		double d_max = 0;
+		for (int i = 0; i < N_PARAMS; ++i) {
+			d_max = fmax(d_max, fabs(d[i]));
+		}
+		// Armijo condition
+		double step = fmin(1, MAX_STEP/d_max), y_new[N_PARAMS], g_new[N_PARAMS], J_new;
+		objective_t trial;
+		for (;;) {
+			for (int i = 0; i < N_PARAMS; ++i) {
+				y_new[i] = y[i] + step*d[i];
+			}
+			J_new = objective_y(tau, RC, tot_budget, weight, y_new, g_new, &trial);
+			if (J_new <= J + 1e-4*step*slope) {
+				break;
+			}
+			step *= 0.5;
+			if (step < 1e-12) {
+				return J;
+			}
+		}
+		double s[N_PARAMS], dg[N_PARAMS], sy = 0;
+		for (int i = 0; i < N_PARAMS; ++i) {
+			s[i]  = y_new[i]-y[i];
+			dg[i] = g_new[i]-g[i];
+			sy   += s[i]*dg[i];
+		}
+		if (sy > 1e-14) {
+			if (iter == 0) { // scale the start matrix to the curvature seen
+				double yy = 0;
+				for (int i = 0; i < N_PARAMS; ++i) {
+					yy += dg[i]*dg[i];
+				}
+				for (int i = 0; i < N_PARAMS; ++i) {
+					H[i][i] = sy/yy;
+				}
+			}
+			// H = (I - rho s y^T) H (I - rho y s^T) + rho s s^T
+			double rho = 1/sy, Hy[N_PARAMS], yHy = 0;
+			for (int i = 0; i < N_PARAMS; ++i) {
+				Hy[i] = 0;
+				for (int j = 0; j < N_PARAMS; ++j) {
+					Hy[i] += H[i][j]*dg[j];
+				}
+				yHy += dg[i]*Hy[i];
+			}
+			for (int i = 0; i < N_PARAMS; ++i) {
+				for (int j = 0; j < N_PARAMS; ++j) {
+					H[i][j] += -rho*(Hy[i]*s[j] + s[i]*Hy[j]) + (rho*rho*yHy + rho)*s[i]*s[j];
+				}
+			}
+		}
+		double dJ = J - J_new;
+		for (int i = 0; i < N_PARAMS; ++i) {
+			y[i] = y_new[i];
+			g[i] = g_new[i];
+		}
+		J     = J_new;
+		*best = trial;
+		if (dJ < 1e-10*(1+fabs(J))) {
+			break;
+		}
+	}
+	return J;
+}
+
+// n^3 points, log spaced in each parameter
+double grid_search(double tau, double RC, double tot_budget, double weight, int n, double *p_best, objective_t *best)
+{
+	const double lo[N_PARAMS] = {TH_LOW, 0.1*(tau+RC), 0.01*(tau+RC)};
+	const double hi[N_PARAMS] = {0.9,    1e4*(tau+RC), 10*(tau+RC)};
+	double J_best = HUGE_VAL;
+	for (int i = 0; i < n*n*n; ++i) {
+		double p[N_PARAMS];
+		int index[N_PARAMS] = {i%n, (i/n)%n, i/(n*n)};
+		for (int k = 0; k < N_PARAMS; ++k) {
+			p[k] = lo[k]*pow(hi[k]/lo[k], (double)index[k]/(n-1));
+		}
+		objective_t result;
+		++n_objective;
+		if (objective(tau, RC, tot_budget, weight, p, &result) && result.J < J_best) {
+			J_best = result.J;
+			*best  = result;
+			for (int k = 0; k < N_PARAMS; ++k) {
+				p_best[k] = p[k];
+			}
+		}
+	}
+	return J_best;
+}
+
+// analytic gradient against central differences
+void check_gradient(double tau, double RC, double tot_budget, double weight, const double *p)
+{
+	objective_t result, plus, minus;
+	if (!objective(tau, RC, tot_budget, weight, p, &result)) {
+		std::cerr << "#gradient check: no dynamic range at the start point" << std::endl;
+		return;
+	}
+	for (int i = 0; i < N_PARAMS; ++i) {
+		double p_plus[N_PARAMS], p_minus[N_PARAMS];
+		for (int k = 0; k < N_PARAMS; ++k) {
+			p_plus[k] = p_minus[k] = p[k];
+		}
+		double h = 1e-5*p[i];
+		p_plus[i]  += h;
+		p_minus[i] -= h;
+		objective(tau, RC, tot_budget, weight, p_plus,  &plus);
+		objective(tau, RC, tot_budget, weight, p_minus, &minus);
+		std::cerr << "#gradient check dJ/dp" << i << " analytic = " << result.grad[i]
+		          << "   numeric = " << (plus.J-minus.J)/(2*h) << std::endl;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+
+	if (argc != 5 && argc != 8) {
+		std::cerr << "usage: " << argv[0] << " tau RC tot_budget weight [threshold_min threshold_tau trigger_delay]" << std::endl;
+		std::cerr << "  maximizes the dynamic range with the ToT below tot_budget and" << std::endl;
+		std::cerr << "  weight times the squared relative amplitude error of a log calibration" << std::endl;
+		std::cerr << "  stdout: iteration evaluations J threshold_min threshold_tau trigger_delay a_hi/a_lo rms" << std::endl;
+		return 1;
+	}
+
+	std::istringstream tau_in(argv[1]);
+	double tau;
+	tau_in >> tau;
+
+	std::istringstream RC_in(argv[2]);
+	double RC;
+	RC_in >> RC;
+
+	std::istringstream tot_budget_in(argv[3]);
+	double tot_budget;
+	tot_budget_in >> tot_budget;
+
+	std::istringstream weight_in(argv[4]);
+	double weight;
+	weight_in >> weight;
+
+	double p[N_PARAMS] = {0.1, tau+RC, 0.5*(tau+RC)};
+	for (int i = 0; argc == 8 && i < N_PARAMS; ++i) {
+		std::istringstream p_in(argv[5+i]);
+		p_in >> p[i];
+	}
+
+	check_gradient(tau, RC, tot_budget, weight, p);
+
+	int n = 20;
+	double p_grid[N_PARAMS];
+	objective_t grid_best;
+	n_objective = n_dtot = 0;
+	double J_grid = grid_search(tau, RC, tot_budget, weight, n, p_grid, &grid_best);
+	long grid_objective = n_objective, grid_dtot = n_dtot;
+
+	double sigmoid = (p[0]-TH_LOW)/(1-TH_LOW);
+	double y[N_PARAMS] = {log(sigmoid/(1-sigmoid)), log(p[1]), log(p[2])};
+	objective_t bfgs_best;
+	n_objective = n_dtot = 0;
+	J_target = J_grid;
+	double J_bfgs = bfgs(tau, RC, tot_budget, weight, y, &bfgs_best);
+	params_from_y(y, p);
+
+	std::cerr << "#bfgs: J = " << J_bfgs
+	          << "  threshold_min = " << p[THRESHOLD_MIN]
+	          << "  threshold_tau = " << p[THRESHOLD_TAU]
+	          << "  trigger_delay = " << p[TRIGGER_DELAY] << std::endl;
+	std::cerr << "#      dynamic range = " << bfgs_best.a_hi/bfgs_best.a_lo
+	          << "  rms amplitude error = " << bfgs_best.rms << std::endl;
+	std::cerr << "#      " << n_objective << " evaluations with gradient, " << n_dtot << " ToT evaluations" << std::endl;
+	if (n_to_target) {
+		std::cerr << "#      better than the grid after " << n_to_target << " evaluations" << std::endl;
+	}
+	std::cerr << "#grid: J = " << J_grid
+	          << "  threshold_min = " << p_grid[THRESHOLD_MIN]
+	          << "  threshold_tau = " << p_grid[THRESHOLD_TAU]
+	          << "  trigger_delay = " << p_grid[TRIGGER_DELAY] << std::endl;
+	std::cerr << "#      dynamic range = " << grid_best.a_hi/grid_best.a_lo
+	          << "  rms amplitude error = " << grid_best.rms << std::endl;
+	std::cerr << "#      " << grid_objective << " evaluations (" << n << "^3), " << grid_dtot << " ToT evaluations" << std::endl;
+
+	return 0;
+}